@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Boots the kernel under QEMU a few times, runs the benchmarks of
+# user/bench in each boot and compares the results with a baseline:
+#
+#   make bench              # compare against bench-baseline.json
+#   make bench-baseline     # store the results as the new baseline
+#
+# Every boot gets a fresh copy of fs.img. A result is a regression if
+# its mean is worse than the baseline's by more than --threshold, and by
+# more than --t standard errors, so that noise between boots is not
+# taken for one. The exit status is 1 if there is a regression.
+
+import argparse
+import json
+import math
+import os
+import select
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+SUITE = ["fsbench", "forkbench", "pipebench", "vmbench", "grepbench"]
+PROMPT = b"$ "
+TICK_US = 10000  # a tick, as the lapic timer is set up
+
+
+def run_until_prompt(qemu, timeout):
+    out = b""
+    deadline = time.time() + timeout
+    while not out.endswith(PROMPT):
+        left = deadline - time.time()
+        if left <= 0 or qemu.poll() is not None:
+            raise RuntimeError("no shell prompt; output so far:\n" +
+                               out.decode(errors="replace"))
+        r, _, _ = select.select([qemu.stdout], [], [], left)
+        if r:
+            out += os.read(qemu.stdout.fileno(), 4096)
+    return out.decode(errors="replace")
+
+
+# Runs the suite in one boot; returns {name: value}, where a value is
+# nanoseconds per op, or a count for results that took no time.
+def boot(args):
+    results = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        fsimg = os.path.join(tmp, "fs.img")
+        shutil.copy(args.fsimg, fsimg)
+        cmd = shlex.split(args.qemu.format(fsimg=fsimg))
+        qemu = subprocess.Popen(cmd, stdin=subprocess.PIPE,
+                                stdout=subprocess.PIPE,
+                                stderr=subprocess.DEVNULL)
+        try:
+            run_until_prompt(qemu, args.timeout)
+            for prog in SUITE:
+                qemu.stdin.write(prog.encode() + b"\n")
+                qemu.stdin.flush()
+                parse(run_until_prompt(qemu, args.timeout), results)
+        finally:
+            qemu.kill()
+            qemu.wait()
+    return results
+
+
+def parse(out, results):
+    tsc_per_ns = None
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) == 3 and f[:2] == ["BENCH", "tsc_per_tick"]:
+            tsc_per_ns = int(f[2]) / (TICK_US * 1000)
+        elif len(f) == 6 and f[0] == "BENCH":
+            kv = dict(x.split("=", 1) for x in f[2:])
+            ops, cycles = int(kv["ops"]), int(kv["cycles"])
+            if cycles == 0:
+                results[f[1]] = ops
+            elif ops and tsc_per_ns:
+                results[f[1]] = cycles / tsc_per_ns / ops
+
+
+def stats(samples):
+    n = len(samples)
+    mean = sum(samples) / n
+    var = sum((x - mean) ** 2 for x in samples) / (n - 1) if n > 1 else 0
+    return {"mean": mean, "stdev": math.sqrt(var), "n": n}
+
+
+# Whether cur is worse than base, lower values being better.
+def regressed(cur, base, args):
+    if cur["mean"] <= base["mean"] * (1 + args.threshold):
+        return False
+    se = math.sqrt(cur["stdev"] ** 2 / cur["n"] +
+                   base["stdev"] ** 2 / base["n"])
+    return se == 0 or (cur["mean"] - base["mean"]) / se > args.t
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--qemu", required=True,
+                    help="the QEMU command line, with {fsimg} for the disk")
+    ap.add_argument("--fsimg", default="out/fs.img")
+    ap.add_argument("--runs", type=int, default=5)
+    ap.add_argument("--baseline", default="bench-baseline.json")
+    ap.add_argument("--save", action="store_true",
+                    help="store the results as the baseline")
+    ap.add_argument("--threshold", type=float, default=0.05,
+                    help="slowdown, as a fraction, below which nothing "
+                    "counts as a regression")
+    ap.add_argument("--t", type=float, default=3.0,
+                    help="standard errors a slowdown must be beyond")
+    ap.add_argument("--timeout", type=float, default=600,
+                    help="seconds a benchmark may take")
+    args = ap.parse_args()
+
+    samples = {}
+    for i in range(args.runs):
+        print("bench: boot %d of %d" % (i + 1, args.runs), file=sys.stderr)
+        for name, value in boot(args).items():
+            samples.setdefault(name, []).append(value)
+    cur = {name: stats(v) for name, v in sorted(samples.items())}
+
+    if args.save:
+        with open(args.baseline, "w") as f:
+            json.dump(cur, f, indent=2, sort_keys=True)
+        print("bench: baseline stored in %s" % args.baseline)
+        return 0
+
+    base = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            base = json.load(f)
+
+    bad = 0
+    print("%-20s %14s %14s %8s" % ("result", "mean", "baseline", "change"))
+    for name, s in cur.items():
+        b = base.get(name)
+        if b is None:
+            print("%-20s %14.1f %14s %8s" % (name, s["mean"], "-", "-"))
+            continue
+        change = (s["mean"] - b["mean"]) / b["mean"] * 100 if b["mean"] else 0
+        flag = ""
+        if regressed(s, b, args):
+            flag = "  REGRESSION"
+            bad += 1
+        print("%-20s %14.1f %14.1f %+7.1f%%%s" %
+              (name, s["mean"], b["mean"], change, flag))
+    if bad:
+        print("bench: %d regression(s)" % bad)
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -5,10 +5,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU list of this buffer's hash bucket
   struct buf *next;
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uint qtime;        // ticks when queued for the disk
+  uchar *data;       // the block: space, or wherever the disk keeps it
+  uchar space[BSIZE];
 };
 #define B_VALID 0x2 // buffer has been read from disk
 #define B_DIRTY 0x4 // buffer needs to be written to disk
+#define B_ASYNC 0x8 // release buffer when the disk is done with it
+
+#define BPERPAGE (PGSIZE / sizeof(struct buf)) // buffers carved from a page
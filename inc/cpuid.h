@@ -82,6 +82,18 @@ enum {
   CPUID_FEATURE_HYPERVISOR = CPUID_BIT(CPUID_1_ECX, 31),
 };
 
+// CPUID(7, 0): EBX
+enum {
+  CPUID_FEATURE_FSGSBASE = CPUID_BIT(CPUID_7_EBX, 0),
+  CPUID_FEATURE_BMI1 = CPUID_BIT(CPUID_7_EBX, 3),
+  CPUID_FEATURE_AVX2 = CPUID_BIT(CPUID_7_EBX, 5),
+  CPUID_FEATURE_SMEP = CPUID_BIT(CPUID_7_EBX, 7),
+  CPUID_FEATURE_BMI2 = CPUID_BIT(CPUID_7_EBX, 8),
+  CPUID_FEATURE_ERMS = CPUID_BIT(CPUID_7_EBX, 9),
+  CPUID_FEATURE_INVPCID = CPUID_BIT(CPUID_7_EBX, 10),
+  CPUID_FEATURE_SMAP = CPUID_BIT(CPUID_7_EBX, 20),
+};
+
 // CPUID(0x80000001): EDX
 enum {
   // duplicated (fpu)		= CPUID_BIT(CPUID_80000001_EDX, 0),
@@ -148,3 +160,4 @@ enum {
 };
 
 void cpuid_print(void);
+int cpuid_feature(unsigned int);
@@ -11,19 +11,44 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trap_frame;
 struct vpage_info;
 struct vpi_page;
 struct vregion;
+struct sysstat;
 struct vspace;
 struct file;
 struct pipe;
+struct cpage;
 
 extern int npages;
 extern int pages_in_use;
 extern int pages_in_swap;
 extern int free_pages;
+extern int num_swap_ins;
+extern int num_swap_outs;
+extern int swap_cached;
+extern int swap_reused;
+extern int ksm_merged;
+extern int slab_pages;
+extern int slab_objects;
+extern int zswap_pages;
 extern int num_page_faults;
+extern int num_cow_faults;
 extern int num_disk_reads;
+extern int bcache_hits;
+extern int disk_queue_depth;
+extern int disk_queue_peak;
+extern int disk_requests;
+extern int disk_merges;
+extern int disk_blocks_read;
+extern int disk_blocks_written;
+extern int icache_hits;
+extern int icache_misses;
+extern int log_commits;
+extern int log_blocks;
+extern int context_switches;
+extern int wakeups;
 
 extern int crashn_enable;
 extern int crashn;
@@ -45,9 +70,15 @@ extern int crashn;
   } while (0)
 
 // bio.c
+struct buf *ballocpage(char *);
 void binit(void);
+struct buf *bget(uint, uint);
 struct buf *bread(uint, uint);
+void breadn(uint, uint, struct buf **, int);
+void breadahead(uint, uint);
+void bwriten(struct buf **, int);
 void brelse(struct buf *);
+void brelse_async(struct buf *);
 void bwrite(struct buf *);
 void print_data_at_block(uint);
 
@@ -59,28 +90,41 @@ noreturn void panic(char *);
 
 // exec.c
 int exec(char *, char **);
+int execload(struct vspace *, char *, char **, struct trap_frame *);
 
 // fs.c
 void readsb(int dev, struct superblock *sb);
 struct inode *dirlookup(struct inode *, char *, uint *);
+int dirlink(struct inode *, char *, uint);
+void logsync(void);
+int readdirents(struct inode *, char *, uint *, uint);
+void ireadpage(struct inode *, uint, char *);
 struct inode *rootlookup(char *);
 struct inode *idup(struct inode *);
 void iinit(int dev);
 void irelease(struct inode *);
 void locki(struct inode *);
 void unlocki(struct inode *);
+void lockishared(struct inode *);
+void unlockishared(struct inode *);
 int namecmp(const char *, const char *);
 struct inode *namei(char *);
 struct inode *nameiparent(char *, char *);
 int concurrent_readi(struct inode *, char *, uint, uint);
 int readi(struct inode *, char *, uint, uint);
+void ireadahead(struct inode *, uint, uint);
 void concurrent_stati(struct inode *, struct stat *);
 void stati(struct inode *, struct stat *);
 int concurrent_writei(struct inode *, char *, uint, uint);
 int writei(struct inode *, char *, uint, uint);
+extern int swapdev;
 void swapread(int, uint, char *);
 void swapwrite(int, uint, char *);
+void swapreadn(int, uint, char **, int);
+void swapwriten(int, uint, char **, int);
 int addfile(char *);
+int unlinkfile(char *);
+int trunci(struct inode *, uint);
 void begin_tx();
 void commit_tx();
 void log_write(struct buf *);
@@ -89,18 +133,37 @@ void log_write(struct buf *);
 struct file_info* fileopen(char *, int);
 int filewrite(struct file_info *, char *, int);
 int fileread(struct file_info *, char *, int);
+int filesplice(struct file_info *, struct file_info *, int);
+int filepread(struct file_info *, char *, int, uint);
+int filepwrite(struct file_info *, char *, int, uint);
+int filegetdents(struct file_info *, char *, int);
 void fileclose(struct file_info *);
 void filestat(struct file_info *, struct stat *);
 void filedup(struct file_info *);
+void fileinit(void);
+int fdalloc(struct proc *, struct file_info *);
+void fdinstall(struct proc *, int, struct file_info *);
+struct file_info *fdremove(struct proc *, int);
+int fdnext(struct proc *, int);
+void pipeinit(void);
+struct pipe *pipealloc(void);
 int pipeopen(struct pipe *, int);
 int piperead(struct file_info *, char *, int);
 int pipewrite(struct file_info *, char *, int);
 void pipeclose(struct file_info *);
 
+// futex.c
+void futexinit(void);
+int futexwait(uint64_t, int);
+int futexwake(uint64_t, int);
+
 // ide.c
 void ideinit(void);
-void ideintr(void);
+void ideintr(int);
+uint idesize(int);
 void iderw(struct buf *);
+void iderw_submit(struct buf **, int);
+void iderw_wait(struct buf *);
 
 // ioapic.c
 void ioapicenable(int irq, int cpu);
@@ -111,10 +174,14 @@ void ioapicinit(void);
 struct core_map_entry *pa2page(uint64_t pa);
 void detect_memory(void);
 char *kalloc(void);
+char *kzalloc(void);
+char *kallochuge(void);
+int kzeroidle(void);
 void kfree(char *);
 void mem_init(void *);
 void mark_user_mem(uint64_t, uint64_t);
 void mark_kernel_mem(uint64_t);
+void mark_huge_mem(uint64_t, int);
 void increment_cme_ref(uint64_t);
 void increment_sme_ref(uint);
 void swapfree(uint);
@@ -122,6 +189,19 @@ int ppage_copy(uint64_t *);
 int swappage_copy(uint);
 struct core_map_entry *get_random_user_page();
 void ensure_n_free_pages(uint);
+void swapinit(uint);
+extern uint64_t zero_ppn;
+int rmapadd(uint64_t, struct vspace *, uint64_t);
+int rmapaddswap(uint, struct vspace *, uint64_t);
+void rmapdel(uint64_t, struct vspace *, uint64_t);
+void rmapdelswap(uint, struct vspace *, uint64_t);
+int takeuserpage(uint64_t, struct vspace *, uint64_t);
+uint64_t ksmpage(int, struct vspace **, uint64_t *);
+int ksmhold(uint64_t);
+int pagedupn(struct vpage_info *, struct vpage_info *, int, struct vspace *,
+             uint64_t, int64_t, struct vpi_page *);
+void rmapmoven(struct vpage_info *, int, struct vspace *, struct vspace *,
+               uint64_t, int64_t, struct vpi_page *);
 
 // kbd.c
 void kbdintr(void);
@@ -133,6 +213,13 @@ extern volatile uint *lapic;
 void lapiceoi(void);
 void lapicinit(void);
 void lapicstartap(uchar, uint);
+void lapicipi(uchar, int);
+void lapicperiodic(void);
+void lapictick(void);
+void lapiconeshot(uint);
+uint lapiconeshotticks(void);
+#define IRQ_TLBFLUSH 30 // vspaceshootdown's IPI, past the device IRQs
+#define IRQ_RESCHED 29  // wakes an idle cpu to look for work
 void microdelay(int);
 
 // mp.c
@@ -142,34 +229,114 @@ void mpinit(void);
 // vspace.c
 void                vspacebootinit(void);
 int                 vspaceinit(struct vspace *);
+struct vspace*      vspacealloc(void);
+void                vspacehold(struct vspace *);
+void                vspaceput(struct vspace *);
+int                 vspacelockfault(struct vspace *);
+void                vspaceunlockfault(struct vspace *, int);
 void                vspaceinitcode(struct vspace *, char *, uint64_t);
 int                 vspaceloadcode(struct vspace *, char *, uint64_t *);
+int                 vspacefault(struct vspace *, uint64_t);
+int                 vspacewritefault(struct vspace *, uint64_t);
+void                vspaceprefault(uint64_t, uint64_t);
 void                vspaceinvalidate(struct vspace *);
 void                vspacemarknotpresent(struct vspace *, uint64_t);
+void                vspacemaprange(struct vspace *, uint64_t, uint64_t);
+void                vspaceunmaprange(struct vspace *, uint64_t, uint64_t);
 void                vspaceinstall(struct proc *);
 void                vspaceinstallkern(void);
+void                vspaceinitcpu(void);
+void                vspaceflush(struct vspace *);
+void                vspaceshootdown(struct vspace *);
+void                vspacetlbflush(void);
 void                vspacefree(struct vspace *);
 struct vregion*     va2vregion(struct vspace *, uint64_t);
+struct vregion*     vspacemapped(struct vspace *, uint64_t, uint64_t);
+uint64_t            vspacemmap(struct vspace *, uint64_t, uint64_t, int, int, struct inode *, uint);
+uint64_t            vspacemapshared(struct vspace *, struct vregion *);
+int                 vspacemunmap(struct vspace *, uint64_t, uint64_t);
+void                vspacesync(struct vspace *);
 struct vpage_info*  va2vpage_info(struct vregion *, uint64_t);
 int                 vregioncontains(struct vregion *, uint64_t, int);
 int                 vspacecopy(struct vspace *, struct vspace *);
 int                 vspacecopy_cow(struct vspace *, struct vspace *);
+void                vspacemove(struct vspace *, struct vspace *);
 int                 vspaceinitstack(struct vspace *, uint64_t);
 int                 vspacewritetova(struct vspace *, uint64_t, char *, int);
 void                vspacedumpstack(struct vspace *);
 void                vspacedumpcode(struct vspace *);
 int                 vregionaddmap(struct vregion *, uint64_t, uint64_t, short, short);
+int                 vregionaddzero(struct vregion *, uint64_t, uint64_t, short);
 int                 vregiondelmap(struct vregion *, uint64_t, uint64_t);
-int                 vspacemarkswapped(uint64_t, uint, uint64_t, struct vspace*);
-int                 vspaceupdatecow(uint64_t, uint, uint64_t, struct vspace*);
+int                 vspacemarkswapped(uint64_t, uint, uint64_t, struct vspace*,
+                                      struct vpi_page*);
+int                 vspacetestaccessed(uint64_t, uint64_t, struct vspace*);
+int                 vspacetestdirty(uint64_t, uint64_t, struct vspace*);
+int                 vspacepresent(struct vspace*, uint64_t, uint64_t*);
+int                 vspaceflippage(struct vspace*, uint64_t, char**);
+int                 vspacemarkcow(struct vspace*, uint64_t, uint64_t);
+int                 vspaceremap(struct vspace*, uint64_t, uint64_t, uint64_t);
+int                 vspaceupdatecow(uint64_t, uint, uint64_t, struct vspace*,
+                                    struct vpi_page*);
+void                vspacesample(struct vspace*);
+int                 vspaceoverlimit(void);
+int                 vspacememstat(struct vspace*, int);
+
+// ksm.c
+void ksminit(void);
+
+// zswap.c
+void zswapinit(void);
+char *zswapstore(char *, ushort *);
+void zswapload(char *, ushort, char *);
+void zswapfree(char *, ushort);
+
+// pcache.c
+void pcacheinit(void);
+struct cpage *pcget(struct inode *, uint);
+void pcput(struct cpage *);
+void pcupdate(struct inode *, uint, char *, uint);
+void pctruncate(struct inode *, uint);
+char *pcsteal(void);
+
+// pci.c
+uint pciconfread(int, int, int, int);
+void pciconfwrite(int, int, int, int, uint);
+int pcifindclass(int, int, int *, int *);
+
+// lz.c
+int lzcompress(const char *, int, char *, int, ushort *);
+int lzdecompress(const char *, int, char *, int);
+
+// shm.c
+void shminit(void);
+int shmopen(char *, int);
+uint64_t shmmap(int);
+int shmunlink(char *);
+
+// slab.c
+struct slabcache;
+void slabcreate(struct slabcache *, char *, uint, void (*)(void *));
+void *slaballoc(struct slabcache *);
+void slabfree(void *);
 
 // picirq.c
 void picenable(int);
 void picinit(void);
 
+// prof.c
+struct profsample;
+void profinit(void);
+void proftick(struct trap_frame *);
+int profile(int);
+int profdump(struct profsample *, int);
+
 // proc.c
 void exit(void);
 int fork(void);
+int spawn(char *, char **, int *, int);
+int clone(uint64_t, uint64_t, uint64_t);
+struct proc *kthread(char *, void (*)(void));
 int growproc(int);
 int kill(int);
 void pinit(void);
@@ -180,11 +347,15 @@ void sleep(void *, struct spinlock *);
 void userinit(void);
 int wait(void);
 void wakeup(void *);
+int wakeupn(void *, int);
 void yield(void);
+int timeslice(void);
+void prioboost(void);
+int setpriority(int, int);
+int memlimit(int, int);
 void reboot(void);
 int ftablecopy(struct proc *, struct proc *);
-int markswapped(uint64_t, uint, uint64_t);
-int updatecowreferences(uint64_t, uint, uint64_t);
+int procsysstats(int, struct sysstat *, int);
 
 // swtch.S
 void swtch(struct context **, struct context *);
@@ -194,6 +365,8 @@ void acquire(struct spinlock *);
 void getcallerpcs(void *, uint64_t *);
 int holding(struct spinlock *);
 void initlock(struct spinlock *, char *);
+void lockdump(void);
+void lockstat(struct spinlock *);
 void release(struct spinlock *);
 void pushcli(void);
 void popcli(void);
@@ -201,10 +374,18 @@ void popcli(void);
 // sleeplock.c
 void acquiresleep(struct sleeplock *);
 void releasesleep(struct sleeplock *);
+void acquiresleepshared(struct sleeplock *);
+void releasesleepshared(struct sleeplock *);
 int holdingsleep(struct sleeplock *);
 void initsleeplock(struct sleeplock *, char *);
 
+// membench.c
+void membench(void);
+
 // string.c
+void stringinit(void);
+void copy_page(void *, const void *);
+void zero_page(void *);
 int memcmp(const void *, const void *, uint);
 void *memmove(void *, const void *, uint);
 void *memset(void *, int, uint);
@@ -222,16 +403,28 @@ int fetchint(uint64_t, int *);
 int fetchint64_t(uint64_t, int64_t *);
 int fetchstr(uint64_t, char **);
 void syscall(void);
+void statcount(int, uint64_t);
+
+// trace.c
+struct traceev;
+void traceinit(void);
+void traceevent(int, int, uint64_t);
+int tracedump(struct traceev *, int);
 
 // trap.c
 void idtinit(void);
 extern uint ticks;
 void tvinit(void);
 extern struct spinlock tickslock;
+void timersleep(uint);
+void tickadvance(uint);
+uint timernext(void);
+extern uint timerseq;
 
 // uart.c
 void uartinit(void);
 void uartintr(void);
 void uartputc(int);
+void uartflush(void);
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x) / sizeof((x)[0]))
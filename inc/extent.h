@@ -1,5 +1,8 @@
 #pragma once
 
+#define NEXTENT 6       // extents per inode
+#define EXTENTBLOCKS 32 // blocks an extent is allocated or grown by
+
 // represents a contiguous block on disk of data
 struct extent {
   uint startblkno; // start block number
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <extent.h>
+#include <param.h>
 #include <sleeplock.h>
 
 // in-memory copy of an inode
@@ -9,12 +10,19 @@ struct inode {
   uint inum; // Inode number
   int ref;   // Reference count
   int valid; // Flag for if node is valid
+  int unlinked; // its name is gone: free it at the last irelease; on
+                // disk too, for iinit to free it after a crash
   struct sleeplock lock;
 
   short type; // copy of disk inode
   short devid;
   uint size;
-  struct extent data[6];
+  struct extent data[NEXTENT];
+  uint indirect;
+
+  struct inode *hnext; // hash chain, protected by icache.lock
+  struct inode *prev;  // LRU list of unreferenced inodes
+  struct inode *next;
 };
 
 // table mapping device ID (devid) to device functions
@@ -39,15 +47,21 @@ struct file_info {
   int ref;   // Reference count
   uint offset; // Current offset in file
   int perm; // Access permission
+  struct file_info *next; // Next on the free list, while not in use
 };
 
 extern struct file_info files_global[];
 
+// A pipe's buffer is a ring of NPIPEPAGES pages, which need not be
+// contiguous: a reader may take a whole page away, and replace it with
+// one of its own. While it does, the page's slot is 0.
 struct pipe {
   struct spinlock lock;
-  char* buf;
-  int head;
-  int tail;
+  char* pages[NPIPEPAGES];
+  uint head; // bytes ever read
+  uint tail; // bytes ever written
+  int nreadwait;  // readers asleep waiting for data
+  int nwritewait; // writers asleep waiting for room
   bool hasopenread;
   bool hasopenwrite;
 };
\ No newline at end of file
@@ -8,7 +8,9 @@
 #define INODEFILEINO 0 // inode file inum
 #define ROOTINO 1      // root i-number
 #define BSIZE 512      // block size
-#define SWAPPAGES 2048 // number of swap pages
+#define SWAPPAGES 2048 // default number of swap pages; mkfs -s changes it
+#define MAXSWAPPAGES 32768 // swap pages the kernel can track
+#define NLOGBLOCKS (LOGSIZE + 1) // default log region: header plus logged blocks
 
 // Disk layout:
 // [ boot block | super block | free bit map |
@@ -23,6 +25,8 @@ struct superblock {
   uint inodestart; // Block number of the start of inode file
   uint swapstart;  // Block number of the start of swap region
   uint logstart;   // Block number of the start of log region
+  uint nlog;       // Number of log blocks, header included
+  uint nswap;      // Number of swap pages
 };
 
 // On-disk inode structure
@@ -30,8 +34,10 @@ struct dinode {
   short type;         // File type
   short devid;        // Device number (T_DEV only)
   uint size;          // Size of file (bytes)
-  struct extent data[6]; // Data blocks of file on disk
-  char pad[6];       // So disk inodes fit contiguosly in a block
+  struct extent data[NEXTENT]; // Data blocks of file on disk
+  uint indirect;      // Root of the extent tree, 0 if none
+  char orphan;        // Unlinked, to be freed once no longer open
+  char pad[1];       // So disk inodes fit contiguosly in a block
 };
 
 // offset of inode in inodefile
@@ -43,6 +49,34 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b) / BPB + (sb).bmapstart)
 
+// Most pages the in-memory copy of the free map can take: a page of
+// pointers to them
+#define BMAPPAGES (PGSIZE / sizeof(uchar *))
+
+// Extent tree.
+// Extents past the NEXTENT direct ones live in a tree of blocks rooted
+// at dinode.indirect. Every node starts with an xhdr. A leaf (depth 0)
+// holds extents, an interior node holds the nodes below it. In both,
+// entries are sorted by the first file block they cover.
+struct xhdr {
+  ushort depth; // 0 for a leaf
+  ushort n;     // number of entries in use
+};
+
+struct xleaf {
+  uint fblk;        // first file block mapped by e
+  struct extent e;
+};
+
+struct xidx {
+  uint fblk;  // first file block under the child
+  uint blkno; // block number of the child node
+};
+
+#define XLEAFN ((BSIZE - sizeof(struct xhdr)) / sizeof(struct xleaf))
+#define XIDXN ((BSIZE - sizeof(struct xhdr)) / sizeof(struct xidx))
+#define XMAXDEPTH 4 // more than enough levels to map the whole disk
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -51,8 +85,37 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory is either a linear array of dirents, or hashed. A hashed
+// directory starts with a block holding a dirhdr, followed by nbuckets
+// blocks of dirents. A name lives in block 1 + dirhash(name) % nbuckets,
+// or, if that one is full, in one of the blocks after it (wrapping
+// around). A slot that was used and freed keeps its name with inum 0,
+// so only a never-used slot, name[0] == 0, ends a search. The header
+// starts with a zero inum, so linear scans such as getdents skip it.
+#define DIRHDR_MAGIC 0x68736864 // "dhsh"
+
+struct dirhdr {
+  ushort inum; // always 0
+  ushort pad;
+  uint magic;
+  uint nbuckets;
+};
+
+// FNV-1a hash of a directory entry name.
+static inline uint dirhash(const char *name) {
+  uint h = 2166136261u;
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+// Most blocks one log header can describe.
+#define LOGMAXBLOCKS ((BSIZE - 2 * sizeof(uint)) / sizeof(uint))
+
 struct log_meta {
     short commited; // Whether log changes are commited
     uint nchanges; // Number of changes (Also the index of the last change)
-    uint blocknos[19]; // Array of block that the changes are written to
+    uint blocknos[LOGMAXBLOCKS]; // Array of block that the changes are written to
 };
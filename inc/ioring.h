@@ -0,0 +1,45 @@
+#pragma once
+
+// The submission and completion ring of ioringsetup and ioringenter.
+// Both the kernel and user programs use this header file.
+//
+// The ring is one page mapped into the process. The process fills in
+// sq[sqtail % IORING_NSQ] and bumps sqtail; ioringenter then carries out
+// entries from sqhead on, posting each result to cq[cqtail % IORING_NCQ]
+// and bumping sqhead and cqtail. The process takes results from cqhead
+// to cqtail and bumps cqhead. The counts only grow, and wrap.
+
+#define IORING_READ 1   // read(fd, addr, len)
+#define IORING_WRITE 2  // write(fd, addr, len)
+#define IORING_PREAD 3  // pread(fd, addr, len, off)
+#define IORING_PWRITE 4 // pwrite(fd, addr, len, off)
+#define IORING_FSYNC 5  // fsync(fd)
+
+#define IORING_NSQ 64 // submission entries, a power of 2
+#define IORING_NCQ 64 // completion entries, a power of 2
+
+// A submission.
+struct io_sqe {
+  int op;        // IORING_*
+  int fd;
+  uint64_t addr; // buffer
+  int len;       // bytes in it
+  int off;       // file offset, for pread and pwrite
+  uint64_t data; // handed back in the completion
+};
+
+// A completion.
+struct io_cqe {
+  uint64_t data; // the submission's
+  int res;       // what the call would have returned
+  int pad;
+};
+
+struct io_ring {
+  volatile uint sqhead; // next submission the kernel takes
+  volatile uint sqtail; // next submission the process fills in
+  volatile uint cqhead; // next completion the process takes
+  volatile uint cqtail; // next completion the kernel posts
+  struct io_sqe sq[IORING_NSQ];
+  struct io_cqe cq[IORING_NCQ];
+};
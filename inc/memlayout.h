@@ -21,6 +21,8 @@
 #define AP_ENTRY 0x7000
 #define AP_OFFSET_CPUNUM 4 /* [0x7000-4, 0x7000) */
 #define AP_OFFSET_STACK 8  /* [0x7000-8, 0x7000-4) */
+#define AP_OFFSET_ENTRY 12 /* [0x7000-12, 0x7000-8) */
+#define AP_OFFSET_KSTACK 20 /* [0x7000-20, 0x7000-12) */
 
 #define EXTMEM 0x100000             // Start of extended memory
 #define DEVSPACE 0xFFFFFFFFFE000000 // Other devices are at high addresses
@@ -28,9 +30,16 @@
 #define DEVBASE 0xFFFFFFFF40000000
 #define KERNLINK (KERNBASE + EXTMEM) // Address where kernel is linked
 
-#define V2P(a) (((uint64_t)(a)) - KERNBASE)
-#define P2V(a) (((void *)(a)) + KERNBASE)
+// All of physical memory is mapped at PHYSBASE, the kernel image at
+// KERNBASE as well. The direct map has room up to where IO2V starts.
+#define PHYSBASE 0xFFFF800000000000
+#define PHYSTOP (0xFFFFFFFF00000000 - PHYSBASE)
+
+#define V2P(a)                                                                 \
+  ((uint64_t)(a) >= KERNBASE ? (uint64_t)(a) - KERNBASE                        \
+                             : (uint64_t)(a) - PHYSBASE)
+#define P2V(a) (((void *)(a)) + PHYSBASE)
 #define IO2V(a) (((void *)(a)) + 0xFFFFFFFF00000000)
 
-#define V2P_WO(x) ((x)-KERNBASE)   // same as V2P, but without casts
-#define P2V_WO(x) ((x) + KERNBASE) // same as P2V, but without casts
+#define V2P_WO(x) ((x)-KERNBASE)   // V2P of the kernel image, without casts
+#define P2V_WO(x) ((x) + KERNBASE) // an address in the kernel image, without casts
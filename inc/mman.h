@@ -0,0 +1,12 @@
+#pragma once
+
+// mmap protections
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+// mmap flags
+#define MAP_SHARED 0x01    // writes reach the file and other sharers
+#define MAP_PRIVATE 0x02   // writes stay in this process
+#define MAP_ANONYMOUS 0x20 // zero-filled memory; fd and offset are ignored
+
+#define MAP_FAILED ((void *)-1)
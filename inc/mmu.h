@@ -22,6 +22,10 @@
 #define CR4_OSXMMEXCPT BIT32(10)
 #define CR4_VMXE BIT32(13)
 #define CR4_FSGSBASE BIT32(16)
+#define CR4_PCIDE BIT32(17)
+
+#define CR3_NOFLUSH BIT64(63) /* keep the PCID's TLB entries */
+#define NPCID 4096            /* PCIDs are 12 bits */
 
 #define FLAGS_CF BIT64(0)    /* carry flag */
 #define FLAGS_FIXED BIT64(1) /* always 1 */
@@ -150,17 +154,42 @@ struct segdesc {
         dpl, 1, (uint)(lim) >> 16, 0, 0, 0, 0, (uint)(base) >> 24              \
   }
 
+struct rmap;
+
 struct core_map_entry {
   int available;
   short user;   // 0 if kernel allocated memory, otherwise is user
 	uint64_t va;  // if it is used by kernel only, this field is 0
 	int ref;      // reference process count
+  short pcache; // 1 while the page cache holds the page
+  short accessed; // accessed bits saved from page tables being rebuilt
+  short huge;   // 1 while part of a 2MB page, which is never swapped out
+  short dirty;  // dirty bits saved from page tables being rebuilt
+  uint swapslot; // 1 + the swap slot still holding a copy of the page, or 0
+  struct core_map_entry *next; // free list, while available
+  short listed; // 1 while on kmem's free list or zero list
+  struct rmap *rmap; // the (vspace, va) pairs mapping the page
 };
 
+// A range of usable physical memory, and where its pages' entries start
+// in the core map.
+struct memrange {
+  uint64_t start; // page aligned
+  uint64_t end;
+  int base;       // core map index of the page at start
+};
+
+extern struct memrange memranges[]; // in kalloc.c
+extern int nmemranges;
+
 struct swap_map_entry {
   int used;
   uint64_t va;  // if it is used by kernel only, this field is 0
   int ref;      // reference process count
+  struct rmap *rmap; // the mappings of the page, while it is swapped
+  char *zdata;  // compressed copy in the zswap pool, or 0 if on disk
+  ushort zlen;  // bytes in zdata
+  short busy;   // 1 while the page is on its way out, or back in
 };
 
 #endif
@@ -44,6 +44,8 @@
 
 #define MSR_IA32_TSC_AUX 0xc0000103
 
+#define MSR_IA32_TSC_DEADLINE 0x000006e0
+
 #define MSR_IA32_FEATURE_CONTROL 0x0000003a
 
 #define FEATURE_CONTROL_LOCK BIT64(0)
@@ -168,3 +170,13 @@
 #define VM_ENTRY_LOAD_PERF_GLOBAL_CTRL BIT32(13)
 #define VM_ENTRY_LOAD_PAT BIT32(14)
 #define VM_ENTRY_LOAD_EFER BIT32(15)
+
+#ifndef __ASSEMBLER__
+// Read the time-stamp counter.
+static inline uint64_t readtsc(void) {
+  uint32_t lo, hi;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (uint64_t)hi << 32 | lo;
+}
+#endif /* !__ASSEMBLER__ */
@@ -3,16 +3,56 @@
 #define KSTACKSIZE PGSIZE
 #define NPROC 64       // maximum number of processes
 #define NCPU 8         // maximum number of CPUs
+#define KSTACKCACHE 4  // kernel stacks each CPU keeps for new processes
 #define NOFILE 16      // open files per process
+#define NPIPEPAGES 4   // pages in a pipe's buffer, a power of 2
 #define NFILE 100      // open files per system
-#define NINODE 50      // maximum number of active i-nodes
+#define NSHM 16        // shared-memory segments
+#define NINODE 50      // i-nodes the inode cache starts with; it grows on demand
 #define NDEV 10        // maximum major device number
 #define ROOTDEV 1      // device number of file system root disk
+#define SWAPDEV 2      // disk of its own for swap, if present: the secondary master
 #define MAXARG 32      // max exec arguments
 #define MAXOPBLOCKS 10 // max # of blocks any FS op writes
 
 #define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
-#define FSSIZE 100000             // size of file system in blocks
+#define NBUF (MAXOPBLOCKS * 3)    // minimum size of disk block cache
+#define BCACHEFRAC 16             // 1/BCACHEFRAC of free pages go to the block cache
+#define NBUCKET 61                // buffer cache hash buckets
+#define NIBUCKET 61               // inode cache hash buckets
+#define NDENTRY 256               // cached directory entries, negative ones included
+#define NPCBUCKET 61              // page cache hash buckets
+#define NREADAHEAD 8              // blocks read ahead of a file read
+#define NIOBATCH 32               // max bufs handed to the disk at once
+#define IOSCHED_CLOOK 1           // disk scheduler: 1 for C-LOOK, 0 for FIFO
+#define SCHED_MLFQ 1              // cpu scheduler: 1 for multilevel feedback queues, 0 for round-robin
+#define NPRIO 4                   // priority levels, 0 the highest
+#define QUANTUM 1                 // ticks in a time slice; MLFQ doubles it at each lower level
+#define PRIOBOOST 100             // ticks between MLFQ's moves of every process back to its base level
+#define SLEEPSPIN 1000            // times round a sleeplock waiter spins while the holder runs
+#define NTIMERWHEEL 64            // slots in the timer wheel sleep() waits on
+#define EVICT_CLOCK 1             // page replacement: 1 for CLOCK, 0 for random
+#define SWAPCLUSTER 8             // max pages swapped out, or read back in, together
+#define KSWAPD_LOW 64             // kswapd wakes when fewer pages than this are free
+#define KSWAPD_HIGH 128           // and reclaims until this many are
+#define HUGEMINFREE 2048          // free pages below which no 2MB page is handed out
+#define ZSWAP_PCT 25              // percent of memory for compressed swap; 0 for none
+#define WSTICKS 100               // ticks between samples of a process's working set
+#define KSM 1                     // 1 runs ksmd, which merges identical user pages
+#define KSMTICKS 100              // ticks between ksmd's scans
+#define KSMSCAN 256               // pages of the core map each scan looks at
+#define LZHASHBITS 10             // log2 of the page compressor's hash table size
+#define KALLOC_DEBUG 0            // 1 fills freed pages with junk to catch dangling refs
+#define MEMBENCH 0                // 1 times the kernel's memmove and memset at boot
+#define BOOTTIME 1                // 1 prints the TSC cycles each phase of boot took
+#define LOCKDEBUG 0               // 1 records the call stack of each spinlock acquire
+#define TRACE 1                   // 1 records kernel events in the per-cpu trace rings
+#define NTRACE 512                // events a cpu's trace ring holds, a power of 2
+#define NPROF 1024                // profiler samples held until profdump takes them
+#define JOURNAL_DATA 0            // 1 logs file data too; 0 logs only metadata, writing new blocks in place first
+#define WRITEBACK 1               // 1 leaves transactions open for fsync or the flusher to commit
+#define FLUSHTICKS 100            // ticks a transaction stays open before the flusher commits it
+#define IDE_DEADLINE 10           // ticks before a queued disk request jumps the queue
+#define FSSIZE 100000             // default size of file system in blocks; mkfs -n changes it
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
@@ -0,0 +1,14 @@
+#pragma once
+
+// A page of file data held by the page cache.
+struct cpage {
+  uint dev;
+  uint inum;
+  uint pgno;  // page number within the file
+  int ref;    // users, protected by pcache.lock
+  short shared; // mapped MAP_SHARED, protected by the inode's lock
+  char *data; // kalloc'd page holding the file data
+  struct cpage *hnext; // hash chain, or free list
+  struct cpage *prev;  // LRU list of all cached pages
+  struct cpage *next;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+// PCI configuration space registers and values used by drivers.
+
+#define PCI_COMMAND 0x04 // Register offset: command and status
+#define PCI_BAR4 0x20    // Register offset: base address register 4
+
+#define PCI_COMMAND_MASTER 0x4 // Enable bus mastering
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+
+static inline void pcioutl(ushort port, uint data) {
+  asm volatile("outl %0,%w1" : : "a"(data), "d"(port));
+}
+
+static inline uint pciinl(ushort port) {
+  uint data;
+  asm volatile("inl %w1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
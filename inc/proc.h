@@ -2,6 +2,7 @@
 #include <defs.h>
 #include <param.h>
 #include <segment.h>
+#include <sysstat.h>
 #include <vspace.h>
 
 // Per-CPU state
@@ -13,7 +14,14 @@ struct cpu {
   volatile uint started;     // Has the CPU started?
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
+  struct vspace *vspace;     // Address space installed, or 0 for the kernel's
+  uint pcidgen;              // PCID generation the TLB was last flushed for
+  volatile uint tlbflush;    // Asked to flush the TLB by another CPU
+  int idle;                  // Halted for want of work; under ptable.lock
+  volatile int tickless;     // cpu0 only: idle with its tick put off
+  uint idleticks;            // ticks spent halted in idle()
 
+  // %gs points here; see mycpu() and myproc()
   struct cpu *cpu;
   struct proc *proc;
 };
@@ -23,34 +31,29 @@ extern int ncpu;
 
 // Per-CPU variables, holding pointers to the
 // current cpu and to the current process.
-// The asm suffix tells gcc to use "%gs:0" to refer to cpu
-// and "%gs:4" to refer to proc.  seginit sets up the
-// %gs segment register so that %gs refers to the memory
-// holding those two variables in the local cpu's struct cpu.
+// "%gs:0" refers to cpu and "%gs:8" to proc.  seginit sets
+// the %gs base to the memory holding those two variables in
+// the local cpu's struct cpu, and trapasm.S swaps it in on
+// entry from user space, which cannot change it from there.
 // This is similar to how thread-local variables are implemented
 // in thread libraries such as Linux pthreads.
 
-// static inline struct cpu *
-static struct cpu *mycpu(void) {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:0, %0" : "=r" (val));
-  // if (val != 0xffffffff8019a780) {
-  //   while (1) {}
-  // }
-  // return (struct cpu *)val;
+// Only stable while interrupts are off: the caller may move to
+// another cpu otherwise.
+static inline struct cpu *mycpu(void) {
+  struct cpu *c;
 
-  // struct cpu* c = &cpus[cpunum()];
-  // return c;
-
-  // single-core for now
-  return &cpus[0];
+  asm volatile("movq %%gs:0, %0" : "=r"(c));
+  return c;
 }
 
+// One load, so no migration can come between finding the cpu and
+// reading its proc.
 static inline struct proc *myproc(void) {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:8, %0" : "=r" (val));
-  // return (struct proc *)val;
-  return mycpu()->proc;
+  struct proc *p;
+
+  asm volatile("movq %%gs:8, %0" : "=r"(p));
+  return p;
 }
 
 // Saved registers for kernel context switches.
@@ -76,9 +79,11 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+#define FDWORDS ((NOFILE + 63) / 64) // words of a proc's fdused
+
 // Per-process state
 struct proc {
-  struct vspace vspace;        // Virtual address space descriptor
+  struct vspace *vspace;       // Virtual address space, shared by threads
   char* kstack;                // Kernel stack
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -88,8 +93,19 @@ struct proc {
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   char name[16];               // Process name (debugging)
+  int txdepth;                 // Nesting depth of begin_tx
+  int cpu;                     // CPU last run on, whose run queue it joins
+  int prio;                    // Priority level it is queued at, 0 the highest
+  int baseprio;                // Level set by setpriority; MLFQ boosts to it
+  int slice;                   // Ticks run at prio
+  struct proc *qnext;          // Next on its run queue or wait list
+  uint64_t ioring;             // Address of its io_ring, or 0
+  int thread;                  // Made by clone, sharing its parent's vspace
+  uint64_t ncalls[NSTAT];      // System calls made by number, then faults by kind
+  uint64_t callcycles[NSTAT];  // TSC cycles spent in them
 
   struct file_info* files[NOFILE];  // Process file table
+  uint64_t fdused[FDWORDS];         // Bitmap of the fds in files in use
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,13 @@
+#pragma once
+
+// Samples of the profiler, handed out by the profdump system call.
+// Both the kernel and user programs use this header file.
+
+#define PROFDEPTH 8 // return addresses a sample holds, the pc first
+
+struct profsample {
+  uint64_t pcs[PROFDEPTH]; // pc at the tick, then its callers; 0 ends
+  int pid;                 // of the process running, or 0
+  int user;                // 1 if the pc is in user space
+  char name[16];           // of the process running
+};
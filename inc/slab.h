@@ -0,0 +1,23 @@
+#pragma once
+
+#include <param.h>
+#include <spinlock.h>
+
+#define SLABMAG 8 // free objects each CPU keeps per cache
+
+struct slab;
+
+// A cache of equal-sized kernel objects, carved out of kalloc'd pages.
+// An object is constructed once, when its page joins the cache, and is
+// handed back to slabfree still in its constructed state.
+struct slabcache {
+  char *name;
+  uint size;               // bytes per object, link word included
+  void (*ctor)(void *);    // constructor, or 0
+  struct spinlock lock;
+  struct slab *partial;    // slabs with free objects, protected by lock
+  struct {
+    int n;
+    void *objs[SLABMAG];
+  } mag[NCPU];             // per-CPU free objects, used with interrupts off
+};
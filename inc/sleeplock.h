@@ -1,12 +1,17 @@
 #pragma once
 #include <spinlock.h>
 
-// Long-term locks for processes
+// Long-term locks for processes. A lock is held by one process, or
+// shared by any number of readers.
 struct sleeplock {
   uint locked;        // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  int readers;        // processes sharing it
+  int writers;        // processes waiting to hold it, which readers let by
 
   // For debugging:
   char *name; // Name of lock.
   int pid;    // Process holding lock
+
+  struct proc *proc; // Process holding lock, for waiters to see if it runs
 };
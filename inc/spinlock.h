@@ -1,12 +1,20 @@
 #pragma once
 
-// Mutual exclusion lock.
+// Mutual exclusion lock: a ticket lock, which CPUs get in the order
+// they asked for it.
 struct spinlock {
-  uint locked; // Is the lock held?
+  uint next;  // Ticket the next CPU to ask takes
+  uint owner; // Ticket that holds the lock, or may take it
 
   // For debugging:
   char *name;       // Name of lock.
   struct cpu *cpu;  // The cpu holding the lock.
   uint64_t pcs[10]; // The call stack (an array of program counters)
-                    // that locked the lock.
+                    // that locked the lock; only with LOCKDEBUG.
+
+  // Contention statistics, under the lock itself:
+  uint64_t nacquire; // times acquired
+  uint64_t nspin;    // times round the loop waiting for it
+  uint64_t maxhold;  // longest it was held, in TSC cycles
+  uint64_t tacquire; // TSC when last acquired
 };
@@ -0,0 +1,51 @@
+#pragma once
+
+// System call numbers
+#define SYS_fork 1
+#define SYS_exit 2
+#define SYS_wait 3
+#define SYS_pipe 4
+#define SYS_read 5
+#define SYS_kill 6
+#define SYS_exec 7
+#define SYS_fstat 8
+#define SYS_chdir 9
+#define SYS_dup 10
+#define SYS_getpid 11
+#define SYS_sbrk 12
+#define SYS_sleep 13
+#define SYS_uptime 14
+#define SYS_open 15
+#define SYS_write 16
+#define SYS_mknod 17
+#define SYS_unlink 18
+#define SYS_link 19
+#define SYS_mkdir 20
+#define SYS_close 21
+#define SYS_sysinfo 22
+#define SYS_crashn 23
+#define SYS_getdents 24
+#define SYS_mmap 25
+#define SYS_munmap 26
+#define SYS_spawn 27
+#define SYS_setpriority 28
+#define SYS_splice 29
+#define SYS_pread 30
+#define SYS_pwrite 31
+#define SYS_readv 32
+#define SYS_writev 33
+#define SYS_ioringsetup 34
+#define SYS_ioringenter 35
+#define SYS_clone 36
+#define SYS_futex_wait 37
+#define SYS_futex_wake 38
+#define SYS_shm_open 39
+#define SYS_shm_map 40
+#define SYS_shm_unlink 41
+#define SYS_stats 42
+#define SYS_tracedump 43
+#define SYS_profile 44
+#define SYS_profdump 45
+#define SYS_fsync 46
+#define SYS_ftruncate 47
+#define SYS_memlimit 48
@@ -0,0 +1,61 @@
+#pragma once
+
+// System statistics returned by the sysinfo system call.
+// Both the kernel and user programs use this header file.
+//
+// New counters go at the end, with a new SYSINFO_VERSION; version and
+// size say how much of the block the running kernel filled in, so that
+// a program built against an older layout still reads its own fields.
+
+#define SYSINFO_VERSION 4
+#define SYSINFO_NCPU 8 // cpus idle_ticks has room for
+
+struct sys_info {
+  int pages_in_use;    // physical pages allocated
+  int pages_in_swap;   // pages held in the swap region
+  int free_pages;      // physical pages free
+  int num_page_faults; // page faults taken
+  int num_swap_ins;    // pages read back from the swap region
+  int zswap_pages;     // swapped pages held compressed in memory
+  int num_disk_reads;  // blocks read from the disk
+
+  int disk_queue_depth; // disk requests queued or in flight now
+  int disk_queue_peak;  // most disk requests ever queued at once
+  int disk_requests;    // commands issued to the disk
+  int disk_merges;      // blocks merged into another block's command
+
+  int icache_hits;   // inode lookups found in the inode cache
+  int icache_misses; // inode lookups that had to read the disk inode
+
+  int slab_pages;   // pages held by the slab caches
+  int slab_objects; // slab objects allocated
+
+  // version 2
+  int version; // SYSINFO_VERSION of the kernel
+  int size;    // bytes of this block it filled in
+
+  int bcache_hits;   // block reads found in the buffer cache
+  int bcache_misses; // block reads that went to the disk
+
+  int disk_blocks_read;    // blocks read by the disk driver
+  int disk_blocks_written; // blocks written by the disk driver
+
+  int log_commits; // transactions committed
+  int log_blocks;  // blocks they logged
+
+  int num_cow_faults; // faults that copied a copy-on-write page
+  int num_swap_outs;  // pages evicted to swap
+
+  int context_switches; // processes switched to
+  int wakeups;          // sleepers woken
+
+  int ncpu;                     // cpus running
+  int idle_ticks[SYSINFO_NCPU]; // ticks each cpu spent halted
+
+  // version 3
+  int swap_cached; // pages in memory whose swap copy is kept
+  int swap_reused; // evictions of such pages, which wrote nothing
+
+  // version 4
+  int ksm_merged; // pages freed by same-page merging
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+// System call and page fault statistics returned by the stats system
+// call. Both the kernel and user programs use this header file.
+
+#define NSYSCALL 49    // system call numbers counted, from 0
+#define NSTATBUCKET 24 // latency buckets; the last takes all longer calls
+
+// Page faults by kind. stats puts them after the system calls, the
+// faults of kind k at NSYSCALL + k.
+#define FAULT_FATAL 0  // nothing to put right; the process is killed
+#define FAULT_LAZY 1   // first touch of a lazily filled page
+#define FAULT_SWAPIN 2 // page read back from swap
+#define FAULT_STACK 3  // stack grown
+#define FAULT_COW 4    // copy-on-write page copied
+#define FAULT_RACE 5   // already put right by another thread
+#define NFAULT 6
+
+// Memory of a process, or of them all, in pages. stats puts them after
+// the faults, figure k in the count of NSYSCALL + NFAULT + k.
+#define MEM_RSS 0   // in memory
+#define MEM_SWAP 1  // in swap
+#define MEM_WS 2    // used within the last WSTICKS
+#define MEM_LIMIT 3 // memlimit's, for a process; 0 for none
+#define NMEM 4
+
+#define NSTAT (NSYSCALL + NFAULT + NMEM) // entries stats fills in at most
+
+// Calls of one system call, or faults of one kind, and their time in
+// TSC cycles.
+struct sysstat {
+  uint64_t count;
+  uint64_t cycles;
+  // calls taking [2^i, 2^(i+1)) cycles; system-wide only
+  uint hist[NSTATBUCKET];
+};
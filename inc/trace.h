@@ -0,0 +1,30 @@
+#pragma once
+
+// Events of the kernel's trace rings, drained by the tracedump system
+// call. Both the kernel and user programs use this header file.
+
+// event types, and the meaning of arg
+#define TR_RUN 1     // the scheduler runs a process; its pid
+#define TR_SLEEP 2   // a process sleeps; the channel
+#define TR_WAKEUP 3  // a sleeper is made runnable; its pid
+#define TR_IDERW 4   // bufs handed to the disk; the first block
+#define TR_IDEINTR 5 // a disk interrupt; the first block done
+#define TR_TX 6      // a file system transaction; 0
+#define TR_COMMIT 7  // a log commit; the blocks in it
+#define TR_FAULT 8   // a page fault handled; the address
+#define TR_EVICT 9   // pages evicted to swap; how many
+#define TR_LOST 10   // events dropped as the ring was full; how many
+
+// phases, as in Chrome's trace format
+#define TR_BEGIN 'B'
+#define TR_END 'E'
+#define TR_INSTANT 'i'
+
+struct traceev {
+  uint64_t tsc; // time stamp counter at the event
+  uint64_t arg;
+  ushort type;  // TR_*
+  uchar phase;  // TR_BEGIN, TR_END or TR_INSTANT
+  uchar cpu;
+  int pid;      // of the process running, or 0
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+// A buffer of a readv or writev call.
+// Both the kernel and user programs use this header file.
+struct iovec {
+  void *iov_base; // start of the buffer
+  int iov_len;    // bytes in it
+};
+
+#define IOV_MAX 16 // most buffers one readv or writev takes
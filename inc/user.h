@@ -0,0 +1,136 @@
+#pragma once
+
+struct stat;
+struct dirent;
+struct sys_info;
+struct iovec;
+struct io_ring;
+struct sysstat;
+struct traceev;
+struct profsample;
+
+// system calls
+int fork(void);
+noreturn void exit(void);
+int wait(void);
+int pipe(int *);
+int write(int, void *, int);
+int read(int, void *, int);
+int close(int);
+int kill(int);
+int exec(char *, char **);
+int open(char *, int);
+int mknod(char *, short, short);
+int unlink(char *);
+int fstat(int fd, struct stat *);
+int link(char *, char *);
+int mkdir(char *);
+int chdir(char *);
+int dup(int);
+int getpid(void);
+char *sbrk(int);
+int sleep(int);
+int uptime(void);
+int sysinfo(struct sys_info *);
+int crashn(int);
+int getdents(int, struct dirent *, int);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int spawn(char *, char **, int *, int);
+int setpriority(int, int);
+int splice(int, int, int);
+int pread(int, void *, int, int);
+int pwrite(int, void *, int, int);
+int readv(int, struct iovec *, int);
+int writev(int, struct iovec *, int);
+struct io_ring *ioringsetup(void);
+int ioringenter(int);
+int clone(void (*)(void *), void *, void *);
+int futex_wait(volatile int *, int);
+int futex_wake(volatile int *, int);
+int shm_open(char *, int);
+void *shm_map(int);
+int shm_unlink(char *);
+int stats(int, struct sysstat *, int);
+int tracedump(struct traceev *, int);
+int profile(int);
+int profdump(struct profsample *, int);
+int fsync(int);
+int ftruncate(int, int);
+int memlimit(int, int);
+
+// ulib.c
+int stat(char *, struct stat *);
+char *strcpy(char *, char *);
+void *memmove(void *, void *, int);
+char *strchr(const char *, char c);
+void *memchr(const void *, int, int);
+int strcmp(const char *, const char *);
+void printf(int, char *, ...);
+char *gets(char *, int max);
+uint strlen(char *);
+void *memset(void *, int, uint);
+void *malloc(uint);
+void free(void *);
+int atoi(const char *);
+
+// A lock for threads that makes a system call only to wait or to wake
+// a waiter. state is 0 unlocked, 1 locked, 2 locked with waiters.
+struct mutex {
+  volatile int state;
+};
+
+// A condition variable; seq counts signals.
+struct cond {
+  volatile int seq;
+};
+
+void mutex_init(struct mutex *);
+void mutex_lock(struct mutex *);
+void mutex_unlock(struct mutex *);
+void cond_init(struct cond *);
+void cond_wait(struct cond *, struct mutex *);
+void cond_signal(struct cond *);
+void cond_broadcast(struct cond *);
+
+// stdio.c
+// Buffered streams over file descriptors. Output to the console is line
+// buffered, and flushed at the end of every printf; to files and pipes
+// it is fully buffered. exit, fork and exec flush every stream first.
+#define BUFSIZ 4096 // bytes of a stream's buffer
+
+#define IOFBF 1 // flushed when full
+#define IOLBF 2 // flushed at each newline too
+#define IONBF 3 // flushed at the end of each call
+
+struct stream {
+  int fd;
+  int reading; // for input rather than output
+  int mode;    // IO*BF, or 0 until the first output picks one
+  int hold;    // in a printf, which flushes at its end
+  int size;    // bytes of buf
+  int n;       // bytes in buf
+  int r;       // next byte of buf to read
+  int error;   // a read or write failed
+  char *buf;
+  struct stream *next; // of the streams exit flushes
+};
+
+extern struct stream *fin, *fout, *ferr; // fds 0, 1 and 2
+
+struct stream *fdopen(int, char *);
+int fclose(struct stream *);
+int fflush(struct stream *);
+int fputc(int, struct stream *);
+int fputs(char *, struct stream *);
+int fwrite(void *, int, struct stream *);
+int fgetc(struct stream *);
+char *fgets(char *, int, struct stream *);
+int fread(void *, int, struct stream *);
+int ferror(struct stream *);
+void fprintf(struct stream *, char *, ...);
+
+// the system calls, without the flush
+int _fork(void);
+noreturn void _exit(void);
+int _exec(char *, char **);
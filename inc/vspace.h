@@ -0,0 +1,132 @@
+#pragma once
+
+#include <mmu.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+#include <x86_64vm.h>
+
+struct inode;
+
+#define VPI_PRESENT ((short)1)
+#define VPI_WRITABLE ((short)1)
+#define VPI_READONLY ((short)0)
+
+// Bookkeeping for one virtual page of a vregion.
+struct vpage_info {
+  short used;        // the page is mapped (in memory or in swap)
+  short present;     // the page is in physical memory
+  short writable;    // the page may be written
+  short is_cow;      // a write must copy the page first
+  short swapped;     // the page is in the swap region
+  uint swap_index;   // swap slot, if swapped
+  uint64_t ppn;      // physical page number, if present
+};
+
+// vpage_infos per vpi_page: small enough that four vpi_pages share a
+// slab page, since most regions are only a few pages long
+#define VPIPPAGE 40
+
+// A run of vpage_infos, a leaf of its region's vpage_info tree. A fork
+// shares the leaves of each region with the child's rather than copying
+// them; a region copies a shared leaf when it first touches it, or takes
+// it over once the others have let go of it.
+struct vpi_page {
+  struct vpage_info infos[VPIPPAGE];
+  int ref;           // regions holding it
+  struct vspace *vs; // the one holder whose page table may map its pages
+                     // and whose reverse map entries name them; 0 if the
+                     // entries name this vpi_page
+};
+
+// children per vpi_dir, which packs four to a slab page like a vpi_page
+#define VPIDIRN 128
+
+// An inner node of a region's vpage_info tree. A region's vpage_infos
+// hang off a radix tree of vpi_dirs over vpi_pages, as tall as the
+// region needs: a tree of height h holds VPIPPAGE * VPIDIRN^h infos, so
+// height 2 covers 2.5GB. Missing subtrees are 0 and hold unused pages.
+struct vpi_dir {
+  void *slots[VPIDIRN];
+};
+
+enum vr_direction { VRDIR_UP, VRDIR_DOWN };
+
+// A piece of a region backed by a file: [va, va + memsz), of which the
+// first filesz bytes come from the region's inode at offset off. Its
+// pages are filled in on first touch.
+struct vrseg {
+  uint64_t va;
+  uint off;
+  uint filesz;
+  uint memsz;
+  short writable;
+};
+
+#define NVRSEG 4 // file-backed segments per region
+
+struct vregion {
+  enum vr_direction dir; // direction the region grows in
+  uint64_t va_base;      // lowest address if it grows up, else one past the highest
+  uint64_t size;         // bytes in the region
+  void *pages;           // vpage_info tree: a vpi_page if pgheight is 0,
+                         // else a vpi_dir
+  int pgheight;          // height of the tree
+  struct vspace *vs;     // the vspace the region is part of
+
+  struct inode *ip;      // file backing the segments, or 0
+  short shared;          // mmap'd MAP_SHARED: pages are shared, never copied
+  int nseg;
+  struct vrseg seg[NVRSEG];
+};
+
+// lowest address and one past the highest address of a region
+#define VRBOT(vr) (((vr)->dir == VRDIR_UP) ? (vr)->va_base : (vr)->va_base - (vr)->size)
+#define VRTOP(vr) (((vr)->dir == VRDIR_UP) ? (vr)->va_base + (vr)->size : (vr)->va_base)
+
+#define NVRMMAP 8 // mmap'd regions per vspace
+
+// mmap places regions downwards from here, leaving the stack room to grow
+#define VMMAPTOP (SZ_2G - SZ_1M)
+
+enum {
+  VR_CODE = 0,
+  VR_HEAP = 1,
+  VR_USTACK = 2,
+  VR_MMAP = 3, // first mmap'd region; a free one has size 0
+  NREGIONS = VR_MMAP + NVRMMAP
+};
+
+struct vspace {
+  struct vregion regions[NREGIONS];
+  pml4e_t *pgtbl;
+  struct spinlock lock;
+
+  // the TLB tags vs's entries with pcid, which is only good while
+  // pcidgen is the current generation; 0 is none yet
+  uint pcid;
+  uint pcidgen;
+  // masks of cpus, a bit each
+  uint tlbactive; // have vs installed
+  uint tlbstale;  // must flush vs's PCID when they next install it
+
+  int ref; // processes using vs, a process and its threads; 0 if free
+  // while vs is shared, held across page faults and changes to its
+  // regions, which the threads would otherwise race in; before inode
+  // locks
+  struct sleeplock faultlock;
+
+  // pages of vs in memory, in swap, and used within WSTICKS, as the
+  // last vspacesample counted them; swapping keeps the first two near
+  int rss;
+  int swapped;
+  int wss;
+  uint sampled; // ticks at the last vspacesample
+  int memlimit; // rss above which reclaim takes vs's pages first; 0 for none
+};
+
+int vspacecontains(struct vspace *, uint64_t, int);
+int vspacehuge(struct vspace *, uint64_t);
+
+// x86_64vm.c
+pde_t *walkpde(pml4e_t *, const void *, int);
+int splitpde(pde_t *);
@@ -1,9 +1,14 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
-// in memory reduces the number of disk reads and also provides
-// a synchronization point for disk blocks used by multiple processes.
+// The buffer cache is a set of buf structures holding cached
+// copies of disk block contents.  Caching disk blocks in memory
+// reduces the number of disk reads and also provides a
+// synchronization point for disk blocks used by multiple processes.
+//
+// The buffers live in pages taken from kalloc at boot, so the
+// cache scales with the amount of memory instead of NBUF.
+// Buffers are kept in hash buckets on (dev, blockno); each
+// bucket's LRU list picks which unused buffer to recycle.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
@@ -21,6 +26,8 @@
 #include <cdefs.h>
 #include <defs.h>
 #include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
 #include <param.h>
 #include <sleeplock.h>
 #include <spinlock.h>
@@ -30,81 +37,260 @@
 int crashn_enable = 0;
 int crashn = 0;
 
-int num_disk_reads = 0;
+int num_disk_reads = 0; // blocks read, which missed the cache
+int bcache_hits = 0;    // blocks read that were cached
 
-struct {
+// disk queue statistics, maintained by the disk driver
+int disk_queue_depth = 0;
+int disk_queue_peak = 0;
+int disk_requests = 0;
+int disk_merges = 0;
+int disk_blocks_read = 0;
+int disk_blocks_written = 0;
+
+// Each bucket has its own lock and its own LRU list of buffers,
+// so lookups of blocks that hash to different buckets never contend.
+// A miss that finds no free buffer in its own bucket steals one from
+// another bucket; steallock serializes stealers so that a process
+// never waits on a second bucket lock while someone else waits on
+// its first.
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
+  // Linked list of the bucket's buffers, through prev/next.
   // head.next is most recently used.
   struct buf head;
+};
+
+struct {
+  struct spinlock steallock;
+  int nbuf;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket *bhash(uint dev, uint blockno) {
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void bunlink(struct buf *b) {
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Insert b at the MRU end of bk.
+static void blinkhead(struct bucket *bk, struct buf *b) {
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Find the least recently used free and clean buffer in bk.
+// "clean" because B_DIRTY and not locked means log.c
+// hasn't yet committed the changes to the buffer.
+static struct buf *bfree(struct bucket *bk) {
+  struct buf *b;
+
+  for (b = bk->head.prev; b != &bk->head; b = b->prev)
+    if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      return b;
+  return 0;
+}
+
+static struct buf *bfind(struct bucket *bk, uint dev, uint blockno) {
+  struct buf *b;
+
+  for (b = bk->head.next; b != &bk->head; b = b->next)
+    if (b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Allocates a page of BPERPAGE empty buffers, each holding its block
+// in its own space, and returns the first; or 0 if out of memory.
+struct buf *ballocpage(char *name) {
+  struct buf *b;
+  char *page;
+  int i;
+
+  if ((page = kalloc()) == 0)
+    return 0;
+  // the disk does DMA with 32-bit addresses
+  if (V2P(page) >= SZ_4G)
+    panic("ballocpage: buffer above 4GB");
+  memset(page, 0, PGSIZE);
+  b = (struct buf *)page;
+  for (i = 0; i < BPERPAGE; i++) {
+    b[i].data = b[i].space;
+    initsleeplock(&b[i].lock, name);
+  }
+  return b;
+}
+
 void binit(void) {
+  struct bucket *bk;
   struct buf *b;
+  int npage, i, j;
 
-  initlock(&bcache.lock, "bcache");
+  initlock(&bcache.steallock, "bcache.steal");
+  lockstat(&bcache.steallock);
+  for (bk = bcache.bucket; bk < bcache.bucket + NBUCKET; bk++) {
+    initlock(&bk->lock, "bcache.bucket");
+    lockstat(&bk->lock);
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  // Give the cache a fixed share of free memory, but never less
+  // than NBUF buffers. Buffers do not straddle pages.
+  npage = free_pages / BCACHEFRAC;
+  if (npage * BPERPAGE < NBUF)
+    npage = (NBUF + BPERPAGE - 1) / BPERPAGE;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for (i = 0; i < npage; i++) {
+    if ((b = ballocpage("buffer")) == 0)
+      break;
+    for (j = 0; j < BPERPAGE; j++) {
+      blinkhead(&bcache.bucket[bcache.nbuf % NBUCKET], b + j);
+      bcache.nbuf++;
+    }
   }
+  if (bcache.nbuf < NBUF)
+    panic("binit: no memory for buffers");
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
+// Callers outside bio.c use this only to overwrite a whole block.
+struct buf *bget(uint dev, uint blockno) {
+  struct bucket *bk, *victim;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-    if (b->dev == dev && b->blockno == blockno) {
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if ((b = bfind(bk, dev, blockno)) != 0) {
+    b->refcnt++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
 
-  // Not cached; recycle some unused buffer and clean buffer
-  // "clean" because B_DIRTY and not locked means log.c
-  // hasn't yet committed the changes to the buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached; recycle an unused buffer from this bucket.
+  if ((b = bfree(bk)) != 0)
+    goto found;
+
+  // None here; steal one from another bucket. Drop our bucket
+  // lock while waiting for the steal lock, so the block may have
+  // been cached (or a buffer freed) by the time we get it back.
+  release(&bk->lock);
+  acquire(&bcache.steallock);
+  acquire(&bk->lock);
+  if ((b = bfind(bk, dev, blockno)) != 0) {
+    b->refcnt++;
+    release(&bk->lock);
+    release(&bcache.steallock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  if ((b = bfree(bk)) == 0) {
+    for (victim = bcache.bucket; victim < bcache.bucket + NBUCKET; victim++) {
+      if (victim == bk)
+        continue;
+      acquire(&victim->lock);
+      if ((b = bfree(victim)) != 0) {
+        bunlink(b);
+        blinkhead(bk, b);
+      }
+      release(&victim->lock);
+      if (b)
+        break;
     }
   }
-  panic("bget: no buffers");
+  release(&bcache.steallock);
+  if (b == 0)
+    panic("bget: no buffers");
+
+found:
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->data = b->space;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
+// Only reads that miss the cache count as disk reads.
 struct buf *bread(uint dev, uint blockno) {
-  num_disk_reads += 1;
   struct buf *b;
 
   b = bget(dev, blockno);
   if (!(b->flags & B_VALID)) {
+    num_disk_reads += 1;
     iderw(b);
+  } else {
+    bcache_hits++;
   }
   return b;
 }
 
+// Start reading the indicated block into the cache without waiting
+// for it. Nothing is done if the block is already cached or no buffer
+// is free in its bucket; read-ahead never evicts through stealing.
+void breadahead(uint dev, uint blockno) {
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  if (bfind(bk, dev, blockno) != 0 || (b = bfree(bk)) == 0) {
+    release(&bk->lock);
+    return;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->data = b->space;
+  release(&bk->lock);
+
+  // A reader may have found the buffer and filled it first.
+  acquiresleep(&b->lock);
+  if (b->flags & B_VALID) {
+    brelse(b);
+    return;
+  }
+  num_disk_reads += 1;
+  b->flags |= B_ASYNC;
+  iderw_submit(&b, 1);
+}
+
+// Return locked bufs for the n blocks starting at blockno in bufs.
+// The disk reads of all blocks that are not cached overlap.
+void breadn(uint dev, uint blockno, struct buf **bufs, int n) {
+  struct buf *io[NIOBATCH];
+  int i, j, nio;
+
+  for (i = 0; i < n; i += NIOBATCH) {
+    nio = 0;
+    for (j = i; j < n && j < i + NIOBATCH; j++) {
+      bufs[j] = bget(dev, blockno + j);
+      if (!(bufs[j]->flags & B_VALID))
+        io[nio++] = bufs[j];
+    }
+    num_disk_reads += nio;
+    bcache_hits += j - i - nio;
+    iderw_submit(io, nio);
+    for (j = 0; j < nio; j++)
+      iderw_wait(io[j]);
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   if (crashn_enable) {
@@ -118,27 +304,62 @@ void bwrite(struct buf *b) {
   iderw(b);
 }
 
-// Release a locked buffer.
-// Move to the head of the MRU list.
-void brelse(struct buf *b) {
-  if (!holdingsleep(&b->lock))
-    panic("brelse");
+// Write the contents of n locked bufs to disk, overlapping the writes.
+void bwriten(struct buf **bufs, int n) {
+  int i, j;
+
+  // Keep the crash point exact: one write at a time.
+  if (crashn_enable) {
+    for (i = 0; i < n; i++)
+      bwrite(bufs[i]);
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (!holdingsleep(&bufs[i]->lock))
+      panic("bwriten");
+    bufs[i]->flags |= B_DIRTY;
+  }
+  for (i = 0; i < n; i += NIOBATCH) {
+    j = min(n - i, NIOBATCH);
+    iderw_submit(bufs + i, j);
+  }
+  for (i = 0; i < n; i++)
+    iderw_wait(bufs[i]);
+}
+
+// Unlock b and put it at the head of its bucket's MRU list.
+static void bunlock(struct buf *b) {
+  struct bucket *bk;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bunlink(b);
+    blinkhead(bk, b);
   }
+  release(&bk->lock);
+}
+
+// Release a locked buffer.
+// Move to the head of its bucket's MRU list.
+void brelse(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("brelse");
+  bunlock(b);
+}
 
-  release(&bcache.lock);
+// Release a B_ASYNC buffer once the disk is done with it. Called from
+// the disk interrupt, which runs in whatever process it lands in, or in
+// none, so it cannot check that the caller is the submitter.
+void brelse_async(struct buf *b) {
+  if (!b->lock.locked)
+    panic("brelse_async");
+  bunlock(b);
 }
 
 // Print the data at the given block.
@@ -145,6 +145,7 @@ void panic(char *s) {
 
   cli();
   cons.locking = 0;
+  uartflush();
   cprintf("cpu with apicid %d: panic: ", mycpu()->apicid);
   cprintf(s);
   cprintf("\n");
@@ -220,7 +221,7 @@ struct {
 #define C(x) ((x) - '@') // Control-x
 
 void consoleintr(int (*getc)(void)) {
-  int c, doprocdump = 0;
+  int c, doprocdump = 0, dolockdump = 0;
 
   acquire(&cons.lock);
   while ((c = getc()) >= 0) {
@@ -229,6 +230,10 @@ void consoleintr(int (*getc)(void)) {
       // procdump() locks cons.lock indirectly; invoke later
       doprocdump = 1;
       break;
+    case C('L'): // Lock statistics.
+      // lockdump() locks cons.lock indirectly too
+      dolockdump = 1;
+      break;
     case C('U'): // Kill line.
       while (input.e != input.w &&
              input.buf[(input.e - 1) % INPUT_BUF] != '\n') {
@@ -260,6 +265,8 @@ void consoleintr(int (*getc)(void)) {
   if (doprocdump) {
     procdump(); // now call procdump() wo. cons.lock held
   }
+  if (dolockdump)
+    lockdump();
 }
 
 int consoleread(struct inode *ip, char *dst, int n) {
@@ -68,6 +68,16 @@ static const char *names[CPUID_BIT(CPUID_NR_FLAGS, 0)] = {
     [CPUID_FEATURE_RDRAND] = "rdrand",
     [CPUID_FEATURE_HYPERVISOR] = "hypervisor",
 
+    // CPUID(7, 0): EBX
+    [CPUID_FEATURE_FSGSBASE] = "fsgsbase",
+    [CPUID_FEATURE_BMI1] = "bmi1",
+    [CPUID_FEATURE_AVX2] = "avx2",
+    [CPUID_FEATURE_SMEP] = "smep",
+    [CPUID_FEATURE_BMI2] = "bmi2",
+    [CPUID_FEATURE_ERMS] = "erms",
+    [CPUID_FEATURE_INVPCID] = "invpcid",
+    [CPUID_FEATURE_SMAP] = "smap",
+
     // CPUID(0x80000001): EDX
     [CPUID_FEATURE_SYSCALL] = "syscall",
     [CPUID_FEATURE_MP] = "mp",
@@ -126,6 +136,29 @@ static bool cpuid_has(uint32_t *feature, unsigned int bit) {
   return feature[bit / 32] & BIT32(bit % 32);
 }
 
+// Reads the feature bits of CPUID(1), CPUID(7, 0) and CPUID(0x80000001).
+static void cpuid_features(uint32_t *feature) {
+  uint32_t max = 0, eax = 7, ecx = 0, edx;
+
+  cpuid(0, &max, NULL, NULL, NULL);
+  cpuid(1, NULL, NULL, &feature[CPUID_1_ECX], &feature[CPUID_1_EDX]);
+  // leaf 7 has subleaves, picked by ecx
+  if (max >= 7)
+    asm volatile("cpuid"
+                 : "+a"(eax), "=b"(feature[CPUID_7_EBX]), "+c"(ecx), "=d"(edx));
+  cpuid(0x80000001, NULL, NULL, &feature[CPUID_80000001_ECX],
+        &feature[CPUID_80000001_EDX]);
+}
+
+// Returns whether the CPU has the feature bit, for use before
+// cpuid_print.
+int cpuid_feature(unsigned int bit) {
+  uint32_t feature[CPUID_NR_FLAGS] = {0};
+
+  cpuid_features(feature);
+  return cpuid_has(feature, bit);
+}
+
 void cpuid_print(void) {
   uint32_t eax, brand[12], feature[CPUID_NR_FLAGS] = {0};
 
@@ -138,9 +171,7 @@ void cpuid_print(void) {
   cpuid(0x80000004, &brand[8], &brand[9], &brand[10], &brand[11]);
   cprintf("CPU: %s\n", brand);
 
-  cpuid(1, NULL, NULL, &feature[CPUID_1_ECX], &feature[CPUID_1_EDX]);
-  cpuid(0x80000001, NULL, NULL, &feature[CPUID_80000001_ECX],
-        &feature[CPUID_80000001_EDX]);
+  cpuid_features(feature);
   print_feature(feature);
   // Check feature bits.
   assert(cpuid_has(feature, CPUID_FEATURE_PSE));
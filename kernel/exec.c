@@ -8,77 +8,117 @@
 #include <trap.h>
 #include <x86_64.h>
 
-int exec(char *path, char **argv) {
-  // your code here
-  struct vspace vs; // new vspace
-  struct vspace vs_old = myproc()->vspace; // current vspace
-  int size = 0;
-  char** argv_new; // argv array on new stack
-  char* str;
-  struct trap_frame tf = *myproc()->tf; // new trap frame
+// Where the strings start in the block execargs builds, after the
+// longest argv array.
+#define ARGSTR ((MAXARG + 1) * sizeof(uint64_t))
 
-  // verify argv address and find its length
-  while(true) {
-    int len = fetchstr((uint64_t)argv[size], &str);
-    size++;
-    
-    if (len == -1)
-      return -1;
+// Builds in block, a page, the arguments argv of the current process as
+// they are to go on a new stack at SZ_2G: the argv array and then the
+// strings it points at, each string fetched once. Returns the bytes of
+// the block, which goes at *base, and sets *argc; or -1 if argv is bad
+// or too big for the stack's page.
+static int execargs(char **argv, char *block, int *argc, uint64_t *base) {
+  uint64_t *ptrs = (uint64_t *)block;
+  int64_t uarg;
+  char *str;
+  int i, len, n = 0, sz;
 
-    // if it is the end \0
-    if (strncmp(str, 0, 1) == 0)
+  for (i = 0;; i++) {
+    if (i > MAXARG || fetchint64_t((uint64_t)(argv + i), &uarg) < 0)
+      return -1;
+    if (uarg == 0)
       break;
+    if ((len = fetchstr(uarg, &str)) < 0 || ARGSTR + n + len + 1 > PGSIZE)
+      return -1;
+    memmove(block + ARGSTR + n, str, len + 1);
+    ptrs[i] = n; // made an address below, once the array's size is known
+    n += len + 1;
   }
+  *argc = i;
 
-  // Initialize new vspace
-  if (vspaceinit(&vs) == -1)
+  // room for the return address too, on a 16-byte boundary
+  sz = (i + 1) * sizeof(uint64_t) + n;
+  *base = (SZ_2G - sz) & ~15;
+  if (SZ_2G - *base + sizeof(uint64_t) > PGSIZE)
     return -1;
+  memmove(block + (i + 1) * sizeof(uint64_t), block + ARGSTR, n);
+  for (i = 0; i < *argc; i++)
+    ptrs[i] += *base + (*argc + 1) * sizeof(uint64_t);
+  ptrs[*argc] = 0;
+  return sz;
+}
 
-  if (vspaceinitstack(&vs, SZ_2G) == -1)
-    return -1;
+// Loads the program at path into the fresh vspace vs, with the
+// arguments argv of the current process on its stack, and points tf at
+// its entry. Returns 0, or -1 if argv or the program is bad.
+int execload(struct vspace *vs, char *path, char **argv,
+             struct trap_frame *tf) {
+  uint64_t base;
+  char *block;
+  int argc, sz;
 
-  if (vspaceloadcode(&vs, path, &tf.rip) == 0)
+  if ((block = kalloc()) == 0)
+    return -1;
+  if ((sz = execargs(argv, block, &argc, &base)) < 0 ||
+      vspaceinitstack(vs, SZ_2G) == -1 ||
+      vspaceloadcode(vs, path, &tf->rip) == 0 ||
+      vspacewritetova(vs, base, block, sz) == -1) {
+    kfree(block);
     return -1;
+  }
+  kfree(block);
 
-  tf.rsp = SZ_2G; // set stack pointer
-  tf.rdi = size - 1; // set argc argument
-  
-  // allocate space for string array
-  tf.rsp -= sizeof(char*) * size;
-  argv_new = (char**) tf.rsp;
-  tf.rsi = tf.rsp; // set argv argument
+  tf->rdi = argc;
+  tf->rsi = base;  // argv
+  tf->rsp = base - 8; // leave room for return address
+  tf->rax = 0;
+  return 0;
+}
 
-  for (int i = 0; i < size; i++) {
-    int len = fetchstr((uint64_t)argv[i], &str);
+int exec(char *path, char **argv) {
+  // your code here
+  struct vspace vs, *nvs = &vs; // new vspace
+  struct trap_frame tf = *myproc()->tf; // new trap frame
+  // threads go on in the old vspace, so the process needs a new one
+  int shared = myproc()->vspace->ref > 1;
 
-    // allocate space for the string
-    tf.rsp -= len + 1;
+  // Initialize new vspace
+  if (shared)
+    nvs = vspacealloc();
+  else if (vspaceinit(&vs) == -1)
+    nvs = 0;
+  if (nvs == 0)
+    return -1;
+  nvs->memlimit = myproc()->vspace->memlimit;
 
-    // copy the string over on new stack
-    if (vspacewritetova(&vs, tf.rsp, str, len + 1) == -1)
-      return -1;
+  if (execload(nvs, path, argv, &tf) == -1) {
+    if (shared)
+      vspaceput(nvs);
+    else
+      vspacefree(&vs);
+    return -1;
+  }
 
-    // copy the pointer to string to the new argv array
-    if (vspacewritetova(&vs, (uint64_t)(argv_new + i), (char*)&tf.rsp, sizeof(tf.rsp)) == -1)
-      return -1;
+  if (shared) {
+    vspaceinstallkern();
+    vspaceput(myproc()->vspace);
+    myproc()->vspace = nvs;
+    myproc()->thread = 0;
+  } else {
+    // free old vspace, writing its shared file mappings back first. It
+    // is freed in place, since its pages' reverse maps name it there.
+    vspacesync(myproc()->vspace);
+    vspaceinstallkern();
+    vspacefree(myproc()->vspace);
+    // the new space becomes the current process's as it is, so that its
+    // pages stay writable rather than going copy-on-write
+    vspacemove(myproc()->vspace, &vs);
   }
-  tf.rsp -= 8; // leave room for return address
-  
-  // clear olg page table map
-  if (vspaceinit(&myproc()->vspace) == -1)
-    return -1;
-  // copy the new space to current process
-  if (vspacecopy_cow(&myproc()->vspace, &vs) == -1)
-    return -1;
+  myproc()->ioring = 0;
 
   vspaceinstall(myproc());
 
-  // free old vspace
-  vspacefree(&vs_old);
-  vspacefree(&vs);
-
   // set trap frame and return
-  tf.rax = 0;
   *myproc()->tf = tf;
 
   return 0;
@@ -8,6 +8,7 @@
 #include <fs.h>
 #include <param.h>
 #include <sleeplock.h>
+#include <slab.h>
 #include <spinlock.h>
 #include <proc.h>
 #include "../inc/file.h"
@@ -19,6 +20,138 @@ struct devsw devsw[NDEV];
 
 struct file_info files_global[NFILE];
 
+// The entries of files_global not in use, linked through next.
+static struct {
+  struct spinlock lock;
+  struct file_info *free;
+} ftable;
+
+#define PIPESIZE (NPIPEPAGES * PGSIZE) // bytes of pipe buffer
+
+static struct slabcache pipecache; // struct pipes
+
+static void pipector(void *p) {
+  initlock(&((struct pipe *)p)->lock, "pipe spinlock");
+}
+
+void fileinit(void) {
+  int i;
+
+  initlock(&ftable.lock, "ftable");
+  for (i = NFILE - 1; i >= 0; i--) {
+    initsleeplock(&files_global[i].lock, "file sleeplock");
+    files_global[i].next = ftable.free;
+    ftable.free = &files_global[i];
+  }
+}
+
+// Take an entry off the free list, or return 0 if the table is full.
+static struct file_info *filealloc(void) {
+  struct file_info *fp;
+
+  acquire(&ftable.lock);
+  if ((fp = ftable.free) != 0)
+    ftable.free = fp->next;
+  release(&ftable.lock);
+  return fp;
+}
+
+// Put an entry no descriptor refers to back on the free list.
+static void filefree(struct file_info *fp) {
+  fp->ip = NULL;
+  fp->pp = NULL;
+  acquire(&ftable.lock);
+  fp->next = ftable.free;
+  ftable.free = fp;
+  release(&ftable.lock);
+}
+
+// Install fp at the lowest free file descriptor of p.
+// Returns the descriptor, or -1 if p has NOFILE open.
+int fdalloc(struct proc *p, struct file_info *fp) {
+  int w, fd;
+
+  for (w = 0; w < FDWORDS; w++) {
+    if (~p->fdused[w] == 0)
+      continue;
+    fd = w * 64 + __builtin_ctzll(~p->fdused[w]);
+    if (fd >= NOFILE)
+      break;
+    fdinstall(p, fd, fp);
+    return fd;
+  }
+  return -1;
+}
+
+// Install fp at file descriptor fd of p, which is free.
+void fdinstall(struct proc *p, int fd, struct file_info *fp) {
+  p->files[fd] = fp;
+  p->fdused[fd / 64] |= 1ULL << (fd % 64);
+}
+
+// Clear file descriptor fd of p, returning the file it held.
+struct file_info *fdremove(struct proc *p, int fd) {
+  struct file_info *fp = p->files[fd];
+
+  p->files[fd] = NULL;
+  p->fdused[fd / 64] &= ~(1ULL << (fd % 64));
+  return fp;
+}
+
+// The lowest file descriptor of p in use at or above fd, or NOFILE.
+int fdnext(struct proc *p, int fd) {
+  int w = fd / 64;
+  uint64_t m;
+
+  if (fd >= NOFILE)
+    return NOFILE;
+  m = p->fdused[w] & (~0ULL << (fd % 64));
+  while (m == 0) {
+    if (++w == FDWORDS)
+      return NOFILE;
+    m = p->fdused[w];
+  }
+  return w * 64 + __builtin_ctzll(m);
+}
+
+void pipeinit(void) {
+  slabcreate(&pipecache, "pipe", sizeof(struct pipe), pipector);
+}
+
+// Free the pages of pipe's buffer, and pipe.
+static void pipefree(struct pipe *pipe) {
+  int i;
+
+  for (i = 0; i < NPIPEPAGES; i++)
+    if (pipe->pages[i])
+      kfree(pipe->pages[i]);
+  slabfree(pipe);
+}
+
+// Allocate an empty pipe, open at both ends, or return 0.
+struct pipe *pipealloc(void) {
+  struct pipe *pipe;
+  int i;
+
+  if ((pipe = slaballoc(&pipecache)) == 0)
+    return 0;
+  for (i = 0; i < NPIPEPAGES; i++)
+    pipe->pages[i] = 0;
+  for (i = 0; i < NPIPEPAGES; i++) {
+    if ((pipe->pages[i] = kalloc()) == 0) {
+      pipefree(pipe);
+      return 0;
+    }
+  }
+  pipe->head = 0;
+  pipe->tail = 0;
+  pipe->nreadwait = 0;
+  pipe->nwritewait = 0;
+  pipe->hasopenread = true;
+  pipe->hasopenwrite = true;
+  return pipe;
+}
+
 /*
  * Updates the reference count for the file represented by fp.
  */
@@ -72,9 +205,94 @@ int fileread(struct file_info* fp, char* buf, int n) {
   return bytes;
 }
 
+/*
+ * Read up to n bytes at offset off of the file represented by fp into buf,
+ * and return the number of bytes read. The file's own offset is neither
+ * used nor changed, so its lock is not taken.
+ */
+int filepread(struct file_info* fp, char* buf, int n, uint off) {
+  if (fp->is_pipe) {
+    return -1;
+  }
+  return concurrent_readi(fp->ip, buf, off, n);
+}
+
+/*
+ * Write n bytes of content from buf at offset off of the file represented
+ * by fp, and return the number of bytes written. The file's own offset is
+ * neither used nor changed.
+ */
+int filepwrite(struct file_info* fp, char* buf, int n, uint off) {
+  if (fp->is_pipe) {
+    return -1;
+  }
+  return concurrent_writei(fp->ip, buf, off, n);
+}
+
+/*
+ * Move up to n bytes from the file represented by in to the one represented
+ * by out, through a kernel page, and return the number of bytes moved, or
+ * -1 if none could be. Stops early at the end of in, or if out takes less
+ * than it is given.
+ */
+int filesplice(struct file_info* in, struct file_info* out, int n) {
+  char *page;
+  int moved = 0, want, r = 0, w;
+
+  if ((page = kalloc()) == 0) {
+    return -1;
+  }
+
+  while (moved < n) {
+    want = min(n - moved, PGSIZE);
+    if ((r = fileread(in, page, want)) <= 0) {
+      break;
+    }
+    if ((w = filewrite(out, page, r)) > 0) {
+      moved += w;
+    }
+    if (w != r) {
+      r = -1;
+      break;
+    }
+    // a short read is all there is for now, as from a pipe or the console
+    if (r < want) {
+      break;
+    }
+  }
+  kfree(page);
+
+  // report an error only if nothing was moved
+  if (r < 0 && moved == 0) {
+    return -1;
+  }
+  return moved;
+}
+
+/*
+ * Read as many whole directory entries as fit in n bytes from the directory
+ * represented by fp into buf, and return the number of bytes read.
+ */
+int filegetdents(struct file_info* fp, char* buf, int n) {
+  int bytes;
+
+  if (fp->is_pipe) {
+    return -1;
+  }
+
+  vspaceprefault((uint64_t)buf, n);
+  acquiresleep(&(fp->lock));
+  locki(fp->ip);
+  bytes = readdirents(fp->ip, buf, &fp->offset, n);
+  unlocki(fp->ip);
+  releasesleep(&(fp->lock));
+
+  return bytes;
+}
+
 /**
- * Find and open spot in the global file table and allocates a new file_info
- * struct to store in that spot. Return the newly allocated file_info struct.
+ * Take a free entry off the global file table's free list and open path in
+ * it. Return the entry, or NULL.
  */
 struct file_info* fileopen(char* path, int mode) {
 	struct inode *ip = namei(path);
@@ -88,27 +306,19 @@ struct file_info* fileopen(char* path, int mode) {
   if (mode >= O_CREATE)
     mode -= O_CREATE;
 
-  // Finds an open entry in the global open file table
-  for (int i = 0; i < NFILE; i++) {
-    if (files_global[i].ip == NULL && files_global[i].pp == NULL) {
-      // allocates a new file_info struct
-      struct file_info finfo;
-      initsleeplock(&(finfo.lock), "open sleeplock");
-      acquiresleep(&(finfo.lock));
-
-      finfo.ip = ip;
-      finfo.ref = 1;
-      finfo.offset = 0;
-      finfo.perm = mode;
-      finfo.is_pipe = false;
-      finfo.pp = NULL;
-
-      files_global[i] = finfo;
-      releasesleep(&(files_global[i].lock));
-      return files_global + i;
-    }
+  struct file_info *fp = filealloc();
+  if (fp == NULL) {
+    irelease(ip);
+    return NULL;
   }
-  return NULL;
+  // no one else can see the entry until it is returned
+  fp->ip = ip;
+  fp->ref = 1;
+  fp->offset = 0;
+  fp->perm = mode;
+  fp->is_pipe = false;
+  fp->pp = NULL;
+  return fp;
 }
 
 /**
@@ -123,9 +333,11 @@ void fileclose(struct file_info* fp) {
       pipeclose(fp);
     } else {
       irelease(fp->ip);
-      fp->ip = NULL;
       fp->offset = 0;
     }
+    releasesleep(&(fp->lock));
+    filefree(fp);
+    return;
   }
   releasesleep(&(fp->lock));
 }
@@ -148,55 +360,53 @@ void filestat(struct file_info* fp, struct stat *sp) {
  */
 int pipeopen(struct pipe* pipe, int mode) {
   int fd;
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (myproc()->files[fd] == NULL) {
-      break;
-    }
+  struct file_info *fp = filealloc();
+  if (fp == NULL) {
+    return -1;
   }
 
-  if (fd == NOFILE) {
+  fp->pp = pipe;
+  fp->is_pipe = true;
+  fp->ref = 1;
+  fp->offset = 0;
+  fp->perm = mode;
+  fp->ip = NULL;
+
+  if ((fd = fdalloc(myproc(), fp)) < 0) {
+    filefree(fp);
     return -1;
   }
+  return fd;
+}
 
-  // Finds an open entry in the global open file table
-  struct file_info finfo;
-  for (int i = 0; i < NFILE; i++) {
-    if (files_global[i].ip == NULL && files_global[i].pp == NULL) {
-      // allocates a new file_info struct
-      initsleeplock(&(finfo.lock), "pipeopen sleeplock");
-      acquiresleep(&(finfo.lock));
-
-      finfo.pp = pipe;
-      finfo.is_pipe = true;
-      finfo.ref = 1;
-      finfo.offset = 0;
-      finfo.perm = mode;
-      finfo.ip = NULL;
-
-      files_global[i] = finfo;
-      myproc()->files[fd] = files_global + i;
-      releasesleep(&(files_global[i].lock));
-
-      return fd;
-    }
-  }
-  return -1;
+// The slot in pipe's ring of the page holding byte off.
+static char **pipeslot(struct pipe *pipe, uint off) {
+  return &pipe->pages[(off / PGSIZE) % NPIPEPAGES];
 }
 
 /*
  * Read up to n bytes of data from the pipe and store them in buf.
+ *
+ * A whole page of the ring, read into a page-aligned page of buf, is not
+ * copied: the reader's page and the pipe's trade places.
+ *
+ * Waiting writers are woken only once the pipe is half empty, so that
+ * a streaming writer wakes to fill half the ring rather than a few bytes.
  */
 int piperead(struct file_info* fp, char* buf, int n) {
-  int buf_size = PGSIZE - sizeof(struct pipe);
-  int num_read;
-
   struct pipe* pipe = fp->pp;
+  char **slot, *page;
+  uint off;
+  int num_read = 0, m, flipped = 0, wake;
+
   acquire(&(pipe->lock));
 
   while (pipe->head == pipe->tail) {
     if (pipe->hasopenwrite) {
       // Sleep until data is available to read
+      pipe->nreadwait++;
       sleep((void*)&pipe->hasopenwrite, &(pipe->lock));
+      pipe->nreadwait--;
     } else {
       // EOF
       release(&(pipe->lock));
@@ -204,93 +414,96 @@ int piperead(struct file_info* fp, char* buf, int n) {
     }
   }
 
-  // Read the buffered data
-  if ((pipe->tail - pipe->head) < n) {
-    // Read tail minus head bytes from pipe and copy into buf
-    memmove((void *) buf, (void *) pipe->buf + (pipe->head % buf_size),
-        pipe->tail - pipe->head);
-
-    num_read = pipe->tail - pipe->head;   // Record num bytes read
-    pipe->head += num_read;              // Update head of buffer
-  } else {
-    // Read n bytes from pipe and copy into buf
-    memmove((void *) buf, (void *) pipe->buf + (pipe->head % buf_size), n);
-
-    num_read = n;     // Record num bytes read
-    pipe->head += n;  // Update head of buffer
+  // what is there is measured afresh each time round: a flip drops the
+  // lock, and another reader may take the rest meanwhile
+  while (num_read < n && pipe->head != pipe->tail) {
+    off = pipe->head % PGSIZE;
+    slot = pipeslot(pipe, pipe->head);
+    m = min(n - num_read, (int)(PGSIZE - off));
+    m = min((uint)m, pipe->tail - pipe->head);
+
+    if (m == PGSIZE && (uint64_t)(buf + num_read) % PGSIZE == 0) {
+      // take the page out of the ring, so that the flip, which may
+      // sleep, need not hold the lock; writers wait for it to come back
+      page = *slot;
+      *slot = 0;
+      pipe->head += PGSIZE;
+      release(&(pipe->lock));
+      if (vspaceflippage(myproc()->vspace, (uint64_t)(buf + num_read),
+                         &page) < 0)
+        memmove(buf + num_read, page, PGSIZE);
+      acquire(&(pipe->lock));
+      *slot = page;
+      flipped = 1;
+    } else {
+      memmove(buf + num_read, *slot + off, m);
+      pipe->head += m;
+    }
+    num_read += m;
   }
+  // a writer may wait for a page taken out, however full the ring
+  wake = pipe->nwritewait > 0 &&
+         (flipped || pipe->tail - pipe->head <= PIPESIZE / 2);
   release(&(pipe->lock));
 
   // Call wakeup to signal buffer is no longer full
-  wakeup((void*)&pipe->hasopenread);
+  if (wake)
+    wakeup((void*)&pipe->hasopenread);
 
   return num_read;
 }
 
 /*
- * Write up to n bytes of data from buf and store them in the pipe.
+ * Write the n bytes of data from buf into the pipe, waiting for room
+ * as need be. Returns n, or, if the read side closes first, the bytes
+ * written before then, or -1 if none were.
+ *
+ * Waiting readers are woken once the write is done, or, during a long
+ * one, once the pipe is half full.
  */
 int pipewrite(struct file_info* fp, char* buf, int n) {
-  int buf_size = PGSIZE - sizeof(struct pipe);
-  int num_written;
-
   struct pipe* pipe = fp->pp;
-  acquire(&(pipe->lock));
+  char *page;
+  uint off;
+  int num_written = 0, m, wake;
 
-  // Return error if trying to write with no read fd open
-  if (!pipe->hasopenread) {
-    release(&(pipe->lock));
-    return -1;
-  }
-
-  // Sleep until there is room to write data
-  while (pipe->tail - pipe->head == buf_size) {
-    sleep((void*)&pipe->hasopenread, &(pipe->lock));
-  }
-
-  // Write the buffered data
-  if (buf_size - (pipe->tail % buf_size) < n) {
-    // Case 1: Not enough room at end of buffer, need to circle back around
-
-    // Number of byes from start of buffer to the current head
-    int start_to_head = pipe->head % buf_size;
-    // Number of bytes from the current tail to the end of the buffer
-    int tail_to_end = buf_size - (pipe->tail % buf_size);
-
-    // Fill the end of the buffer
-    memmove((void *) pipe->buf + (pipe->tail % buf_size), (void *) buf,
-        tail_to_end);
-
-    num_written = tail_to_end;
-    pipe->tail += num_written;
-    int remaining = n - tail_to_end;
-
-    // Circle back to the front of the buffer and write as much as possible
-    if (remaining < start_to_head) {
-      // Write all the remaining bytes
-      memmove((void *) pipe->buf, (void *) buf, remaining);
+  acquire(&(pipe->lock));
 
-      num_written += remaining;
-      pipe->tail += remaining;
-    } else {
-      // Write as much as possible up to the head
-      memmove((void *) pipe->buf, (void *) buf, start_to_head);
+  while (num_written < n) {
+    // Return error if trying to write with no read fd open
+    if (!pipe->hasopenread) {
+      release(&(pipe->lock));
+      return num_written > 0 ? num_written : -1;
+    }
 
-      num_written += start_to_head;
-      pipe->tail += start_to_head;
+    // Sleep until there is room to write data, in a page that is there
+    page = *pipeslot(pipe, pipe->tail);
+    if (pipe->tail - pipe->head == PIPESIZE || page == 0) {
+      if (pipe->nreadwait > 0)
+        wakeup((void*)&pipe->hasopenwrite);
+      pipe->nwritewait++;
+      sleep((void*)&pipe->hasopenread, &(pipe->lock));
+      pipe->nwritewait--;
+      continue;
     }
 
-  } else {
-    // Case 2: There is enough room at the end of the buffer, rite n bytes
-    memmove((void *) pipe->buf + (pipe->tail % buf_size), (void *) buf, n);
+    off = pipe->tail % PGSIZE;
+    m = min(n - num_written, (int)(PGSIZE - off));
+    m = min(m, (int)(PIPESIZE - (pipe->tail - pipe->head)));
+    memmove(page + off, buf + num_written, m);
+    pipe->tail += m;
+    num_written += m;
 
-    num_written = n;
-    pipe->tail += n;
+    if (pipe->nreadwait > 0 && num_written < n &&
+        pipe->tail - pipe->head >= PIPESIZE / 2)
+      wakeup((void*)&pipe->hasopenwrite);
   }
+  wake = pipe->nreadwait > 0;
   release(&(pipe->lock));
 
   // Call wakeup to signal data can be read
-  wakeup((void*)&pipe->hasopenwrite);
+  if (wake)
+    wakeup((void*)&pipe->hasopenwrite);
 
   return num_written;
 }
@@ -305,18 +518,17 @@ void pipeclose(struct file_info* fp) {
 
   if (fp->perm == O_RDONLY) {
     pipe->hasopenread = false;
-    wakeup((void*)pipe->hasopenread);
+    wakeup((void*)&pipe->hasopenread);
   } else if (fp->perm == O_WRONLY) {
     pipe->hasopenwrite = false;
-    wakeup((void*)pipe->hasopenwrite);
+    wakeup((void*)&pipe->hasopenwrite);
   } else {
     panic("permission is neither read or write only");
   }
   release(&(pipe->lock));
 
-  if (!pipe->hasopenread && !pipe->hasopenwrite) {
-    kfree(pipe->buf);
-  }
+  if (!pipe->hasopenread && !pipe->hasopenwrite)
+    pipefree(pipe);
 }
 
 
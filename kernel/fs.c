@@ -14,10 +14,12 @@
 #include <fs.h>
 #include <mmu.h>
 #include <param.h>
+#include <pcache.h>
 #include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
 #include <stat.h>
+#include <trace.h>
 
 #include <buf.h>
 #include "../inc/buf.h"
@@ -26,7 +28,76 @@
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
-struct sleeplock loglock;
+
+// Logging.
+//
+// A transaction groups the block writes of one or more file system
+// operations so that they reach the disk atomically. log_write only
+// records the block number in the in-memory log header and pins the
+// cached buffer (B_DIRTY); nothing is written until commit.
+//
+// Several operations can be open at once: begin_tx reserves room for
+// MAXOPBLOCKS blocks in the transaction and waits only if the log
+// could not hold them or a commit is in progress. The last operation
+// to finish commits everything written by the group.
+//
+// Commit writes every logged block to the log region as one batch,
+// then the header with commited set (the commit point), and returns.
+// The checkpoint kernel thread then writes the blocks to their home
+// locations and clears the header, while new operations run. Only
+// the next commit has to wait for the checkpoint, because it reuses
+// the log region.
+//
+// With WRITEBACK, the last operation out leaves the transaction open
+// unless the log is close to full, so later operations join it and a
+// block written again and again is logged once. The flusher kernel
+// thread commits a transaction once it is FLUSHTICKS old, and fsync
+// commits it at once; until then the writes are only in the cache.
+// The order on disk stays log blocks, commit record, home blocks.
+//
+// begin_tx/commit_tx pairs nest within a process; only the outermost
+// pair opens and closes an operation.
+
+struct {
+  struct spinlock lock;
+  int outstanding;        // operations open in the transaction
+  int committing;         // in commit(), please wait
+  int syncwant;           // logsync waits for the open transaction to commit
+  uint gen;               // transactions committed, for logsync to wait on
+  uint opened;            // ticks when the open transaction logged a block
+  int size;               // data blocks the on-disk log can hold
+  struct log_meta header; // blocks written by the open transaction
+
+  // Buffers held by commit(); only one commit runs at a time.
+  struct buf *logbufs[LOGMAXBLOCKS];
+
+  // Committed transaction still to be installed by the checkpointer,
+  // and the private buffers it writes the home blocks with.
+  int ckpt_pending;
+  struct log_meta ckpt;
+  struct buf *ckbufs[LOGMAXBLOCKS];
+
+  // Extents freed by the open transaction, and by the one being
+  // checkpointed, which balloc may not hand out yet (see bfree).
+  int nfree;
+  struct extent frees[LOGMAXBLOCKS];
+  int nckfree;
+  struct extent ckfrees[LOGMAXBLOCKS];
+} log;
+
+// Most extents one operation frees: a piece of a file's last extent
+// and the extent tree nodes it leaves empty.
+#define MAXOPFREES (XMAXDEPTH + 1)
+
+int log_commits = 0; // transactions committed
+int log_blocks = 0;  // blocks written by them
+
+static void initlog(void);
+static void fminit(void);
+static void dcacheinit(void);
+static void ifree(struct inode *);
+static void ireclaim(uint);
+static uint swapsetup(int);
 
 // Read the super block.
 void readsb(int dev, struct superblock *sb) {
@@ -65,15 +136,86 @@ void readsb(int dev, struct superblock *sb) {
 // to and inode. irelease() will decrement the in memory reference count
 // and will free the inode if there are no more references to it,
 // freeing up space in the cache for the inode to be used again.
+//
+// Cached inodes are found through a hash table on (dev, inum). An
+// inode whose last reference is dropped stays valid on an LRU list,
+// so opening it again needs no disk read; iget recycles the least
+// recently used one, and adds a page of inodes when all are in use.
+//
+// An inode's lock is held by one process to change the inode, or
+// shared by readers (lockishared), so that many processes can read or
+// exec the same file at once. The inode file is shared to read and
+// write dinodes, each of which lies in one block: the block's buffer
+// lock keeps updates to the same block apart, while those to other
+// blocks go on in parallel. Only growing the inode file holds it.
 
-
+int icache_hits = 0;
+int icache_misses = 0;
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  int ninode;
+  struct inode *hash[NIBUCKET];
+  struct inode lru; // lru.next is most recently used
   struct inode inodefile;
+  uint freeinum; // no dinode slot below this is free
 } icache;
 
+static struct inode **ihash(uint dev, uint inum) {
+  return &icache.hash[(dev * 31 + inum) % NIBUCKET];
+}
+
+static void iunlink(struct inode *ip) {
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// Put ip at the MRU end of the LRU list.
+static void ilinkhead(struct inode *ip) {
+  ip->next = icache.lru.next;
+  ip->prev = &icache.lru;
+  icache.lru.next->prev = ip;
+  icache.lru.next = ip;
+}
+
+// Return the cached inode for (dev, inum) with a new reference,
+// or 0 if it is not cached. Caller must hold icache.lock.
+static struct inode *icached(uint dev, uint inum) {
+  struct inode *ip;
+
+  for (ip = *ihash(dev, inum); ip != 0; ip = ip->hnext) {
+    if (ip->dev == dev && ip->inum == inum) {
+      if (ip->ref++ == 0)
+        iunlink(ip);
+      icache_hits++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Carve a page into free inodes.
+// Returns -1 if there is no memory.
+static int igrow(void) {
+  struct inode *ip;
+  char *page;
+  int i;
+
+  if ((page = kalloc()) == 0)
+    return -1;
+  memset(page, 0, PGSIZE);
+
+  acquire(&icache.lock);
+  for (i = 0; i < PGSIZE / sizeof(struct inode); i++) {
+    ip = (struct inode *)page + i;
+    initsleeplock(&ip->lock, "inode");
+    ilinkhead(ip);
+    icache.ninode++;
+  }
+  release(&icache.lock);
+  return 0;
+}
+
 // Find the inode file on the disk and load it into memory
 // should only be called once, but is idempotent.
 static void init_inodefile(int dev) {
@@ -93,72 +235,50 @@ static void init_inodefile(int dev) {
   icache.inodefile.size = di.size;
   // icache.inodefile.data = di.data;
 
-  for (int i = 0; i < 6; i++) {
+  for (int i = 0; i < NEXTENT; i++) {
     icache.inodefile.data[i] = di.data[i];
   }
+  icache.inodefile.indirect = di.indirect;
 
   brelse(b);
 }
 
 void iinit(int dev) {
-  int i, j;
-  struct log_meta log;
-  struct buf *buf, *log_buf;
-  uint block_no;
-
   initlock(&icache.lock, "icache");
-  for (i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  lockstat(&icache.lock);
+  icache.lru.prev = &icache.lru;
+  icache.lru.next = &icache.lru;
+  while (icache.ninode < NINODE)
+    if (igrow() < 0)
+      panic("iinit: no memory for inodes");
   initsleeplock(&icache.inodefile.lock, "inodefile");
+  icache.freeinum = ROOTINO + 1;
+  dcacheinit();
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d bmap start %d inodestart %d\n", sb.size,
           sb.nblocks, sb.bmapstart, sb.inodestart);
 
-  init_inodefile(dev);
-
-  initsleeplock(&loglock, "loglock");
+  initlog();
+  swapinit(swapsetup(dev));
 
-  // Read log_meta in
-  buf = bread(ROOTDEV, sb.logstart);
-  memmove(&log, buf->data, sizeof(struct log_meta));
-  brelse(buf);
-
-  if (log.commited == 1) {
-    // Write log blocks to their corresponding place on disk
-    for (j = 0; j < log.nchanges; j++) {
-      block_no = log.blocknos[j];
-      buf = bread(ROOTDEV, block_no);
-
-      log_buf = bread(ROOTDEV, sb.logstart + 1 + j);
-
-      memmove(buf->data, log_buf->data, BSIZE);
-      bwrite(buf);
-      brelse(buf);
-    }
-
-    // Set log to uncommitted and nchanges = 0, then write to disk
-    memset(&log, 0, sizeof(struct log_meta));
-    buf = bread(ROOTDEV, sb.logstart);
-    memmove(buf->data, &log, BSIZE);
-    bwrite(buf);
-    brelse(buf);
-  }
+  init_inodefile(dev);
+  fminit();
+  ireclaim(dev);
 }
 
 
 // Reads the dinode with the passed inum from the inode file.
-// Threadsafe, will acquire sleeplock on inodefile inode if not held.
+// Threadsafe, will share the inodefile inode's lock if not held.
 static void read_dinode(uint inum, struct dinode *dip) {
   int holding_inodefile_lock = holdingsleep(&icache.inodefile.lock);
   if (!holding_inodefile_lock)
-    locki(&icache.inodefile);
+    lockishared(&icache.inodefile);
 
   readi(&icache.inodefile, (char *)dip, INODEOFF(inum), sizeof(*dip));
 
   if (!holding_inodefile_lock)
-    unlocki(&icache.inodefile);
+    unlockishared(&icache.inodefile);
 
 }
 
@@ -166,37 +286,71 @@ static void read_dinode(uint inum, struct dinode *dip) {
 // and return the in-memory copy. Does not read
 // the inode from from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
+  if ((ip = icached(dev, inum)) != 0) {
+    release(&icache.lock);
+    return ip;
+  }
+
+  // Recycle the least recently used unreferenced inode.
+  while ((ip = icache.lru.prev) == &icache.lru) {
+    release(&icache.lock);
+    if (igrow() < 0)
+      panic("iget: no inodes");
+    acquire(&icache.lock);
+    // someone else may have cached it meanwhile
+    if ((ip = icached(dev, inum)) != 0) {
       release(&icache.lock);
       return ip;
     }
-    if (empty == 0 && ip->ref == 0) // Remember empty slot.
-      empty = ip;
+  }
+  iunlink(ip);
+  // inodes that were never used have dev 0 and are not hashed
+  if (ip->dev != 0) {
+    for (pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
   }
 
-  // Recycle an inode cache entry.
-  if (empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  icache_misses++;
   ip->ref = 1;
   ip->valid = 0;
+  ip->unlinked = 0;
   ip->dev = dev;
   ip->inum = inum;
+  pp = ihash(dev, inum);
+  ip->hnext = *pp;
+  *pp = ip;
 
   release(&icache.lock);
 
   return ip;
 }
 
+// Free the files that were unlinked while open when the system went
+// down, whose dinodes are still marked orphan. locki reads the mark in
+// with the rest, and the last irelease frees them as usual.
+static void ireclaim(uint dev) {
+  struct dinode di;
+  struct inode *ip;
+  uint inum;
+
+  for (inum = ROOTINO + 1;
+       INODEOFF(inum) + sizeof(di) <= icache.inodefile.size; inum++) {
+    read_dinode(inum, &di);
+    if (di.type == 0 || !di.orphan)
+      continue;
+    ip = iget(dev, inum);
+    locki(ip);
+    unlocki(ip);
+    irelease(ip);
+  }
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
@@ -208,13 +362,18 @@ struct inode *idup(struct inode *ip) {
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
-// be recycled.
+// be recycled. The file goes too if its name has been unlinked.
 void irelease(struct inode *ip) {
   acquire(&icache.lock);
-  // inode has no other references release
-  if (ip->ref == 1)
-    ip->type = 0;
-  ip->ref--;
+  if (ip->ref == 1 && ip->unlinked) {
+    // no one else can find it now, so nobody else is in its way
+    release(&icache.lock);
+    ifree(ip);
+    acquire(&icache.lock);
+  }
+  // inode has no other references: keep it cached, but recyclable
+  if (--ip->ref == 0 && ip != &icache.inodefile)
+    ilinkhead(ip);
   release(&icache.lock);
 }
 
@@ -230,20 +389,20 @@ void locki(struct inode *ip) {
 
   if (ip->valid == 0) {
 
-    if (ip != &icache.inodefile)
-      locki(&icache.inodefile);
     read_dinode(ip->inum, &dip);
-    if (ip != &icache.inodefile)
-      unlocki(&icache.inodefile);
 
     ip->type = dip.type;
     ip->devid = dip.devid;
 
     ip->size = dip.size;
     // ip->data = dip.data;
-    for (int i = 0; i < 6; i++) {
+    for (int i = 0; i < NEXTENT; i++) {
       ip->data[i] = dip.data[i];
     }
+    ip->indirect = dip.indirect;
+    acquire(&icache.lock);
+    ip->unlinked = dip.orphan;
+    release(&icache.lock);
 
     ip->valid = 1;
 
@@ -260,17 +419,47 @@ void unlocki(struct inode *ip) {
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared, to read it. Filling it in from disk
+// changes it, so the first locker holds it for that.
+void lockishared(struct inode *ip) {
+  if(ip == 0 || ip->ref < 1)
+    panic("lockishared");
+
+  for (;;) {
+    acquiresleepshared(&ip->lock);
+    if (ip->valid)
+      return;
+    releasesleepshared(&ip->lock);
+    locki(ip);
+    unlocki(ip);
+  }
+}
+
+void unlockishared(struct inode *ip) {
+  if(ip == 0 || ip->lock.readers < 1 || ip->ref < 1)
+    panic("unlockishared");
+
+  releasesleepshared(&ip->lock);
+}
+
+// Does the caller hold ip->lock, either way? Readers are not told
+// apart, so any sharing counts.
+static int holdingi(struct inode *ip) {
+  return holdingsleep(&ip->lock) || ip->lock.readers > 0;
+}
+
 // threadsafe stati.
 void concurrent_stati(struct inode *ip, struct stat *st) {
-  locki(ip);
+  vspaceprefault((uint64_t)st, sizeof(*st));
+  lockishared(ip);
   stati(ip, st);
-  unlocki(ip);
+  unlockishared(ip);
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, or share it.
 void stati(struct inode *ip, struct stat *st) {
-  if (!holdingsleep(&ip->lock))
+  if (!holdingi(ip))
     panic("not holding lock");
 
   st->dev = ip->dev;
@@ -283,18 +472,530 @@ void stati(struct inode *ip, struct stat *st) {
 int concurrent_readi(struct inode *ip, char *dst, uint off, uint n) {
   int retval;
 
-  locki(ip);
+  // a fault on dst must not need ip's lock
+  vspaceprefault((uint64_t)dst, n);
+  lockishared(ip);
   retval = readi(ip, dst, off, n);
-  unlocki(ip);
+  unlockishared(ip);
 
   return retval;
 }
 
+// Blocks.
+//
+// The free bitmap is kept in memory, in whole pages, from iinit on.
+// Allocation is next-fit: the search for free blocks starts where
+// the previous allocation ended. Bitmap changes are made both in
+// memory and in the cached bitmap blocks, which are logged, so the
+// caller must be inside a transaction. Freed blocks rejoin the free
+// runs around them in the bitmap, so they merge with their
+// neighbours without any bookkeeping.
+
+static struct {
+  struct spinlock lock;
+  uint cursor; // next-fit: block after the last allocation
+  uchar **page; // a page of pointers to the pages of the bitmap
+} freemap;
+
+// Byte of the in-memory bitmap that holds the bit for block b.
+static uchar *fmbyte(uint b) {
+  uint off = b / 8;
+  return freemap.page[off / PGSIZE] + off % PGSIZE;
+}
+
+static int fmisset(uint b) {
+  return *fmbyte(b) & (1 << (b % 8));
+}
+
+static void fmset(uint start, uint n) {
+  uint b;
+
+  for (b = start; b < start + n; b++)
+    *fmbyte(b) |= 1 << (b % 8);
+}
+
+static void fmclear(uint start, uint n) {
+  uint b;
+
+  for (b = start; b < start + n; b++)
+    *fmbyte(b) &= ~(1 << (b % 8));
+}
+
+// Read the on-disk bitmap into memory.
+static void fminit(void) {
+  struct buf *bufs[NIOBATCH];
+  uint nbmap, i, j, n;
+  char *page;
+
+  initlock(&freemap.lock, "freemap");
+  nbmap = sb.size / BPB + 1;
+  if (nbmap * BSIZE > BMAPPAGES * PGSIZE)
+    panic("fminit: bitmap too big");
+  if ((freemap.page = (uchar **)kalloc()) == 0)
+    panic("fminit: no memory");
+
+  for (i = 0; i < (nbmap * BSIZE + PGSIZE - 1) / PGSIZE; i++) {
+    if ((page = kalloc()) == 0)
+      panic("fminit: no memory");
+    memset(page, 0, PGSIZE);
+    freemap.page[i] = (uchar *)page;
+  }
+
+  for (i = 0; i < nbmap; i += n) {
+    n = min(nbmap - i, (uint)NIOBATCH);
+    breadn(ROOTDEV, sb.bmapstart + i, bufs, n);
+    for (j = 0; j < n; j++) {
+      memmove(fmbyte((i + j) * BPB), bufs[j]->data, BSIZE);
+      brelse(bufs[j]);
+    }
+  }
+  freemap.cursor = sb.inodestart;
+}
+
+// Set the bits of blocks [start, start+n) in the on-disk bitmap, or
+// clear them if set is 0.
+static void fmlog(uint start, uint n, int set) {
+  struct buf *buf;
+  uint b, end;
+
+  for (b = start; b < start + n; b = end) {
+    end = min(start + n, (b / BPB + 1) * BPB);
+    buf = bread(ROOTDEV, BBLOCK(b, sb));
+    for (; b < end; b++) {
+      if (set)
+        buf->data[(b % BPB) / 8] |= 1 << (b % 8);
+      else
+        buf->data[(b % BPB) / 8] &= ~(1 << (b % 8));
+    }
+    log_write(buf);
+    brelse(buf);
+  }
+}
+
+// Allocate up to want free blocks starting exactly at start, so that
+// an extent ending at start can grow in place.
+// Returns the number of blocks allocated, possibly 0.
+static uint bextend(uint start, uint want) {
+  uint n;
+
+  acquire(&freemap.lock);
+  for (n = 0; n < want && start + n < sb.size && !fmisset(start + n); n++)
+    ;
+  fmset(start, n);
+  release(&freemap.lock);
+
+  if (n > 0)
+    fmlog(start, n, 1);
+  return n;
+}
+
+// Allocate a run of up to want contiguous free blocks.
+// Returns the first block and sets *got to the length of the run.
+static uint balloc(uint want, uint *got) {
+  uint b, n, scanned, first;
+
+  first = sb.inodestart;
+  acquire(&freemap.lock);
+  b = freemap.cursor;
+  for (scanned = 0; scanned < sb.size - first; scanned++, b++) {
+    if (b >= sb.size)
+      b = first;
+    // skip over fully allocated bytes
+    if (b % 8 == 0 && *fmbyte(b) == 0xff && scanned + 8 <= sb.size - first) {
+      scanned += 7;
+      b += 7;
+      continue;
+    }
+    if (!fmisset(b))
+      break;
+  }
+  if (scanned >= sb.size - first)
+    panic("No more free space in extent region");
+
+  for (n = 1; n < want && b + n < sb.size && !fmisset(b + n); n++)
+    ;
+  fmset(b, n);
+  freemap.cursor = b + n;
+  release(&freemap.lock);
+
+  fmlog(b, n, 1);
+  *got = n;
+  return b;
+}
+
+// Free blocks [start, start+n), which lie in one bitmap block. The
+// on-disk bits are cleared in the transaction, but balloc sees the
+// blocks free only once the transaction has been checkpointed: until
+// then a crash may bring them back into use, and the checkpoint may
+// still write them, so they must not be written in place for a new
+// file. Adjacent frees are merged, as a truncate frees from the end.
+static void bfree(uint start, uint n) {
+  struct extent *last;
+
+  fmlog(start, n, 0);
+  acquire(&log.lock);
+  last = log.nfree > 0 ? &log.frees[log.nfree - 1] : 0;
+  if (last && last->startblkno == start + n) {
+    last->startblkno = start;
+    last->nblocks += n;
+  } else if (last && last->startblkno + last->nblocks == start) {
+    last->nblocks += n;
+  } else {
+    if (log.nfree == LOGMAXBLOCKS)
+      panic("bfree: too many frees");
+    log.frees[log.nfree].startblkno = start;
+    log.frees[log.nfree].nblocks = n;
+    log.nfree++;
+  }
+  release(&log.lock);
+}
+
+// Extent tree lookup: return the disk block holding file block fblk,
+// or 0 if the tree does not map it. Each level is a binary search for
+// the last entry that starts at or before fblk.
+static uint xlookup(struct inode *ip, uint fblk) {
+  struct buf *buf;
+  struct xhdr *h;
+  struct xleaf *leaf;
+  struct xidx *idx;
+  uint blkno, bno;
+  int lo, hi, mid;
+
+  for (blkno = ip->indirect; blkno != 0;) {
+    buf = bread(ip->dev, blkno);
+    h = (struct xhdr *)buf->data;
+    lo = 0;
+    hi = h->n - 1;
+    if (h->depth > 0) {
+      idx = (struct xidx *)(h + 1);
+      while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (idx[mid].fblk <= fblk)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+      blkno = (h->n > 0 && idx[lo].fblk <= fblk) ? idx[lo].blkno : 0;
+      brelse(buf);
+      continue;
+    }
+    leaf = (struct xleaf *)(h + 1);
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (leaf[mid].fblk <= fblk)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    bno = 0;
+    if (h->n > 0 && leaf[lo].fblk <= fblk &&
+        fblk < leaf[lo].fblk + leaf[lo].e.nblocks)
+      bno = leaf[lo].e.startblkno + fblk - leaf[lo].fblk;
+    brelse(buf);
+    return bno;
+  }
+  return 0;
+}
+
+// Allocate a zeroed extent tree node of the given depth.
+// Returns it locked; the caller fills it in, log_writes and releases it.
+static struct buf *xnewnode(struct inode *ip, ushort depth) {
+  struct buf *buf;
+  uint got;
+
+  buf = bget(ip->dev, balloc(1, &got));
+  memset(buf->data, 0, BSIZE);
+  buf->flags |= B_VALID;
+  ((struct xhdr *)buf->data)->depth = depth;
+  return buf;
+}
+
+// Map file block fblk, the first block past the end of the file's
+// extents, through the extent tree. Files only grow at their end, so
+// all changes happen along the rightmost path: the last extent is
+// grown in place if possible; otherwise a new extent is appended to
+// the rightmost leaf, splitting off new nodes up the path as they fill.
+// want is the number of blocks to try to allocate.
+// Caller must hold ip->lock and be in a transaction.
+static uint xappend(struct inode *ip, uint fblk, uint want) {
+  struct buf *path[XMAXDEPTH];
+  struct buf *buf, *child;
+  struct xhdr *h;
+  struct xleaf *leaf, *last;
+  struct xidx *idx;
+  uint start, got, childfblk, blkno;
+  int depth, d;
+
+  if (ip->indirect == 0) {
+    buf = xnewnode(ip, 0);
+    ip->indirect = buf->blockno;
+    brelse(buf);
+  }
+
+  // walk down the rightmost path
+  depth = 0;
+  for (blkno = ip->indirect;; depth++) {
+    if (depth == XMAXDEPTH)
+      panic("xappend: tree too deep");
+    path[depth] = bread(ip->dev, blkno);
+    h = (struct xhdr *)path[depth]->data;
+    if (h->depth == 0)
+      break;
+    blkno = ((struct xidx *)(h + 1))[h->n - 1].blkno;
+  }
+
+  h = (struct xhdr *)path[depth]->data;
+  leaf = (struct xleaf *)(h + 1);
+  last = h->n > 0 ? &leaf[h->n - 1] : 0;
+  if (last && last->fblk + last->e.nblocks != fblk)
+    panic("bmap: hole");
+
+  if (last &&
+      (got = bextend(last->e.startblkno + last->e.nblocks, want)) > 0) {
+    start = last->e.startblkno + last->e.nblocks;
+    last->e.nblocks += got;
+    log_write(path[depth]);
+    goto done;
+  }
+
+  start = balloc(want, &got);
+  if (h->n < XLEAFN) {
+    leaf[h->n].fblk = fblk;
+    leaf[h->n].e.startblkno = start;
+    leaf[h->n].e.nblocks = got;
+    h->n++;
+    log_write(path[depth]);
+    goto done;
+  }
+
+  // the rightmost leaf is full: start a new one, then hook it into the
+  // lowest ancestor with room, adding new nodes on the way up.
+  child = xnewnode(ip, 0);
+  h = (struct xhdr *)child->data;
+  leaf = (struct xleaf *)(h + 1);
+  leaf[0].fblk = fblk;
+  leaf[0].e.startblkno = start;
+  leaf[0].e.nblocks = got;
+  h->n = 1;
+  childfblk = fblk;
+  for (d = depth - 1; d >= 0; d--) {
+    h = (struct xhdr *)path[d]->data;
+    idx = (struct xidx *)(h + 1);
+    if (h->n < XIDXN) {
+      idx[h->n].fblk = childfblk;
+      idx[h->n].blkno = child->blockno;
+      h->n++;
+      log_write(path[d]);
+      break;
+    }
+    log_write(child);
+    buf = xnewnode(ip, h->depth);
+    h = (struct xhdr *)buf->data;
+    idx = (struct xidx *)(h + 1);
+    idx[0].fblk = childfblk;
+    idx[0].blkno = child->blockno;
+    h->n = 1;
+    brelse(child);
+    child = buf;
+  }
+  if (d < 0) {
+    // every node on the path was full: grow a new root above them
+    if (depth + 1 == XMAXDEPTH)
+      panic("xappend: tree too deep");
+    h = (struct xhdr *)path[0]->data;
+    buf = xnewnode(ip, h->depth + 1);
+    idx = (struct xidx *)((struct xhdr *)buf->data + 1);
+    idx[0].fblk = h->depth > 0 ? ((struct xidx *)(h + 1))[0].fblk
+                               : ((struct xleaf *)(h + 1))[0].fblk;
+    idx[0].blkno = ip->indirect;
+    idx[1].fblk = childfblk;
+    idx[1].blkno = child->blockno;
+    ((struct xhdr *)buf->data)->n = 2;
+    ip->indirect = buf->blockno;
+    log_write(buf);
+    brelse(buf);
+  }
+  log_write(child);
+  brelse(child);
+
+done:
+  for (d = 0; d <= depth; d++)
+    brelse(path[d]);
+  return start;
+}
+
+// Return the disk block that holds block fblk of ip, or 0 if it has
+// not been allocated. If alloc is non-zero, allocate it, along with
+// up to alloc-1 blocks after it (at least EXTENTBLOCKS in all, so
+// small appends do not each need an allocation): files only grow at
+// their end, so fblk is then the first unallocated block. The last
+// extent is grown in place when the blocks after it are free;
+// otherwise a new extent is started. Once the direct extents are all
+// in use, further extents go in the extent tree.
+// Caller must hold ip->lock, and be in a transaction if alloc is set.
+static uint bmap(struct inode *ip, uint fblk, uint alloc) {
+  struct extent *e;
+  uint base, got, bno;
+  int i;
+
+  base = 0;
+  for (i = 0; i < NEXTENT; i++) {
+    e = &ip->data[i];
+    if (e->nblocks == 0)
+      break;
+    if (fblk < base + e->nblocks)
+      return e->startblkno + fblk - base;
+    base += e->nblocks;
+  }
+  if (i == NEXTENT && ip->indirect != 0) {
+    if ((bno = xlookup(ip, fblk)) != 0 || !alloc)
+      return bno;
+    return xappend(ip, fblk, min(max(alloc, (uint)EXTENTBLOCKS), (uint)BPB));
+  }
+  if (!alloc)
+    return 0;
+  if (fblk != base)
+    panic("bmap: hole");
+
+  // one bitmap block covers BPB blocks, so this touches at most two
+  alloc = min(max(alloc, (uint)EXTENTBLOCKS), (uint)BPB);
+
+  if (i > 0) {
+    e = &ip->data[i - 1];
+    if ((got = bextend(e->startblkno + e->nblocks, alloc)) > 0) {
+      e->nblocks += got;
+      return e->startblkno + e->nblocks - got;
+    }
+  }
+  if (i == NEXTENT)
+    return xappend(ip, fblk, alloc);
+  e = &ip->data[i];
+  e->startblkno = balloc(alloc, &e->nblocks);
+  return e->startblkno;
+}
+
+// Free the tail of extent e, which maps file blocks from base on: its
+// blocks past file block keep that share a bitmap block with its last.
+static void xtrimext(struct extent *e, uint base, uint keep) {
+  uint end, lo;
+
+  end = e->startblkno + e->nblocks;
+  lo = max(e->startblkno + (keep > base ? keep - base : 0),
+           (end - 1) / BPB * BPB);
+  bfree(lo, end - lo);
+  e->nblocks = lo - e->startblkno;
+  if (e->nblocks == 0)
+    e->startblkno = 0;
+}
+
+// Trim the last extent in the extent tree, the file's tail, past file
+// block keep, freeing the nodes that leaves empty along the rightmost
+// path. Returns 0 if the tree maps nothing past keep.
+// Caller must hold ip->lock and be in a transaction.
+static int xtrim(struct inode *ip, uint keep) {
+  struct buf *path[XMAXDEPTH];
+  struct xhdr *h;
+  struct xleaf *last;
+  uint blkno;
+  int depth, d, trimmed;
+
+  depth = 0;
+  for (blkno = ip->indirect;; depth++) {
+    path[depth] = bread(ip->dev, blkno);
+    h = (struct xhdr *)path[depth]->data;
+    if (h->depth == 0)
+      break;
+    blkno = ((struct xidx *)(h + 1))[h->n - 1].blkno;
+  }
+
+  trimmed = 0;
+  last = h->n > 0 ? &((struct xleaf *)(h + 1))[h->n - 1] : 0;
+  if (last && last->fblk + last->e.nblocks > keep) {
+    xtrimext(&last->e, last->fblk, keep);
+    if (last->e.nblocks == 0)
+      h->n--;
+    log_write(path[depth]);
+    trimmed = 1;
+  }
+  for (d = depth; d >= 0 && ((struct xhdr *)path[d]->data)->n == 0; d--) {
+    bfree(path[d]->blockno, 1);
+    trimmed = 1;
+    if (d == 0) {
+      ip->indirect = 0;
+      break;
+    }
+    ((struct xhdr *)path[d - 1]->data)->n--;
+    log_write(path[d - 1]);
+  }
+
+  for (d = 0; d <= depth; d++)
+    brelse(path[d]);
+  return trimmed;
+}
+
+// Free the last piece of ip's blocks past file block keep: the part of
+// its last extent in one bitmap block, so that an operation logs a
+// bounded number of blocks. Returns 0 if ip has no blocks past keep.
+// Caller must hold ip->lock and be in a transaction.
+static int btrim(struct inode *ip, uint keep) {
+  struct extent *e;
+  uint base;
+  int i;
+
+  base = 0;
+  for (i = 0; i < NEXTENT && ip->data[i].nblocks > 0; i++)
+    base += ip->data[i].nblocks;
+  // the extent tree holds the blocks after the direct extents
+  if (i == NEXTENT && ip->indirect != 0)
+    return xtrim(ip, keep);
+  if (i == 0)
+    return 0;
+  e = &ip->data[i - 1];
+  base -= e->nblocks;
+  if (base + e->nblocks <= keep)
+    return 0;
+  xtrimext(e, base, keep);
+  return 1;
+}
+
+// Read page pgno of ip into dst for the page cache. Runs of blocks
+// that are contiguous on disk are read as one batch; parts of the page
+// past the file's blocks are zeroed.
+// Caller must hold ip->lock.
+void ireadpage(struct inode *ip, uint pgno, char *dst) {
+  struct buf *bufs[PGSIZE / BSIZE];
+  uint fblk, bno;
+  int i, j, n;
+
+  fblk = pgno * (PGSIZE / BSIZE);
+  for (i = 0; i < PGSIZE / BSIZE; i += n) {
+    n = 1;
+    if ((bno = bmap(ip, fblk + i, 0)) == 0) {
+      memset(dst + i * BSIZE, 0, BSIZE);
+      continue;
+    }
+    while (i + n < PGSIZE / BSIZE && bmap(ip, fblk + i + n, 0) == bno + n)
+      n++;
+    breadn(ip->dev, bno, bufs, n);
+    for (j = 0; j < n; j++) {
+      memmove(dst + (i + j) * BSIZE, bufs[j]->data, BSIZE);
+      brelse(bufs[j]);
+    }
+  }
+}
+
 // Read data from inode.
 // Returns number of bytes read.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, or share it.
+//
+// File data is read through the page cache, except for the inode
+// file, whose blocks write_dinode updates behind writei's back.
 int readi(struct inode *ip, char *dst, uint off, uint n) {
-  if (!holdingsleep(&ip->lock))
+  uint tot, m, bno;
+  struct buf* buf;
+  struct cpage *cp;
+
+  if (!holdingi(ip))
     panic("not holding lock");
 
   if (ip->type == T_DEV) {
@@ -308,66 +1009,94 @@ int readi(struct inode *ip, char *dst, uint off, uint n) {
   if (off + n > ip->size)
     n = ip->size - off;
 
-  struct extent* extent = &ip->data[0];
-  uint extno = 0, extoff = 0, foff = 0;
-  uint tot, m;
-  struct buf* buf;
-
-  for (tot = 0; tot < n; extoff++, foff++) {
-    assert(extent->nblocks > 0);
-    if (extoff >= extent->nblocks) {
-      // move on the next extent
-      assert(extno < 5);
-      extno++;
-      extent = &ip->data[extno];
-      extoff = 0;
-    }
-    if (foff >= off / BSIZE) {
-      buf = bread(ip->dev, extent->startblkno + extoff);
-      m = min(n - tot, BSIZE - off % BSIZE);
-      memmove(dst, buf->data + off % BSIZE, m);
-      brelse(buf);
-      off += m;
-      tot += m;
-      dst += m;
+  // once for the whole read: the rest of it, and the window past it
+  if (ip != &icache.inodefile)
+    ireadahead(ip, (off / PGSIZE + 1) * PGSIZE, n + NREADAHEAD * BSIZE);
+
+  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    if (ip != &icache.inodefile) {
+      if ((cp = pcget(ip, off / PGSIZE)) == 0)
+        return -1;
+      m = min(n - tot, PGSIZE - off % PGSIZE);
+      memmove(dst, cp->data + off % PGSIZE, m);
+      pcput(cp);
+      continue;
     }
+    bno = bmap(ip, off / BSIZE, 0);
+    assert(bno != 0);
+    buf = bread(ip->dev, bno);
+    m = min(n - tot, BSIZE - off % BSIZE);
+    memmove(dst, buf->data + off % BSIZE, m);
+    brelse(buf);
   }
   return n;
 }
 
-uint balloc(void) {
-  int data[BSIZE / sizeof(int)];
-  struct buf *buf;
-  uint blockno;
-  uint i;
-  uint addr;
-
-  for (blockno = BBLOCK(sb.inodestart, sb); blockno < sb.inodestart; blockno++) {
-    buf = bread(ROOTDEV, blockno);
-    memmove(data, buf->data, BSIZE);  // copy buf into data
-
-    for (i = 0; i < BSIZE/sizeof(int); i++) {
-      if (data[i] == 0) {  // 32 bits of 0
-        data[i] = -1;  // 32 bits of 1
-        memmove(buf->data, data, BSIZE);  // copy data into buf
-        log_write(buf);
-        brelse(buf);
-        addr = (blockno - sb.bmapstart) * BPB + i * 32;
-        assert(addr > sb.inodestart);
-        assert(addr < FSSIZE);
-        return addr;
-      }
-    }
+// Start reading the blocks of ip that hold [off, off+n) into the
+// buffer cache without waiting for them.
+// Caller must hold ip->lock.
+void ireadahead(struct inode *ip, uint off, uint n) {
+  uint fblk, last, bno;
 
-    brelse(buf);
+  if (ip->type == T_DEV || n == 0 || off >= ip->size)
+    return;
+  if (off + n > ip->size || off + n < off)
+    n = ip->size - off;
+
+  last = (off + n - 1) / BSIZE;
+  for (fblk = off / BSIZE; fblk <= last; fblk++) {
+    if ((bno = bmap(ip, fblk, 0)) == 0)
+      break;
+    breadahead(ip->dev, bno);
   }
+}
 
-  panic("No more free space in extent region");
+// Write ip's in-memory dinode fields back through the log, into the
+// inode file block that holds it, sharing the inode file's lock.
+// Caller must hold ip->lock and be in a transaction.
+static void write_dinode(struct inode *ip) {
+  struct dinode dip;
+  struct buf *buf;
+  uint off;
+  int holding;
+
+  // populate dinode
+  memset(&dip, 0, sizeof(dip));
+  dip.type = ip->type;
+  dip.devid = ip->devid;
+  dip.size = ip->size;
+  for (int i = 0; i < NEXTENT; i++) {
+    dip.data[i] = ip->data[i];
+  }
+  dip.indirect = ip->indirect;
+  dip.orphan = ip->unlinked;
+
+  // write the updated dinode back to disk
+  if (ip != &icache.inodefile) {
+    off = INODEOFF(ip->inum);
+    if (!(holding = holdingsleep(&icache.inodefile.lock)))
+      lockishared(&icache.inodefile);
+    if (off + sizeof(dip) > icache.inodefile.size)
+      panic("write_dinode");
+    buf = bread(ip->dev, bmap(&icache.inodefile, off / BSIZE, 0));
+    memmove(buf->data + off % BSIZE, &dip, sizeof(dip));
+    log_write(buf);
+    brelse(buf);
+    if (!holding)
+      unlockishared(&icache.inodefile);
+  } else {
+    buf = bread(ip->dev, sb.inodestart);
+    memmove(buf->data, &dip, sizeof(struct dinode));
+    log_write(buf);
+    brelse(buf);
+  }
 }
 
 // threadsafe writei.
 int concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
   int retval;
+  // a fault on src must not need ip's lock
+  vspaceprefault((uint64_t)src, n);
   locki(ip);
   retval = writei(ip, src, off, n);
   unlocki(ip);
@@ -375,10 +1104,38 @@ int concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
   return retval;
 }
 
+// Most data blocks writei logs in one transaction, leaving room for
+// the dinode block, two bitmap blocks and two extent tree blocks.
+#define WRITEMAXBLOCKS (MAXOPBLOCKS - 5)
+
+// Write the n bufs of new file blocks in place and release them.
+static void writedirect(struct buf **bufs, int n) {
+  int i;
+
+  bwriten(bufs, n);
+  for (i = 0; i < n; i++)
+    brelse(bufs[i]);
+}
+
 // Write data to inode.
 // Returns number of bytes written.
 // Caller must hold ip->lock.
+//
+// Space for the whole write is allocated at once, and the dinode is
+// written once per transaction that allocated and once more at the
+// end if the size changed, rather than once per block.
+//
+// Unless JOURNAL_DATA is set, the blocks of a regular file past the
+// end it had when the write began are not logged: nothing on disk
+// shows them yet, so they are written in place before the transaction
+// that makes them part of the file commits, and only the dinode, the
+// bitmap and the extent tree go through the log.
 int writei(struct inode *ip, char *src, uint off, uint n) {
+  struct buf *direct[NIOBATCH];
+  uint tot, m, i, fblk, bno, size, newfblk;
+  int alloced, ndirect;
+  struct buf* buf;
+
   if (!holdingsleep(&ip->lock))
     panic("not holding lock");
 
@@ -391,74 +1148,142 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
   if (off > ip->size || off + n < off) {
     return -1;
   }
-  
-  struct extent* extent = &ip->data[0];
-  uint extno = 0, extoff = 0, foff = 0;
-  uint tot, m;
-  struct buf* buf;
-  struct dinode dip;
-  uint oldoff = off;
-  short log_started = holdingsleep(&loglock);
-
-  for (tot = 0; tot < n; extoff++, foff++) {
-    if (extoff >= extent->nblocks && extent->nblocks != 0) {
-      // end of this extent, move on the next extent
-      extno++;
-      extent = &ip->data[extno];
-      extoff = 0;
-    }
-
-    if (foff >= off / BSIZE) {
-      if (!log_started)
-        begin_tx();
 
-      if (extent->nblocks == 0) {
-        // empty extent, allocate new blocks
-        if (extno == 5)
-          panic("Run out of space for a file");
-        extent->startblkno = balloc();
-        extent->nblocks = 32;
+  size = ip->size;
+  newfblk = -1;
+  if (!JOURNAL_DATA && ip->type == T_FILE && ip != &icache.inodefile)
+    newfblk = (size + BSIZE - 1) / BSIZE;
+  for (tot = 0; tot < n;) {
+    begin_tx();
+
+    alloced = 0;
+    ndirect = 0;
+    for (i = 0; i < WRITEMAXBLOCKS && tot < n; tot += m, off += m, src += m) {
+      fblk = off / BSIZE;
+      if ((bno = bmap(ip, fblk, 0)) == 0) {
+        // allocate at most once per transaction to bound its size
+        if (alloced)
+          break;
+        bno = bmap(ip, fblk, (off + n - tot - 1) / BSIZE - fblk + 1);
+        alloced = 1;
       }
-      
-      buf = bread(ip->dev, extent->startblkno + extoff);
+
+      buf = bread(ip->dev, bno);
       m = min(n - tot, BSIZE - off % BSIZE);
       memmove(buf->data + off % BSIZE, src, m);
-      log_write(buf);
-      brelse(buf);
-      off += m;
-      tot += m;
-      src += m;
-
-      // update file size
-      if (oldoff + tot > ip->size) {
-        ip->size = oldoff + tot;
-      }
-
-      // populate dinode
-      dip.type = ip->type;
-      dip.devid = ip->devid;
-      dip.size = ip->size;
-      for (int i = 0; i < 6; i++) {
-        dip.data[i] = ip->data[i];
-      }
-
-      // write the updated dinode back to disk
-      if (ip != &icache.inodefile)
-        concurrent_writei(&icache.inodefile, &dip, INODEOFF(ip->inum), sizeof(struct dinode));
-      else {
-        buf = bread(ip->dev, sb.inodestart);
-        memmove(buf->data, &dip, sizeof(struct dinode));
+      if (fblk >= newfblk) {
+        direct[ndirect++] = buf;
+        if (ndirect == NIOBATCH) {
+          writedirect(direct, ndirect);
+          ndirect = 0;
+        }
+      } else {
         log_write(buf);
         brelse(buf);
+        i++;
       }
+      if (ip != &icache.inodefile)
+        pcupdate(ip, off, src, m);
 
-      if (!log_started)
-        commit_tx();
+      // update file size
+      if (off + m > ip->size)
+        ip->size = off + m;
     }
+
+    // the data goes before the metadata that points at it
+    writedirect(direct, ndirect);
+
+    // new extents must reach the disk with the bitmap bits that claim
+    // them; a growing size alone can wait for the last transaction.
+    if (alloced || (tot == n && ip->size != size))
+      write_dinode(ip);
+
+    commit_tx();
   }
   return n;
 }
 
+// Free ip's blocks past file block keep, one piece per transaction,
+// writing the dinode, with whatever size the caller set, in each.
+// Caller must hold ip->lock.
+static void itrim(struct inode *ip, uint keep) {
+  int more;
+
+  do {
+    begin_tx();
+    more = btrim(ip, keep);
+    write_dinode(ip);
+    commit_tx();
+  } while (more);
+}
+
+// Cut ip down to size bytes, freeing the blocks past its new end.
+// The new size is written in the first transaction, before any block
+// is freed, so a crash part way leaves only unused blocks allocated.
+// Returns 0, or -1 if ip is not a regular file or is smaller than size.
+// Caller must hold ip->lock.
+int trunci(struct inode *ip, uint size) {
+  if (!holdingsleep(&ip->lock))
+    panic("not holding lock");
+  if (ip->type != T_FILE || ip == &icache.inodefile || size > ip->size)
+    return -1;
+
+  pctruncate(ip, size);
+  ip->size = size;
+  itrim(ip, (size + BSIZE - 1) / BSIZE);
+  return 0;
+}
+
+// Free ip, which has neither a name nor a reference but the caller's:
+// its blocks, then its slot in the inode file, for addfile to reuse.
+static void ifree(struct inode *ip) {
+  locki(ip);
+  pctruncate(ip, 0);
+  ip->size = 0;
+  itrim(ip, 0);
+  begin_tx();
+  ip->type = 0;
+  acquire(&icache.lock);
+  ip->unlinked = 0;
+  release(&icache.lock);
+  write_dinode(ip);
+  commit_tx();
+  // the slot may be reused before this inode is recycled
+  ip->valid = 0;
+  unlocki(ip);
+
+  acquire(&icache.lock);
+  if (ip->inum < icache.freeinum)
+    icache.freeinum = ip->inum;
+  release(&icache.lock);
+}
+
+// The first free dinode slot from icache.freeinum on, or the one past
+// the end of the inode file.
+// Caller must hold the inode file's lock.
+static uint ifreeslot(void) {
+  struct dinode di;
+  uint inum, start;
+
+  acquire(&icache.lock);
+  start = icache.freeinum;
+  release(&icache.lock);
+
+  for (inum = start; INODEOFF(inum) + sizeof(di) <= icache.inodefile.size;
+       inum++) {
+    readi(&icache.inodefile, (char *)&di, INODEOFF(inum), sizeof(di));
+    if (di.type == 0)
+      break;
+  }
+
+  acquire(&icache.lock);
+  // unless ifree freed a slot below start meanwhile
+  if (icache.freeinum >= start)
+    icache.freeinum = inum + 1;
+  release(&icache.lock);
+  return inum;
+}
+
 // Directories
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
@@ -467,57 +1292,376 @@ struct inode *rootlookup(char *name) {
   return dirlookup(namei("/"), name, 0);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+// Name cache.
+//
+// Maps (directory, name) to the inum found there, so that repeated
+// path lookups skip the directory scan. A negative entry, inum 0,
+// records that the name is absent. Entries are only filled in and
+// changed with the directory's lock held, so a scan and an update of
+// the same directory cannot interleave.
+
+struct dentry {
+  uint dev;
+  uint dinum; // directory the entry is in; 0 if the slot is unused
+  char name[DIRSIZ];
+  uint inum;  // 0 for a negative entry
+  uint off;   // byte offset of the dirent in the directory
+  struct dentry *hnext;
+  struct dentry *prev; // LRU list
+  struct dentry *next;
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry *hash[NIBUCKET];
+  struct dentry lru; // lru.next is most recently used
+  struct dentry ent[NDENTRY];
+} dcache;
+
+static struct dentry **dhash(uint dev, uint dinum, char *name) {
+  uint h = dev * 31 + dinum;
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NIBUCKET];
+}
 
-  if (dp->type != T_DIR)
-    panic("dirlookup not DIR");
+static void dunlink(struct dentry *d) {
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+}
 
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if (de.inum == 0)
-      continue;
-    if (namecmp(name, de.name) == 0) {
-      // entry matches path element
-      if (poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+static void dlinkhead(struct dentry *d) {
+  d->next = dcache.lru.next;
+  d->prev = &dcache.lru;
+  dcache.lru.next->prev = d;
+  dcache.lru.next = d;
+}
+
+static void dcacheinit(void) {
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.prev = &dcache.lru;
+  dcache.lru.next = &dcache.lru;
+  for (d = dcache.ent; d < dcache.ent + NDENTRY; d++)
+    dlinkhead(d);
+}
+
+// Caller must hold dcache.lock.
+static struct dentry *dfind(struct inode *dp, char *name) {
+  struct dentry *d;
+
+  for (d = *dhash(dp->dev, dp->inum, name); d != 0; d = d->hnext)
+    if (d->dev == dp->dev && d->dinum == dp->inum && namecmp(name, d->name) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in dp's cached entries.
+// Returns 1 and sets *inum (0 if the name is known to be absent) and
+// *off on a hit, or 0 if the cache does not know.
+static int dcache_lookup(struct inode *dp, char *name, uint *inum, uint *off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dp, name)) == 0) {
+    release(&dcache.lock);
+    return 0;
+  }
+  dunlink(d);
+  dlinkhead(d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in dp is inum at byte offset off, or that it is
+// absent if inum is 0, replacing what was cached for it.
+// Caller must hold dp->lock.
+static void dcache_enter(struct inode *dp, char *name, uint inum, uint off) {
+  struct dentry *d, **pp;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dp, name)) == 0) {
+    // recycle the least recently used entry
+    d = dcache.lru.prev;
+    if (d->dinum != 0) {
+      for (pp = dhash(d->dev, d->dinum, d->name); *pp != d; pp = &(*pp)->hnext)
+        ;
+      *pp = d->hnext;
     }
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    pp = dhash(d->dev, d->dinum, d->name);
+    d->hnext = *pp;
+    *pp = d;
   }
+  d->inum = inum;
+  d->off = off;
+  dunlink(d);
+  dlinkhead(d);
+  release(&dcache.lock);
+}
 
-  return 0;
+// Map the directory block holding byte off of dp, so a scan can look
+// at all of its entries in place instead of copying them out one at
+// a time. Returns the locked buffer and sets *de to the entry at off
+// and *n to the number of entries from there to the end of the block.
+// Entries never straddle blocks, since BSIZE is a multiple of their
+// size. Caller must hold dp->lock and brelse the buffer.
+static struct buf *dirblock(struct inode *dp, uint off, struct dirent **de, int *n) {
+  struct buf *buf;
+  uint bno, end;
+
+  if ((bno = bmap(dp, off / BSIZE, 0)) == 0)
+    panic("dirblock: unmapped block");
+  buf = bread(dp->dev, bno);
+  end = min(dp->size - off / BSIZE * BSIZE, (uint)BSIZE);
+  *de = (struct dirent *)(buf->data + off % BSIZE);
+  *n = (end - off % BSIZE) / sizeof(struct dirent);
+  return buf;
 }
 
-void swapread(int dev, uint swap_index, char* addr) {
+// Copy the in-use entries of directory dp from byte offset *off on
+// into dst, as many whole entries as fit in n bytes, and advance *off
+// past the entries consumed. Returns the number of bytes copied,
+// 0 at the end of the directory.
+// Caller must hold dp->lock.
+int readdirents(struct inode *dp, char *dst, uint *off, uint n) {
+  struct dirent *de;
   struct buf *buf;
-  uint block_no;
+  uint tot;
+  int i, nde;
+
+  if (dp->type != T_DIR)
+    return -1;
 
-  for (int i = 0; i < 8; i++) {
-    block_no = sb.swapstart + swap_index * 8 + i;
-    buf = bread(dev, block_no);
-    memmove(addr, buf->data, BSIZE);
+  tot = 0;
+  while (*off < dp->size && tot + sizeof(*de) <= n) {
+    buf = dirblock(dp, *off, &de, &nde);
+    for (i = 0; i < nde && tot + sizeof(*de) <= n; i++) {
+      if (de[i].inum != 0) {
+        memmove(dst + tot, &de[i], sizeof(*de));
+        tot += sizeof(*de);
+      }
+    }
     brelse(buf);
-    addr += BSIZE;
+    *off += i * sizeof(*de);
+    // skip a partial entry at the end of the directory
+    if (nde == 0)
+      *off = dp->size;
   }
+  return tot;
 }
 
-void swapwrite(int dev, uint swap_index, char* addr) {
+// Number of hash buckets if dp is a hashed directory, 0 if linear.
+// Caller must hold dp->lock.
+static uint dirbuckets(struct inode *dp) {
+  struct dirent *de;
+  struct dirhdr *h;
   struct buf *buf;
-  uint block_no;
+  uint nb;
+  int n;
+
+  if (dp->size < BSIZE)
+    return 0;
+  buf = dirblock(dp, 0, &de, &n);
+  h = (struct dirhdr *)buf->data;
+  nb = 0;
+  if (h->inum == 0 && h->magic == DIRHDR_MAGIC &&
+      dp->size == (h->nbuckets + 1) * BSIZE)
+    nb = h->nbuckets;
+  brelse(buf);
+  return nb;
+}
+
+// Search directory dp for name. Returns the byte offset of its entry
+// and sets *inum, or returns -1 if it is not there. Either way sets
+// *slot to the offset of a free slot the name could be added at, the
+// end of a linear directory if it has none, or -1 if a hashed
+// directory is full.
+// Caller must hold dp->lock.
+static int dirsearch(struct inode *dp, char *name, uint *inum, int *slot) {
+  struct dirent *de;
+  struct buf *buf;
+  uint off, nb, b, k;
+  int i, n, stop;
+
+  *slot = -1;
+  if ((nb = dirbuckets(dp)) == 0) {
+    for (off = 0; off < dp->size; off += n * sizeof(*de)) {
+      buf = dirblock(dp, off, &de, &n);
+      if (n == 0)
+        panic("dirlink read");
+      for (i = 0; i < n; i++) {
+        if (de[i].inum == 0) {
+          if (*slot < 0)
+            *slot = off + i * sizeof(*de);
+          continue;
+        }
+        if (namecmp(name, de[i].name) == 0) {
+          *inum = de[i].inum;
+          brelse(buf);
+          return off + i * sizeof(*de);
+        }
+      }
+      brelse(buf);
+    }
+    if (*slot < 0)
+      *slot = dp->size;
+    return -1;
+  }
 
-  for (int i = 0; i < 8; i++) {
-    block_no = sb.swapstart + swap_index * 8 + i;
-    buf = bread(ROOTDEV, block_no);
-    memmove(buf->data, addr, BSIZE);
-    bwrite(buf);
+  b = dirhash(name) % nb;
+  for (k = 0, stop = 0; k < nb && !stop; k++) {
+    off = (1 + (b + k) % nb) * BSIZE;
+    buf = dirblock(dp, off, &de, &n);
+    for (i = 0; i < n; i++) {
+      if (de[i].inum == 0) {
+        if (*slot < 0)
+          *slot = off + i * sizeof(*de);
+        // a never-used slot: name was never placed beyond it
+        if (de[i].name[0] == 0) {
+          stop = 1;
+          break;
+        }
+        continue;
+      }
+      if (namecmp(name, de[i].name) == 0) {
+        *inum = de[i].inum;
+        brelse(buf);
+        return off + i * sizeof(*de);
+      }
+    }
     brelse(buf);
-    addr += BSIZE;
   }
+  return -1;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
+struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
+  uint inum;
+  int off, slot;
+
+  if (dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if (dcache_lookup(dp, name, &inum, (uint *)&off)) {
+    if (inum == 0)
+      return 0;
+    if (poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if ((off = dirsearch(dp, name, &inum, &slot)) < 0) {
+    dcache_enter(dp, name, 0, 0);
+    return 0;
+  }
+  // entry matches path element
+  if (poff)
+    *poff = off;
+  dcache_enter(dp, name, inum, off);
+  return iget(dp->dev, inum);
+}
+
+// Write a new directory entry (name, inum) into dp, reusing a free
+// slot if there is one. Returns -1 if the name is already there or
+// a hashed directory is full.
+// Caller must hold dp->lock and be in a transaction.
+int dirlink(struct inode *dp, char *name, uint inum) {
+  struct dirent de;
+  uint oinum;
+  int slot;
+
+  if (dirsearch(dp, name, &oinum, &slot) >= 0 || slot < 0)
+    return -1;
+
+  memset(&de, 0, sizeof(de));
+  strncpy(de.name, name, DIRSIZ);
+  de.inum = inum;
+  if (writei(dp, (char *)&de, slot, sizeof(de)) != sizeof(de))
+    return -1;
+  dcache_enter(dp, name, inum, slot);
+  return 0;
+}
+
+// Swap slots are one page: SWAPBLOCKS consecutive disk blocks, read
+// and written as one batch so the transfers overlap. Runs of slots go
+// SWAPBATCH pages at a time, as many blocks as the disk takes at once.
+#define SWAPBLOCKS (PGSIZE / BSIZE)
+#define SWAPBATCH (NIOBATCH >= SWAPBLOCKS ? NIOBATCH / SWAPBLOCKS : 1)
+
+int swapdev = ROOTDEV; // the disk swap is on
+static uint swapbase;  // block of swap slot 0 on it
+
+// Puts swap on SWAPDEV, the whole of it, if there is such a disk, so
+// that paging and file system I/O move on separate channels at once;
+// otherwise in the swap region of the file system's disk dev. Returns
+// the swap slots there are.
+static uint swapsetup(int dev) {
+  uint n;
+
+  if ((n = idesize(SWAPDEV) / SWAPBLOCKS) > 0) {
+    swapdev = SWAPDEV;
+    swapbase = 0;
+    cprintf("swap: disk %d, %d pages\n", SWAPDEV, n);
+    return n;
+  }
+  swapdev = dev;
+  swapbase = sb.swapstart;
+  return sb.nswap;
+}
+
+// Reads the n slots from swap_index on into the pages in pages[].
+void swapreadn(int dev, uint swap_index, char **pages, int n) {
+  struct buf *bufs[SWAPBATCH * SWAPBLOCKS];
+  int i, j, m;
+
+  for (i = 0; i < n; i += m) {
+    m = min(n - i, SWAPBATCH);
+    breadn(dev, swapbase + (swap_index + i) * SWAPBLOCKS, bufs,
+           m * SWAPBLOCKS);
+    for (j = 0; j < m * SWAPBLOCKS; j++) {
+      memmove(pages[i + j / SWAPBLOCKS] + (j % SWAPBLOCKS) * BSIZE,
+              bufs[j]->data, BSIZE);
+      brelse(bufs[j]);
+    }
+  }
+}
+
+// Writes the pages in pages[] to the n slots from swap_index on.
+void swapwriten(int dev, uint swap_index, char **pages, int n) {
+  struct buf *bufs[SWAPBATCH * SWAPBLOCKS];
+  int i, j, m;
+
+  for (i = 0; i < n; i += m) {
+    m = min(n - i, SWAPBATCH);
+    // Whole blocks are overwritten, so there is no need to read them.
+    for (j = 0; j < m * SWAPBLOCKS; j++) {
+      bufs[j] = bget(dev, swapbase + (swap_index + i) * SWAPBLOCKS + j);
+      memmove(bufs[j]->data,
+              pages[i + j / SWAPBLOCKS] + (j % SWAPBLOCKS) * BSIZE, BSIZE);
+      bufs[j]->flags |= B_VALID;
+    }
+    bwriten(bufs, m * SWAPBLOCKS);
+    for (j = 0; j < m * SWAPBLOCKS; j++)
+      brelse(bufs[j]);
+  }
+}
+
+void swapread(int dev, uint swap_index, char* addr) {
+  swapreadn(dev, swap_index, &addr, 1);
+}
+
+void swapwrite(int dev, uint swap_index, char* addr) {
+  swapwriten(dev, swap_index, &addr, 1);
 }
 
 // Paths
@@ -614,7 +1758,7 @@ int addfile(char* path) {
   struct dinode di;
   uint inum;
   struct inode* rootdev;
-  struct dirent dirent;
+  char name[DIRSIZ];
 
   begin_tx();
 
@@ -622,31 +1766,34 @@ int addfile(char* path) {
   di.devid = ROOTDEV;
   di.size = 0;
   di.type = T_FILE;
-  di.data[0].startblkno = balloc();
-  di.data[0].nblocks = 32;
-  for (int i = 1; i < 6; i++) {
+  di.data[0].startblkno = balloc(EXTENTBLOCKS, &di.data[0].nblocks);
+  for (int i = 1; i < NEXTENT; i++) {
     di.data[i].startblkno = 0;
     di.data[i].nblocks = 0;
   }
+  di.indirect = 0;
+  di.orphan = 0;
+  di.pad[0] = 0;
   
-  // append the dinode to the end of the inode file
+  // put the dinode in a free slot, or append it to the inode file
   locki(&icache.inodefile);
-  if (writei(&icache.inodefile, &di, icache.inodefile.size, sizeof(struct dinode))
-    != sizeof(struct dinode)) {
+  inum = ifreeslot();
+  if (writei(&icache.inodefile, (char *)&di, INODEOFF(inum),
+             sizeof(struct dinode)) != sizeof(struct dinode)) {
     unlocki(&icache.inodefile);
+    commit_tx();
     return -1;
   }
-  inum = icache.inodefile.size / sizeof(struct dinode) - 1;
   unlocki(&icache.inodefile);
 
-  // append a new dirent to the root directory
+  // add a new dirent to the root directory
   rootdev = iget(ROOTDEV, ROOTINO);
-  dirent.inum = inum;
-  skipelem(path, dirent.name);
+  skipelem(path, name);
   locki(rootdev);
-  if (writei(rootdev, &dirent, rootdev->size, sizeof(struct dirent))
-    != sizeof(struct dirent)) {
+  if (dirlink(rootdev, name, inum) < 0) {
     unlocki(rootdev);
+    irelease(rootdev);
+    commit_tx();
     return -1;
   }
   unlocki(rootdev);
@@ -657,89 +1804,375 @@ int addfile(char* path) {
   return 0;
 }
 
-void begin_tx() {
-  struct log_meta log;
-  struct buf *buf;
+// Remove the name path. The file itself is freed once no one has it
+// open or mapped. Returns 0, or -1 if there is no such file or it is
+// a directory.
+int unlinkfile(char *path) {
+  struct inode *dp, *ip;
+  struct dirent de;
+  char name[DIRSIZ];
+  uint off;
+
+  if ((dp = nameiparent(path, name)) == 0)
+    return -1;
+  locki(dp);
+  if (namecmp(name, ".") == 0 || namecmp(name, "..") == 0 ||
+      (ip = dirlookup(dp, name, &off)) == 0) {
+    unlocki(dp);
+    irelease(dp);
+    return -1;
+  }
+  locki(ip);
+  if (ip->type == T_DIR) {
+    unlocki(ip);
+    irelease(ip);
+    unlocki(dp);
+    irelease(dp);
+    return -1;
+  }
 
-  acquiresleep(&loglock);
+  // the name stays in the free slot, so that the probes of a hashed
+  // directory go on past it
+  memset(&de, 0, sizeof(de));
+  strncpy(de.name, name, DIRSIZ);
+  begin_tx();
+  writei(dp, (char *)&de, off, sizeof(de));
+  // marked orphan on disk as the name goes, so that a crash while it is
+  // still open does not leak it
+  acquire(&icache.lock);
+  ip->unlinked = 1;
+  release(&icache.lock);
+  write_dinode(ip);
+  commit_tx();
+  unlocki(ip);
+  dcache_enter(dp, name, 0, 0);
+  unlocki(dp);
+  irelease(dp);
 
-  // Initialize a new struct log_meta
-  memset(&log, 0, sizeof(struct log_meta));
+  irelease(ip);
+  return 0;
+}
+
+// Copy the committed log on disk to its home locations.
+static void install_log(void) {
+  struct buf *home, *lb;
+  int i;
+
+  breadn(ROOTDEV, sb.logstart + 1, log.logbufs, log.header.nchanges);
+  for (i = 0; i < log.header.nchanges; i++) {
+    lb = log.logbufs[i];
+    home = bread(ROOTDEV, log.header.blocknos[i]);
+    memmove(home->data, lb->data, BSIZE);
+    bwrite(home);
+    brelse(home);
+    brelse(lb);
+  }
+}
+
+// Write a log header to disk.
+static void write_head(struct log_meta *h) {
+  struct buf *buf;
 
-  // Write struct to beginning of log region
   buf = bread(ROOTDEV, sb.logstart);
-  memmove(buf->data, &log, sizeof(struct log_meta));
+  memmove(buf->data, h, sizeof(struct log_meta));
   bwrite(buf);
   brelse(buf);
 }
 
-void commit_tx() {
-  struct log_meta log;
-  struct buf *data_buf, *log_buf, *meta_buf;
-  uint block_no;
+static void checkpointer(void);
+static void flusher(void);
 
-  if (!holdingsleep(&loglock))
-    panic("not holding lock");
+static void initlog(void) {
+  struct buf *buf, *bufs = 0;
+  int i;
+
+  initlock(&log.lock, "log");
+  lockstat(&log.lock);
+  if (sb.nlog < 2)
+    panic("initlog: no log region");
+  log.size = min(sb.nlog - 1, (uint)LOGMAXBLOCKS);
+  if (log.size < MAXOPBLOCKS)
+    panic("initlog: log too small");
 
   // Read log_meta in
-  meta_buf = bread(ROOTDEV, sb.logstart);
-  memmove(&log, meta_buf->data, sizeof(struct log_meta));
+  buf = bread(ROOTDEV, sb.logstart);
+  memmove(&log.header, buf->data, sizeof(struct log_meta));
+  brelse(buf);
 
-  // Set log to committed and write to disk
-  log.commited = 1;
-  memmove(meta_buf->data, &log, sizeof(struct log_meta));
-  bwrite(meta_buf);
+  if (log.header.commited == 1) {
+    install_log();
 
-  // Write log blocks to their corresponding place on disk
-  for (int i = 0; i < log.nchanges; i++) {
-    block_no = log.blocknos[i];
-    // cprintf("read bno at %d: %d\n", i, block_no);
-    data_buf = bread(ROOTDEV, block_no);
-    log_buf = bread(ROOTDEV, sb.logstart + 1 + i);
+    // Set log to uncommitted and nchanges = 0, then write to disk
+    memset(&log.header, 0, sizeof(struct log_meta));
+    write_head(&log.header);
+  }
+  memset(&log.header, 0, sizeof(struct log_meta));
 
-    memmove(data_buf->data, log_buf->data, sizeof(struct log_meta));
-    bwrite(data_buf);
-    brelse(data_buf);
-    brelse(log_buf);
+  // Buffers the checkpointer writes home locations through.
+  for (i = 0; i < log.size; i++) {
+    if (i % BPERPAGE == 0 && (bufs = ballocpage("ckbuf")) == 0)
+      panic("initlog: no memory");
+    log.ckbufs[i] = bufs + i % BPERPAGE;
+  }
+  kthread("checkpoint", checkpointer);
+  if (WRITEBACK)
+    kthread("flusher", flusher);
+}
 
-    data_buf->flags &= ~B_DIRTY;
+void begin_tx() {
+  if (myproc()->txdepth++ > 0)
+    return;
+
+  acquire(&log.lock);
+  while (log.committing || log.syncwant ||
+         log.header.nchanges + (log.outstanding + 1) * MAXOPBLOCKS > log.size ||
+         log.nfree + (log.outstanding + 1) * MAXOPFREES > LOGMAXBLOCKS)
+    sleep(&log, &log.lock);
+  log.outstanding++;
+  release(&log.lock);
+  traceevent(TR_TX, TR_BEGIN, 0);
+}
+
+// Write the transaction to the log and commit it. The checkpointer
+// installs it at the home locations later.
+// Caller must have set log.committing.
+static void commit(void) {
+  struct buf **logbufs = log.logbufs;
+  struct buf *home;
+  int i, n;
+
+  n = log.header.nchanges;
+  if (n == 0)
+    return;
+  traceevent(TR_COMMIT, TR_BEGIN, n);
+
+  // The log region still holds the previous transaction until it
+  // has been checkpointed.
+  acquire(&log.lock);
+  while (log.ckpt_pending)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  // The cached home copies hold the logged data; copy them into
+  // the log region and write it as one batch. They stay B_DIRTY, so
+  // they stay cached, until the checkpoint is done.
+  for (i = 0; i < n; i++) {
+    home = bread(ROOTDEV, log.header.blocknos[i]);
+    logbufs[i] = bget(ROOTDEV, sb.logstart + 1 + i);
+    memmove(logbufs[i]->data, home->data, BSIZE);
+    logbufs[i]->flags |= B_VALID;
+    brelse(home);
   }
+  bwriten(logbufs, n);
+  for (i = 0; i < n; i++)
+    brelse(logbufs[i]);
+
+  // Commit point.
+  log.header.commited = 1;
+  write_head(&log.header);
+  log_commits++;
+  log_blocks += n;
+  traceevent(TR_COMMIT, TR_END, n);
+
+  // Hand the transaction to the checkpointer.
+  acquire(&log.lock);
+  log.ckpt = log.header;
+  log.ckpt_pending = 1;
+  memset(&log.header, 0, sizeof(struct log_meta));
+  memmove(log.ckfrees, log.frees, log.nfree * sizeof(struct extent));
+  log.nckfree = log.nfree;
+  log.nfree = 0;
+  wakeup(&log.ckpt);
+  release(&log.lock);
+}
 
-  // Set log to uncommitted and nchanges = 0, then write to disk
-  memset(&log, 0, sizeof(struct log_meta));
-  memmove(meta_buf->data, &log, sizeof(struct log_meta));
-  bwrite(meta_buf);
-  brelse(meta_buf);
+// Is blockno part of the open transaction?
+// Caller must hold log.lock.
+static int inlog(uint blockno) {
+  int i;
 
-  // Release log lock
-  releasesleep(&loglock);
+  for (i = 0; i < log.header.nchanges; i++)
+    if (log.header.blocknos[i] == blockno)
+      return 1;
+  return 0;
 }
 
-void log_write(struct buf *b) {
-  struct log_meta log;
-  struct buf *log_buf;
-  struct buf *data_buf;
+// Kernel thread that installs committed transactions at their home
+// locations, so that commit_tx can return once the commit record
+// is on disk.
+static void checkpointer(void) {
+  struct log_meta *ck = &log.ckpt;
+  struct buf *b, *lb;
+  int i, n, m, alias;
+
+  for (;;) {
+    acquire(&log.lock);
+    while (!log.ckpt_pending)
+      sleep(&log.ckpt, &log.lock);
+    release(&log.lock);
+
+    // Later transactions may have changed the cached home copies
+    // already, so write the committed data from the log instead. A
+    // cached copy that is the disk's own block, as the RAM disk hands
+    // out, is on disk already with those changes, which the logged
+    // data would roll back; it is left as it is.
+    n = ck->nchanges;
+    for (i = m = 0; i < n; i++) {
+      b = bread(ROOTDEV, ck->blocknos[i]);
+      alias = b->data != b->space;
+      brelse(b);
+      if (alias)
+        continue;
+      lb = bread(ROOTDEV, sb.logstart + 1 + i);
+      b = log.ckbufs[m++];
+      acquiresleep(&b->lock);
+      b->dev = ROOTDEV;
+      b->blockno = ck->blocknos[i];
+      b->flags = B_VALID;
+      memmove(b->data, lb->data, BSIZE);
+      brelse(lb);
+    }
+    bwriten(log.ckbufs, m);
+    for (i = 0; i < m; i++)
+      releasesleep(&log.ckbufs[i]->lock);
+
+    // The disk now holds these blocks, so their cached copies may be
+    // evicted, unless the open transaction has written them again.
+    for (i = 0; i < n; i++) {
+      b = bread(ROOTDEV, ck->blocknos[i]);
+      acquire(&log.lock);
+      if (!inlog(b->blockno))
+        b->flags &= ~B_DIRTY;
+      release(&log.lock);
+      brelse(b);
+    }
 
-  if (!holdingsleep(&loglock))
-    panic("not holding lock");
+    // Set log to uncommitted and nchanges = 0, then write to disk
+    ck->commited = 0;
+    ck->nchanges = 0;
+    write_head(ck);
+
+    // The blocks the transaction freed may be reused now.
+    acquire(&freemap.lock);
+    for (i = 0; i < log.nckfree; i++)
+      fmclear(log.ckfrees[i].startblkno, log.ckfrees[i].nblocks);
+    release(&freemap.lock);
+    log.nckfree = 0;
+
+    acquire(&log.lock);
+    log.ckpt_pending = 0;
+    wakeup(&log);
+    release(&log.lock);
+  }
+}
 
-  b->flags |= B_DIRTY;
+void commit_tx() {
+  int do_commit = 0;
+
+  if (myproc()->txdepth <= 0)
+    panic("commit_tx: no transaction");
+  if (--myproc()->txdepth > 0)
+    return;
+  traceevent(TR_TX, TR_END, 0);
+
+  acquire(&log.lock);
+  log.outstanding--;
+  if (log.committing)
+    panic("log.committing");
+  if (log.outstanding == 0 &&
+      (!WRITEBACK || log.syncwant ||
+       log.header.nchanges + MAXOPBLOCKS > log.size ||
+       log.nfree + MAXOPFREES > LOGMAXBLOCKS)) {
+    do_commit = 1;
+    log.committing = 1;
+  } else {
+    // begin_tx may be waiting for the room this operation reserved.
+    wakeup(&log);
+  }
+  release(&log.lock);
+
+  if (do_commit) {
+    // No lock is held while writing; nobody else touches the
+    // header while committing is set.
+    commit();
+    acquire(&log.lock);
+    log.committing = 0;
+    log.syncwant = 0;
+    log.gen++;
+    wakeup(&log);
+    release(&log.lock);
+  }
+}
 
-  // Read in log_meta
-  log_buf = bread(ROOTDEV, sb.logstart);
-  memmove(&log, log_buf->data, sizeof(struct log_meta));
+// Commit the open transaction, if it logged anything, and return once
+// its commit record is on disk. Must not be called inside a transaction.
+void logsync(void) {
+  uint gen;
+
+  acquire(&log.lock);
+  while (log.committing)
+    sleep(&log, &log.lock);
+  if (log.header.nchanges == 0) {
+    release(&log.lock);
+    return;
+  }
+  if (log.outstanding > 0) {
+    // the last operation out commits, and begin_tx lets no more in
+    gen = log.gen;
+    log.syncwant = 1;
+    while (log.gen == gen)
+      sleep(&log, &log.lock);
+    release(&log.lock);
+    return;
+  }
+  log.committing = 1;
+  release(&log.lock);
+
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.syncwant = 0;
+  log.gen++;
+  wakeup(&log);
+  release(&log.lock);
+}
 
-  // Update blockno in log_meta and increment number of changes
-  log.blocknos[log.nchanges] = b->blockno;
-  log.nchanges++;
+// Kernel thread that commits the open transaction once it has held
+// its first block for FLUSHTICKS.
+static void flusher(void) {
+  int old;
+
+  for (;;) {
+    acquire(&tickslock);
+    timersleep(ticks + FLUSHTICKS);
+    release(&tickslock);
+
+    acquire(&log.lock);
+    old = log.header.nchanges > 0 && ticks - log.opened >= FLUSHTICKS;
+    release(&log.lock);
+    if (old)
+      logsync();
+  }
+}
+
+void log_write(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("log_write: buf not locked");
 
-  data_buf = bread(ROOTDEV, sb.logstart + log.nchanges);
-  memmove(data_buf->data, b->data, BSIZE);
-  bwrite(data_buf);
-  brelse(data_buf);
+  acquire(&log.lock);
+  if (log.outstanding < 1 || myproc()->txdepth < 1)
+    panic("log_write outside of trans");
 
-  // Write log_meta back to disk
-  memmove(log_buf->data, &log, sizeof(struct log_meta));
-  bwrite(log_buf);
-  brelse(log_buf);
+  // Keep the buffer in the cache until the transaction commits.
+  b->flags |= B_DIRTY;
+
+  // Absorb repeated writes of a block into one log entry.
+  if (!inlog(b->blockno)) {
+    if (log.header.nchanges >= log.size)
+      panic("log_write: transaction too big");
+    if (log.header.nchanges == 0)
+      log.opened = ticks;
+    log.header.blocknos[log.header.nchanges++] = b->blockno;
+  }
+  release(&log.lock);
 }
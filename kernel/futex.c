@@ -0,0 +1,82 @@
+// Futexes: a user word to sleep on while it holds a value.
+//
+// A futex is named by the physical address of its word rather than the
+// virtual one, so that processes sharing the page through a shared
+// mapping, or still sharing it copy-on-write after a fork, meet on it.
+// Waiters sleep on the word's address in the kernel's map of physical
+// memory, a channel no kernel object uses, on the hashed wait lists
+// every sleep goes on.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <vspace.h>
+
+// held from a waiter's look at the word until it sleeps, so that a wake
+// after a change to the word cannot come in between
+static struct spinlock futexlock;
+
+void futexinit(void) {
+  initlock(&futexlock, "futex");
+  lockstat(&futexlock);
+}
+
+// The channel for the word at user address va, which must be aligned.
+// Returns 0 if va is not in the address space, or if its page is not in
+// memory, when there is no telling who else has it.
+static int *futexchan(uint64_t va) {
+  struct vspace *vs = myproc()->vspace;
+  uint64_t ppn;
+
+  if (va % sizeof(int) != 0 || vspacecontains(vs, va, sizeof(int)) != 1)
+    return 0;
+  if (!vspacepresent(vs, va, &ppn))
+    return 0;
+  return (int *)((char *)P2V(ppn << PT_SHIFT) + va % PGSIZE);
+}
+
+// Sleeps until woken if the word at va holds val. Returns 0 once woken,
+// or -1 at once if the word holds something else or va is bad.
+int futexwait(uint64_t va, int val) {
+  volatile int *w;
+
+  for (;;) {
+    // brings the page in, if it is out, before the lock is held
+    if (vspacecontains(myproc()->vspace, va, sizeof(int)) != 1 ||
+        *(volatile int *)va != val)
+      return -1;
+    acquire(&futexlock);
+    if ((w = futexchan(va)) != 0)
+      break;
+    // the page went out meanwhile
+    release(&futexlock);
+  }
+
+  if (*w != val) {
+    release(&futexlock);
+    return -1;
+  }
+  sleep((void *)w, &futexlock);
+  release(&futexlock);
+  return myproc()->killed ? -1 : 0;
+}
+
+// Wakes at most n of those waiting on the word at va.
+// Returns how many, or -1 if va is bad.
+int futexwake(uint64_t va, int n) {
+  int *w;
+  int r;
+
+  if (va % sizeof(int) != 0 ||
+      vspacecontains(myproc()->vspace, va, sizeof(int)) != 1)
+    return -1;
+  acquire(&futexlock);
+  // waiters have the page in memory, unless it has gone out since
+  r = (w = futexchan(va)) != 0 ? wakeupn(w, n) : 0;
+  release(&futexlock);
+  return r;
+}
@@ -1,4 +1,9 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.
+// Requests for adjacent blocks that are queued together are moved
+// by one command. When the PCI IDE controller supports bus-master
+// DMA the disk copies the data itself; otherwise the CPU copies it
+// with PIO, using READ/WRITE MULTIPLE when the disk allows. The two
+// channels run at once: swap may have a disk on the secondary.
 
 #include <cdefs.h>
 #include <defs.h>
@@ -9,10 +14,12 @@
 #include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
+#include <trace.h>
 #include <trap.h>
 #include <x86_64.h>
 
 #include <buf.h>
+#include <pci.h>
 
 #define SECTOR_SIZE 512
 #define IDE_BSY 0x80
@@ -24,136 +31,469 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_READDMA 0xc8
+#define IDE_CMD_WRITEDMA 0xca
+#define IDE_CMD_IDENTIFY 0xec
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Bus-master IDE registers, relative to BAR4 of the controller.
+#define BM_CMD 0x0
+#define BM_STATUS 0x2
+#define BM_PRDT 0x4
 
-static struct spinlock idelock;
-static struct buf *idequeue;
+#define BM_CMD_START 0x01
+#define BM_CMD_TOMEM 0x08 // transfer from the disk to memory
+#define BM_ST_ERR 0x02
+#define BM_ST_INTR 0x04
 
-static int havedisk1;
-static void idestart(struct buf *);
+// Most sectors moved by one READ/WRITE MULTIPLE command.
+#define IDE_MAXMULT 16
+// Most sectors moved by one DMA command.
+#define IDE_MAXDMA 32
 
-// Wait for IDE disk to become ready.
-static int idewait(int checkerr) {
+// Physical region descriptor: one buffer of a DMA transfer.
+struct prd {
+  uint addr;
+  ushort nbytes;
+  ushort flags;
+};
+#define PRD_EOT 0x8000 // last descriptor of the table
+
+// Each IDE channel drives its two disks on its own, with its own lock,
+// request queue and interrupt, so the disks of different channels move
+// data at the same time. Disks 0 and 1 are the master and slave of the
+// primary channel, disks 2 and 3 those of the secondary.
+//
+// A channel's queue holds the bufs waiting for it, in the order chosen
+// by the I/O scheduler, linked through qnext. active holds the count
+// bufs of the request now being read/written to the disk, also linked
+// through qnext. You must hold the channel's lock while manipulating
+// either list.
+struct idechan {
+  ushort base;  // command block registers
+  ushort ctl;   // control register
+  int irq;
+  struct spinlock lock;
+  struct buf *queue;
+  struct buf *active;
+  int count;
+  uint pos;     // block just past the last request started
+  int disk[2];  // which disks are there
+  uint blocks[2]; // blocks on each
+  int mult;     // sectors per multiple-mode request, 0 if unsupported
+  int maxrun;   // most sectors in one request
+  ushort bm;    // bus-master I/O base, 0 if none
+  struct prd *prdt;
+};
+
+static struct idechan idechans[2] = {
+    {0x1f0, 0x3f6, IRQ_IDE},
+    {0x170, 0x376, IRQ_IDE + 1},
+};
+
+static void idestart(struct idechan *, struct buf *);
+
+// the channel of disk dev
+static struct idechan *idechan(uint dev) {
+  if (dev >= 4)
+    panic("idechan");
+  return &idechans[dev / 2];
+}
+
+// An I/O scheduler decides where new requests go in a channel's queue
+// and which queued request the channel serves next.
+struct iosched {
+  char *name;
+  // Add b to c's queue.
+  void (*add)(struct idechan *c, struct buf *b);
+  // Return the link in c's queue that points at the next request.
+  struct buf **(*next)(struct idechan *c);
+};
+
+// First come, first served.
+static void fifo_add(struct idechan *c, struct buf *b) {
+  struct buf **pp;
+
+  for (pp = &c->queue; *pp; pp = &(*pp)->qnext) // DOC:insert-queue
+    ;
+  *pp = b;
+}
+
+static struct buf **fifo_next(struct idechan *c) {
+  return c->queue ? &c->queue : 0;
+}
+
+static struct iosched fifo_sched = {"fifo", fifo_add, fifo_next};
+
+// C-LOOK: keep the queue sorted by block number and sweep upwards
+// from the last position, wrapping around to the lowest block. A
+// request that has waited IDE_DEADLINE ticks is served first, so a
+// steady stream of nearby requests cannot starve a distant one.
+static void clook_add(struct idechan *c, struct buf *b) {
+  struct buf **pp;
+
+  for (pp = &c->queue; *pp; pp = &(*pp)->qnext)
+    if ((*pp)->dev > b->dev ||
+        ((*pp)->dev == b->dev && (*pp)->blockno > b->blockno))
+      break;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+static struct buf **clook_next(struct idechan *c) {
+  struct buf **pp, **oldest, **up;
+
+  if (c->queue == 0)
+    return 0;
+
+  oldest = up = 0;
+  for (pp = &c->queue; *pp; pp = &(*pp)->qnext) {
+    if (ticks - (*pp)->qtime >= IDE_DEADLINE &&
+        (oldest == 0 || (int)((*pp)->qtime - (*oldest)->qtime) < 0))
+      oldest = pp;
+    if (up == 0 && (*pp)->blockno >= c->pos)
+      up = pp;
+  }
+  if (oldest)
+    return oldest;
+  if (up)
+    return up;
+  return &c->queue;
+}
+
+static struct iosched clook_sched = {"c-look", clook_add, clook_next};
+
+static struct iosched *iosched = IOSCHED_CLOOK ? &clook_sched : &fifo_sched;
+
+// Wait for the selected disk of channel c to become ready.
+static int idewait(struct idechan *c, int checkerr) {
   int r;
 
-  while (((r = inb(0x1f7)) & (IDE_BSY | IDE_DRDY)) != IDE_DRDY)
+  while (((r = inb(c->base + 7)) & (IDE_BSY | IDE_DRDY)) != IDE_DRDY)
     ;
   if (checkerr && (r & (IDE_DF | IDE_ERR)) != 0)
     return -1;
   return 0;
 }
 
+// Find the bus-master registers of the PCI IDE controller and turn on
+// bus mastering, the secondary channel's 8 ports after the primary's.
+// Leaves bm 0, so PIO is used, if there is none.
+static void idedmainit(void) {
+  int slot, func;
+  uint bar;
+  struct prd *prdt;
+
+  if (pcifindclass(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &slot, &func) < 0)
+    return;
+  bar = pciconfread(0, slot, func, PCI_BAR4);
+  if (!(bar & 1) || (bar & ~3) == 0) // must be an I/O port range
+    return;
+  // a table for each channel, in one page
+  if ((prdt = (struct prd *)kalloc()) == 0 || V2P(prdt) >= SZ_4G)
+    return;
+  pciconfwrite(0, slot, func, PCI_COMMAND,
+               pciconfread(0, slot, func, PCI_COMMAND) | PCI_COMMAND_MASTER);
+  idechans[0].bm = bar & ~3;
+  idechans[0].prdt = prdt;
+  idechans[1].bm = (bar & ~3) + 8;
+  idechans[1].prdt = prdt + IDE_MAXDMA;
+  outb(idechans[0].bm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+  outb(idechans[1].bm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+}
+
+// Is disk d of channel c there? A channel with no disks at all may
+// float its status register to all ones.
+static int ideprobe(struct idechan *c, int d) {
+  int i, r;
+
+  outb(c->base + 6, 0xe0 | (d << 4));
+  for (i = 0; i < 1000; i++)
+    if ((r = inb(c->base + 7)) != 0)
+      return r != 0xff;
+  return 0;
+}
+
+// Let disk d of channel c move several sectors per command and
+// interrupt, and find its size. The file system or swap may be as big
+// as the disk, whose size in sectors is in words 60 and 61 of what
+// IDENTIFY DEVICE returns. Returns -1 if the disk does not identify
+// itself, as a CD drive does not.
+static int idesetup(struct idechan *c, int d) {
+  ushort id[SECTOR_SIZE / 2];
+  uint n;
+
+  outb(c->base + 6, 0xe0 | (d << 4));
+  outb(c->base + 7, IDE_CMD_IDENTIFY);
+  if (idewait(c, 1) < 0)
+    return -1;
+  insl(c->base, id, SECTOR_SIZE / 4);
+  if ((n = id[60] | (uint)id[61] << 16) != 0)
+    c->blocks[d] = n / (BSIZE / SECTOR_SIZE);
+
+  outb(c->base + 2, IDE_MAXMULT);
+  outb(c->base + 7, IDE_CMD_SETMUL);
+  // multiple mode is set for the channel as a whole, at its least
+  if (idewait(c, 1) < 0)
+    c->mult = 0;
+  return 0;
+}
+
 void ideinit(void) {
-  int i;
+  struct idechan *c;
+
+  idechans[0].blocks[0] = idechans[0].blocks[1] = FSSIZE;
+  for (c = idechans; c < &idechans[2]; c++) {
+    initlock(&c->lock, "ide");
+    c->mult = IDE_MAXMULT;
+  }
+  idewait(&idechans[0], 0);
 
-  initlock(&idelock, "ide");
-  picenable(IRQ_IDE);
-  ioapicenable(IRQ_IDE, ncpu - 1);
-  idewait(0);
+  // Disk 1 holds the file system; disk 2, the secondary master, may
+  // hold swap. Disk 0 is the boot disk.
+  idechans[0].disk[0] = 1;
+  if (ideprobe(&idechans[0], 1)) {
+    idechans[0].disk[1] = 1;
+    if (idesetup(&idechans[0], 1) < 0)
+      idechans[0].mult = 0;
+  }
+  if (ideprobe(&idechans[1], 0) && idesetup(&idechans[1], 0) == 0 &&
+      idechans[1].blocks[0] > 0)
+    idechans[1].disk[0] = 1;
+  if (!idechans[0].disk[1])
+    idechans[0].mult = 0;
+  if (!idechans[1].disk[0])
+    idechans[1].mult = 0;
 
-  // Check if disk 1 is present
-  outb(0x1f6, 0xe0 | (1 << 4));
-  for (i = 0; i < 1000; i++) {
-    if (inb(0x1f7) != 0) {
-      havedisk1 = 1;
-      break;
+  // Switch back to disk 0.
+  outb(idechans[0].base + 6, 0xe0 | (0 << 4));
+
+  idedmainit();
+  for (c = idechans; c < &idechans[2]; c++) {
+    c->maxrun = c->bm ? IDE_MAXDMA : (c->mult ? c->mult : 1);
+    if (c == idechans || c->disk[0]) {
+      picenable(c->irq);
+      ioapicenable(c->irq, ncpu - 1);
     }
   }
 
-  // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0 << 4));
+  cprintf("ide: %s scheduler, %s, %d sectors per request, %d blocks\n",
+          iosched->name, idechans[0].bm ? "dma" : "pio", idechans[0].maxrun,
+          idechans[0].blocks[1]);
+  if (idechans[1].disk[0])
+    cprintf("ide: disk 2, %d blocks, on its own channel\n",
+            idechans[1].blocks[0]);
+}
+
+// Returns the blocks on disk dev, or 0 if there is no such disk.
+uint idesize(int dev) {
+  struct idechan *c;
+
+  if (dev < 0 || dev >= 4)
+    return 0;
+  c = idechan(dev);
+  return c->disk[dev & 1] ? c->blocks[dev & 1] : 0;
+}
+
+// Can b2 be moved by the same command that moves b1?
+static int idemergeable(struct buf *b1, struct buf *b2) {
+  return b2 && b2->dev == b1->dev && b2->blockno == b1->blockno + 1 &&
+         (b2->flags & B_DIRTY) == (b1->flags & B_DIRTY) &&
+         b2->blockno < idechan(b1->dev)->blocks[b1->dev & 1];
+}
+
+// Take the next request off c's queue, together with the queued bufs
+// right after it that hold the following blocks, and start it.
+// Caller must hold c->lock and the channel must be idle.
+static void idestartnext(struct idechan *c) {
+  struct buf **pp, *b, *last;
+  int n;
+
+  if ((pp = iosched->next(c)) == 0)
+    return;
+
+  b = last = *pp;
+  n = 1;
+  while ((n + 1) * (BSIZE / SECTOR_SIZE) <= c->maxrun &&
+         idemergeable(last, last->qnext)) {
+    last = last->qnext;
+    n++;
+  }
+  *pp = last->qnext;
+  last->qnext = 0;
+
+  c->active = b;
+  c->count = n;
+  c->pos = b->blockno + n;
+  // the channels count under their own locks
+  __sync_fetch_and_add(&disk_requests, 1);
+  __sync_fetch_and_add(&disk_merges, n - 1);
+  if (b->flags & B_DIRTY)
+    __sync_fetch_and_add(&disk_blocks_written, n);
+  else
+    __sync_fetch_and_add(&disk_blocks_read, n);
+  idestart(c, b);
 }
 
-// Start the request for b.  Caller must hold idelock.
-static void idestart(struct buf *b) {
+// Start the request for the count bufs of c->active, starting with b,
+// as one command.
+// Caller must hold c->lock.
+static void idestart(struct idechan *c, struct buf *b) {
+  struct buf *p;
+  int i;
+
   if (b == 0)
     panic("idestart");
-  if (b->blockno >= FSSIZE)
+  if (b->blockno >= c->blocks[b->dev & 1])
     panic("incorrect blockno");
   int sector_per_block = BSIZE / SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int read_cmd = (sector_per_block == 1 && !c->mult) ? IDE_CMD_READ : IDE_CMD_RDMUL;
+  int write_cmd = (sector_per_block == 1 && !c->mult) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7)
     panic("idestart");
 
-  idewait(0);
-  outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
-  outb(0x1f3, sector & 0xff);
-  outb(0x1f4, (sector >> 8) & 0xff);
-  outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
-  if (b->flags & B_DIRTY) {
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+  idewait(c, 0);
+  if (c->bm) {
+    // One descriptor per buf; buf data never crosses a page.
+    for (i = 0, p = b; p; i++, p = p->qnext) {
+      c->prdt[i].addr = V2P(p->data);
+      c->prdt[i].nbytes = BSIZE;
+      c->prdt[i].flags = p->qnext ? 0 : PRD_EOT;
+    }
+    pcioutl(c->bm + BM_PRDT, V2P(c->prdt));
+    outb(c->bm + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_CMD_TOMEM);
+    outb(c->bm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+  }
+  outb(c->ctl, 0);                // generate interrupt
+  outb(c->base + 2, c->count * sector_per_block); // number of sectors
+  outb(c->base + 3, sector & 0xff);
+  outb(c->base + 4, (sector >> 8) & 0xff);
+  outb(c->base + 5, (sector >> 16) & 0xff);
+  outb(c->base + 6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
+  if (c->bm) {
+    outb(c->base + 7, (b->flags & B_DIRTY) ? IDE_CMD_WRITEDMA : IDE_CMD_READDMA);
+    outb(c->bm + BM_CMD, inb(c->bm + BM_CMD) | BM_CMD_START);
+  } else if (b->flags & B_DIRTY) {
+    outb(c->base + 7, write_cmd);
+    for (p = b; p; p = p->qnext)
+      outsl(c->base, p->data, BSIZE / 4);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(c->base + 7, read_cmd);
   }
 }
 
-// Interrupt handler.
-void ideintr(void) {
-  struct buf *b;
+// Interrupt handler for channel chan, 0 for the primary.
+void ideintr(int chan) {
+  struct idechan *c = &idechans[chan];
+  struct buf *b, *async[IDE_MAXDMA];
+  int i, nasync, ok, st;
 
-  // First queued buffer is the active request.
-  acquire(&idelock);
-  if ((b = idequeue) == 0) {
-    release(&idelock);
+  // c->active is the request that just finished.
+  acquire(&c->lock);
+  if ((b = c->active) == 0) {
+    release(&c->lock);
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
+  traceevent(TR_IDEINTR, TR_INSTANT, b->blockno);
 
-  // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE / 4);
+  if (c->bm) {
+    // Stop the bus master; the data is already in memory.
+    st = inb(c->bm + BM_STATUS);
+    outb(c->bm + BM_CMD, 0);
+    outb(c->bm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+    ok = idewait(c, 1) >= 0 && !(st & BM_ST_ERR);
+    if (!ok)
+      cprintf("ide: dma error on block %d of disk %d\n", b->blockno, b->dev);
+  } else {
+    // Read data if needed.
+    ok = (b->flags & B_DIRTY) || idewait(c, 1) >= 0;
+  }
+
+  nasync = 0;
+  while ((b = c->active) != 0) {
+    c->active = b->qnext;
+    if (!c->bm && !(b->flags & B_DIRTY) && ok)
+      insl(c->base, b->data, BSIZE / 4);
+
+    // Wake process waiting for this buf.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if (b->flags & B_ASYNC)
+      async[nasync++] = b;
+  }
+  __sync_fetch_and_sub(&disk_queue_depth, c->count);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Start disk on next request in queue.
+  idestartnext(c);
 
-  // Start disk on next buf in queue.
-  if (idequeue != 0)
-    idestart(idequeue);
+  release(&c->lock);
 
-  release(&idelock);
+  // Nobody waits for an asynchronous request; drop its buffer.
+  for (i = 0; i < nasync; i++) {
+    async[i]->flags &= ~B_ASYNC;
+    brelse_async(async[i]);
+  }
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b) {
-  struct buf **pp;
+// Queue requests for the n locked bufs and return without waiting.
+// A channel is started if it was idle; the rest of the batch follows
+// from the interrupt handler. Use iderw_wait to wait for each buf,
+// except B_ASYNC bufs, which the interrupt handler releases itself.
+void iderw_submit(struct buf **bufs, int n) {
+  struct idechan *c;
+  struct buf *b;
+  int i, j, depth;
 
-  if (!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if (b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  // the bufs of a batch are for one disk, as a rule
+  for (i = 0; i < n; i = j) {
+    c = idechan(bufs[i]->dev);
+    acquire(&c->lock); // DOC:acquire-lock
 
-  acquire(&idelock); // DOC:acquire-lock
+    for (j = i; j < n && idechan(bufs[j]->dev) == c; j++) {
+      b = bufs[j];
+      if (!holdingsleep(&b->lock))
+        panic("iderw: buf not locked");
+      if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
+        panic("iderw: nothing to do");
+      if (!c->disk[b->dev & 1])
+        panic("iderw: ide disk not present");
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for (pp = &idequeue; *pp; pp = &(*pp)->qnext) // DOC:insert-queue
-    ;
-  *pp = b;
+      b->qnext = 0;
+      b->qtime = ticks;
+      iosched->add(c, b);
+    }
+    traceevent(TR_IDERW, TR_INSTANT, bufs[i]->blockno);
+    depth = __sync_add_and_fetch(&disk_queue_depth, j - i);
+    if (depth > disk_queue_peak)
+      disk_queue_peak = depth;
+
+    // Start disk if necessary.
+    if (c->active == 0)
+      idestartnext(c);
+
+    release(&c->lock);
+  }
+}
 
-  // Start disk if necessary.
-  if (idequeue == b)
-    idestart(b);
+// Wait for a request queued by iderw_submit to finish.
+void iderw_wait(struct buf *b) {
+  struct idechan *c = idechan(b->dev);
 
-  // Wait for request to finish.
+  acquire(&c->lock);
   while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID) {
-    sleep(b, &idelock);
+    sleep(b, &c->lock);
   }
+  release(&c->lock);
+}
 
-  release(&idelock);
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void iderw(struct buf *b) {
+  iderw_submit(&b, 1);
+  iderw_wait(b);
 }
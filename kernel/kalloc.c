@@ -11,59 +11,206 @@
 #include <spinlock.h>
 #include <fs.h>
 #include <proc.h>
+#include <slab.h>
+#include <trace.h>
+#include <vspace.h>
 #include "../inc/mmu.h"
 
 int npages = 0;
 int pages_in_use;
 int pages_in_swap;
 int free_pages;
+int num_swap_ins;
+int num_swap_outs; // pages written out to swap, or to the compressed pool
+int swap_cached;   // pages in core whose swap slot still holds their copy
+int swap_reused;   // evictions that went back to such a slot unwritten
 uint64_t cow_ppn;
+uint64_t zero_ppn; // the page of zeroes untouched anonymous memory maps
 
 struct core_map_entry *core_map = NULL;
-struct swap_map_entry *swap_map = NULL;
+
+// Usable physical memory, as the E820 map reports it. The core map has
+// entries for these pages only, each range's together and the ranges
+// one after another, so a hole in physical memory takes no core map.
+struct memrange memranges[E820_NR_MAX];
+int nmemranges;
+
+// Swap slots. The superblock says how many there are, so the swap map
+// lives in pages kalloc'd once the file system is up, SMEPERPAGE
+// entries to a page. A bitmap with a bit per slot, set while the slot
+// is used, finds free slots a word at a time, starting from the word
+// the last slot came from. All of it is protected by kmem.lock.
+//
+// Swap cache: a page read back from a slot on disk that only one
+// mapping has keeps the slot, as core_map_entry.swapslot, until it is
+// written to. Evicting it while it is still clean just points its
+// mapping back at the slot, with no write. Writes are told by the dirty
+// bit of its page table entry, saved in core_map_entry.dirty when the
+// entry is rebuilt; anything that shares, moves or frees the page lets
+// the slot go first.
+#define SMEPERPAGE (PGSIZE / sizeof(struct swap_map_entry))
+#define SME(i) (&swap_map[(i) / SMEPERPAGE][(i) % SMEPERPAGE])
+
+static struct swap_map_entry *swap_map[MAXSWAPPAGES / SMEPERPAGE + 1];
+static uint swapbits[MAXSWAPPAGES / 32];
+static uint nswap;      // swap slots
+static uint swapcursor; // word of swapbits to search from
+
+// Reverse map: every user page, in core or in swap, keeps a list of the
+// (vspace, va) pairs mapping it, so that swapping the page out or back
+// in visits just those mappings. A vspace takes its entries off as it
+// lets go of its pages; an entry left behind some other way no longer
+// matches its vspace and is dropped the next time its list is walked.
+// A page in a vpi_page that a fork left shared, and that no page table
+// of its holders maps, is named by the vpi_page and its slot instead.
+// The lists are protected by kmem.lock. kfree empties them under that
+// lock, so spare entries wait on rmapfree rather than going back to
+// the slab.
+struct rmap {
+  struct vspace *vs;
+  uint64_t va;           // slot in page, if vs is 0
+  struct vpi_page *page; // if vs is 0, the vpi_page; 0 if the entry is dead
+  struct rmap *next;
+};
+
+static struct slabcache rmapcache;
+static struct rmap *rmapfree;
+static int nrmapfree; // entries on rmapfree
+
+// The range holding pa, or 0 if pa is not in usable memory.
+static struct memrange *pa2range(uint64_t pa) {
+  struct memrange *m;
+
+  for (m = memranges; m < &memranges[nmemranges]; m++)
+    if (pa >= m->start && pa < m->end)
+      return m;
+  return 0;
+}
 
 struct core_map_entry *pa2page(uint64_t pa) {
-  if (PGNUM(pa) >= npages) {
+  struct memrange *m;
+
+  if ((m = pa2range(pa)) == 0) {
     panic("pa2page called with invalid pa");
   }
-  return &core_map[PGNUM(pa)];
+  return &core_map[m->base + ((pa - m->start) >> PT_SHIFT)];
 }
 
 uint64_t page2pa(struct core_map_entry *pp) {
-  return (pp - core_map) << PT_SHIFT;
+  struct memrange *m;
+  int i = pp - core_map;
+
+  for (m = memranges; m < &memranges[nmemranges]; m++)
+    if (i >= m->base && i < m->base + (int)((m->end - m->start) >> PT_SHIFT))
+      return m->start + ((uint64_t)(i - m->base) << PT_SHIFT);
+  panic("page2pa");
 }
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
 // --------------------------------------------------------------
 
+// Takes the usable ranges of the E820 map, as far as the direct map has
+// room for, and counts their pages.
 void detect_memory(void) {
   uint32_t i;
   struct e820_entry *e;
-  size_t mem = 0, mem_max = -KERNBASE;
+  struct memrange *m;
+  uint64_t start, end, mem = 0;
 
   e = e820_map.entries;
   for (i = 0; i != e820_map.nr; ++i, ++e) {
-    if (e->addr >= mem_max)
+    if (e->type != E820_AVAILABLE)
+      continue;
+    start = PGROUNDUP(e->addr);
+    end = min(PGROUNDDOWN(e->addr + e->len), PHYSTOP);
+    if (start >= end)
       continue;
-    mem = max(mem, (size_t)(e->addr + e->len));
+    m = &memranges[nmemranges++];
+    m->start = start;
+    m->end = end;
+    m->base = npages;
+    npages += (end - start) >> PT_SHIFT;
+    mem = max(mem, end);
   }
-
-  // Limit memory to 256MB.
-  mem = min(mem, mem_max);
-  npages = mem / PGSIZE;
-  cprintf("E820: physical memory %dMB\n", mem / 1024 / 1024);
+  cprintf("E820: physical memory %dMB, %dMB usable\n", (int)(mem / 1024 / 1024),
+          npages / (1024 * 1024 / PGSIZE));
 }
 
-void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
 
+// Freed pages are not cleaned: they go on freelist as they are, with
+// junk written over them only in KALLOC_DEBUG builds. The scheduler
+// zeroes some while it has nothing to run, and keeps them on zerolist
+// for kzalloc, so that pages handed out for user memory and page tables
+// are seldom zeroed on the way.
+#define NZEROPAGES 64 // pre-zeroed pages to keep ready
+
 struct {
   struct spinlock lock;
   int use_lock;
+  struct core_map_entry *freelist; // available pages, through next
+  struct core_map_entry *zerolist; // available pages of zeroes
+  int nzero;                       // pages on zerolist
 } kmem;
 
+// Each CPU keeps a few free pages of its own, so that most kallocs and
+// kfrees neither take kmem.lock nor touch the shared list, and a page
+// freed is soon reused while still in the cache. Pages on a magazine
+// are available and count as free. Only the owning CPU touches its
+// magazine, with interrupts off; kallochuge asks the others to put
+// theirs back on the free list by setting drain.
+#define MAGSIZE 16
+
+static struct magazine {
+  int n;
+  int drain; // empty into the free list on the next slow path
+  struct core_map_entry *pages[MAGSIZE];
+} magazines[NCPU];
+
+static struct magazine *mymagazine(void) {
+  return &magazines[mycpu() - cpus];
+}
+
+// Counts n pages going from free to in use, or back if n < 0. The
+// magazine fast paths count without kmem.lock, so every count is atomic.
+static void countpages(int n) {
+  __sync_fetch_and_add(&pages_in_use, n);
+  __sync_fetch_and_sub(&free_pages, n);
+}
+
+// Caller must hold kmem.lock.
+static void freelistpush(struct core_map_entry *r) {
+  r->next = kmem.freelist;
+  r->listed = 1;
+  kmem.freelist = r;
+}
+
+// Empties this CPU's magazine into the free list, if kallochuge asked
+// for it. Returns 1 if it did. Caller must hold kmem.lock.
+static int magdrain(void) {
+  struct magazine *mag = mymagazine();
+
+  if (!mag->drain)
+    return 0;
+  while (mag->n > 0)
+    freelistpush(mag->pages[--mag->n]);
+  mag->drain = 0;
+  return 1;
+}
+
+// kswapd reclaims memory in the background, so that kalloc seldom has
+// to. It is woken once free_pages drops below KSWAPD_LOW, and steals
+// cached file pages or swaps out user pages until KSWAPD_HIGH are free.
+static struct spinlock kswapdlock;
+static int kswapdwanted; // set to wake kswapd; protected by kswapdlock
+static int kswapdstarted;
+
 static void setrand(unsigned int);
+static void rmapdrop(struct rmap **);
+static void swapcachedrop(struct core_map_entry *);
+static void kswapd(void);
+static int freerange(struct memrange *, uint64_t);
 
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
@@ -71,33 +218,59 @@ static void setrand(unsigned int);
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
 void mem_init(void *vstart) {
-  void *vend;
-
-  core_map = vstart;
-  memset(vstart, 0, PGROUNDUP(npages * sizeof(struct core_map_entry)));
-  vstart += PGROUNDUP(npages * sizeof(struct core_map_entry));
-
-  swap_map = vstart;
-  memset(vstart, 0, PGROUNDUP(SWAPPAGES * sizeof(struct swap_map_entry)));
-  vstart += PGROUNDUP(SWAPPAGES * sizeof(struct swap_map_entry));
+  struct memrange *m;
+  uint64_t pa;
+
+  // the core map goes just past the kernel, where the boot page table
+  // maps it; the pages after it are for kalloc
+  pa = PGROUNDUP(V2P(vstart));
+  m = pa2range(pa);
+  if (!m || pa + PGROUNDUP(npages * sizeof(struct core_map_entry)) >
+                min(m->end, SZ_1G))
+    panic("mem_init: no room for the core map");
+  core_map = P2V(pa);
+  pa += PGROUNDUP(npages * sizeof(struct core_map_entry));
 
   initlock(&kmem.lock, "kmem");
+  lockstat(&kmem.lock);
   kmem.use_lock = 0;
+  slabcreate(&rmapcache, "rmap", sizeof(struct rmap), 0);
+  initlock(&kswapdlock, "kswapd");
 
-  vend = (void *)P2V((uint64_t)(npages * PGSIZE));
-  freerange(vstart, vend);
-  free_pages = (vend - vstart) >> PT_SHIFT;
+  // last range first, so that the lowest page is on top
+  free_pages = 0;
+  for (m = &memranges[nmemranges]; m-- > memranges;)
+    free_pages += freerange(m, min(max(m->start, pa), m->end));
   pages_in_use = 0;
   pages_in_swap = 0;
+  num_swap_ins = 0;
+  num_swap_outs = 0;
   kmem.use_lock = 1;
   setrand(1);
+
+  // its reference here keeps it from ever being freed
+  zero_ppn = PGNUM(V2P(kzalloc()));
 }
 
-void freerange(void *vstart, void *vend) {
-  char *p;
-  p = (char *)PGROUNDUP((uint64_t)vstart);
-  for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-    kfree(p);
+// Puts the pages of range m from the one at from on the free list,
+// lowest on top, and returns how many there are. Each core map entry is
+// written once, those of the pages below from zeroed, as the kernel's;
+// the pages themselves are not touched, so boot does not write all of
+// memory on the way. The pages boot allocates, the disk's DMA buffers
+// among them, come out low, below 4GB.
+static int freerange(struct memrange *m, uint64_t from) {
+  struct core_map_entry *first, *free, *last, *r;
+
+  first = &core_map[m->base];
+  free = first + ((from - m->start) >> PT_SHIFT);
+  last = first + ((m->end - m->start) >> PT_SHIFT);
+  memset(first, 0, (char *)free - (char *)first);
+  for (r = last; r-- > free;) {
+    *r = (struct core_map_entry){
+        .available = 1, .listed = 1, .next = kmem.freelist};
+    kmem.freelist = r;
+  }
+  return last - free;
 }
 
 // Free the page of physical memory pointed at by v,
@@ -106,31 +279,63 @@ void freerange(void *vstart, void *vend) {
 // initializing the allocator; see kinit above.)
 void kfree(char *v) {
   struct core_map_entry *r;
+  struct magazine *mag;
 
-  if ((uint64_t)v % PGSIZE || v < _end || V2P(v) >= (uint64_t)(npages * PGSIZE))
+  if ((uint64_t)v % PGSIZE || V2P(v) < V2P(_end) || !pa2range(V2P(v)))
     panic("kfree");
 
+  r = (struct core_map_entry *)pa2page(V2P(v));
+
+  // Fast path: the last reference, and room on this CPU's magazine.
+  // No one else holds the page, so no one can be changing its count.
+  if (kmem.use_lock && r->ref == 1 && r->rmap == 0 && r->swapslot == 0) {
+    pushcli();
+    mag = mymagazine();
+    if (mag->n < MAGSIZE && !mag->drain) {
+      if (KALLOC_DEBUG)
+        memset(v, 2, PGSIZE);
+      r->available = 1;
+      r->user = 0;
+      r->va = 0;
+      r->ref = 0;
+      r->pcache = 0;
+      r->accessed = 0;
+      r->huge = 0;
+      mag->pages[mag->n++] = r;
+      countpages(-1);
+      popcli();
+      return;
+    }
+    popcli();
+  }
+
   if (kmem.use_lock)
     acquire(&kmem.lock);
 
-  r = (struct core_map_entry *)pa2page(V2P(v));
-
   r->ref--;
   if (kmem.use_lock == 0 || r->ref == 0) {
-    pages_in_use--;
-    free_pages++;
+    countpages(-1);
 
     // Fill with junk to catch dangling refs.
-    memset(v, 2, PGSIZE);
+    if (KALLOC_DEBUG)
+      memset(v, 2, PGSIZE);
 
     r->available = 1;
     r->user = 0;
     r->va = 0;
     r->ref = 0;
+    r->pcache = 0;
+    r->accessed = 0;
+    r->huge = 0;
+    rmapdrop(&r->rmap);
+    swapcachedrop(r);
+    freelistpush(r);
   }
 
-  if (kmem.use_lock)
+  if (kmem.use_lock) {
+    magdrain();
     release(&kmem.lock);
+  }
 }
 
 void
@@ -143,6 +348,18 @@ mark_user_mem(uint64_t pa, uint64_t va)
   r->va = va;
 }
 
+// Marks the 2MB page at pa as mapped whole, or no longer, by setting
+// or clearing huge in each of its pages.
+void
+mark_huge_mem(uint64_t pa, int huge)
+{
+  struct core_map_entry *r = pa2page(pa);
+  uint i;
+
+  for (i = 0; i < PTRS_PER_PT; i++)
+    r[i].huge = huge;
+}
+
 void
 mark_kernel_mem(uint64_t pa)
 {
@@ -153,98 +370,879 @@ mark_kernel_mem(uint64_t pa)
   r->va = 0;
 }
 
-char* evictpage(int iskalloc) {
-  struct core_map_entry* cme;
-  char* addr;
-  uint swap_idx;
+// Set up n swap slots, all free, and start kswapd to fill them.
+// Called once the superblock is read.
+void swapinit(uint n) {
+  uint i;
+
+  if (n > MAXSWAPPAGES)
+    n = MAXSWAPPAGES;
+  for (i = 0; i < n; i += SMEPERPAGE) {
+    if ((swap_map[i / SMEPERPAGE] = (struct swap_map_entry *)kalloc()) == 0)
+      panic("swapinit");
+    memset(swap_map[i / SMEPERPAGE], 0, PGSIZE);
+  }
+  // slots past the end look used, so no search hands them out
+  for (i = n; i % 32 != 0; i++)
+    swapbits[i / 32] |= 1U << (i % 32);
+  nswap = n;
 
-  if (kmem.use_lock ) {
+  kthread("kswapd", kswapd);
+  kswapdstarted = 1;
+}
+
+// Claim a free swap slot and return its index, or -1 if swap is full.
+// Caller must hold kmem.lock.
+static int swapalloc(void) {
+  uint i, w, nwords = (nswap + 31) / 32;
+
+  for (i = 0; i < nwords; i++) {
+    w = (swapcursor + i) % nwords;
+    if (swapbits[w] != ~0U) {
+      swapcursor = w;
+      i = __builtin_ctz(~swapbits[w]);
+      swapbits[w] |= 1U << i;
+      return w * 32 + i;
+    }
+  }
+  return -1;
+}
+
+// Claim n free swap slots in a row and return the first, or -1 if
+// there is no such run. Caller must hold kmem.lock.
+static int swapallocn(int n) {
+  uint i, k, start = 0;
+  int run = 0;
+
+  if (n == 1)
+    return swapalloc();
+  for (k = 0; k < nswap; k++) {
+    i = (swapcursor * 32 + k) % nswap;
+    // runs do not wrap around the end of swap
+    if (i == 0)
+      run = 0;
+    if (swapbits[i / 32] & (1U << (i % 32))) {
+      run = 0;
+      continue;
+    }
+    if (run++ == 0)
+      start = i;
+    if (run == n) {
+      for (i = start; i < start + n; i++)
+        swapbits[i / 32] |= 1U << (i % 32);
+      swapcursor = start / 32;
+      return start;
+    }
+  }
+  return -1;
+}
+
+// Mark swap slot i free. Caller must hold kmem.lock.
+static void swapput(uint i) {
+  swapbits[i / 32] &= ~(1U << (i % 32));
+}
+
+// Frees swap slot swap_idx, which nothing refers to any more. Returns
+// its copy in the zswap pool, if it has one, for the caller to free once
+// it has released kmem.lock. Caller must hold kmem.lock.
+static char *swapdrop(uint swap_idx, ushort *zlen) {
+  struct swap_map_entry *sme = SME(swap_idx);
+  char *z = sme->zdata;
+
+  sme->used = 0;
+  rmapdrop(&sme->rmap);
+  *zlen = sme->zlen;
+  sme->zdata = 0;
+  swapput(swap_idx);
+  pages_in_swap--;
+  return z;
+}
+
+// Lets go of the swap slot still holding a copy of the page at cme, if
+// there is one: the page is changing hands or going.
+// Caller must hold kmem.lock.
+static void swapcachedrop(struct core_map_entry *cme) {
+  if (cme->swapslot) {
+    swapput(cme->swapslot - 1);
+    cme->swapslot = 0;
+    swap_cached--;
+  }
+  cme->dirty = 0;
+}
+
+// Is the page at cme unchanged since it was read from its swap slot?
+// Caller must hold kmem.lock.
+static int swapcacheclean(struct core_map_entry *cme) {
+  struct rmap *e;
+
+  if (!cme->swapslot || cme->dirty)
+    return 0;
+  for (e = cme->rmap; e; e = e->next)
+    if (e->vs && vspacetestdirty(PGNUM(page2pa(cme)), e->va, e->vs))
+      return 0;
+  return 1;
+}
+
+// Adds (vs, va) to the list at l, unless it is there already.
+// Returns 0, or -1 if there is no memory for the entry.
+static int rmapinsert(struct rmap **l, struct vspace *vs, uint64_t va) {
+  struct rmap *e, *spare = 0;
+
+  for (;;) {
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    for (e = *l; e; e = e->next)
+      if (e->vs == vs && e->va == va)
+        break;
+    if (e || spare || rmapfree)
+      break;
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    // the slab may need a page, and kalloc takes kmem.lock
+    if ((spare = slaballoc(&rmapcache)) == 0)
+      return -1;
+  }
+
+  if (!spare) {
+    spare = rmapfree;
+    rmapfree = spare->next;
+    nrmapfree--;
+  }
+  if (e) {
+    spare->next = rmapfree;
+    rmapfree = spare;
+    nrmapfree++;
+  } else {
+    spare->vs = vs;
+    spare->va = va;
+    spare->page = 0;
+    spare->next = *l;
+    *l = spare;
+  }
+
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return 0;
+}
+
+// Takes (vs, va), or every dead entry if vs is 0, off the list at l.
+// Caller must hold kmem.lock.
+static void rmapremove(struct rmap **l, struct vspace *vs, uint64_t va) {
+  struct rmap *e;
+
+  while ((e = *l) != 0) {
+    if (e->vs == vs && (vs ? e->va == va : !e->page)) {
+      *l = e->next;
+      e->next = rmapfree;
+      rmapfree = e;
+      nrmapfree++;
+    } else {
+      l = &e->next;
+    }
+  }
+}
+
+// Empties the list at l. Caller must hold kmem.lock.
+static void rmapdrop(struct rmap **l) {
+  struct rmap *e;
+
+  while ((e = *l) != 0) {
+    *l = e->next;
+    e->next = rmapfree;
+    rmapfree = e;
+    nrmapfree++;
+  }
+}
+
+// Records that vs maps physical page ppn at va.
+// The zero page is never swapped out, so its mappings go unrecorded.
+int rmapadd(uint64_t ppn, struct vspace *vs, uint64_t va) {
+  if (ppn == zero_ppn)
+    return 0;
+  return rmapinsert(&pa2page(ppn << PT_SHIFT)->rmap, vs, va);
+}
+
+// Records that vs maps the page in swap slot swap_idx at va.
+int rmapaddswap(uint swap_idx, struct vspace *vs, uint64_t va) {
+  return rmapinsert(&SME(swap_idx)->rmap, vs, va);
+}
+
+// Copies the n vpage_infos at src to dst, and takes a further reference
+// on each used page, in core or in swap, for vs mapping it through dst
+// at va, va + step, ... It is increment_cme_ref or increment_sme_ref and
+// rmapadd for each, under one hold of kmem.lock. vs must not map any of
+// them yet, as when it is being copied into. If vs is 0, the new entries
+// name slots 0, 1, ... of the vpi_page page instead, src being its infos.
+// Returns 0, or -1 if there is no memory for the reverse map entries.
+int pagedupn(struct vpage_info *dst, struct vpage_info *src, int n,
+             struct vspace *vs, uint64_t va, int64_t step,
+             struct vpi_page *page) {
+  struct core_map_entry *cme;
+  struct swap_map_entry *sme;
+  struct rmap *e, **l;
+  struct vpage_info *vpi = dst;
+  int i, need = 0;
+
+  for (i = 0; i < n; i++)
+    if (src[i].used)
+      need++;
+
+  // every page may need an entry; the slab may need a page
+  for (;;) {
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    if (nrmapfree >= need)
+      break;
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    if ((e = slaballoc(&rmapcache)) == 0)
+      return -1;
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    e->next = rmapfree;
+    rmapfree = e;
+    nrmapfree++;
+    if (kmem.use_lock)
+      release(&kmem.lock);
+  }
+
+  // copied under the lock, so that the copy agrees with the references
+  memmove(dst, src, n * sizeof(*dst));
+  for (i = 0; i < n; i++, va += step) {
+    if (!vpi[i].used)
+      continue;
+    if (vpi[i].swapped) {
+      sme = SME(vpi[i].swap_index);
+      assert(sme->used && sme->ref > 0);
+      sme->ref++;
+      l = &sme->rmap;
+    } else {
+      cme = pa2page(vpi[i].ppn << PT_SHIFT);
+      assert(!cme->available && cme->ref > 0);
+      cme->ref++;
+      swapcachedrop(cme);
+      if (vpi[i].ppn == zero_ppn)
+        continue;
+      l = &cme->rmap;
+    }
+    e = rmapfree;
+    rmapfree = e->next;
+    nrmapfree--;
+    e->vs = vs;
+    e->va = vs ? va : i;
+    e->page = vs ? 0 : page;
+    e->next = *l;
+    *l = e;
+  }
+
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return 0;
+}
+
+// Moves the reverse map entries of the used pages of the n vpage_infos
+// at vpi from (from, va), (from, va + step), ... to the same addresses in
+// to, for a vspace that is moving to another place in memory. If from or
+// to is 0, that side is slots 0, 1, ... of the vpi_page page, vpi being
+// its infos, for a vpi_page a fork shared changing hands.
+void rmapmoven(struct vpage_info *vpi, int n, struct vspace *from,
+               struct vspace *to, uint64_t va, int64_t step,
+               struct vpi_page *page) {
+  struct rmap *e, *l;
+  int i;
+
+  if (kmem.use_lock)
     acquire(&kmem.lock);
+  for (i = 0; i < n; i++, va += step) {
+    if (!vpi[i].used)
+      continue;
+    if (vpi[i].swapped) {
+      l = SME(vpi[i].swap_index)->rmap;
+    } else if (vpi[i].ppn != zero_ppn) {
+      // the new page table entries start clean
+      swapcachedrop(pa2page(vpi[i].ppn << PT_SHIFT));
+      l = pa2page(vpi[i].ppn << PT_SHIFT)->rmap;
+    } else {
+      continue;
+    }
+    for (e = l; e; e = e->next) {
+      if (from ? e->vs != from || e->va != va
+               : e->vs || e->page != page || e->va != i)
+        continue;
+      e->vs = to;
+      e->va = to ? va : i;
+      e->page = to ? 0 : page;
+    }
+  }
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Forgets that vs maps physical page ppn at va.
+void rmapdel(uint64_t ppn, struct vspace *vs, uint64_t va) {
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  rmapremove(&pa2page(ppn << PT_SHIFT)->rmap, vs, va);
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Takes back the user page ppn, which only vs maps, at va, as a kernel
+// page: its reverse map goes, and it is no longer evictable. The caller
+// is to change the mapping. Returns 0, or -1 if the page is shared, or
+// on its way out to the swap region.
+int takeuserpage(uint64_t ppn, struct vspace *vs, uint64_t va) {
+  struct core_map_entry *cme = pa2page(ppn << PT_SHIFT);
+  int r = -1;
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  if (cme->va != 0 && cme->ref == 1 && !cme->pcache && !cme->huge &&
+      cme->rmap && cme->rmap->vs == vs && cme->rmap->va == va &&
+      !cme->rmap->next) {
+    rmapdrop(&cme->rmap);
+    swapcachedrop(cme);
+    cme->va = 0;
+    cme->user = 0;
+    cme->accessed = 0;
+    r = 0;
+  }
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return r;
+}
+
+// Forgets that vs maps the page in swap slot swap_idx at va.
+void rmapdelswap(uint swap_idx, struct vspace *vs, uint64_t va) {
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  rmapremove(&SME(swap_idx)->rmap, vs, va);
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Tests and clears the accessed bit of the page at cme in every page
+// table mapping it. Returns whether any of them had it set.
+// Caller must hold kmem.lock.
+static int pageaccessed(struct core_map_entry *cme) {
+  struct rmap *e;
+  int used = 0;
+
+  for (e = cme->rmap; e; e = e->next)
+    if (e->vs && vspacetestaccessed(PGNUM(page2pa(cme)), e->va, e->vs))
+      used = 1;
+  return used;
+}
+
+// Points the mappings of page ppn, now in swap slot swap_idx, at the slot.
+// Marking a mapping takes its vspace's lock, which comes before kmem.lock,
+// so the list is walked unlocked and stale entries are dropped after.
+static void markswapped(uint64_t ppn, uint swap_idx) {
+  struct swap_map_entry *sme = SME(swap_idx);
+  struct rmap *e;
+
+  for (e = sme->rmap; e; e = e->next) {
+    if (!vspacemarkswapped(ppn, swap_idx, e->va, e->vs, e->page)) {
+      e->vs = 0;
+      e->page = 0;
+    }
   }
 
-  // pick a randome user page to evict
-  cme = get_random_user_page();
-  while (PGNUM(page2pa(cme)) == cow_ppn || PGNUM(page2pa(cme)) == 0 || cme->available) {
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  rmapremove(&sme->rmap, 0, 0);
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Points the mappings of swap slot swap_idx, now read into page ppn, at
+// the page, each taking its reference from the slot to the page.
+static void updatecowreferences(uint64_t ppn, uint swap_idx) {
+  struct core_map_entry *cme = pa2page(ppn << PT_SHIFT);
+  struct rmap *e;
+
+  for (e = cme->rmap; e; e = e->next) {
+    if (!vspaceupdatecow(ppn, swap_idx, e->va, e->vs, e->page)) {
+      e->vs = 0;
+      e->page = 0;
+      continue;
+    }
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    cme->ref++;
+    SME(swap_idx)->ref--;
+    if (kmem.use_lock)
+      release(&kmem.lock);
+  }
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  rmapremove(&cme->rmap, 0, 0);
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// whether the page at cme may be swapped out; the page cache owns its
+// pages, ppage_copy is copying cow_ppn, the zero page stays put, and a
+// 2MB page goes out only once split
+static int evictable(struct core_map_entry *cme) {
+  uint64_t ppn = PGNUM(page2pa(cme));
+
+  return cme->va != 0 && ppn != cow_ppn && ppn != zero_ppn && ppn != 0 &&
+         !cme->available &&
+         !cme->pcache && !cme->huge;
+}
+
+// Takes a reference to the i'th page of memory if it is a user page
+// that same-page merging may share: mapped at one place only, and not
+// copied to swap. Returns its page number and the place, or 0.
+uint64_t ksmpage(int i, struct vspace **vs, uint64_t *va) {
+  struct core_map_entry *cme = &core_map[i];
+  uint64_t ppn = 0;
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  if (evictable(cme) && cme->ref == 1 && cme->rmap && !cme->rmap->next &&
+      cme->rmap->vs && !cme->swapslot) {
+    cme->ref++;
+    *vs = cme->rmap->vs;
+    *va = cme->rmap->va;
+    ppn = PGNUM(page2pa(cme));
+  }
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return ppn;
+}
+
+// Takes a reference to page ppn, a page ksmpage gave out earlier, if it
+// is still a user page same-page merging may share. Returns 0, or -1.
+int ksmhold(uint64_t ppn) {
+  struct core_map_entry *cme = pa2page(ppn << PT_SHIFT);
+  int r = -1;
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  if (evictable(cme) && cme->ref > 0) {
+    cme->ref++;
+    // more than one mapping will share it
+    swapcachedrop(cme);
+    r = 0;
+  }
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return r;
+}
+
+// whether a vspace mapping the page at cme has more pages in memory than
+// its limit. Caller must hold kmem.lock.
+static int overlimit(struct core_map_entry *cme) {
+  struct rmap *e;
+
+  for (e = cme->rmap; e; e = e->next)
+    if (e->vs && e->vs->memlimit && e->vs->rss > e->vs->memlimit)
+      return 1;
+  return 0;
+}
+
+static struct core_map_entry *randomvictim(void) {
+  struct core_map_entry *cme;
+  // a page over a limit if one turns up soon
+  int tries = vspaceoverlimit() ? npages : 0;
+
+  do {
     cme = get_random_user_page();
+  } while (!evictable(cme) || (tries-- > 0 && !overlimit(cme)));
+  return cme;
+}
+
+static int clockhand;
+
+// Second chance: sweep the core map, taking the first evictable page
+// not used since the hand last passed it. Use is the accessed bit of
+// every page table mapping the page, cleared as the hand goes by.
+// While some vspace is over its limit, the first two sweeps take only
+// pages it maps. Returns 0 if there is no evictable page.
+static struct core_map_entry *clockvictim(void) {
+  struct core_map_entry *cme;
+  int n, used, over = vspaceoverlimit();
+
+  // the first sweep may do nothing but clear accessed bits
+  for (n = 0; n < (over ? 4 : 2) * npages; n++) {
+    cme = &core_map[clockhand];
+    clockhand = (clockhand + 1) % npages;
+    if (!evictable(cme) || (over && n < 2 * npages && !overlimit(cme)))
+      continue;
+    used = pageaccessed(cme);
+    if (used || cme->accessed) {
+      cme->accessed = 0;
+      continue;
+    }
+    return cme;
   }
-  assert(cme->ref > 0);
-  addr = P2V(page2pa(cme));
-
-  // find a free swap region page
-  for (swap_idx = 0; swap_idx < SWAPPAGES; swap_idx++) {
-    if (swap_map[swap_idx].used == 0) {
-      swap_map[swap_idx].used = 1;
-      swap_map[swap_idx].ref = cme->ref;
-      swap_map[swap_idx].va = cme->va;
-      pages_in_swap++;
+  return 0;
+}
+
+static struct core_map_entry *(*pickvictim)(void) =
+    EVICT_CLOCK ? clockvictim : randomvictim;
+
+// Gathers into cl the victim cme and the pages after it in the one
+// vspace that maps it, as long as they are as good to evict: cold and
+// mapped only there. They go to swap together in adjacent slots, so
+// sequential access brings them back together too.
+// Returns how many pages there are. Caller must hold kmem.lock.
+static int swapcluster(struct core_map_entry *cme, struct core_map_entry **cl) {
+  struct core_map_entry *c;
+  struct rmap *e = cme->rmap;
+  uint64_t ppn, va;
+  int n;
+
+  cl[0] = cme;
+  if (cme->ref != 1 || !e || e->next || !e->vs)
+    return 1;
+
+  for (n = 1; n < SWAPCLUSTER; n++) {
+    va = e->va + n * PGSIZE;
+    if (!vspacepresent(e->vs, va, &ppn) || !pa2range(ppn << PT_SHIFT))
+      break;
+    c = pa2page(ppn << PT_SHIFT);
+    if (!evictable(c) || c->ref != 1 || c->accessed || c->swapslot || !c->rmap ||
+        c->rmap->next || c->rmap->vs != e->vs || c->rmap->va != va)
+      break;
+    if (vspacetestaccessed(ppn, va, e->vs)) {
+      // keep the bit for the clock hand to find
+      c->accessed = 1;
       break;
     }
+    cl[n] = c;
+  }
+  return n;
+}
+
+char* evictpage(int iskalloc) {
+  struct core_map_entry *cme, *cl[SWAPCLUSTER];
+  struct swap_map_entry *sme;
+  char *pages[SWAPCLUSTER], *z[SWAPCLUSTER];
+  ushort zlen[SWAPCLUSTER];
+  int swap_idx, n, i, j, cached;
+
+  if (kmem.use_lock ) {
+    acquire(&kmem.lock);
   }
 
-  // if no free swap page
-  if (swap_idx == SWAPPAGES) {
+  if ((cme = pickvictim()) == 0) {
     if (kmem.use_lock)
       release(&kmem.lock);
     return 0;
   }
+  assert(cme->ref > 0);
 
-  if (iskalloc) {
-    // set up kalloc memory
-    cme->ref = 1;
-    assert(cme->available = 0);
+  // a clean page goes back to the slot it came from, unwritten
+  cached = swapcacheclean(cme);
+  if (cached) {
+    cl[0] = cme;
+    n = 1;
+    swap_idx = cme->swapslot - 1;
+    cme->swapslot = 0;
+    swap_cached--;
+    swap_reused++;
   } else {
-    // set up free page
-    cme->available = 1;
-    cme->ref = 0;
-    pages_in_use--;
-    free_pages++;
+    swapcachedrop(cme);
+    // find free swap region pages in a row, fewer if need be
+    n = swapcluster(cme, cl);
+    while ((swap_idx = swapallocn(n)) == -1 && n > 1)
+      n--;
+    if (swap_idx == -1) {
+      if (kmem.use_lock)
+        release(&kmem.lock);
+      return 0;
+    }
+  }
+  traceevent(TR_EVICT, TR_BEGIN, n);
+
+  for (i = 0; i < n; i++) {
+    sme = SME(swap_idx + i);
+    sme->used = 1;
+    sme->ref = cl[i]->ref;
+    sme->va = cl[i]->va;
+    sme->rmap = cl[i]->rmap;
+    sme->busy = 1;
+    cl[i]->rmap = 0;
+    // no longer evictable, while the write goes on
+    cl[i]->va = 0;
+    cl[i]->accessed = 0;
+    pages[i] = P2V(page2pa(cl[i]));
+    pages_in_swap++;
+  }
+
+  if (kmem.use_lock)
+    release(&kmem.lock);
+
+  // update vpage_infos first, so that nothing writes to a page after
+  // it has gone to the disk
+  for (i = 0; i < n; i++)
+    markswapped(PGNUM(page2pa(cl[i])), swap_idx + i);
+  num_swap_outs += n;
+
+  // also flushes the accessed bits the clock cleared from the TLB
+  vspaceflush(myproc()->vspace);
+
+  // pages that compress keep to memory; write the rest into the swap
+  // region, in runs of adjacent slots
+  for (i = 0; i < n; i++)
+    z[i] = cached ? 0 : zswapstore(pages[i], &zlen[i]);
+  for (i = cached ? n : 0; i < n; i = j + 1) {
+    for (j = i; j < n && !z[j]; j++)
+      ;
+    if (j > i)
+      swapwriten(swapdev, swap_idx + i, pages + i, j - i);
   }
-  cme->user = 0;
-  cme->va = 0;
 
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  for (i = 0; i < n; i++) {
+    sme = SME(swap_idx + i);
+    sme->zdata = z[i];
+    sme->zlen = z[i] ? zlen[i] : 0;
+    sme->busy = 0;
+    // every mapping may have let go meanwhile
+    z[i] = sme->ref == 0 ? swapdrop(swap_idx + i, &zlen[i]) : 0;
+    cl[i]->user = 0;
+    if (i == 0 && iskalloc) {
+      // set up kalloc memory
+      cl[i]->ref = 1;
+      assert(cl[i]->available == 0);
+    } else {
+      // set up free page
+      cl[i]->available = 1;
+      cl[i]->ref = 0;
+      countpages(-1);
+      freelistpush(cl[i]);
+    }
+  }
   if (kmem.use_lock)
     release(&kmem.lock);
+  for (i = 0; i < n; i++)
+    if (z[i])
+      zswapfree(z[i], zlen[i]);
+  traceevent(TR_EVICT, TR_END, n);
+
+  return pages[0];
+}
+
+// Wakes kswapd if free memory has run low. kswapd sleeps and is woken
+// through the process table, which is locked before kmem.lock, so the
+// wakeup is left to a later kalloc if this one holds kmem.lock.
+static void kswapdpoke(void) {
+  if (free_pages >= KSWAPD_LOW || !kswapdstarted || kswapdwanted ||
+      holding(&kmem.lock))
+    return;
+  acquire(&kswapdlock);
+  kswapdwanted = 1;
+  wakeup(&kswapdwanted);
+  release(&kswapdlock);
+}
+
+// Hands out the free page r, off every list now.
+static char *takepage(struct core_map_entry *r) {
+  r->available = 0;
+  r->ref = 1;
+  r->user = 0;
+  r->va = 0;
+  r->accessed = 0;
+  r->next = 0;
+  r->listed = 0;
+  countpages(1);
+  kswapdpoke();
+  return P2V(page2pa(r));
+}
+
+// Allocates 2MB of zeroed memory on a 2MB boundary, for a 2MB page.
+// Each of its pages is allocated as by kalloc and freed by kfree in
+// the usual way. Returns 0 if there is no such run of free pages, or
+// memory is too short to spend one.
+//
+// Only pages on the free lists are taken. A free page can also be on
+// another CPU's magazine, or off the lists while kzeroidle zeroes it;
+// the other magazines are asked to drain, for the next try.
+char *kallochuge(void) {
+  struct core_map_entry *r, **l;
+  struct magazine *mag;
+  struct memrange *m;
+  uint64_t i, j, pa;
+  int c;
+
+  // the search and the list walks are long, and the memory is better
+  // left for the many when it is short
+  if (!kmem.use_lock || free_pages < HUGEMINFREE)
+    return 0;
 
-  // write the data into swap region
-  swapwrite(ROOTDEV, swap_idx, addr);
+  acquire(&kmem.lock);
+  // pages on this CPU's magazine are free too
+  mag = mymagazine();
+  while (mag->n > 0)
+    freelistpush(mag->pages[--mag->n]);
+  for (c = 0; c < ncpu; c++)
+    if (&magazines[c] != mag && magazines[c].n > 0)
+      magazines[c].drain = 1;
+
+  // a 2MB boundary in a range, with the 2MB after it free
+  for (m = memranges; m < &memranges[nmemranges]; m++) {
+    for (pa = (m->start + PD_SIZE - 1) & ~(PD_SIZE - 1); pa + PD_SIZE <= m->end;
+         pa += PD_SIZE) {
+      i = m->base + ((pa - m->start) >> PT_SHIFT);
+      for (j = 0; j < PTRS_PER_PT && core_map[i + j].listed; j++)
+        ;
+      if (j == PTRS_PER_PT)
+        goto found;
+    }
+  }
+  release(&kmem.lock);
+  return 0;
 
-  // update vpage_infos
-  markswapped(PGNUM(page2pa(cme)), swap_idx, swap_map[swap_idx].va);
+found:
+  // take the run off the free lists
+  for (l = &kmem.freelist; (r = *l) != 0;)
+    if (r >= &core_map[i] && r < &core_map[i + PTRS_PER_PT])
+      *l = r->next;
+    else
+      l = &r->next;
+  for (l = &kmem.zerolist; (r = *l) != 0;)
+    if (r >= &core_map[i] && r < &core_map[i + PTRS_PER_PT]) {
+      *l = r->next;
+      kmem.nzero--;
+    } else {
+      l = &r->next;
+    }
 
-  vspaceinstall(myproc());
+  for (j = 0; j < PTRS_PER_PT; j++) {
+    r = &core_map[i + j];
+    r->available = 0;
+    r->listed = 0;
+    r->ref = 1;
+    r->user = 0;
+    r->va = 0;
+    r->accessed = 0;
+    r->next = 0;
+  }
+  countpages(PTRS_PER_PT);
+  release(&kmem.lock);
+  kswapdpoke();
 
-  return addr;
+  memset(P2V(pa), 0, PD_SIZE);
+  return P2V(pa);
 }
 
 char *kalloc(void) {
-  int i;
   short lockacquired = 0;
+  int drained;
+  struct core_map_entry *r = 0;
+  struct magazine *mag;
+  char *page;
 
-  if (kmem.use_lock && !holding(&kmem.lock)) {
-    acquire(&kmem.lock);
-    lockacquired = 1;
+  if (kmem.use_lock) {
+    pushcli();
+    mag = mymagazine();
+    if (mag->n > 0 && !mag->drain)
+      r = mag->pages[--mag->n];
+    popcli();
   }
 
-  for (i = 0; i < npages; i++) {
-    if (core_map[i].available == 1) {
-      core_map[i].available = 0;
-      core_map[i].ref = 1;
-      core_map[i].user = 0;
-      core_map[i].va = 0;
-      if (lockacquired && kmem.use_lock)
-        release(&kmem.lock);
-      pages_in_use++;
-      free_pages--;
-      return P2V(page2pa(&core_map[i]));
+  if (!r) {
+    if (kmem.use_lock && !holding(&kmem.lock)) {
+      acquire(&kmem.lock);
+      lockacquired = 1;
+    }
+
+    drained = kmem.use_lock && magdrain();
+    if ((r = kmem.freelist) != 0) {
+      kmem.freelist = r->next;
+      // restock the magazine while we are here, for the next few,
+      // unless it was just drained for kallochuge
+      if (kmem.use_lock && !drained) {
+        mag = mymagazine();
+        while (mag->n < MAGSIZE / 2 && kmem.freelist) {
+          mag->pages[mag->n++] = kmem.freelist;
+          kmem.freelist->listed = 0;
+          kmem.freelist = kmem.freelist->next;
+        }
+      }
+    } else if ((r = kmem.zerolist) != 0) {
+      kmem.zerolist = r->next;
+      kmem.nzero--;
+    }
+    // taken while kmem.lock is held, so kallochuge cannot count it free
+    if (r) {
+      r->listed = 0;
+      r->available = 0;
     }
+
+    if (lockacquired && kmem.use_lock)
+      release(&kmem.lock);
   }
 
-  if (lockacquired && kmem.use_lock)
-    release(&kmem.lock);
+  if (r)
+    return takepage(r);
 
+  // cached file pages are cheaper to give up than user pages
+  if ((page = pcsteal()) != 0)
+    return page;
   return evictpage(1);
 }
 
+// Allocates a page of zeroes, pre-zeroed if there is one.
+char *kzalloc(void) {
+  struct core_map_entry *r;
+  short lockacquired = 0;
+  char *page;
+
+  if (kmem.use_lock && !holding(&kmem.lock)) {
+    acquire(&kmem.lock);
+    lockacquired = 1;
+  }
+  if ((r = kmem.zerolist) != 0) {
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+    // taken while kmem.lock is held, so kallochuge cannot count it free
+    r->listed = 0;
+    r->available = 0;
+  }
+  if (lockacquired)
+    release(&kmem.lock);
+
+  if (r)
+    return takepage(r);
+  if ((page = kalloc()) != 0)
+    memset(page, 0, PGSIZE);
+  return page;
+}
+
+// Zeroes a free page for kzalloc, while the CPU has nothing better to
+// do. Called by the scheduler when it finds nothing to run.
+// Returns 1 if it zeroed one, 0 if there was none to zero.
+int kzeroidle(void) {
+  struct core_map_entry *r;
+
+  acquire(&kmem.lock);
+  if (kmem.nzero >= NZEROPAGES || (r = kmem.freelist) == 0) {
+    release(&kmem.lock);
+    return 0;
+  }
+  // off both lists while it is zeroed, though still free
+  kmem.freelist = r->next;
+  r->listed = 0;
+  release(&kmem.lock);
+
+  memset(P2V(page2pa(r)), 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  r->listed = 1;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+  return 1;
+}
+
 
 // Increments the reference count for a given physical page
 void increment_cme_ref(uint64_t ppn) {
@@ -264,7 +1262,7 @@ void increment_sme_ref(uint swap_idx) {
   if (kmem.use_lock) {
     acquire(&kmem.lock);
   }
-  struct swap_map_entry *sme = &swap_map[swap_idx];
+  struct swap_map_entry *sme = SME(swap_idx);
   assert(sme->used && sme->ref > 0);
   sme->ref++;
   if (kmem.use_lock) {
@@ -272,24 +1270,30 @@ void increment_sme_ref(uint swap_idx) {
   }
 }
 
-// Decrement the reference count of a given swapped page
+// Decrement the reference count of a given swapped page. A slot on its
+// way out or back in is freed by whoever is moving it, once done.
 void swapfree(uint swap_idx) {
+  char *z = 0;
+  ushort zlen = 0;
+
   if (kmem.use_lock) {
     acquire(&kmem.lock);
   }
-  struct swap_map_entry *sme = &swap_map[swap_idx];
+  struct swap_map_entry *sme = SME(swap_idx);
   assert(sme->used && sme->ref > 0);
   sme->ref--;
 
   // free the page
-  if (sme->ref == 0) {
-    sme->used = 0;
-    pages_in_swap--;
-  }
+  if (sme->ref == 0 && !sme->busy)
+    z = swapdrop(swap_idx, &zlen);
 
   if (kmem.use_lock) {
     release(&kmem.lock);
   }
+
+  // the slab may give a page back to kfree
+  if (z)
+    zswapfree(z, zlen);
 }
 
 // allocate and copy the page data when ref count is larger than 1
@@ -306,13 +1310,14 @@ int ppage_copy(uint64_t* ppn_ptr) {
   assert(cme->ref != 0);
   if (cme->ref > 1) {
     cow_ppn = ppn;
-    if (!(data = kalloc())) {
+    if (!(data = ppn == zero_ppn ? kzalloc() : kalloc())) {
       if (kmem.use_lock) {
         release(&kmem.lock);
       }
       return -1;
     }
-    memmove(data, P2V(ppn << PT_SHIFT), PGSIZE);
+    if (ppn != zero_ppn)
+      memmove(data, P2V(ppn << PT_SHIFT), PGSIZE);
     cme->ref--;
     *ppn_ptr = PGNUM(V2P(data));
   }
@@ -323,59 +1328,172 @@ int ppage_copy(uint64_t* ppn_ptr) {
   return 0;
 }
 
+// Reads swap slot swap_idx back into memory, and the used slots after
+// it too while there are free pages for them: a cluster swapped out
+// together is likely wanted together. Every mapping of each page is
+// pointed at it. The slots stay used, and busy, until then, so the
+// mappings may still let go of them meanwhile; and each page keeps the
+// reference kalloc gave it, so it stays this one's until the end.
+// Returns 0, or -1 if there is no page for swap_idx.
 int swappage_copy(uint swap_idx) {
   struct core_map_entry *cme;
   struct swap_map_entry *swe;
-  char *mem;
-  uint64_t ppn;
+  char *pages[SWAPCLUSTER], *z[SWAPCLUSTER];
+  ushort zlen[SWAPCLUSTER];
+  uint64_t va[SWAPCLUSTER];
+  int i, j, n;
+
+  // Allocate new pages; kalloc may have to swap something out for
+  // the first, but the others come only from free memory
+  if (!(pages[0] = kalloc()))
+    return -1;
+  for (n = 1; n < SWAPCLUSTER && swap_idx + n < nswap; n++) {
+    if (free_pages <= SWAPCLUSTER || !SME(swap_idx + n)->used)
+      break;
+    if (!(pages[n] = kalloc()))
+      break;
+  }
 
   if (kmem.use_lock) {
     acquire(&kmem.lock);
   }
 
-  // Allocate a new page
-  if (!(mem = kalloc())) {
-    return -1;
+  // the page may still be on its way out, or in for another sharer
+  while (SME(swap_idx)->busy && kmem.use_lock) {
+    release(&kmem.lock);
+    yield();
+    acquire(&kmem.lock);
   }
 
-  // Get the new ppn and the core map entry associated with it
-  ppn = PGNUM(V2P(mem));
-  cme = pa2page(V2P(mem));
-
-  // Update the core map entry with the fields of the swap_map_entry
-  swe = &(swap_map[swap_idx]);
-  assert(swe->used == 1);
-  assert(swe->ref > 0);
-  assert(swe->va != 0);
+  for (i = 0; i < n; i++) {
+    swe = SME(swap_idx + i);
+    if (!swe->used || swe->busy) {
+      // freed, or swapped in or out by someone else, meanwhile. If that
+      // is the faulting page, the fault is retried.
+      break;
+    }
+    assert(swe->ref > 0);
+    assert(swe->va != 0);
+    swe->busy = 1;
+    va[i] = swe->va;
+    z[i] = swe->zdata;
+    zlen[i] = swe->zlen;
+  }
+  num_swap_ins += i;
 
-  cme->user = 1;
-  cme->ref = swe->ref;
-  cme->va = swe->va;
+  if (kmem.use_lock) {
+    release(&kmem.lock);
+  }
 
-  swe->used = 0;
-  swe->ref = 0;
-  pages_in_swap--;
+  for (; n > i; n--)
+    kfree(pages[n - 1]);
+
+  // Read the data from the pool, or in runs of slots from the swap
+  // region, into the newly allocated pages
+  for (i = 0; i < n; i = j + 1) {
+    for (j = i; j < n && !z[j]; j++)
+      ;
+    if (j > i)
+      swapreadn(swapdev, swap_idx + i, pages + i, j - i);
+    if (j < n)
+      zswapload(z[j], zlen[j], pages[j]);
+  }
 
+  if (kmem.use_lock) {
+    acquire(&kmem.lock);
+  }
+  for (i = 0; i < n; i++) {
+    // no va, so not evictable, until the mappings point at the page
+    swe = SME(swap_idx + i);
+    cme = pa2page(V2P(pages[i]));
+    cme->user = 1;
+    cme->rmap = swe->rmap;
+    swe->rmap = 0;
+    // the faulting page was wanted just now; don't let the clock take
+    // it straight back. The others are only a guess.
+    cme->accessed = i == 0;
+    cme->dirty = 0;
+  }
   if (kmem.use_lock) {
     release(&kmem.lock);
   }
 
-  // Read the data from the swap entry into the newly allocated page
-  swapread(ROOTDEV, swap_idx, mem);
+  // If a page is a cow page, update all processes referencing it
+  for (i = 0; i < n; i++)
+    updatecowreferences(PGNUM(V2P(pages[i])), swap_idx + i);
+
+  if (kmem.use_lock) {
+    acquire(&kmem.lock);
+  }
+  for (i = 0; i < n; i++) {
+    swe = SME(swap_idx + i);
+    cme = pa2page(V2P(pages[i]));
+    swe->busy = 0;
+    if (swe->ref > 0) {
+      // mapped at the slot since it was read; it stays as it is
+      z[i] = 0;
+    } else if (!z[i] && cme->ref == 2 && cme->rmap && !cme->rmap->next) {
+      // a page on disk that one mapping has keeps its slot until written
+      swe->used = 0;
+      rmapdrop(&swe->rmap);
+      pages_in_swap--;
+      cme->swapslot = swap_idx + i + 1;
+      swap_cached++;
+    } else {
+      z[i] = swapdrop(swap_idx + i, &zlen[i]);
+    }
+    // now the clock may take it, unless every mapping let go of it
+    if (cme->ref > 1)
+      cme->va = va[i];
+  }
+  if (kmem.use_lock) {
+    release(&kmem.lock);
+  }
 
-  // If the page is a cow page, update all processes referencing the cow page
-  updatecowreferences(ppn, swap_idx, cme->va);
+  // the pages are the mappings' now, or free if there are none left
+  for (i = 0; i < n; i++) {
+    if (z[i])
+      zswapfree(z[i], zlen[i]);
+    kfree(pages[i]);
+  }
 
   return 0;
 }
 
 void ensure_n_free_pages(uint n) {
+  char *page;
+
   while (free_pages < n) {
-    if (!evictpage(0))
+    if ((page = pcsteal()) != 0)
+      kfree(page);
+    else if (!evictpage(0))
       panic("Run out of swap region memory");
   }
 }
 
+static void kswapd(void) {
+  char *page;
+
+  for (;;) {
+    acquire(&kswapdlock);
+    while (!kswapdwanted)
+      sleep(&kswapdwanted, &kswapdlock);
+    release(&kswapdlock);
+
+    while (free_pages < KSWAPD_HIGH) {
+      if ((page = pcsteal()) != 0)
+        kfree(page);
+      else if (!evictpage(0))
+        break; // nothing left to reclaim; a later kalloc wakes us again
+    }
+
+    // only now, so that kallocs meanwhile do not wake us again
+    acquire(&kswapdlock);
+    kswapdwanted = 0;
+    release(&kswapdlock);
+  }
+}
+
 static unsigned long int next = 1; 
 
 // returns random integer from [0, limit)
@@ -0,0 +1,126 @@
+// Same-page merging.
+//
+// ksmd walks the core map a few pages at a time, hashing the user pages
+// only one mapping has. A page hashing like one seen earlier in the pass
+// is compared with it byte for byte, both made copy-on-write first so
+// that neither can change meanwhile, and if they match the second
+// mapping is pointed at the first page and the second page is freed. A
+// write to either takes a copy through the copy-on-write fault, as after
+// a fork. A page of zeroes is merged into the zero page.
+//
+// The table of hashes starts afresh with each pass over memory, so a
+// page written often is merely forgotten rather than keeping a stale
+// entry. ksmd runs if KSM is 1.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <spinlock.h>
+
+#define KSMHASH 512 // pages remembered per pass
+
+struct ksmentry {
+  uint64_t hash;
+  uint64_t ppn; // 0 if the entry is free
+  struct vspace *vs;
+  uint64_t va;
+};
+
+static struct ksmentry table[KSMHASH];
+static int cursor; // the next page of the core map to look at
+
+int ksm_merged; // pages freed by merging
+
+static uint64_t ksmhash(uint64_t *w) {
+  uint64_t h = 0;
+  int i;
+
+  for (i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static int ksmzero(uint64_t *w) {
+  int i;
+
+  for (i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+    if (w[i])
+      return 0;
+  return 1;
+}
+
+// Tries to merge page ppn, which vs maps at va and which the caller
+// holds a reference to, into an identical page.
+static void ksmone(uint64_t ppn, struct vspace *vs, uint64_t va) {
+  uint64_t *w = P2V(ppn << PT_SHIFT);
+  uint64_t h, q;
+  struct ksmentry *e;
+
+  if (ksmzero(w)) {
+    q = zero_ppn;
+    increment_cme_ref(q);
+  } else {
+    h = ksmhash(w);
+    e = &table[h % KSMHASH];
+    if (!e->ppn || e->hash != h || e->ppn == ppn) {
+      e->hash = h;
+      e->ppn = ppn;
+      e->vs = vs;
+      e->va = va;
+      return;
+    }
+    q = e->ppn;
+    // the page may have gone, or changed hands, since it was seen
+    e->ppn = 0;
+    if (ksmhold(q) < 0)
+      return;
+    if (vspacemarkcow(e->vs, e->va, q) < 0) {
+      kfree(P2V(q << PT_SHIFT));
+      return;
+    }
+  }
+
+  // neither page changes once both are copy-on-write
+  if (vspacemarkcow(vs, va, ppn) == 0 &&
+      memcmp(w, P2V(q << PT_SHIFT), PGSIZE) == 0) {
+    // a reference for the new mapping
+    increment_cme_ref(q);
+    if (vspaceremap(vs, va, ppn, q) == 0) {
+      // the old mapping's; the caller drops its own
+      kfree(P2V(ppn << PT_SHIFT));
+      ksm_merged++;
+    } else {
+      kfree(P2V(q << PT_SHIFT));
+    }
+  }
+  kfree(P2V(q << PT_SHIFT));
+}
+
+static void ksmd(void) {
+  struct vspace *vs;
+  uint64_t ppn, va;
+  int n;
+
+  for (;;) {
+    acquire(&tickslock);
+    timersleep(ticks + KSMTICKS);
+    release(&tickslock);
+
+    for (n = 0; n < KSMSCAN; n++) {
+      if (cursor == 0)
+        memset(table, 0, sizeof(table));
+      if ((ppn = ksmpage(cursor, &vs, &va)) != 0) {
+        ksmone(ppn, vs, va);
+        kfree(P2V(ppn << PT_SHIFT));
+      }
+      cursor = (cursor + 1) % npages;
+    }
+  }
+}
+
+void ksminit(void) {
+  if (KSM)
+    kthread("ksmd", ksmd);
+}
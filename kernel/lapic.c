@@ -2,10 +2,12 @@
 // See Chapter 8 & Appendix C of Intel processor manual volume 3.
 
 #include <cdefs.h>
+#include <cpuid.h>
 #include <date.h>
 #include <defs.h>
 #include <memlayout.h>
 #include <mmu.h>
+#include <msr.h>
 #include <param.h>
 #include <proc.h> // ncpu
 #include <trap.h>
@@ -32,7 +34,9 @@
 #define ICRHI (0x0310 / 4)  // Interrupt Command [63:32]
 #define TIMER (0x0320 / 4)  // Local Vector Table 0 (TIMER)
 #define X1 0x0000000B       // divide counts by 1
+#define ONESHOT 0x00000000  // One-shot
 #define PERIODIC 0x00020000 // Periodic
+#define TSCDEADLINE 0x00040000 // One-shot at a TSC value
 #define PCINT (0x0340 / 4)  // Performance Counter LVT
 #define LINT0 (0x0350 / 4)  // Local Vector Table 1 (LINT0)
 #define LINT1 (0x0360 / 4)  // Local Vector Table 2 (LINT1)
@@ -42,8 +46,19 @@
 #define TCCR (0x0390 / 4)   // Timer Current Count
 #define TDCR (0x03E0 / 4)   // Timer Divide Configuration
 
+#define TICKCOUNT 10000000 // timer counts in a tick
+
 volatile uint *lapic; // Initialized in mp.c
 
+// For the one-shot timer an idle cpu arms in place of its tick. With the
+// TSC-deadline timer, once cpu0 has measured a tick in TSC cycles, the
+// timer goes off at a TSC value; otherwise it counts down TICKCOUNT a
+// tick, which can only reach so far.
+static int tscdeadline; // the timer has a TSC-deadline mode
+static uint64_t tsctick; // TSC cycles in a tick, 0 until measured
+static uint64_t lasttsc; // TSC at cpu0's last periodic tick, or 0
+static uint64_t armed[NCPU]; // what each cpu's one-shot started from
+
 static void lapicw(int index, int value) {
   lapic[index] = value;
   lapic[ID]; // wait for write to finish, by reading
@@ -60,9 +75,8 @@ void lapicinit(void) {
   // from lapic[TICR] and then issues an interrupt.
   // If xk cared more about precise timekeeping,
   // TICR would be calibrated using an external time source.
-  lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (TRAP_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicperiodic();
+  tscdeadline = cpuid_feature(CPUID_FEATURE_TSC_DEADLINE);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -119,12 +133,78 @@ int cpunum(void) {
   panic("unknown apicid\n");
 }
 
+// Send the interrupt vector to the cpu with local APIC id apicid.
+// Interrupts must be off, so that nothing else uses the ICR meanwhile.
+void lapicipi(uchar apicid, int vector) {
+  lapicw(ICRHI, apicid << 24);
+  lapicw(ICRLO, FIXED | DEASSERT | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Acknowledge interrupt.
 void lapiceoi(void) {
   if (lapic)
     lapicw(EOI, 0);
 }
 
+// Set this cpu's timer ticking periodically, as it does except when idle.
+void lapicperiodic(void) {
+  if (!lapic)
+    return;
+  lapicw(TDCR, X1);
+  lapicw(TIMER, PERIODIC | (TRAP_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, TICKCOUNT);
+}
+
+// Count cpu0's periodic tick, which measures a tick in TSC cycles
+// for the TSC-deadline timer.
+void lapictick(void) {
+  uint64_t now;
+
+  if (!tscdeadline || tsctick)
+    return;
+  now = readtsc();
+  if (lasttsc)
+    tsctick = now - lasttsc;
+  lasttsc = now;
+}
+
+// Set this cpu's timer to go off once, n ticks from now, in place of
+// its periodic tick; n of 0 turns it off. The count-down timer reaches
+// only so far, and goes off sooner.
+void lapiconeshot(uint n) {
+  int i = cpunum();
+
+  if (!lapic)
+    return;
+  // ticks that are not back to back would mismeasure
+  lasttsc = 0;
+  if (n == 0) {
+    lapicw(TIMER, MASKED);
+  } else if (tscdeadline && tsctick) {
+    lapicw(TIMER, TSCDEADLINE | (TRAP_IRQ0 + IRQ_TIMER));
+    armed[i] = readtsc();
+    wrmsr(MSR_IA32_TSC_DEADLINE, armed[i] + n * tsctick);
+  } else {
+    armed[i] = (uint64_t)min(n, 0xffffffffU / TICKCOUNT) * TICKCOUNT;
+    lapicw(TDCR, X1);
+    lapicw(TIMER, ONESHOT | (TRAP_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, armed[i]);
+  }
+}
+
+// Whole ticks since lapiconeshot armed this cpu's timer.
+uint lapiconeshotticks(void) {
+  int i = cpunum();
+
+  if (!lapic)
+    return 0;
+  if (tscdeadline && tsctick)
+    return (readtsc() - armed[i]) / tsctick;
+  return (armed[i] - lapic[TCCR]) / TICKCOUNT;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void microdelay(int us) {}
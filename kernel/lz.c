@@ -0,0 +1,146 @@
+// A small LZ77 compressor in the manner of LZ4, for pages going to the
+// compressed swap pool. It favours speed over ratio: one hash probe per
+// position, no lazy matching.
+//
+// A compressed block is a run of sequences. Each starts with a token
+// byte holding a literal count in its high four bits and a match length
+// less LZMINMATCH in its low four; a field of 15 continues in the bytes
+// that follow, each added on, until one is less than 255. Then come the
+// literals, then a two-byte little-endian offset back to the match. The
+// last sequence ends with its literals.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <param.h>
+
+#define LZMINMATCH 4
+
+static uint lzhash(const uchar *p) {
+  uint v = p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+
+  return (v * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// Writes the continuation bytes of a length field. Returns the new end
+// of the output, or 0 if it would pass oend.
+static uchar *lzputlen(uchar *op, uchar *oend, uint n) {
+  for (; n >= 255; n -= 255) {
+    if (op >= oend)
+      return 0;
+    *op++ = 255;
+  }
+  if (op >= oend)
+    return 0;
+  *op++ = n;
+  return op;
+}
+
+// Writes a sequence of nlit literals and a match of mlen bytes off back,
+// or just the literals if mlen is 0. Returns the new end of the output,
+// or 0 if it would pass oend.
+static uchar *lzputseq(uchar *op, uchar *oend, const uchar *lit, uint nlit,
+                       uint off, uint mlen) {
+  uchar *token;
+  uint ml = mlen ? mlen - LZMINMATCH : 0;
+
+  if (op >= oend)
+    return 0;
+  token = op++;
+  *token = min(nlit, 15U) << 4 | min(ml, 15U);
+  if (nlit >= 15 && (op = lzputlen(op, oend, nlit - 15)) == 0)
+    return 0;
+  if (oend - op < nlit)
+    return 0;
+  memmove(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0)
+    return op;
+
+  if (oend - op < 2)
+    return 0;
+  *op++ = off;
+  *op++ = off >> 8;
+  if (ml >= 15 && (op = lzputlen(op, oend, ml - 15)) == 0)
+    return 0;
+  return op;
+}
+
+// Compresses the n bytes at src, n at most 64K, into at most max bytes
+// at dst. htab is scratch of 1 << LZHASHBITS entries.
+// Returns the compressed size, or -1 if it would not fit in max.
+int lzcompress(const char *src, int n, char *dst, int max, ushort *htab) {
+  const uchar *base = (const uchar *)src, *ip = base, *anchor = base;
+  const uchar *iend = base + n, *ref;
+  uchar *op = (uchar *)dst, *oend = (uchar *)dst + max;
+  uint h, len;
+
+  memset(htab, 0, sizeof(ushort) << LZHASHBITS);
+  while (ip + LZMINMATCH <= iend) {
+    h = lzhash(ip);
+    ref = base + htab[h];
+    htab[h] = ip - base;
+    if (ref >= ip || memcmp(ref, ip, LZMINMATCH) != 0) {
+      ip++;
+      continue;
+    }
+    for (len = LZMINMATCH; ip + len < iend && ref[len] == ip[len]; len++)
+      ;
+    if ((op = lzputseq(op, oend, anchor, ip - anchor, ip - ref, len)) == 0)
+      return -1;
+    ip += len;
+    anchor = ip;
+  }
+  if ((op = lzputseq(op, oend, anchor, iend - anchor, 0, 0)) == 0)
+    return -1;
+  return op - (uchar *)dst;
+}
+
+// Reads a length field's continuation bytes onto *n.
+// Returns the new input position, or 0 if the input runs out.
+static const uchar *lzgetlen(const uchar *ip, const uchar *iend, uint *n) {
+  do {
+    if (ip >= iend)
+      return 0;
+    *n += *ip;
+  } while (*ip++ == 255);
+  return ip;
+}
+
+// Decompresses the n bytes at src into at most max bytes at dst.
+// Returns the decompressed size, or -1 if the input is corrupt.
+int lzdecompress(const char *src, int n, char *dst, int max) {
+  const uchar *ip = (const uchar *)src, *iend = ip + n;
+  uchar *op = (uchar *)dst, *oend = op + max, *ref;
+  uint token, nlit, mlen;
+
+  while (ip < iend) {
+    token = *ip++;
+    nlit = token >> 4;
+    if (nlit == 15 && (ip = lzgetlen(ip, iend, &nlit)) == 0)
+      return -1;
+    if (iend - ip < nlit || oend - op < nlit)
+      return -1;
+    memmove(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    ref = op - (ip[0] | ip[1] << 8);
+    ip += 2;
+    if (ref < (uchar *)dst || ref == op)
+      return -1;
+    mlen = token & 15;
+    if (mlen == 15 && (ip = lzgetlen(ip, iend, &mlen)) == 0)
+      return -1;
+    mlen += LZMINMATCH;
+    if (oend - op < mlen)
+      return -1;
+    // byte by byte: the match may overlap what it is copied to
+    while (mlen-- > 0)
+      *op++ = *ref++;
+  }
+  return op - (uchar *)dst;
+}
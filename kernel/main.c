@@ -3,15 +3,40 @@
 #include <defs.h>
 #include <e820.h>
 #include <memlayout.h>
+#include <msr.h>
+#include <param.h>
+#include <proc.h>
 #include <trap.h>
+#include <x86_64.h>
 
+static void startothers(void);
 noreturn static void mpmain(void);
 extern char _end[]; // first address after kernel loaded from ELF file
 
+static uint64_t boottsc; // TSC at the end of the last phase timed
+
+// Prints how long the phase since the last call took.
+static void bootphase(char *name) {
+  uint64_t now = readtsc();
+
+  if (BOOTTIME)
+    cprintf("boot: %s %ld cycles\n", name, now - boottsc);
+  boottsc = now;
+}
+
 int main(uint64_t addr) {
+  uint64_t start = readtsc(), memtsc;
+
+  // mycpu() reads %gs, which seginit sets up; locks are taken before that
+  cpus[0].cpu = &cpus[0];
+  wrmsr(MSR_IA32_GS_BASE, (uint64_t)&cpus[0].cpu);
+
+  stringinit(); // copy routines for this cpu
   e820_init(addr);
   detect_memory();
+  boottsc = readtsc();
   mem_init(_end); // phys page allocator
+  memtsc = readtsc() - boottsc;
   vspacebootinit();
   mpinit();
   lapicinit();
@@ -23,19 +48,83 @@ int main(uint64_t addr) {
   e820_print();
   cprintf("\ncpu%d: starting xk\n\n", cpunum());
   cprintf("free pages: %d\n", free_pages);
+  if (BOOTTIME)
+    cprintf("boot: mem_init %ld cycles\n", memtsc);
+  if (MEMBENCH)
+    membench();
   pinit();
+  futexinit();
+  shminit();
+  traceinit();
+  profinit();
+  bootphase("setup");
   tvinit();   // trap vectors
+  bootphase("tvinit");
   binit();    // buffer cache
+  bootphase("binit");
+  pcacheinit(); // page cache
+  fileinit(); // open file table
+  pipeinit(); // pipe cache
+  zswapinit(); // compressed swap pool
+  bootphase("caches");
   ideinit();  // disk
+  bootphase("ideinit");
   userinit(); // first user process
+  bootphase("userinit");
+  startothers(); // start other processors
+  bootphase("startothers");
+  if (BOOTTIME)
+    cprintf("boot: total %ld cycles\n", boottsc - start);
   mpmain();
   return 0;
 }
 
+// Other CPUs jump here from entry.S.
+noreturn void mpenter(void) {
+  vspaceinitcpu();
+  lapicinit();
+  mpmain();
+}
+
 // Common CPU setup code.
 static void mpmain(void) {
   cprintf("cpu%d: starting\n", cpunum());
   idtinit(); // load idt register
-  // xchg(&cpu->started, 1); // tell startothers() we're up
+  xchg(&mycpu()->started, 1); // tell startothers() we're up
   scheduler(); // start running processes
 }
+
+// Start the non-boot (AP) processors.
+static void startothers(void) {
+  extern char _binary_out_entryother_start[], _binary_out_entryother_size[];
+  extern char start_common[];
+  char *code, *stack;
+  struct cpu *c;
+
+  // entryother.S is linked to run at AP_ENTRY, below any page kalloc has
+  code = P2V(AP_ENTRY);
+  memmove(code, _binary_out_entryother_start,
+          (uint64_t)_binary_out_entryother_size);
+
+  for (c = cpus; c < cpus + ncpu; c++) {
+    if (c == mycpu()) // we've started already
+      continue;
+
+    // tell entryother.S which cpu this is, what stack to use, and
+    // where to go
+    if ((stack = kalloc()) == 0)
+      panic("startothers: no scheduler stack");
+    *(uint *)(code - AP_OFFSET_CPUNUM) = c - cpus;
+    // nothing is pushed before entry.S moves to the kernel stack, which
+    // may be anywhere in memory, so the 32-bit one is a scrap below code
+    *(uint *)(code - AP_OFFSET_STACK) = AP_ENTRY - AP_OFFSET_KSTACK;
+    *(uint *)(code - AP_OFFSET_ENTRY) = V2P(start_common);
+    *(uint64_t *)(code - AP_OFFSET_KSTACK) = (uint64_t)stack + KSTACKSIZE;
+
+    lapicstartap(c->apicid, AP_ENTRY);
+
+    // wait for cpu to finish mpmain()
+    while (c->started == 0)
+      ;
+  }
+}
@@ -1,5 +1,15 @@
 // Fake IDE disk; stores blocks in memory.
 // Useful for running kernel without scratch disk.
+//
+// The image is in memory already, so a read copies nothing: it points
+// the buf's data at the block in the image. Changes to the buf then
+// go straight to the image, and a write of such a buf has nothing
+// to copy either. That is safe because the image is the disk, and it
+// lasts only until the kernel stops. A buf goes back to its own space
+// when it is recycled for another block, so a buf that bget hands out
+// to be overwritten never writes into the image early. The image holds
+// changes before they commit, then, and the log's checkpointer must not
+// write the older committed copies of such blocks over them.
 
 #include <cdefs.h>
 #include <defs.h>
@@ -25,10 +35,15 @@ void ideinit(void) {
 }
 
 // Interrupt handler.
-void ideintr(void) {
+void ideintr(int chan) {
   // no-op
 }
 
+// There is only the file system's disk, of the image's size.
+uint idesize(int dev) {
+  return dev == 1 ? disksize : 0;
+}
+
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
@@ -48,8 +63,27 @@ void iderw(struct buf *b) {
 
   if (b->flags & B_DIRTY) {
     b->flags &= ~B_DIRTY;
-    memmove(p, b->data, BSIZE);
+    if (b->data != p)
+      memmove(p, b->data, BSIZE);
   } else
-    memmove(b->data, p, BSIZE);
+    b->data = p;
   b->flags |= B_VALID;
 }
+
+// The copies are synchronous, so every request is done on return.
+void iderw_submit(struct buf **bufs, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    iderw(bufs[i]);
+    if (bufs[i]->flags & B_ASYNC) {
+      bufs[i]->flags &= ~B_ASYNC;
+      brelse(bufs[i]);
+    }
+  }
+}
+
+void iderw_wait(struct buf *b) {
+  if ((b->flags & (B_VALID | B_DIRTY)) != B_VALID)
+    panic("iderw_wait: request not done");
+}
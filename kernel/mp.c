@@ -98,6 +98,11 @@ void mpinit(void) {
       proc = (struct mpproc *)p;
       if (ncpu < NCPU) {
         cpus[ncpu].apicid = proc->apicid; // apicid may differ from ncpu
+        // the boot cpu is cpus[0], as entry.S and main() have it
+        if ((proc->flags & MPBOOT) && ncpu > 0) {
+          cpus[ncpu].apicid = cpus[0].apicid;
+          cpus[0].apicid = proc->apicid;
+        }
         ncpu++;
       }
       p += sizeof(struct mpproc);
@@ -0,0 +1,240 @@
+// Page cache.
+//
+// Caches file contents in whole pages, keyed on (dev, inum, page
+// number). readi copies file data out of it and writei keeps it up to
+// date, and exec maps its pages straight into processes copy-on-write,
+// so every process running a program shares one copy of its text.
+//
+// Pages are filled from the buffer cache by ireadpage. When memory
+// runs low, kalloc takes back cached pages that no process maps. A
+// page that processes still map is dropped from the cache instead of
+// being changed, and is freed by its last user. The exception is a
+// page mapped MAP_SHARED, which writei changes in place so that the
+// mapping sees the write.
+//
+// All users of an inode's pages hold the inode's lock, so the cache
+// itself only needs a spinlock for its tables.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <pcache.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+static struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCBUCKET];
+  struct cpage lru;   // lru.next is most recently used
+  struct cpage *free; // unused descriptors, through hnext
+} pcache;
+
+static struct cpage **pchash(uint dev, uint inum, uint pgno) {
+  return &pcache.hash[((dev * 31 + inum) * 31 + pgno) % NPCBUCKET];
+}
+
+static void pcunlink(struct cpage *cp) {
+  cp->next->prev = cp->prev;
+  cp->prev->next = cp->next;
+}
+
+static void pclinkhead(struct cpage *cp) {
+  cp->next = pcache.lru.next;
+  cp->prev = &pcache.lru;
+  pcache.lru.next->prev = cp;
+  pcache.lru.next = cp;
+}
+
+static struct core_map_entry *pccme(struct cpage *cp) {
+  return pa2page(V2P(cp->data));
+}
+
+void pcacheinit(void) {
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.prev = &pcache.lru;
+  pcache.lru.next = &pcache.lru;
+}
+
+// Caller must hold pcache.lock.
+static struct cpage *pcfind(uint dev, uint inum, uint pgno) {
+  struct cpage *cp;
+
+  for (cp = *pchash(dev, inum, pgno); cp != 0; cp = cp->hnext)
+    if (cp->dev == dev && cp->inum == inum && cp->pgno == pgno)
+      return cp;
+  return 0;
+}
+
+// Take cp out of the cache and return its page.
+// Caller must hold pcache.lock; cp must be unused.
+static char *pcremove(struct cpage *cp) {
+  struct cpage **pp;
+  char *data;
+
+  for (pp = pchash(cp->dev, cp->inum, cp->pgno); *pp != cp; pp = &(*pp)->hnext)
+    ;
+  *pp = cp->hnext;
+  pcunlink(cp);
+  pccme(cp)->pcache = 0;
+
+  data = cp->data;
+  cp->data = 0;
+  cp->hnext = pcache.free;
+  pcache.free = cp;
+  return data;
+}
+
+// Get an unused descriptor, carving a page into new ones if needed.
+static struct cpage *pcdesc(void) {
+  struct cpage *cp;
+  char *page;
+  int i;
+
+  acquire(&pcache.lock);
+  while (pcache.free == 0) {
+    release(&pcache.lock);
+    if ((page = kalloc()) == 0)
+      return 0;
+    memset(page, 0, PGSIZE);
+    acquire(&pcache.lock);
+    for (i = 0; i < PGSIZE / sizeof(struct cpage); i++) {
+      cp = (struct cpage *)page + i;
+      cp->hnext = pcache.free;
+      pcache.free = cp;
+    }
+  }
+  cp = pcache.free;
+  pcache.free = cp->hnext;
+  release(&pcache.lock);
+  return cp;
+}
+
+// Return page pgno of ip with a reference held, reading it in if it is
+// not cached. Returns 0 if there is no memory for it.
+// Caller must hold ip->lock, or share it, and pcput the page when done.
+struct cpage *pcget(struct inode *ip, uint pgno) {
+  struct cpage *cp, *other;
+  char *data;
+
+  acquire(&pcache.lock);
+  if ((cp = pcfind(ip->dev, ip->inum, pgno)) != 0) {
+    cp->ref++;
+    pcunlink(cp);
+    pclinkhead(cp);
+    release(&pcache.lock);
+    return cp;
+  }
+  release(&pcache.lock);
+
+  // Readers sharing ip->lock may read the page meanwhile too; the
+  // first to add it wins.
+  if ((cp = pcdesc()) == 0)
+    return 0;
+  if ((data = kalloc()) == 0) {
+    acquire(&pcache.lock);
+    cp->hnext = pcache.free;
+    pcache.free = cp;
+    release(&pcache.lock);
+    return 0;
+  }
+  ireadpage(ip, pgno, data);
+
+  acquire(&pcache.lock);
+  if ((other = pcfind(ip->dev, ip->inum, pgno)) != 0) {
+    other->ref++;
+    pcunlink(other);
+    pclinkhead(other);
+    cp->hnext = pcache.free;
+    pcache.free = cp;
+    release(&pcache.lock);
+    kfree(data);
+    return other;
+  }
+  cp->dev = ip->dev;
+  cp->inum = ip->inum;
+  cp->pgno = pgno;
+  cp->ref = 1;
+  cp->shared = 0;
+  cp->data = data;
+  cp->hnext = *pchash(cp->dev, cp->inum, pgno);
+  *pchash(cp->dev, cp->inum, pgno) = cp;
+  pclinkhead(cp);
+  pccme(cp)->pcache = 1;
+  release(&pcache.lock);
+  return cp;
+}
+
+void pcput(struct cpage *cp) {
+  acquire(&pcache.lock);
+  if (cp->ref < 1)
+    panic("pcput");
+  cp->ref--;
+  release(&pcache.lock);
+}
+
+// writei has written n bytes at byte off of ip, all within one page;
+// bring the cached copy of that page, if any, up to date.
+// Caller must hold ip->lock.
+void pcupdate(struct inode *ip, uint off, char *src, uint n) {
+  struct cpage *cp;
+  char *drop = 0;
+
+  acquire(&pcache.lock);
+  if ((cp = pcfind(ip->dev, ip->inum, off / PGSIZE)) != 0) {
+    if (pccme(cp)->ref > 1 && !cp->shared)
+      // processes map it privately: leave their copy alone
+      drop = pcremove(cp);
+    else
+      memmove(cp->data + off % PGSIZE, src, n);
+  }
+  release(&pcache.lock);
+
+  if (drop)
+    kfree(drop);
+}
+
+// ip is being cut down to size bytes; drop its cached pages wholly past
+// the new end. Processes that map one keep their copy.
+// Caller must hold ip->lock.
+void pctruncate(struct inode *ip, uint size) {
+  struct cpage *cp;
+  uint pgno;
+  char *drop;
+
+  for (pgno = (size + PGSIZE - 1) / PGSIZE;
+       pgno < (ip->size + PGSIZE - 1) / PGSIZE; pgno++) {
+    drop = 0;
+    acquire(&pcache.lock);
+    if ((cp = pcfind(ip->dev, ip->inum, pgno)) != 0 && cp->ref == 0)
+      drop = pcremove(cp);
+    release(&pcache.lock);
+    if (drop)
+      kfree(drop);
+  }
+}
+
+// Take the least recently used page that only the cache refers to out
+// of the cache, and return it allocated as if by kalloc.
+// Returns 0 if there is none.
+char *pcsteal(void) {
+  struct core_map_entry *cme;
+  struct cpage *cp;
+  char *data;
+
+  acquire(&pcache.lock);
+  for (cp = pcache.lru.prev; cp != &pcache.lru; cp = cp->prev) {
+    cme = pccme(cp);
+    if (cp->ref == 0 && cme->ref == 1) {
+      data = pcremove(cp);
+      cme->user = 0;
+      cme->va = 0;
+      release(&pcache.lock);
+      return data;
+    }
+  }
+  release(&pcache.lock);
+  return 0;
+}
@@ -0,0 +1,54 @@
+// PCI configuration space access through configuration mechanism #1:
+// write the address of a register to port 0xCF8, then read or write
+// its value at port 0xCFC.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <pci.h>
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+#define PCI_ID 0x00        // Register offset: vendor and device ID
+#define PCI_CLASS 0x08     // Register offset: class, subclass, prog if, rev
+#define PCI_HDRTYPE 0x0c   // Register offset: header type (bits 16-23)
+
+static uint pciaddr(int bus, int slot, int func, int off) {
+  return 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (off & 0xfc);
+}
+
+uint pciconfread(int bus, int slot, int func, int off) {
+  pcioutl(PCI_CONFIG_ADDR, pciaddr(bus, slot, func, off));
+  return pciinl(PCI_CONFIG_DATA);
+}
+
+void pciconfwrite(int bus, int slot, int func, int off, uint val) {
+  pcioutl(PCI_CONFIG_ADDR, pciaddr(bus, slot, func, off));
+  pcioutl(PCI_CONFIG_DATA, val);
+}
+
+// Find the first function on bus 0 with the given class and subclass.
+// Returns 0 and fills in *slot and *func, or -1 if there is none.
+int pcifindclass(int class, int subclass, int *slot, int *func) {
+  int s, f, nfunc;
+  uint id, cls;
+
+  for (s = 0; s < 32; s++) {
+    id = pciconfread(0, s, 0, PCI_ID);
+    if ((id & 0xffff) == 0xffff)
+      continue;
+    nfunc = (pciconfread(0, s, 0, PCI_HDRTYPE) & 0x800000) ? 8 : 1;
+    for (f = 0; f < nfunc; f++) {
+      id = pciconfread(0, s, f, PCI_ID);
+      if ((id & 0xffff) == 0xffff)
+        continue;
+      cls = pciconfread(0, s, f, PCI_CLASS);
+      if ((cls >> 24) == class && ((cls >> 16) & 0xff) == subclass) {
+        *slot = s;
+        *func = f;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
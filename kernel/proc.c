@@ -7,6 +7,7 @@
 #include <param.h>
 #include <proc.h>
 #include <spinlock.h>
+#include <trace.h>
 #include <trap.h>
 #include <x86_64.h>
 #include <fs.h>
@@ -14,12 +15,42 @@
 #include <vspace.h>
 #include "../inc/proc.h"
 
+// A cpu's RUNNABLE processes, a queue for each priority level, first to
+// run first. ptable.lock protects the queues, being the lock held across
+// a switch to a process anyway.
+//
+// With SCHED_MLFQ, a process that runs out its time slice goes down a
+// level, where the slices are twice as long; one that sleeps first keeps
+// its level, and what is left of its slice. Every PRIOBOOST ticks
+// everything goes back to its base level. Under round-robin, processes
+// stay at their base levels, and the slice is always QUANTUM.
+struct runq {
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;
+};
+
+#define NSLEEPQ 64 // wait lists
+
 // process table
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct runq runq[NCPU];
+  // SLEEPING processes, in lists hashed by channel, so that a wakeup
+  // looks only at those that may be sleeping on its channel
+  struct proc *sleepq[NSLEEPQ];
+  int nidle; // cpus with their idle flag set
+  struct proc *free; // UNUSED procs, linked through qnext
 } ptable;
 
+// kernel stacks of procs gone, kept by each cpu for the next to start
+// there, so that a fork need not go to the page allocator
+static struct {
+  char *stacks[KSTACKCACHE];
+  int n;
+} kstacks[NCPU];
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -28,6 +59,13 @@ extern void trapret(void);
 
 static void wakeup1(void *chan);
 
+int context_switches = 0; // switches from the scheduler to a process
+int wakeups = 0;          // sleepers made runnable
+static void makerunnable(struct proc *);
+static void kickidle(struct cpu *);
+static void killproc(struct proc *);
+void freeproc(struct proc *);
+
 // to test crash safety in lab5, 
 // we trigger restarts in the middle of file operations
 void reboot(void) {
@@ -40,10 +78,57 @@ loop:
   goto loop;
 }
 
-void pinit(void) { initlock(&ptable.lock, "ptable"); }
+void pinit(void) {
+  struct proc *p;
+
+  initlock(&ptable.lock, "ptable");
+  lockstat(&ptable.lock);
+  // the lowest slots first
+  for (p = &ptable.proc[NPROC - 1]; p >= ptable.proc; p--) {
+    p->qnext = ptable.free;
+    ptable.free = p;
+  }
+}
+
+// Marks p UNUSED and puts it on the free list.
+// Caller must hold ptable.lock.
+static void unuseproc(struct proc *p) {
+  p->state = UNUSED;
+  p->qnext = ptable.free;
+  ptable.free = p;
+}
+
+// A kernel stack, from this cpu's cache if it has one. Returns 0 if
+// there is no memory.
+static char *kstackalloc(void) {
+  char *s = 0;
+  int c;
+
+  pushcli();
+  c = mycpu() - cpus;
+  if (kstacks[c].n > 0)
+    s = kstacks[c].stacks[--kstacks[c].n];
+  popcli();
+  return s ? s : kalloc();
+}
+
+// Frees the kernel stack s, to this cpu's cache while it has room.
+static void kstackfree(char *s) {
+  int c, kept = 0;
+
+  pushcli();
+  c = mycpu() - cpus;
+  if (kstacks[c].n < KSTACKCACHE) {
+    kstacks[c].stacks[kstacks[c].n++] = s;
+    kept = 1;
+  }
+  popcli();
+  if (!kept)
+    kfree(s);
+}
 
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
+// Take an UNUSED proc off the free list.
+// If there is one, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
 static struct proc *allocproc(void) {
@@ -52,23 +137,33 @@ static struct proc *allocproc(void) {
 
   acquire(&ptable.lock);
 
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
+  if ((p = ptable.free) == 0) {
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.free = p->qnext;
+  p->qnext = 0;
 
-found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->killed = 0;
+  p->cpu = mycpu() - cpus;
+  // a child keeps its parent's base priority
+  p->baseprio = myproc() ? myproc()->baseprio : 0;
+  p->prio = p->baseprio;
+  p->slice = 0;
+  p->ioring = 0;
+  p->thread = 0;
+  memset(p->ncalls, 0, sizeof(p->ncalls));
+  memset(p->callcycles, 0, sizeof(p->callcycles));
 
   release(&ptable.lock);
 
   // Allocate kernel stack.
-  if ((p->kstack = kalloc()) == 0) {
-    p->state = UNUSED;
+  if ((p->kstack = kstackalloc()) == 0) {
+    acquire(&ptable.lock);
+    unuseproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -90,6 +185,35 @@ found:
   return p;
 }
 
+// A kernel thread's first scheduling by scheduler() swtches here.
+// "Return" to the thread's function (see kthread).
+static void kthreadret(void) {
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+}
+
+// Start a kernel thread running fn, which must never return.
+// It has no user address space and is adopted by init.
+struct proc *kthread(char *name, void (*fn)(void)) {
+  struct proc *p;
+
+  if ((p = allocproc()) == 0)
+    panic("kthread: no proc");
+  assertm((p->vspace = vspacealloc()) != 0, "kthread: no page table");
+
+  // Return into fn instead of trapret.
+  *(uint64_t *)(p->context + 1) = (uint64_t)fn;
+  p->context->rip = (uint64_t)kthreadret;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->parent = initproc;
+  makerunnable(p);
+  release(&ptable.lock);
+  return p;
+}
+
 // Set up first user process.
 void userinit(void) {
   struct proc *p;
@@ -98,14 +222,14 @@ void userinit(void) {
   p = allocproc();
 
   initproc = p;
-  assertm(vspaceinit(&p->vspace) == 0, "error initializing process's virtual address descriptor");
-  vspaceinitcode(&p->vspace, _binary_out_initcode_start, (int64_t)_binary_out_initcode_size);
+  assertm((p->vspace = vspacealloc()) != 0, "error initializing process's virtual address descriptor");
+  vspaceinitcode(p->vspace, _binary_out_initcode_start, (int64_t)_binary_out_initcode_size);
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ss = (SEG_UDATA << 3) | DPL_USER;
   p->tf->rflags = FLAGS_IF;
-  p->tf->rip = VRBOT(&p->vspace.regions[VR_CODE]);  // beginning of initcode.S
-  p->tf->rsp = VRTOP(&p->vspace.regions[VR_USTACK]);
+  p->tf->rip = VRBOT(&p->vspace->regions[VR_CODE]);  // beginning of initcode.S
+  p->tf->rsp = VRTOP(&p->vspace->regions[VR_USTACK]);
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
 
@@ -114,7 +238,7 @@ void userinit(void) {
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
-  p->state = RUNNABLE;
+  makerunnable(p);
   release(&ptable.lock);
 }
 
@@ -129,16 +253,25 @@ int fork(void) {
   }
 
   // Copy the vspace
-  vspaceinit(&p->vspace);
+  if ((p->vspace = vspacealloc()) == 0) {
+    kstackfree(p->kstack);
+    acquire(&ptable.lock);
+    unuseproc(p);
+    release(&ptable.lock);
+    return -1;
+  }
   acquire(&ptable.lock);
 
-  if (vspacecopy_cow(&(p->vspace), &(myproc()->vspace)) == -1) {
+  if (vspacecopy_cow(p->vspace, myproc()->vspace) == -1) {
     release(&ptable.lock);
     return -1;
   }
+  p->vspace->memlimit = myproc()->vspace->memlimit;
 
   // Copy the trap frame
   *(p->tf) = *(myproc()->tf);
+  // the ring is in the copied space, at the same address
+  p->ioring = myproc()->ioring;
   release(&ptable.lock);
 
   // Copy the file table
@@ -151,7 +284,7 @@ int fork(void) {
   p->parent = myproc();
 
   // Set process to RUNNABLE
-  p->state = RUNNABLE;
+  makerunnable(p);
 
   // Return 0 for child process
   p->tf->rax = 0;
@@ -160,6 +293,97 @@ int fork(void) {
   return p->pid;
 }
 
+// Create a thread of this process running fn(arg) on the user stack
+// whose top is stack. The thread shares this process's address space,
+// and has its own kernel stack and trap frame and a copy of the file
+// table. fn must end with exit, having nowhere to return to. The thread
+// is a child like any other, for wait, but dies when this process exits.
+// Returns the thread's pid, or -1.
+int clone(uint64_t fn, uint64_t arg, uint64_t stack) {
+  struct proc *p;
+
+  // the ABI's alignment, and a return address of 0 pushed on it
+  stack &= ~0xfULL;
+  if (vspacecontains(myproc()->vspace, stack - 8, 8) != 1)
+    return -1;
+  *(uint64_t *)(stack - 8) = 0;
+
+  p = allocproc();
+  if (p == 0) {
+    return -1;
+  }
+  vspacehold(myproc()->vspace);
+  p->vspace = myproc()->vspace;
+  p->thread = 1;
+
+  *(p->tf) = *(myproc()->tf);
+  p->tf->rip = fn;
+  p->tf->rdi = arg;
+  p->tf->rsp = stack - 8;
+  p->tf->rax = 0;
+  safestrcpy(p->name, myproc()->name, sizeof(p->name));
+  ftablecopy(p, myproc());
+
+  acquire(&ptable.lock);
+  p->parent = myproc();
+  makerunnable(p);
+  release(&ptable.lock);
+  return p->pid;
+}
+
+// Create a new process running the program at path with arguments
+// argv, as fork and then exec would, but loading the program straight
+// into the child instead of copying this process first.
+// The child's file descriptor i is a duplicate of this process's
+// fds[i] for i < nfd, or closed if that is -1; the rest are closed. If
+// fds is 0 the child has all of this process's files, as after fork.
+// Returns the child's pid, or -1.
+int spawn(char *path, char **argv, int *fds, int nfd) {
+  struct proc *p;
+  int fd;
+
+  for (fd = 0; fds && fd < nfd; fd++)
+    if (fds[fd] != -1 && (fds[fd] < 0 || fds[fd] >= NOFILE ||
+                          myproc()->files[fds[fd]] == NULL))
+      return -1;
+
+  p = allocproc();
+  if (p == 0) {
+    return -1;
+  }
+
+  if ((p->vspace = vspacealloc()) == 0) {
+    kstackfree(p->kstack);
+    acquire(&ptable.lock);
+    unuseproc(p);
+    release(&ptable.lock);
+    return -1;
+  }
+  p->vspace->memlimit = myproc()->vspace->memlimit;
+  *(p->tf) = *(myproc()->tf);
+  if (execload(p->vspace, path, argv, p->tf) == -1) {
+    freeproc(p);
+    return -1;
+  }
+
+  if (fds == 0) {
+    ftablecopy(p, myproc());
+  } else {
+    for (fd = 0; fd < nfd; fd++) {
+      if (fds[fd] == -1)
+        continue;
+      fdinstall(p, fd, myproc()->files[fds[fd]]);
+      filedup(p->files[fd]);
+    }
+  }
+
+  acquire(&ptable.lock);
+  p->parent = myproc();
+  makerunnable(p);
+  release(&ptable.lock);
+  return p->pid;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -167,39 +391,47 @@ void exit(void) {
   struct proc *p;
   int fd;
 
+  // shared file mappings reach their files before the files close
+  vspacesync(myproc()->vspace);
+
   // close all open files
-  struct file_info** ftable = myproc()->files;
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (ftable[fd] != NULL) {
-      fileclose(ftable[fd]);
-      ftable[fd] = NULL;
-    }
-  }
+  for (fd = fdnext(myproc(), 0); fd < NOFILE; fd = fdnext(myproc(), fd + 1))
+    fileclose(fdremove(myproc(), fd));
 
+  // One hold of ptable.lock from here until the scheduler has taken
+  // the cpu off this process's stack: the parent waits for it, and may
+  // free the stack, only once the lock is free again.
   acquire(&ptable.lock);
-  myproc()->state = ZOMBIE;
   // Reassign the parent of its children to be initproc
   for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if (p->parent->pid == myproc()->pid)
+    if (p->parent && p->parent->pid == myproc()->pid) {
       p->parent = initproc;
+      if (p->state == ZOMBIE)
+        wakeup1((void*)(uintptr_t)(initproc->pid));
+    }
+    // a process's threads die with it
+    if (!myproc()->thread && p->thread && p->vspace == myproc()->vspace &&
+        p->state != ZOMBIE && p->state != UNUSED)
+      killproc(p);
   }
-  release(&ptable.lock);
 
   // signal any waiting parents
-  wakeup((void*)(uintptr_t)(myproc()->parent->pid));
+  wakeup1((void*)(uintptr_t)(myproc()->parent->pid));
 
   // give up control
-  acquire(&ptable.lock);
+  myproc()->state = ZOMBIE;
   sched();
+  panic("zombie exit");
 }
 
 // find a zombie child for pid
-int findzombiechild(int pid, struct proc** pp) {
-  bool haschild;
+// Caller must hold ptable.lock.
+static int findzombiechild(int pid, struct proc** pp) {
+  bool haschild = false;
   struct proc *p;
   
   for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if (p->parent->pid == pid) {
+    if (p->parent && p->parent->pid == pid) {
       haschild = true;
       if (p->state == ZOMBIE) {
         *pp = p;
@@ -214,12 +446,17 @@ int findzombiechild(int pid, struct proc** pp) {
 
 // free memory for proc p
 void freeproc(struct proc* p) {
+  struct vspace *vs = p->vspace;
+
+  kstackfree(p->kstack);
   acquire(&ptable.lock);
   p->parent = NULL;
-  p->state = UNUSED;
-  kfree(p->kstack);
-  vspacefree(&p->vspace);
+  p->vspace = 0;
+  unuseproc(p);
   release(&ptable.lock);
+  // outside ptable.lock: dropping the last reference to an unlinked
+  // binary or mapped file frees its inode, which sleeps on the disk
+  vspaceput(vs);
 }
 
 // Wait for a child process to exit and return its pid.
@@ -228,19 +465,245 @@ int wait(void) {
   int pid = 0;
   struct proc *p;
 
-  pid = findzombiechild(myproc()->pid, &p); 
-  while (pid <= 0) {
-    if (pid == -1) return -1;
-    acquire(&ptable.lock);
+  // scanned and slept on under one hold of ptable.lock, which exit
+  // holds as it wakes us, so no wakeup is missed
+  acquire(&ptable.lock);
+  while ((pid = findzombiechild(myproc()->pid, &p)) == 0)
     sleep((void*)(uintptr_t)(myproc()->pid), &ptable.lock);
-    release(&ptable.lock);
-    pid = findzombiechild(myproc()->pid, &p);
-  }
+  // no longer anyone's child, so that no other waiter frees it too
+  if (pid > 0)
+    p->parent = NULL;
+  release(&ptable.lock);
+  if (pid == -1)
+    return -1;
 
   freeproc(p);
   return pid;
 }
 
+// Makes p RUNNABLE, at the back of the run queue of the cpu it last ran
+// on. Caller must hold ptable.lock.
+static void makerunnable(struct proc *p) {
+  struct runq *rq = &ptable.runq[p->cpu];
+
+  p->state = RUNNABLE;
+  p->qnext = 0;
+  if (rq->tail[p->prio])
+    rq->tail[p->prio]->qnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->n++;
+
+  if (ptable.nidle > 0)
+    kickidle(&cpus[p->cpu]);
+}
+
+// Wakes c if it is idle.
+static void wakeidle(struct cpu *c) {
+  ptable.nidle--;
+  c->idle = 0;
+  if (c != mycpu())
+    lapicipi(c->apicid, TRAP_IRQ0 + IRQ_RESCHED);
+}
+
+// Wakes an idle cpu to pick up a process just queued, c if it is idle,
+// and cpu0 too if it put its tick off, so that time is kept while there
+// is work. Caller must hold ptable.lock.
+static void kickidle(struct cpu *c) {
+  if (!c->idle)
+    for (c = cpus; c < &cpus[ncpu] && !c->idle; c++)
+      ;
+  if (c < &cpus[ncpu])
+    wakeidle(c);
+  if (cpus[0].tickless && cpus[0].idle)
+    wakeidle(&cpus[0]);
+}
+
+// Halts this cpu until an interrupt, having found nothing to run. The
+// last cpu to go idle, if cpu0, puts off its tick until the next sleeper
+// on the timer wheel is due; other cpus turn their timers off altogether,
+// as cpu0 alone keeps time, and a process queued for them wakes them.
+static void idle(void) {
+  struct cpu *c = mycpu();
+  struct runq *rq;
+  uint seq, n, t0;
+
+  // tickslock comes before ptable.lock, so look at the wheel first, and
+  // give up the tickless idea if a sleeper comes meanwhile
+  seq = timerseq;
+  n = timernext();
+
+  // nothing may come in between the last look at the queues and hlt
+  cli();
+  acquire(&ptable.lock);
+  for (rq = ptable.runq; rq < &ptable.runq[ncpu]; rq++) {
+    if (rq->n) {
+      release(&ptable.lock);
+      return;
+    }
+  }
+  c->idle = 1;
+  ptable.nidle++;
+  if (c != cpus)
+    lapiconeshot(0);
+  else if (ptable.nidle == ncpu && seq == timerseq) {
+    c->tickless = 1;
+    lapiconeshot(n ? n : NTIMERWHEEL);
+  }
+  release(&ptable.lock);
+  t0 = ticks;
+
+  // sti takes effect only after the next instruction, so an interrupt
+  // seen from then on ends the hlt
+  asm volatile("sti; hlt");
+
+  acquire(&ptable.lock);
+  if (c->idle) {
+    c->idle = 0;
+    ptable.nidle--;
+  }
+  release(&ptable.lock);
+  if (c->tickless) {
+    n = lapiconeshotticks();
+    lapicperiodic();
+    c->tickless = 0;
+    tickadvance(n);
+  } else if (c != cpus) {
+    lapicperiodic();
+  }
+  c->idleticks += ticks - t0;
+}
+
+// Takes the next process for this cpu off its run queue, from the highest
+// level with any, or, if that is empty, steals the one the longest other
+// queue would run next. Returns 0 if nothing is RUNNABLE. Caller must
+// hold ptable.lock.
+static struct proc *runqpop(void) {
+  struct runq *rq, *q;
+  struct proc *p;
+  int i;
+
+  rq = &ptable.runq[mycpu() - cpus];
+  if (rq->n == 0) {
+    for (q = ptable.runq; q < &ptable.runq[ncpu]; q++)
+      if (q->n > rq->n)
+        rq = q;
+    if (rq->n == 0)
+      return 0;
+  }
+
+  for (i = 0; rq->head[i] == 0; i++)
+    ;
+  p = rq->head[i];
+  rq->head[i] = p->qnext;
+  if (rq->head[i] == 0)
+    rq->tail[i] = 0;
+  rq->n--;
+  return p;
+}
+
+// Charges the running process for a timer tick. Returns 1 if it should
+// give up the cpu: its time slice is used up, or a process of a higher
+// level is waiting for this cpu.
+int timeslice(void) {
+  struct proc *p = myproc();
+  struct runq *rq;
+  int i, quantum, yield = 0;
+
+  acquire(&ptable.lock);
+  quantum = SCHED_MLFQ ? QUANTUM << p->prio : QUANTUM;
+  if (++p->slice >= quantum) {
+    p->slice = 0;
+    if (SCHED_MLFQ && p->prio < NPRIO - 1)
+      p->prio++;
+    yield = 1;
+  }
+  rq = &ptable.runq[mycpu() - cpus];
+  for (i = 0; i < p->prio; i++)
+    if (rq->head[i])
+      yield = 1;
+  release(&ptable.lock);
+  return yield;
+}
+
+// Moves every process back up to its base level, so that those MLFQ has
+// sunk to the bottom still get to run. The timer calls it every
+// PRIOBOOST ticks.
+void prioboost(void) {
+  struct runq *rq;
+  struct proc *p, *q, *all, **end;
+  int i;
+
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    p->prio = p->baseprio;
+    p->slice = 0;
+  }
+
+  // requeue the RUNNABLE ones at their new levels, keeping their order
+  for (rq = ptable.runq; rq < &ptable.runq[ncpu]; rq++) {
+    all = 0;
+    end = &all;
+    for (i = 0; i < NPRIO; i++) {
+      if (rq->head[i]) {
+        *end = rq->head[i];
+        end = &rq->tail[i]->qnext;
+      }
+      rq->head[i] = rq->tail[i] = 0;
+    }
+    rq->n = 0;
+    for (p = all; p; p = q) {
+      q = p->qnext;
+      makerunnable(p);
+    }
+  }
+  release(&ptable.lock);
+}
+
+// Sets the base priority level of the process with the given pid, 0 the
+// highest, and moves it to that level. Returns 0, or -1 if there is no
+// such process or level.
+int setpriority(int pid, int prio) {
+  struct proc *p;
+
+  if (prio < 0 || prio >= NPRIO)
+    return -1;
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    if (p->pid == pid && p->state != UNUSED) {
+      // a RUNNABLE process is queued at its old level until it next runs
+      p->baseprio = p->prio = prio;
+      p->slice = 0;
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Caps the pages in memory of the process with the given pid, and of
+// the threads sharing its vspace, at pages, or 0 for no cap. Over it,
+// reclaim takes their pages before anyone else's. Returns 0, or -1 if
+// there is no such process.
+int memlimit(int pid, int pages) {
+  struct proc *p;
+
+  if (pages < 0)
+    return -1;
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    if (p->pid == pid && p->state != UNUSED && p->vspace) {
+      p->vspace->memlimit = pages;
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -255,19 +718,19 @@ void scheduler(void) {
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
     acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if (p->state != RUNNABLE)
-        continue;
-
+    if ((p = runqpop()) != 0) {
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       mycpu()->proc = p;
+      p->cpu = mycpu() - cpus;
       vspaceinstall(p);
       p->state = RUNNING;
+      context_switches++;
+      traceevent(TR_RUN, TR_BEGIN, p->pid);
       swtch(&mycpu()->scheduler, p->context);
+      traceevent(TR_RUN, TR_END, p->pid);
       vspaceinstallkern();
 
       // Process is done running for now.
@@ -275,6 +738,10 @@ void scheduler(void) {
       mycpu()->proc = 0;
     }
     release(&ptable.lock);
+
+    // idle: get a page ready for the next kzalloc, or else halt
+    if (!p && !kzeroidle())
+      idle();
   }
 }
 
@@ -310,7 +777,7 @@ void sched(void) {
 // Give up the CPU for one scheduling round.
 void yield(void) {
   acquire(&ptable.lock); // DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  makerunnable(myproc());
   sched();
   release(&ptable.lock);
 }
@@ -328,11 +795,37 @@ void forkret(void) {
     // be run from main().
     first = 0;
     iinit(ROOTDEV);
+    ksminit();
   }
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// The wait list for chan.
+static struct proc **sleepqhead(void *chan) {
+  uint64_t a = (uint64_t)chan;
+
+  return &ptable.sleepq[(a ^ (a >> 6) ^ (a >> 12)) % NSLEEPQ];
+}
+
+// Puts the SLEEPING process p on the wait list for p->chan.
+// Caller must hold ptable.lock.
+static void sleepqadd(struct proc *p) {
+  struct proc **pp = sleepqhead(p->chan);
+
+  p->qnext = *pp;
+  *pp = p;
+}
+
+// Takes p off the wait list for p->chan. Caller must hold ptable.lock.
+static void sleepqremove(struct proc *p) {
+  struct proc **pp;
+
+  for (pp = sleepqhead(p->chan); *pp != p; pp = &(*pp)->qnext)
+    ;
+  *pp = p->qnext;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk) {
@@ -354,8 +847,10 @@ void sleep(void *chan, struct spinlock *lk) {
   }
 
   // Go to sleep.
+  traceevent(TR_SLEEP, TR_INSTANT, (uint64_t)chan);
   myproc()->chan = chan;
   myproc()->state = SLEEPING;
+  sleepqadd(myproc());
   sched();
 
   // Tidy up.
@@ -371,11 +866,18 @@ void sleep(void *chan, struct spinlock *lk) {
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
 static void wakeup1(void *chan) {
-  struct proc *p;
-
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct proc **pp, *p;
+
+  for (pp = sleepqhead(chan); (p = *pp) != 0;) {
+    if (p->chan == chan) {
+      *pp = p->qnext;
+      makerunnable(p);
+      wakeups++;
+      traceevent(TR_WAKEUP, TR_INSTANT, p->pid);
+    } else {
+      pp = &p->qnext;
+    }
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -385,6 +887,42 @@ void wakeup(void *chan) {
   release(&ptable.lock);
 }
 
+// Wake up at most n of the processes sleeping on chan, the ones that
+// have slept longest first. Returns how many it woke.
+int wakeupn(void *chan, int n) {
+  struct proc **pp, **last, *p;
+  int woken;
+
+  acquire(&ptable.lock);
+  // the list has the newest first
+  for (woken = 0; woken < n; woken++) {
+    last = 0;
+    for (pp = sleepqhead(chan); (p = *pp) != 0; pp = &p->qnext)
+      if (p->chan == chan)
+        last = pp;
+    if (last == 0)
+      break;
+    p = *last;
+    *last = p->qnext;
+    makerunnable(p);
+    traceevent(TR_WAKEUP, TR_INSTANT, p->pid);
+  }
+  wakeups += woken;
+  release(&ptable.lock);
+  return woken;
+}
+
+// Mark p killed, so that it exits on its way back to user space.
+// Caller must hold ptable.lock.
+static void killproc(struct proc *p) {
+  p->killed = 1;
+  // Wake process from sleep if necessary.
+  if (p->state == SLEEPING) {
+    sleepqremove(p);
+    makerunnable(p);
+  }
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -394,10 +932,7 @@ int kill(int pid) {
   acquire(&ptable.lock);
   for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
     if (p->pid == pid) {
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if (p->state == SLEEPING)
-        p->state = RUNNABLE;
+      killproc(p);
       release(&ptable.lock);
       return 0;
     }
@@ -406,6 +941,31 @@ int kill(int pid) {
   return -1;
 }
 
+// Fills in the first n entries of st, by system call number, with the
+// calls of the process pid, and then its faults and memory. Returns how many, or -1 if there is no such
+// process.
+int procsysstats(int pid, struct sysstat *st, int n) {
+  struct proc *p;
+  int i;
+
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    if (p->pid == pid && p->state != UNUSED) {
+      for (i = 0; i < n; i++) {
+        memset(&st[i], 0, sizeof(st[i]));
+        st[i].count = p->ncalls[i];
+        st[i].cycles = p->callcycles[i];
+        if (i >= NSYSCALL + NFAULT)
+          st[i].count = vspacememstat(p->vspace, i - NSYSCALL - NFAULT);
+      }
+      release(&ptable.lock);
+      return n;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -413,6 +973,9 @@ void procdump(void) {
   static char *states[] = {[UNUSED] = "unused",   [EMBRYO] = "embryo",
                            [SLEEPING] = "sleep ", [RUNNABLE] = "runble",
                            [RUNNING] = "run   ",  [ZOMBIE] = "zombie"};
+  static char *faults[] = {[FAULT_FATAL] = "fatal", [FAULT_LAZY] = "lazy",
+                           [FAULT_SWAPIN] = "swapin", [FAULT_STACK] = "stack",
+                           [FAULT_COW] = "cow",     [FAULT_RACE] = "race"};
   int i;
   struct proc *p;
   char *state;
@@ -426,6 +989,16 @@ void procdump(void) {
     else
       state = "???";
     cprintf("%d %s %s", p->pid, state, p->name);
+    for (i = 0; i < NFAULT; i++)
+      if (p->ncalls[NSYSCALL + i])
+        cprintf(" %s=%d", faults[i], (int)p->ncalls[NSYSCALL + i]);
+    if (p->vspace) {
+      cprintf(" rss=%d ws=%d", p->vspace->rss, p->vspace->wss);
+      if (p->vspace->swapped)
+        cprintf(" swap=%d", p->vspace->swapped);
+      if (p->vspace->memlimit)
+        cprintf(" limit=%d", p->vspace->memlimit);
+    }
     if (p->state == SLEEPING) {
       getcallerpcs((uint64_t *)p->context->rbp, pc);
       for (i = 0; i < 10 && pc[i] != 0; i++)
@@ -450,35 +1023,11 @@ int ftablecopy(struct proc* dst, struct proc* src) {
   }
 
   int fd;
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (src->files[fd] != NULL) {
-      acquiresleep(&(src->files[fd]->lock));
-      dst->files[fd] = src->files[fd];
-      dst->files[fd]->ref++;
-      releasesleep(&(src->files[fd]->lock));
-    }
+  for (fd = fdnext(src, 0); fd < NOFILE; fd = fdnext(src, fd + 1)) {
+    acquiresleep(&(src->files[fd]->lock));
+    fdinstall(dst, fd, src->files[fd]);
+    dst->files[fd]->ref++;
+    releasesleep(&(src->files[fd]->lock));
   }
   return 0;
 }
-
-int markswapped(uint64_t ppn, uint swap_index, uint64_t va) {
-  struct proc *p;
-  int count = 0;
-
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    count += vspacemarkswapped(ppn, swap_index, va, &p->vspace);
-  }
-
-  return count;
-}
-
-int updatecowreferences(uint64_t ppn, uint swap_idx, uint64_t va) {
-  struct proc *p;
-  int count = 0;
-
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    count += vspaceupdatecow(ppn, swap_idx, va, &p->vspace);
-  }
-
-  return count;
-}
\ No newline at end of file
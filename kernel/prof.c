@@ -0,0 +1,131 @@
+// A sampling profiler. While it is on, every cpu's timer tick records
+// the pc it interrupted and the return addresses up the frame pointer
+// chain, in the kernel or in the process, for profdump to hand out.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <prof.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <trap.h>
+#include <vspace.h>
+
+static struct {
+  struct spinlock lock;
+  int on;
+  uint head;    // next sample written
+  uint tail;    // next sample profdump hands out
+  uint dropped; // samples lost to a full buffer since profiling started
+  struct profsample s[NPROF];
+} prof;
+
+void profinit(void) {
+  initlock(&prof.lock, "prof");
+}
+
+// Reads the word at user address va of vs, if its page is in memory,
+// through the kernel's map of physical memory, so as never to fault.
+static int userword(struct vspace *vs, uint64_t va, uint64_t *w) {
+  uint64_t ppn;
+
+  if (va % sizeof(uint64_t) != 0 || va >= KERNBASE ||
+      !vspacepresent(vs, va, &ppn))
+    return 0;
+  *w = *(uint64_t *)((char *)P2V(ppn << PT_SHIFT) + va % PGSIZE);
+  return 1;
+}
+
+// The return addresses up the frame pointer chain from rbp.
+static void callers(struct trap_frame *tf, uint64_t *pcs, int n) {
+  struct vspace *vs;
+  uint64_t *rbp = (uint64_t *)tf->rbp;
+  uint64_t fp[2];
+  int i;
+
+  if ((tf->cs & 3) == 0) {
+    for (i = 0; i < n; i++) {
+      if (rbp == 0 || rbp < (uint64_t *)PHYSBASE ||
+          rbp == (uint64_t *)0xffffffffffffffff)
+        break;
+      pcs[i] = rbp[1];
+      rbp = (uint64_t *)rbp[0];
+    }
+    return;
+  }
+
+  // other threads might be changing a shared address space
+  vs = myproc()->vspace;
+  if (vs->ref > 1)
+    return;
+  for (i = 0; i < n; i++) {
+    if (rbp == 0 || !userword(vs, (uint64_t)rbp, &fp[0]) ||
+        !userword(vs, (uint64_t)(rbp + 1), &fp[1]))
+      break;
+    pcs[i] = fp[1];
+    rbp = (uint64_t *)fp[0];
+  }
+}
+
+// Takes a sample of what the timer interrupt tf interrupted.
+void proftick(struct trap_frame *tf) {
+  struct profsample s;
+  struct proc *p = myproc();
+
+  if (!prof.on)
+    return;
+
+  memset(&s, 0, sizeof(s));
+  s.pcs[0] = tf->rip;
+  s.user = (tf->cs & 3) == DPL_USER;
+  if (p) {
+    s.pid = p->pid;
+    safestrcpy(s.name, p->name, sizeof(s.name));
+  }
+  callers(tf, s.pcs + 1, PROFDEPTH - 1);
+
+  acquire(&prof.lock);
+  if (prof.head - prof.tail < NPROF)
+    prof.s[prof.head++ % NPROF] = s;
+  else
+    prof.dropped++;
+  release(&prof.lock);
+}
+
+// Turns the profiler on, throwing away the samples not yet handed out,
+// or off. Returns the count of samples dropped since it was turned on.
+int profile(int on) {
+  int dropped;
+
+  acquire(&prof.lock);
+  dropped = prof.dropped;
+  if (on) {
+    prof.tail = prof.head;
+    prof.dropped = 0;
+  }
+  prof.on = on;
+  release(&prof.lock);
+  return dropped;
+}
+
+// Moves at most n samples, the oldest first, to user memory at buf.
+// Returns how many.
+int profdump(struct profsample *buf, int n) {
+  struct profsample s;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    acquire(&prof.lock);
+    if (prof.tail == prof.head) {
+      release(&prof.lock);
+      break;
+    }
+    s = prof.s[prof.tail++ % NPROF];
+    release(&prof.lock);
+    // copied out without the lock, as the copy may fault
+    buf[i] = s;
+  }
+  return i;
+}
@@ -0,0 +1,114 @@
+// Named shared-memory segments.
+//
+// shm_open names a segment, making it if it is new; shm_map maps the
+// whole of it into the process. Every mapping shares the segment's pages,
+// as a fork shares a MAP_SHARED region, so the pages are referenced and
+// swapped through the core map and the swap map like any shared page.
+// The segment keeps its pages in a region of a vspace of its own, which
+// the reverse maps name like any other; shm_unlink drops that, and the
+// pages go once the last mapping is unmapped too.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <mman.h>
+#include <param.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <vspace.h>
+
+#define SHMNAME 16 // bytes of a segment's name, with its nul
+
+struct shm {
+  char name[SHMNAME]; // "" if the slot is free
+  struct vspace *vs;  // holds the pages at VR_MMAP
+};
+
+static struct {
+  // held while a segment is made or mapped, which allocates
+  struct sleeplock lock;
+  struct shm segs[NSHM];
+} shmtab;
+
+void shminit(void) {
+  initsleeplock(&shmtab.lock, "shm");
+}
+
+static struct shm *shmlookup(char *name) {
+  struct shm *s;
+
+  for (s = shmtab.segs; s < &shmtab.segs[NSHM]; s++)
+    if (s->name[0] && strncmp(s->name, name, SHMNAME) == 0)
+      return s;
+  return 0;
+}
+
+// Opens the segment called name, making it size bytes of zeroed memory
+// if there is none. Returns its id, or -1 if the name is too long, or if
+// there is no such segment and size is 0, or one smaller than size.
+int shmopen(char *name, int size) {
+  struct shm *s;
+  struct vregion *vr;
+
+  if (strlen(name) == 0 || strlen(name) >= SHMNAME || size < 0)
+    return -1;
+
+  acquiresleep(&shmtab.lock);
+  if ((s = shmlookup(name)) != 0) {
+    vr = &s->vs->regions[VR_MMAP];
+    releasesleep(&shmtab.lock);
+    return size <= vr->size ? s - shmtab.segs : -1;
+  }
+
+  for (s = shmtab.segs; s < &shmtab.segs[NSHM]; s++)
+    if (s->name[0] == 0)
+      break;
+  if (size == 0 || s == &shmtab.segs[NSHM] || (s->vs = vspacealloc()) == 0) {
+    releasesleep(&shmtab.lock);
+    return -1;
+  }
+  if (vspacemmap(s->vs, 0, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, 0, 0) == (uint64_t)-1) {
+    vspaceput(s->vs);
+    releasesleep(&shmtab.lock);
+    return -1;
+  }
+  safestrcpy(s->name, name, SHMNAME);
+  releasesleep(&shmtab.lock);
+  return s - shmtab.segs;
+}
+
+// Maps the whole of segment id into the current process, read-write.
+// Returns the address of the mapping, or -1.
+uint64_t shmmap(int id) {
+  struct vspace *vs = myproc()->vspace;
+  uint64_t va = -1;
+  int locked;
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+  acquiresleep(&shmtab.lock);
+  if (shmtab.segs[id].name[0]) {
+    locked = vspacelockfault(vs);
+    va = vspacemapshared(vs, &shmtab.segs[id].vs->regions[VR_MMAP]);
+    vspaceunlockfault(vs, locked);
+  }
+  releasesleep(&shmtab.lock);
+  return va;
+}
+
+// Removes the name of a segment. Its pages stay with the mappings of it
+// there are. Returns 0, or -1 if there is no such segment.
+int shmunlink(char *name) {
+  struct shm *s;
+
+  acquiresleep(&shmtab.lock);
+  if ((s = shmlookup(name)) == 0) {
+    releasesleep(&shmtab.lock);
+    return -1;
+  }
+  s->name[0] = 0;
+  vspaceput(s->vs);
+  s->vs = 0;
+  releasesleep(&shmtab.lock);
+  return 0;
+}
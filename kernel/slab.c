@@ -0,0 +1,179 @@
+// Slab allocator.
+//
+// Small kernel objects (page-info chains, pipes) would waste most of a
+// page each if they came from kalloc directly. A slab cache instead
+// carves each page it takes into objects of one type: the page starts
+// with a struct slab header, followed by the objects, each with a link
+// word after it that chains the page's free objects without touching
+// the object itself.
+//
+// Each CPU keeps a few free objects of each cache, so most allocations
+// and frees do not take the cache's lock. A page whose objects are all
+// free goes back to kalloc.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <proc.h>
+#include <slab.h>
+
+struct slab {
+  struct slabcache *cache;
+  struct slab *prev; // cache's partial list
+  struct slab *next;
+  char *free;        // free objects, through their link words
+  int inuse;         // objects handed out, magazines included
+};
+
+#define ROUNDUP(n, a) (((n) + (a)-1) / (a) * (a))
+// an object's link word, and the first object of a slab
+#define LINK(c, obj) (*(char **)((obj) + (c)->size - sizeof(char *)))
+#define FIRSTOBJ(s) ((char *)(s) + ROUNDUP(sizeof(struct slab), sizeof(char *)))
+
+int slab_pages;   // pages held by all caches
+int slab_objects; // objects allocated and not yet freed
+
+static void slabunlink(struct slabcache *c, struct slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  s->prev = s->next = 0;
+}
+
+static void slablink(struct slabcache *c, struct slab *s) {
+  s->prev = 0;
+  s->next = c->partial;
+  if (c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Set up c for objects of size bytes, each passed to ctor, if it is
+// not 0, when its page joins the cache.
+void slabcreate(struct slabcache *c, char *name, uint size,
+                void (*ctor)(void *)) {
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->size = ROUNDUP(size, sizeof(char *)) + sizeof(char *);
+  if (c->size > PGSIZE - ROUNDUP(sizeof(struct slab), sizeof(char *)))
+    panic("slabcreate: object too big");
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+}
+
+// Take a fresh page for c and put it on the partial list.
+// Returns 0 if kalloc has no page.
+static struct slab *slabgrow(struct slabcache *c) {
+  struct slab *s;
+  char *obj;
+
+  if ((s = (struct slab *)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for (obj = FIRSTOBJ(s); obj + c->size <= (char *)s + PGSIZE; obj += c->size) {
+    if (c->ctor)
+      c->ctor(obj);
+    LINK(c, obj) = s->free;
+    s->free = obj;
+  }
+
+  acquire(&c->lock);
+  slablink(c, s);
+  slab_pages++;
+  release(&c->lock);
+  return s;
+}
+
+// Take an object off a slab of c, leaving up to SLABMAG / 2 more on
+// this CPU's magazine. Caller must hold c->lock.
+static char *slabtake(struct slabcache *c) {
+  struct slab *s;
+  char *obj, *first = 0;
+  int m = mycpu() - cpus;
+
+  while ((s = c->partial) != 0) {
+    obj = s->free;
+    s->free = LINK(c, obj);
+    s->inuse++;
+    if (s->free == 0)
+      slabunlink(c, s);
+    if (!first)
+      first = obj;
+    else
+      c->mag[m].objs[c->mag[m].n++] = obj;
+    if (c->mag[m].n >= SLABMAG / 2)
+      break;
+  }
+  return first;
+}
+
+// Return an object of c, or 0 if there is no memory.
+void *slaballoc(struct slabcache *c) {
+  char *obj = 0;
+  int m;
+
+  pushcli();
+  m = mycpu() - cpus;
+  if (c->mag[m].n > 0) {
+    obj = c->mag[m].objs[--c->mag[m].n];
+    slab_objects++;
+  }
+  popcli();
+  if (obj)
+    return obj;
+
+  acquire(&c->lock);
+  if (!c->partial) {
+    release(&c->lock);
+    if (!slabgrow(c))
+      return 0;
+    acquire(&c->lock);
+  }
+  obj = slabtake(c);
+  if (obj)
+    slab_objects++;
+  release(&c->lock);
+  return obj;
+}
+
+// Give obj back to its cache. It must be in its constructed state.
+void slabfree(void *v) {
+  char *obj = v;
+  struct slab *s = (struct slab *)PGROUNDDOWN((uint64_t)obj);
+  struct slabcache *c = s->cache;
+  int m;
+
+  pushcli();
+  slab_objects--;
+  m = mycpu() - cpus;
+  if (c->mag[m].n < SLABMAG) {
+    c->mag[m].objs[c->mag[m].n++] = obj;
+    popcli();
+    return;
+  }
+  popcli();
+
+  acquire(&c->lock);
+  if (s->free == 0)
+    slablink(c, s);
+  LINK(c, obj) = s->free;
+  s->free = obj;
+  // an empty page goes back to kalloc unless it is the cache's last,
+  // so that a lone object coming and going doesn't thrash kalloc
+  if (--s->inuse == 0 && (c->partial != s || s->next != 0)) {
+    slabunlink(c, s);
+    slab_pages--;
+  } else {
+    s = 0;
+  }
+  release(&c->lock);
+
+  if (s)
+    kfree((char *)s);
+}
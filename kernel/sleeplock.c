@@ -14,18 +14,38 @@ void initsleeplock(struct sleeplock *lk, char *name) {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->writers = 0;
   lk->pid = 0;
+  lk->proc = 0;
 }
 
 // a sleeping lock relinquishes the processor if the lock is busy
 // note mesa semantics: process can wakeup and find the lock still busy
+//
+// but while the holder is running, on another cpu, the waiter spins a
+// while first: inode and buffer locks are mostly held for less time
+// than a sleep and a wakeup take
 void acquiresleep(struct sleeplock *lk) {
+  struct proc *p;
+  int i;
+
+  for (i = 0; i < SLEEPSPIN && lk->locked; i++) {
+    p = lk->proc;
+    if (p == 0 || p->state != RUNNING)
+      break;
+    asm volatile("pause" ::: "memory");
+  }
+
   acquire(&lk->lk);
-  while (lk->locked) { 
+  lk->writers++;
+  while (lk->locked || lk->readers) {
     sleep(lk, &lk->lk);
   }
+  lk->writers--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->proc = myproc();
   release(&lk->lk);
 }
 
@@ -34,15 +54,34 @@ void releasesleep(struct sleeplock *lk) {
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->proc = 0;
   wakeup(lk); 
   release(&lk->lk);
 }
 
-int holdingsleep(struct sleeplock *lk) {
-  int r;
+// Share lk with other readers. New readers wait while a process waits
+// to hold lk, so that a stream of readers cannot keep it out.
+void acquiresleepshared(struct sleeplock *lk) {
+  acquire(&lk->lk);
+  while (lk->locked || lk->writers)
+    sleep(lk, &lk->lk);
+  lk->readers++;
+  release(&lk->lk);
+}
 
+void releasesleepshared(struct sleeplock *lk) {
   acquire(&lk->lk);
-  r = lk->locked;
+  if (lk->readers <= 0)
+    panic("releasesleepshared");
+  if (--lk->readers == 0)
+    wakeup(lk);
   release(&lk->lk);
-  return r;
+}
+
+// Is the calling process holding lk? No lock is needed: lk->pid is its
+// pid only if it set it, and only it clears it.
+int holdingsleep(struct sleeplock *lk) {
+  struct proc *p = myproc();
+
+  return p && *(volatile int *)&lk->pid == p->pid;
 }
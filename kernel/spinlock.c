@@ -4,15 +4,33 @@
 #include <defs.h>
 #include <memlayout.h>
 #include <mmu.h>
+#include <msr.h>
 #include <param.h>
 #include <proc.h>
 #include <spinlock.h>
 #include <x86_64.h>
 
+#define NLOCKSTAT 80
+
+// Locks whose contention statistics lockdump() prints.
+static struct spinlock *lockstats[NLOCKSTAT];
+static int nlockstat;
+
 void initlock(struct spinlock *lk, char *name) {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->nspin = 0;
+  lk->maxhold = 0;
+}
+
+// Have lockdump() print lk's contention statistics. Only
+// for locks that live as long as the kernel.
+void lockstat(struct spinlock *lk) {
+  if (nlockstat < NLOCKSTAT)
+    lockstats[nlockstat++] = lk;
 }
 
 // Acquire the lock.
@@ -20,31 +38,48 @@ void initlock(struct spinlock *lk, char *name) {
 // Holding a lock for a long time may cause
 // other CPUs to waste time spinning to acquire it.
 void acquire(struct spinlock *lk) {
+  uint ticket;
+  uint64_t spins = 0;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if (holding(lk)) {
     cprintf(lk->name);
     panic("acquire");
   }
 
-  // The xchg is atomic.
-  while (xchg(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket, atomically, and wait for it to come up.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  while (*(volatile uint *)&lk->owner != ticket) {
+    spins++;
+    asm volatile("pause");
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
   // references happen after the lock is acquired.
   __sync_synchronize();
 
+  lk->nacquire++;
+  lk->nspin += spins;
+  lk->tacquire = readtsc();
+
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
-  getcallerpcs(&lk, lk->pcs);
+  if (LOCKDEBUG)
+    getcallerpcs(&lk, lk->pcs);
 }
 
 // Release the lock.
 void release(struct spinlock *lk) {
+  uint64_t held;
+
   if (!holding(lk))
     panic("release");
 
+  held = readtsc() - lk->tacquire;
+  if (held > lk->maxhold)
+    lk->maxhold = held;
+
   lk->pcs[0] = 0;
   lk->cpu = 0;
 
@@ -55,10 +90,10 @@ void release(struct spinlock *lk) {
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
+  // Release the lock to the next ticket, equivalent to lk->owner++.
   // This code can't use a C assignment, since it might
   // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m"(lk->locked) :);
+  asm volatile("incl %0" : "+m"(lk->owner) :);
 
   popcli();
 }
@@ -71,7 +106,7 @@ void getcallerpcs(void *v, uint64_t pcs[]) {
   asm volatile("mov %%rbp, %0" : "=r"(rbp));
 
   for (i = 0; i < 10; i++) {
-    if (rbp == 0 || rbp < (uint64_t *)KERNBASE ||
+    if (rbp == 0 || rbp < (uint64_t *)PHYSBASE ||
         rbp == (uint64_t *)0xffffffffffffffff)
       break;
     pcs[i] = rbp[1];          // saved %eip
@@ -83,7 +118,37 @@ void getcallerpcs(void *v, uint64_t pcs[]) {
 
 // Check whether this cpu is holding the lock.
 int holding(struct spinlock *lock) {
-  return lock->locked && lock->cpu == mycpu();
+  return lock->owner != lock->next && lock->cpu == mycpu();
+}
+
+// Print the contention statistics of the locks given to lockstat(),
+// summing those initialized with the same name. For debugging.
+// Runs when user types ^L on console.
+// No lock to avoid wedging a stuck machine further.
+void lockdump(void) {
+  struct spinlock *lk;
+  uint64_t nacquire, nspin, maxhold;
+  int i, j;
+
+  cprintf("lock acquires spins maxhold\n");
+  for (i = 0; i < nlockstat; i++) {
+    for (j = 0; j < i && lockstats[j]->name != lockstats[i]->name; j++)
+      ;
+    if (j < i)
+      continue;
+    nacquire = nspin = maxhold = 0;
+    for (j = i; j < nlockstat; j++) {
+      lk = lockstats[j];
+      if (lk->name != lockstats[i]->name)
+        continue;
+      nacquire += lk->nacquire;
+      nspin += lk->nspin;
+      if (lk->maxhold > maxhold)
+        maxhold = lk->maxhold;
+    }
+    cprintf("%s %ld %ld %ld\n", lockstats[i]->name, nacquire, nspin,
+            maxhold);
+  }
 }
 
 // Pushcli/popcli are like cli/sti except that they are matched:
@@ -1,12 +1,98 @@
 #include <cdefs.h>
+#include <cpuid.h>
+#include <mmu.h>
 #include <x86_64.h>
 
+// The copy and fill routines move 8-byte words, with rep movsq and rep
+// stosq, but for a few odd bytes at either end. A CPU with ERMS (fast
+// rep movsb and stosb) does the whole thing faster in bytes itself.
+static int erms;
+
+// Picks the copy routines for this CPU, from its cpuid feature bits.
+void stringinit(void) { erms = cpuid_feature(CPUID_FEATURE_ERMS); }
+
+static inline void stosq(void *addr, uint64_t data, uint64_t cnt) {
+  asm volatile("cld; rep stosq"
+               : "=D"(addr), "=c"(cnt)
+               : "0"(addr), "1"(cnt), "a"(data)
+               : "memory", "cc");
+}
+
+static inline void movsb(void *dst, const void *src, uint64_t cnt) {
+  asm volatile("cld; rep movsb"
+               : "=D"(dst), "=S"(src), "=c"(cnt)
+               : "0"(dst), "1"(src), "2"(cnt)
+               : "memory", "cc");
+}
+
+static inline void movsq(void *dst, const void *src, uint64_t cnt) {
+  asm volatile("cld; rep movsq"
+               : "=D"(dst), "=S"(src), "=c"(cnt)
+               : "0"(dst), "1"(src), "2"(cnt)
+               : "memory", "cc");
+}
+
+// rep movsq from the top down: dst and src are the last words.
+static inline void movsqdown(void *dst, const void *src, uint64_t cnt) {
+  asm volatile("std; rep movsq; cld"
+               : "=D"(dst), "=S"(src), "=c"(cnt)
+               : "0"(dst), "1"(src), "2"(cnt)
+               : "memory", "cc");
+}
+
+// Copies the page-aligned page at src to dst with non-temporal stores,
+// which go around the cache: a page copied whole, as a copy-on-write
+// break, would otherwise push out a page's worth of the cache to make
+// room for data that is not read again soon.
+void copy_page(void *dst, const void *src) {
+  uint64_t *d = dst;
+  const uint64_t *s = src;
+  int i;
+
+  for (i = 0; i < PGSIZE / 8; i += 4) {
+    asm volatile("movnti %1, %0" : "=m"(d[i]) : "r"(s[i]));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 1]) : "r"(s[i + 1]));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 2]) : "r"(s[i + 2]));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 3]) : "r"(s[i + 3]));
+  }
+  // the stores are weakly ordered; finish them before the page is used
+  asm volatile("sfence" ::: "memory");
+}
+
+// Zeroes the page-aligned page at dst with non-temporal stores.
+void zero_page(void *dst) {
+  uint64_t *d = dst;
+  int i;
+
+  for (i = 0; i < PGSIZE / 8; i += 4) {
+    asm volatile("movnti %1, %0" : "=m"(d[i]) : "r"(0UL));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 1]) : "r"(0UL));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 2]) : "r"(0UL));
+    asm volatile("movnti %1, %0" : "=m"(d[i + 3]) : "r"(0UL));
+  }
+  asm volatile("sfence" ::: "memory");
+}
+
 void *memset(void *dst, int c, uint n) {
-  if ((int64_t)dst % 4 == 0 && n % 4 == 0) {
-    c &= 0xFF;
-    stosl(dst, (c << 24) | (c << 16) | (c << 8) | c, n / 4);
-  } else
+  uchar *d = dst;
+
+  c &= 0xFF;
+  // whole pages, as kzalloc's, go to zero_page
+  if (c == 0 && n == PGSIZE && (uint64_t)dst % PGSIZE == 0) {
+    zero_page(dst);
+    return dst;
+  }
+  if (erms) {
     stosb(dst, c, n);
+    return dst;
+  }
+  // bytes up to a word boundary, words, and the bytes left
+  for (; n > 0 && (uint64_t)d % 8 != 0; n--)
+    *d++ = c;
+  stosq(d, c * 0x0101010101010101ULL, n / 8);
+  d += n & ~7;
+  for (n %= 8; n > 0; n--)
+    *d++ = c;
   return dst;
 }
 
@@ -30,14 +116,27 @@ void *memmove(void *dst, const void *src, uint n) {
 
   s = src;
   d = dst;
+  // whole pages, as copy-on-write breaks, go to copy_page
+  if (n == PGSIZE && (uint64_t)s % PGSIZE == 0 && (uint64_t)d % PGSIZE == 0 &&
+      s != d) {
+    copy_page(d, s);
+    return dst;
+  }
   if (s < d && s + n > d) {
+    // overlapping, with dst above: copy from the top down, the odd
+    // bytes first, then the words below them
     s += n;
     d += n;
-    while (n-- > 0)
+    for (; n % 8 != 0; n--)
       *--d = *--s;
-  } else
-    while (n-- > 0)
-      *d++ = *s++;
+    if (n > 0)
+      movsqdown(d - 8, s - 8, n / 8);
+  } else if (erms) {
+    movsb(d, s, n);
+  } else {
+    movsq(d, s, n / 8);
+    movsb(d + (n & ~7), s + (n & ~7), n % 8);
+  }
 
   return dst;
 }
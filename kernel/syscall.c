@@ -2,10 +2,12 @@
 #include <defs.h>
 #include <memlayout.h>
 #include <mmu.h>
+#include <msr.h>
 #include <param.h>
 #include <proc.h>
 #include <syscall.h>
 #include <sysinfo.h>
+#include <sysstat.h>
 #include <trap.h>
 #include <x86_64.h>
 #include <vspace.h>
@@ -22,7 +24,7 @@
   { \
     struct vregion *r; \
     struct vspace *v; \
-    v = &myproc()->vspace; \
+    v = myproc()->vspace; \
     for (r = v->regions; r < &v->regions[NREGIONS]; r++) { \
       if (vregioncontains(r, addr, sizeof(type))) { \
         *ip = *(type *)(addr); \
@@ -51,7 +53,7 @@ fetchstr(uint64_t addr, char **pp)
   struct vspace *v;
   char *s, *ep;
 
-  v = &myproc()->vspace;
+  v = myproc()->vspace;
   for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
     if (vregioncontains(r, addr, 0)) {
       *pp = (char*)addr;
@@ -108,7 +110,7 @@ int argptr(int n, char **pp, int size) {
   if (size < 0)
     return -1;
 
-  v = &myproc()->vspace;
+  v = myproc()->vspace;
   for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
     if (vregioncontains(r, i, size)) {
       *pp = (char*)i;
@@ -147,6 +149,32 @@ extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_sysinfo(void);
 extern int sys_crashn(void);
+extern int sys_getdents(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_spawn(void);
+extern int sys_setpriority(void);
+extern int sys_splice(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_ioringsetup(void);
+extern int sys_ioringenter(void);
+extern int sys_clone(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_shm_open(void);
+extern int sys_shm_map(void);
+extern int sys_shm_unlink(void);
+extern int sys_stats(void);
+extern int sys_tracedump(void);
+extern int sys_profile(void);
+extern int sys_profdump(void);
+extern int sys_fsync(void);
+extern int sys_unlink(void);
+extern int sys_ftruncate(void);
+extern int sys_memlimit(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -158,31 +186,133 @@ static int (*syscalls[])(void) = {
     [SYS_uptime] = sys_uptime,   [SYS_open] = sys_open,
     [SYS_write] = sys_write,     [SYS_close] = sys_close,
     [SYS_sysinfo] = sys_sysinfo, [SYS_crashn] = sys_crashn,
+    [SYS_getdents] = sys_getdents, [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,   [SYS_spawn] = sys_spawn,
+    [SYS_setpriority] = sys_setpriority, [SYS_splice] = sys_splice,
+    [SYS_pread] = sys_pread,     [SYS_pwrite] = sys_pwrite,
+    [SYS_readv] = sys_readv,     [SYS_writev] = sys_writev,
+    [SYS_ioringsetup] = sys_ioringsetup, [SYS_ioringenter] = sys_ioringenter,
+    [SYS_clone] = sys_clone,     [SYS_futex_wait] = sys_futex_wait,
+    [SYS_futex_wake] = sys_futex_wake, [SYS_shm_open] = sys_shm_open,
+    [SYS_shm_map] = sys_shm_map, [SYS_shm_unlink] = sys_shm_unlink,
+    [SYS_stats] = sys_stats,     [SYS_tracedump] = sys_tracedump,
+    [SYS_profile] = sys_profile, [SYS_profdump] = sys_profdump,
+    [SYS_fsync] = sys_fsync,     [SYS_unlink] = sys_unlink,
+    [SYS_ftruncate] = sys_ftruncate, [SYS_memlimit] = sys_memlimit,
 };
 
+static_assert(NELEM(syscalls) <= NSYSCALL, "NSYSCALL too small");
+
+// Every cpu counts the calls and faults that finish on it, so that one
+// counting never takes another's cache line; stats adds them up.
+static struct sysstat cpustats[NCPU][NSTAT];
+
+// Counts a call of system call num, or a fault of kind num - NSYSCALL,
+// that took dt cycles.
+void statcount(int num, uint64_t dt) {
+  struct sysstat *st;
+  int b = 63 - __builtin_clzll(dt | 1);
+
+  myproc()->ncalls[num]++;
+  myproc()->callcycles[num] += dt;
+
+  pushcli();
+  st = &cpustats[mycpu() - cpus][num];
+  st->count++;
+  st->cycles += dt;
+  st->hist[min(b, NSTATBUCKET - 1)]++;
+  popcli();
+}
+
 void syscall(void) {
   int num;
+  uint64_t t0;
 
   num = myproc()->tf->rax;
   if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    t0 = readtsc();
     myproc()->tf->rax = syscalls[num]();
+    statcount(num, readtsc() - t0);
   } else {
     cprintf("%d %s: unknown sys call %d\n", myproc()->pid, myproc()->name, num);
     myproc()->tf->rax = -1;
   }
 }
 
+static_assert(NCPU <= SYSINFO_NCPU, "SYSINFO_NCPU too small");
+
 int sys_sysinfo(void) {
   struct sys_info *info;
+  int i;
 
-  if (argptr(0, (void *)&info, sizeof(info)) < 0)
+  if (argptr(0, (void *)&info, sizeof(*info)) < 0)
     return -1;
 
   info->pages_in_use = pages_in_use;
   info->pages_in_swap = pages_in_swap;
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
+  info->num_swap_ins = num_swap_ins;
+  info->zswap_pages = zswap_pages;
   info->num_disk_reads = num_disk_reads;
+  info->disk_queue_depth = disk_queue_depth;
+  info->disk_queue_peak = disk_queue_peak;
+  info->disk_requests = disk_requests;
+  info->disk_merges = disk_merges;
+  info->icache_hits = icache_hits;
+  info->icache_misses = icache_misses;
+  info->slab_pages = slab_pages;
+  info->slab_objects = slab_objects;
+
+  info->version = SYSINFO_VERSION;
+  info->size = sizeof(*info);
+  info->bcache_hits = bcache_hits;
+  info->bcache_misses = num_disk_reads;
+  info->disk_blocks_read = disk_blocks_read;
+  info->disk_blocks_written = disk_blocks_written;
+  info->log_commits = log_commits;
+  info->log_blocks = log_blocks;
+  info->num_cow_faults = num_cow_faults;
+  info->num_swap_outs = num_swap_outs;
+  info->context_switches = context_switches;
+  info->wakeups = wakeups;
+  info->ncpu = ncpu;
+  for (i = 0; i < SYSINFO_NCPU; i++)
+    info->idle_ticks[i] = i < ncpu ? cpus[i].idleticks : 0;
+  info->swap_cached = swap_cached;
+  info->swap_reused = swap_reused;
+  info->ksm_merged = ksm_merged;
 
   return 0;
 }
+
+// Fills in st[0..n), by system call number, then by fault kind and then
+// by memory figure, with the calls, faults and pages of the process pid,
+// or of every process if pid is 0.
+// Returns the count of entries filled in, or -1.
+int sys_stats(void) {
+  struct sysstat *st;
+  int pid, n, c, i, b;
+
+  if (argint(0, &pid) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  n = min(n, NSTAT);
+  if (argptr(1, (void *)&st, n * sizeof(*st)) < 0)
+    return -1;
+  if (pid != 0)
+    return procsysstats(pid, st, n);
+
+  // the counters keep going meanwhile; the sums need not be exact
+  for (i = 0; i < n; i++) {
+    memset(&st[i], 0, sizeof(st[i]));
+    for (c = 0; c < ncpu; c++) {
+      st[i].count += cpustats[c][i].count;
+      st[i].cycles += cpustats[c][i].cycles;
+      for (b = 0; b < NSTATBUCKET; b++)
+        st[i].hist[b] += cpustats[c][i].hist[b];
+    }
+    if (i >= NSYSCALL + NFAULT)
+      st[i].count = vspacememstat(0, i - NSYSCALL - NFAULT);
+  }
+  return n;
+}
@@ -9,12 +9,16 @@
 #include <fcntl.h>
 #include <file.h>
 #include <fs.h>
+#include <ioring.h>
+#include <mman.h>
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
 #include <stat.h>
+#include <uio.h>
+#include <vspace.h>
 #include "../inc/file.h"
 
 int sys_dup(void) {
@@ -35,17 +39,11 @@ int sys_dup(void) {
     return -1;
   }
 
-  // Find an open slot in the process file table
-  int fd;
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (myproc()->files[fd] == NULL) break;
-  }
-  if (fd == NOFILE){
+  // Duplicate the file at the lowest free slot of the process file table
+  int fd = fdalloc(myproc(), fp);
+  if (fd < 0) {
     return -1;
   }
-
-  // Duplicate the file in the process table
-  myproc()->files[fd] = fp;
   filedup(fp);
 
   return fd;
@@ -82,6 +80,35 @@ int sys_read(void) {
   return fileread(fp, buf, n);
 }
 
+int sys_getdents(void) {
+  int fd;
+  char *buf;
+  int n;
+
+  // Reading & checking parameters
+  if (argint(0, &fd) < 0) {
+    return -1;
+  }
+  if (argint(2, &n) < 0 || n <= 0) {
+    return -1;
+  }
+  if (argptr(1, &buf, n) < 0) {
+    return -1;
+  }
+
+  // Check if file descriptor is valid
+  if (fd >= NOFILE || fd < 0) {
+    return -1;
+  }
+
+  struct file_info* fp = myproc()->files[fd];
+  if (fp == NULL || (fp->perm != O_RDONLY && fp->perm != O_RDWR)) {
+    return -1;
+  }
+
+  return filegetdents(fp, buf, n);
+}
+
 int sys_write(void) {
   int fd;
   char *buf;
@@ -112,6 +139,245 @@ int sys_write(void) {
   return filewrite(fp, buf, n);
 }
 
+// The open file at fd, if it can be read, or written if forwrite; or 0.
+static struct file_info *fdfile(int fd, int forwrite) {
+  struct file_info *fp;
+
+  if (fd >= NOFILE || fd < 0) {
+    return 0;
+  }
+  fp = myproc()->files[fd];
+  if (fp == NULL || fp->perm == (forwrite ? O_RDONLY : O_WRONLY)) {
+    return 0;
+  }
+  return fp;
+}
+
+// Fetches the file of descriptor argument n, if it is open for reading
+// (forwrite 0) or writing (forwrite 1), into *pfp. Returns 0, or -1.
+static int argfile(int n, int forwrite, struct file_info **pfp) {
+  int fd;
+
+  if (argint(n, &fd) < 0 || (*pfp = fdfile(fd, forwrite)) == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int sys_pread(void) {
+  struct file_info *fp;
+  char *buf;
+  int n, off;
+
+  if (argfile(0, 0, &fp) < 0 || argint(2, &n) < 0 || n <= 0 ||
+      argptr(1, &buf, n) < 0 || argint(3, &off) < 0 || off < 0) {
+    return -1;
+  }
+  return filepread(fp, buf, n, off);
+}
+
+int sys_pwrite(void) {
+  struct file_info *fp;
+  char *buf;
+  int n, off;
+
+  if (argfile(0, 1, &fp) < 0 || argint(2, &n) < 0 || n <= 0 ||
+      argptr(1, &buf, n) < 0 || argint(3, &off) < 0 || off < 0) {
+    return -1;
+  }
+  return filepwrite(fp, buf, n, off);
+}
+
+// Fetches the iovec array of readv and writev into iov, checking each
+// buffer, and returns the count of them, or -1.
+static int argiovec(struct iovec *iov) {
+  char *p;
+  int cnt, i, total = 0;
+
+  if (argint(2, &cnt) < 0 || cnt <= 0 || cnt > IOV_MAX) {
+    return -1;
+  }
+  if (argptr(1, &p, cnt * sizeof(struct iovec)) < 0) {
+    return -1;
+  }
+  // a copy, which the user cannot change under us once checked
+  memmove(iov, p, cnt * sizeof(struct iovec));
+  for (i = 0; i < cnt; i++) {
+    if (iov[i].iov_len < 0 || iov[i].iov_len > 0x7fffffff - total ||
+        vspacecontains(myproc()->vspace, (uint64_t)iov[i].iov_base,
+                       iov[i].iov_len) != 1) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return cnt;
+}
+
+int sys_readv(void) {
+  struct file_info *fp;
+  struct iovec iov[IOV_MAX];
+  int cnt, i, r, total = 0;
+
+  if (argfile(0, 0, &fp) < 0 || (cnt = argiovec(iov)) < 0) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    r = fileread(fp, iov[i].iov_base, iov[i].iov_len);
+    if (r < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += r;
+    // a short read is all there is for now
+    if (r < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+int sys_writev(void) {
+  struct file_info *fp;
+  struct iovec iov[IOV_MAX];
+  int cnt, i, r, total = 0;
+
+  if (argfile(0, 1, &fp) < 0 || (cnt = argiovec(iov)) < 0) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    r = filewrite(fp, iov[i].iov_base, iov[i].iov_len);
+    if (r < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += r;
+    if (r < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+// Maps a page holding a new, empty io_ring into the process and returns
+// its address, or -1. A process has one ring.
+int sys_ioringsetup(void) {
+  struct proc *p = myproc();
+  uint64_t va;
+  int locked;
+
+  if (p->ioring != 0) {
+    return -1;
+  }
+  locked = vspacelockfault(p->vspace);
+  va = vspacemmap(p->vspace, 0, PGSIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  vspaceunlockfault(p->vspace, locked);
+  if (va == (uint64_t)-1) {
+    return -1;
+  }
+  p->ioring = va;
+  return va;
+}
+
+// Carries out one submission, returning what the call would have.
+static int ioringdo(struct io_sqe *sqe) {
+  struct file_info *fp;
+  int forwrite = sqe->op == IORING_WRITE || sqe->op == IORING_PWRITE;
+  char *buf = (char *)sqe->addr;
+
+  if ((fp = fdfile(sqe->fd, forwrite)) == 0) {
+    return -1;
+  }
+  if (sqe->op == IORING_FSYNC) {
+    if (fp->is_pipe)
+      return -1;
+    logsync();
+    return 0;
+  }
+  if (sqe->len <= 0 ||
+      vspacecontains(myproc()->vspace, sqe->addr, sqe->len) != 1) {
+    return -1;
+  }
+  switch (sqe->op) {
+  case IORING_READ:
+    return fileread(fp, buf, sqe->len);
+  case IORING_WRITE:
+    return filewrite(fp, buf, sqe->len);
+  case IORING_PREAD:
+    return sqe->off < 0 ? -1 : filepread(fp, buf, sqe->len, sqe->off);
+  case IORING_PWRITE:
+    return sqe->off < 0 ? -1 : filepwrite(fp, buf, sqe->len, sqe->off);
+  }
+  return -1;
+}
+
+// Carries out at most n of the ring's submissions in order, stopping
+// early if the completion queue fills, and returns how many, or -1.
+int sys_ioringenter(void) {
+  struct proc *p = myproc();
+  struct io_ring *r = (struct io_ring *)p->ioring;
+  struct io_sqe sqe;
+  struct io_cqe *cqe;
+  uint head, tail;
+  int n, done;
+
+  if (argint(0, &n) < 0 || n < 0 || r == 0 ||
+      vspacecontains(p->vspace, (uint64_t)r, sizeof(*r)) != 1) {
+    return -1;
+  }
+  tail = r->sqtail;
+  __sync_synchronize(); // see the entries filled in before the tail
+  head = r->sqhead;
+  for (done = 0; done < n && head != tail; done++, head++) {
+    if (r->cqtail - r->cqhead >= IORING_NCQ) {
+      break;
+    }
+    // a copy, which the process cannot change under us once checked
+    sqe = r->sq[head % IORING_NSQ];
+    cqe = &r->cq[r->cqtail % IORING_NCQ];
+    cqe->res = ioringdo(&sqe);
+    cqe->data = sqe.data;
+    __sync_synchronize(); // post the completion before the tail
+    r->cqtail++;
+    r->sqhead = head + 1;
+  }
+  return done;
+}
+
+int sys_splice(void) {
+  int fd_in, fd_out, n;
+  struct file_info *in, *out;
+
+  // Reading & checking parameters
+  if (argint(0, &fd_in) < 0 || argint(1, &fd_out) < 0) {
+    return -1;
+  }
+  if (argint(2, &n) < 0 || n <= 0) {
+    return -1;
+  }
+
+  // Check if file descriptors are valid
+  if (fd_in >= NOFILE || fd_in < 0 || fd_out >= NOFILE || fd_out < 0) {
+    return -1;
+  }
+
+  // Get the file infos and check permissions
+  in = myproc()->files[fd_in];
+  out = myproc()->files[fd_out];
+  if (in == NULL || (in->perm != O_RDONLY && in->perm != O_RDWR)) {
+    return -1;
+  }
+  if (out == NULL || (out->perm != O_WRONLY && out->perm != O_RDWR)) {
+    return -1;
+  }
+
+  return filesplice(in, out, n);
+}
+
 int sys_close(void) {
   int fd;
 
@@ -132,7 +398,7 @@ int sys_close(void) {
   fileclose(fp);
 
   // Close the file in the process
-  myproc()->files[fd] = NULL;
+  fdremove(myproc(), fd);
   return 0;
 }
 
@@ -171,6 +437,41 @@ int sys_fstat(void) {
   return 0;
 }
 
+// Return once every write made to the file so far is on the disk.
+int sys_fsync(void) {
+  struct file_info *fp;
+  int fd;
+
+  if (argint(0, &fd) < 0 || fd >= NOFILE || fd < 0)
+    return -1;
+  if ((fp = myproc()->files[fd]) == NULL || fp->is_pipe)
+    return -1;
+  logsync();
+  return 0;
+}
+
+// Cut the file down to size bytes; it cannot grow this way.
+int sys_ftruncate(void) {
+  struct file_info *fp;
+  int size, r;
+
+  if (argfile(0, 1, &fp) < 0 || argint(1, &size) < 0 || size < 0 ||
+      fp->is_pipe)
+    return -1;
+  locki(fp->ip);
+  r = trunci(fp->ip, size);
+  unlocki(fp->ip);
+  return r;
+}
+
+int sys_unlink(void) {
+  char *path;
+
+  if (argstr(0, &path) < 0)
+    return -1;
+  return unlinkfile(path);
+}
+
 int sys_open(void) {
   // LAB1
   char* path;
@@ -184,18 +485,16 @@ int sys_open(void) {
   if (argint(1, &mode) < 0 || mode == O_CREATE) // read only
     return -1;
 
-  // find an open slot in the process file table
-  int fd;
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (myproc()->files[fd] == NULL) break;
-  }
-  if (fd == NOFILE) return -1;
-
   // Finds an open entry in the global open file table
   struct file_info* fp = fileopen(path, mode);
   if (fp == NULL) return -1;
-  
-  myproc()->files[fd] = fp;
+
+  // and the lowest open slot in the process file table
+  int fd = fdalloc(myproc(), fp);
+  if (fd < 0) {
+    fileclose(fp);
+    return -1;
+  }
   return fd;
 }
 
@@ -216,6 +515,23 @@ int sys_exec(void) {
   return exec(path, argv);
 }
 
+int sys_spawn(void) {
+  char *path;
+  char **argv;
+  int *fds;
+  int nfd;
+
+  if (argstr(0, &path) < 0 || argptr(1, (char **)&argv, 8) < 0 ||
+      argint(3, &nfd) < 0 || nfd < 0 || nfd > NOFILE)
+    return -1;
+  if (argint64(2, (int64_t *)&fds) < 0)
+    return -1;
+  if (fds && argptr(2, (char **)&fds, nfd * sizeof(int)) < 0)
+    return -1;
+
+  return spawn(path, argv, fds, nfd);
+}
+
 int sys_pipe(void) {
   // LAB2
   int* fd_arr;
@@ -226,24 +542,11 @@ int sys_pipe(void) {
 
   struct pipe* pipe;
 
-  if((pipe = (struct pipe*)kalloc()) == 0) {
+  // open at both ends
+  if((pipe = pipealloc()) == 0) {
     return -1;
   }
 
-  // Reassign the pipe address to be at the start of the page, and move
-  // the head and tail of the buffer to the end of the struct
-  pipe->head += sizeof(struct pipe);
-  pipe->tail += sizeof(struct pipe);
-
-  pipe->buf = (char*) pipe;
-
-  // Initialize pipe lock
-  initlock(&(pipe->lock), "pipe spinlock");
-
-  // Set pipe read and write to open
-  pipe->hasopenread = true;
-  pipe->hasopenwrite = true;
-
   int rfd, wfd;
 
   // Open the pipe read fd
@@ -263,3 +566,83 @@ int sys_pipe(void) {
 
   return 0;
 }
+
+int sys_mmap(void) {
+  int64_t addr;
+  int len, prot, flags, fd, off, locked;
+  struct file_info *fp;
+  struct inode *ip = 0;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0 ||
+      argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+      argint(4, &fd) < 0 || argint(5, &off) < 0 || off < 0) {
+    return -1;
+  }
+
+  // exactly one of shared and private; the page tables cannot say
+  // "no access", so every mapping can be read
+  if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0) ||
+      (prot & PROT_READ) == 0) {
+    return -1;
+  }
+
+  if ((flags & MAP_ANONYMOUS) == 0) {
+    if (fd >= NOFILE || fd < 0) {
+      return -1;
+    }
+    fp = myproc()->files[fd];
+    if (fp == NULL || fp->is_pipe || fp->ip->type != T_FILE ||
+        fp->perm == O_WRONLY) {
+      return -1;
+    }
+    // writing a shared mapping writes the file
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && fp->perm != O_RDWR) {
+      return -1;
+    }
+    ip = fp->ip;
+  }
+
+  locked = vspacelockfault(myproc()->vspace);
+  addr = vspacemmap(myproc()->vspace, addr, len, prot, flags, ip, off);
+  vspaceunlockfault(myproc()->vspace, locked);
+  return addr;
+}
+
+int sys_munmap(void) {
+  int64_t addr;
+  int len, locked, r;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0) {
+    return -1;
+  }
+
+  locked = vspacelockfault(myproc()->vspace);
+  r = vspacemunmap(myproc()->vspace, addr, len);
+  vspaceunlockfault(myproc()->vspace, locked);
+  return r < 0 ? -1 : 0;
+}
+
+int sys_shm_open(void) {
+  char *name;
+  int size;
+
+  if (argstr(0, &name) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmopen(name, size);
+}
+
+int sys_shm_map(void) {
+  int id;
+
+  if (argint(0, &id) < 0)
+    return -1;
+  return shmmap(id);
+}
+
+int sys_shm_unlink(void) {
+  char *name;
+
+  if (argstr(0, &name) < 0)
+    return -1;
+  return shmunlink(name);
+}
@@ -5,6 +5,8 @@
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <prof.h>
+#include <trace.h>
 #include <x86_64.h>
 
 int sys_crashn(void) {
@@ -22,6 +24,61 @@ int sys_fork(void){
   return fork();
 }
 
+int sys_futex_wait(void) {
+  int64_t addr;
+  int val;
+
+  if (argint64(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+int sys_futex_wake(void) {
+  int64_t addr;
+  int n;
+
+  if (argint64(0, &addr) < 0 || argint(1, &n) < 0 || n < 0)
+    return -1;
+  return futexwake(addr, n);
+}
+
+int sys_tracedump(void) {
+  struct traceev *buf;
+  int n;
+
+  if (argint(1, &n) < 0 || n < 0 ||
+      argptr(0, (void *)&buf, n * sizeof(*buf)) < 0)
+    return -1;
+  return tracedump(buf, n);
+}
+
+int sys_profile(void) {
+  int on;
+
+  if (argint(0, &on) < 0)
+    return -1;
+  return profile(on != 0);
+}
+
+int sys_profdump(void) {
+  struct profsample *buf;
+  int n;
+
+  if (argint(1, &n) < 0 || n < 0 ||
+      argptr(0, (void *)&buf, n * sizeof(*buf)) < 0)
+    return -1;
+  return profdump(buf, n);
+}
+
+int sys_clone(void) {
+  int64_t fn, arg, stack;
+
+  if (argint64(0, &fn) < 0 || argint64(1, &arg) < 0 ||
+      argint64(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
 void halt(void) {
   while (1)
     ;
@@ -42,35 +99,66 @@ int sys_kill(void) {
   return kill(pid);
 }
 
+int sys_setpriority(void) {
+  int pid, prio;
+
+  if (argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+int sys_memlimit(void) {
+  int pid, pages;
+
+  if (argint(0, &pid) < 0 || argint(1, &pages) < 0)
+    return -1;
+  return memlimit(pid, pages);
+}
+
 int sys_getpid(void) { return myproc()->pid; }
 
-int sys_sbrk(void) {
-  // LAB3
-  int size;
+// Grows the heap of vs by size bytes, returning the old limit, or -1.
+static int growheap(struct vspace *vs, int size) {
   int old_limit;
   struct vregion* heap;
 
-  if (argint(0, &size) < 0)
-    return -1;
-
-  heap = &myproc()->vspace.regions[VR_HEAP];
+  heap = &vs->regions[VR_HEAP];
   old_limit = heap->va_base + heap->size;
 
   if (size <= 0) return old_limit;
+
+  // the heap may not grow into an mmap'd region
+  if (vspacemapped(vs, old_limit, PGROUNDUP(old_limit + size)))
+    return -1;
   
-  // allocate and map new pages
-  if (vregionaddmap(heap, old_limit, size, 1, 1) != size)
+  // map the new pages to the zero page; each gets a page of its own
+  // when first written
+  if (vregionaddzero(heap, old_limit, size, 1) != size)
     return -1;
   
   // update heap size
   heap->size += size;
 
-  vspaceinvalidate(&myproc()->vspace);
-  vspaceinstall(myproc());
+  vspacemaprange(vs, old_limit, size);
 
   return old_limit;
 }
 
+int sys_sbrk(void) {
+  // LAB3
+  int size, locked, r;
+  struct vspace *vs = myproc()->vspace;
+
+  if (argint(0, &size) < 0)
+    return -1;
+
+  // the threads of a process share its heap
+  locked = vspacelockfault(vs);
+  r = growheap(vs, size);
+  vspaceunlockfault(vs, locked);
+  return r;
+}
+
 int sys_sleep(void) {
   int n;
   uint ticks0;
@@ -84,7 +172,7 @@ int sys_sleep(void) {
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    timersleep(ticks0 + n);
   }
   release(&tickslock);
   return 0;
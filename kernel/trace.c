@@ -0,0 +1,93 @@
+// Trace rings: a timeline of kernel events, for working out where the
+// time of a slow operation went.
+//
+// Every cpu appends to a ring of its own, with interrupts off, so the
+// hot paths take no lock. tracedump copies events out from the other
+// end; the ring drops events, and says how many, rather than overwrite
+// ones not yet read.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <msr.h>
+#include <param.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <trace.h>
+
+struct tracering {
+  volatile uint head;    // next event written, by the ring's cpu
+  volatile uint tail;    // next event read, by tracedump
+  volatile uint dropped; // events lost since tracedump last looked
+  struct traceev ev[NTRACE];
+};
+
+static struct tracering rings[NCPU];
+
+// one drainer at a time; a sleeplock, as copying out may fault
+static struct sleeplock tracelock;
+
+void traceinit(void) {
+  initsleeplock(&tracelock, "trace");
+}
+
+// Records an event of type, in phase, on this cpu's ring.
+void traceevent(int type, int phase, uint64_t arg) {
+  struct tracering *r;
+  struct traceev *e;
+
+  if (!TRACE)
+    return;
+
+  pushcli();
+  r = &rings[mycpu() - cpus];
+  if (r->head - r->tail >= NTRACE) {
+    r->dropped++;
+    popcli();
+    return;
+  }
+  e = &r->ev[r->head % NTRACE];
+  e->tsc = readtsc();
+  e->arg = arg;
+  e->type = type;
+  e->phase = phase;
+  e->cpu = mycpu() - cpus;
+  e->pid = myproc() ? myproc()->pid : 0;
+  // the event is filled in before the drainer can see it
+  __sync_synchronize();
+  r->head++;
+  popcli();
+}
+
+// Moves at most n events to user memory at buf, cpu by cpu. A cpu that
+// dropped events starts with a TR_LOST event saying how many.
+// Returns the count of events moved.
+int tracedump(struct traceev *buf, int n) {
+  struct tracering *r;
+  struct traceev lost;
+  uint h, t;
+  int c, i = 0;
+
+  acquiresleep(&tracelock);
+  for (c = 0; c < ncpu && i < n; c++) {
+    r = &rings[c];
+    if (r->dropped) {
+      memset(&lost, 0, sizeof(lost));
+      lost.tsc = readtsc();
+      lost.arg = __sync_lock_test_and_set(&r->dropped, 0);
+      lost.type = TR_LOST;
+      lost.phase = TR_INSTANT;
+      lost.cpu = c;
+      buf[i++] = lost;
+    }
+    h = r->head;
+    // read the events only after seeing head
+    __sync_synchronize();
+    for (t = r->tail; t != h && i < n; t++)
+      buf[i++] = r->ev[t % NTRACE];
+    // done reading before the slots go back to the writer
+    __sync_synchronize();
+    r->tail = t;
+  }
+  releasesleep(&tracelock);
+  return i;
+}
@@ -2,9 +2,12 @@
 #include <defs.h>
 #include <memlayout.h>
 #include <mmu.h>
+#include <msr.h>
 #include <param.h>
 #include <proc.h>
 #include <spinlock.h>
+#include <sysstat.h>
+#include <trace.h>
 #include <trap.h>
 #include <x86_64.h>
 
@@ -14,7 +17,16 @@ extern void *vectors[]; // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 
+// A timer wheel, protected by tickslock. A process sleeping until tick t
+// waits on slot t % NTIMERWHEEL, which the timer wakes only at those
+// ticks, and only if the slot has sleepers; one sleeping further out than
+// a turn of the wheel wakes once a turn to look at the time. Each slot
+// counts its sleepers.
+static int timerwheel[NTIMERWHEEL];
+uint timerseq; // counts timersleeps, for an idle cpu0 to see new sleepers
+
 int num_page_faults = 0;
+int num_cow_faults = 0; // page faults that copied a copy-on-write page
 
 void tvinit(void) {
   int i;
@@ -25,10 +37,159 @@ void tvinit(void) {
                 USER_PL);
 
   initlock(&tickslock, "time");
+  lockstat(&tickslock);
 }
 
 void idtinit(void) { lidt((void *)idt, sizeof(idt)); }
 
+// Sleeps until tick deadline, or until the timer wheel comes round to
+// it, or a kill. Caller must hold tickslock and check the time again.
+void timersleep(uint deadline) {
+  int *slot = &timerwheel[deadline % NTIMERWHEEL];
+
+  (*slot)++;
+  timerseq++;
+  sleep(slot, &tickslock);
+  (*slot)--;
+}
+
+// Advances the clock n ticks, waking those sleeping until any of them.
+// The timer calls it each tick, and cpu0, back from idling with its tick
+// off, calls it for the ticks it let pass.
+void tickadvance(uint n) {
+  uint t, end, boost;
+
+  acquire(&tickslock);
+  end = ticks + 1 + min(n, (uint)NTIMERWHEEL);
+  for (t = ticks + 1; t != end; t++)
+    if (timerwheel[t % NTIMERWHEEL])
+      wakeup(&timerwheel[t % NTIMERWHEEL]);
+  boost = (ticks + n) / PRIOBOOST != ticks / PRIOBOOST;
+  ticks += n;
+  release(&tickslock);
+  if (SCHED_MLFQ && boost)
+    prioboost();
+}
+
+// Returns how many ticks from now the nearest sleeper on the timer wheel
+// is due, or 0 if there are none.
+uint timernext(void) {
+  uint i, n = 0;
+
+  acquire(&tickslock);
+  for (i = 1; i <= NTIMERWHEEL; i++) {
+    if (timerwheel[(ticks + i) % NTIMERWHEEL]) {
+      n = i;
+      break;
+    }
+  }
+  release(&tickslock);
+  return n;
+}
+
+// Handles a page fault at addr of the current process that the kernel
+// can put right: a lazily filled, swapped, stack or copy-on-write page.
+// Returns the FAULT_* kind it was, FAULT_FATAL if it could not.
+static int pagefault(struct trap_frame *tf, uint64_t addr) {
+  if ((tf->err & 1) == 0) {
+    // first touch of a lazily filled page: program text or data,
+    // or an mmap'd file or anonymous memory
+    int r = vspacefault(myproc()->vspace, addr);
+    if (r < 0)
+      panic("cannot allocate page for lazily filled memory");
+    // the page was not present before, so there is nothing to flush
+    if (r > 0)
+      return FAULT_LAZY;
+  }
+
+  if ((tf->err & 5) == 4) {
+    struct vregion* vregion;
+    struct vpage_info* vpi;
+
+    // Get vpi info
+    vregion = va2vregion(myproc()->vspace, addr);
+    if (vregion) {
+      vpi = va2vpage_info(vregion, addr);
+      if (vpi && vpi->swapped) {
+        // Check if the page is a swap page
+        if (swappage_copy(vpi->swap_index) == -1) {
+          panic ("cannot allocate new page for swap memory");
+        }
+        return FAULT_SWAPIN;
+      }
+    }
+  }
+
+  if ((tf->err & 1) == 0
+    && addr < myproc()->vspace->regions[VR_USTACK].va_base
+    && addr > myproc()->vspace->regions[VR_USTACK].va_base - 10 * PGSIZE) {
+    // if the page fault is on stack, then grow the stack
+    struct vregion* stack = &myproc()->vspace->regions[VR_USTACK];
+    uint64_t base = PGROUNDDOWN(addr);
+    uint64_t size = stack->va_base - stack->size - base;
+
+    // written pages get their own on the copy-on-write fault
+    if (vregionaddzero(stack, base, size, 1) != size)
+      panic("cannot allocate space in stack");
+
+    stack->size += size;
+
+    vspacemaprange(myproc()->vspace, base, size);
+
+    return FAULT_STACK;
+  }
+
+  if ((tf->err & 3) == 3) {
+    // if it is a read only protecttion issue
+    struct vregion* vregion;
+    struct vpage_info* vpi;
+
+    // a fork took write access from the whole 2MB block
+    if (vspacewritefault(myproc()->vspace, addr))
+      return FAULT_COW;
+
+    vregion = va2vregion(myproc()->vspace, addr);
+    if (vregion == NULL)
+      panic("cannot get vregion for attempted address");
+    vpi = va2vpage_info(vregion, addr);
+    if (vpi == NULL)
+      panic("cannot get vpage_info for attempted address");
+
+    if (vpi->is_cow == 1) {
+      // if the address is on a copy-on-write page
+
+      // a heap block all on the zero page may go to a 2MB page whole
+      if (vpi->ppn == zero_ppn && vspacehuge(myproc()->vspace, addr))
+        return FAULT_COW;
+
+      // allocate a new page copy the page data
+      uint64_t ppn = vpi->ppn;
+      if (ppage_copy(&vpi->ppn) == -1)
+        panic("cannot allocate new page for copy-on-write memory");
+      if (vpi->ppn != ppn) {
+        rmapdel(ppn, myproc()->vspace, PGROUNDDOWN(addr));
+        if (rmapadd(vpi->ppn, myproc()->vspace, PGROUNDDOWN(addr)) < 0)
+          panic("cannot allocate new page for copy-on-write memory");
+      }
+
+      vpi->writable = 1;
+      vpi->is_cow = 0;
+      num_cow_faults++;
+
+      vspacemaprange(myproc()->vspace, PGROUNDDOWN(addr), PGSIZE);
+
+      return FAULT_COW;
+    }
+    // another thread took the copy first, or the entry lost write access
+    // with the rest of its block and may have it back
+    if (vpi->writable && vpi->present) {
+      vspacemaprange(myproc()->vspace, PGROUNDDOWN(addr), PGSIZE);
+      return FAULT_RACE;
+    }
+  }
+  return FAULT_FATAL;
+}
+
 void trap(struct trap_frame *tf) {
   uint64_t addr;
 
@@ -44,20 +205,30 @@ void trap(struct trap_frame *tf) {
 
   switch (tf->trapno) {
   case TRAP_IRQ0 + IRQ_TIMER:
-    if (cpunum() == 0) {
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
+    // an idle cpu0 that put its tick off counts the ticks on waking
+    if (cpunum() == 0 && !mycpu()->tickless) {
+      lapictick();
+      tickadvance(1);
     }
+    proftick(tf);
+    lapiceoi();
+    break;
+  case TRAP_IRQ0 + IRQ_RESCHED:
+    // the scheduler looks for work on the way out of idle()
+    lapiceoi();
+    break;
+  case TRAP_IRQ0 + IRQ_TLBFLUSH:
+    vspacetlbflush();
     lapiceoi();
     break;
   case TRAP_IRQ0 + IRQ_IDE:
-    ideintr();
+    ideintr(0);
     lapiceoi();
     break;
   case TRAP_IRQ0 + IRQ_IDE + 1:
-    // Bochs generates spurious IDE1 interrupts.
+    // the swap disk's; Bochs also generates spurious ones
+    ideintr(1);
+    lapiceoi();
     break;
   case TRAP_IRQ0 + IRQ_KBD:
     kbdintr();
@@ -79,71 +250,19 @@ void trap(struct trap_frame *tf) {
     if (tf->trapno == TRAP_PF) {
       num_page_faults += 1;
 
-      if ((tf->err & 5) == 4) {
-        struct vregion* vregion;
-        struct vpage_info* vpi;
-
-        // Get vpi info
-        vregion = va2vregion(&myproc()->vspace, addr);
-        if (vregion) {
-          vpi = va2vpage_info(vregion, addr);
-          if (vpi && vpi->swapped) {
-            // Check if the page is a swap page
-            if (swappage_copy(vpi->swap_index) == -1) {
-              panic ("cannot allocate new page for swap memory");
-            }
-            vspaceinstall(myproc());
-            return;
-          }
-        }
-      }
-
-      if ((tf->err & 1) == 0
-        && addr < myproc()->vspace.regions[VR_USTACK].va_base
-        && addr > myproc()->vspace.regions[VR_USTACK].va_base - 10 * PGSIZE) {
-        // if the page fault is on stack, then grow the stack
-        struct vregion* stack = &myproc()->vspace.regions[VR_USTACK];
-        uint64_t base = PGROUNDDOWN(addr);
-        uint64_t size = stack->va_base - stack->size - base;
-
-        if (vregionaddmap(stack, base, size, 1, 1) != size)
-          panic("cannot allocate space in stack");
-
-        stack->size += size;
-
-        vspaceinvalidate(&myproc()->vspace);
-        vspaceinstall(myproc());
-
-        return;
-      }
-
-      if ((tf->err & 3) == 3) {
-        // if it is a read only protecttion issue
-        struct vregion* vregion;
-        struct vpage_info* vpi;
-
-        vregion = va2vregion(&myproc()->vspace, addr);
-        if (vregion == NULL)
-          panic("cannot get vregion for attempted address");
-        vpi = va2vpage_info(vregion, addr);
-        if (vpi == NULL)
-          panic("cannot get vpage_info for attempted address");
-
-        if (vpi->is_cow == 1) {
-          // if the address is on a copy-on-write page
-
-          // allocate a new page copy the page data
-          if (ppage_copy(&vpi->ppn) == -1)
-            panic("cannot allocate new page for copy-on-write memory");
-
-          vpi->writable = 1;
-          vpi->is_cow = 0;
-
-          vspaceinvalidate(&myproc()->vspace);
-          vspaceinstall(myproc());
+      if (myproc()) {
+        struct vspace *vs = myproc()->vspace;
+        uint64_t t0 = readtsc();
+        int locked, r;
 
+        traceevent(TR_FAULT, TR_BEGIN, addr);
+        locked = vspacelockfault(vs);
+        r = pagefault(tf, addr);
+        vspaceunlockfault(vs, locked);
+        traceevent(TR_FAULT, TR_END, addr);
+        statcount(NSYSCALL + r, readtsc() - t0);
+        if (r != FAULT_FATAL)
           return;
-        }
       }
 
       if (myproc() == 0 || (tf->cs & 3) == 0) {
@@ -168,10 +287,15 @@ void trap(struct trap_frame *tf) {
   if (myproc() && myproc()->killed && (tf->cs & 3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // now and then, takes a look at what the process has been using
+  if (myproc() && tf->trapno == TRAP_IRQ0 + IRQ_TIMER &&
+      (tf->cs & 3) == DPL_USER)
+    vspacesample(myproc()->vspace);
+
+  // Force process to give up CPU at the end of its time slice.
   // If interrupts were on while locks held, would need to check nlock.
   if (myproc() && myproc()->state == RUNNING &&
-      tf->trapno == TRAP_IRQ0 + IRQ_TIMER)
+      tf->trapno == TRAP_IRQ0 + IRQ_TIMER && timeslice())
     yield();
 
   // Check if the process has been killed since we yielded
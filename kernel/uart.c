@@ -1,4 +1,8 @@
 // Intel 8250 serial port (UART).
+//
+// Output goes into a ring that the transmitter-empty interrupt drains,
+// so that a write to the console returns once its bytes are queued.
+// When the ring is full, or after a panic, bytes go out by polling.
 
 #include <cdefs.h>
 #include <defs.h>
@@ -13,14 +17,30 @@
 #include <x86_64.h>
 
 #define COM1 0x3f8
+#define TXBUF 1024 // bytes of output the ring holds, a power of 2
 
-static int uart; // is there a uart?
+static int uart;   // is there a uart?
+static int txfifo; // bytes the transmitter takes at once
+static int polled; // no more interrupts to drain the ring; see uartflush
+
+static struct {
+  struct spinlock lock;
+  char buf[TXBUF];
+  uint r; // next byte to the transmitter
+  uint w; // next byte queued
+} tx;
+
+static void uartstart(void);
 
 void uartinit(void) {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1 + 2, 0);
+  initlock(&tx.lock, "uart");
+
+  // Turn on and clear the FIFOs, if any; the receiver still interrupts
+  // at every byte
+  outb(COM1 + 2, 0x07);
+  txfifo = (inb(COM1 + 2) & 0xc0) == 0xc0 ? 16 : 1;
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1 + 3, 0x80); // Unlock divisor
@@ -28,7 +48,7 @@ void uartinit(void) {
   outb(COM1 + 1, 0);
   outb(COM1 + 3, 0x03); // Lock divisor, 8 data bits.
   outb(COM1 + 4, 0);
-  outb(COM1 + 1, 0x01); // Enable receive interrupts.
+  outb(COM1 + 1, 0x03); // Enable receive and transmitter-empty interrupts.
 
   // If status is 0xFF, no serial port.
   if (inb(COM1 + 5) == 0xFF)
@@ -47,16 +67,54 @@ void uartinit(void) {
     uartputc(*p);
 }
 
-void uartputc(int c) {
+// Waits a bounded time for the transmitter to empty, and sends c.
+static void uartputcsync(int c) {
   int i;
 
-  if (!uart)
-    return;
   for (i = 0; i < 128 && !(inb(COM1 + 5) & 0x20); i++)
     microdelay(10);
   outb(COM1 + 0, c);
 }
 
+// Hands queued bytes to the transmitter, if it is empty.
+// Caller must hold tx.lock.
+static void uartstart(void) {
+  int i;
+
+  if (!(inb(COM1 + 5) & 0x20))
+    return;
+  for (i = 0; i < txfifo && tx.r != tx.w; i++)
+    outb(COM1 + 0, tx.buf[tx.r++ % TXBUF]);
+}
+
+void uartputc(int c) {
+  if (!uart)
+    return;
+  if (polled) {
+    uartputcsync(c);
+    return;
+  }
+
+  acquire(&tx.lock);
+  // full: wait for the oldest byte to go, as interrupts may be off
+  while (tx.w - tx.r == TXBUF)
+    uartputcsync(tx.buf[tx.r++ % TXBUF]);
+  tx.buf[tx.w++ % TXBUF] = c;
+  uartstart();
+  release(&tx.lock);
+}
+
+// Sends what is queued by polling, and polls for all output from now
+// on. For panic, which leaves interrupts off for good; it takes no lock,
+// as the cpu holding it may be the one that panicked.
+void uartflush(void) {
+  if (!uart || polled)
+    return;
+  polled = 1;
+  while (tx.r != tx.w)
+    uartputcsync(tx.buf[tx.r++ % TXBUF]);
+}
+
 static int uartgetc(void) {
   if (!uart)
     return -1;
@@ -65,4 +123,11 @@ static int uartgetc(void) {
   return inb(COM1 + 0);
 }
 
-void uartintr(void) { consoleintr(uartgetc); }
+void uartintr(void) {
+  // reading the interrupt id clears a transmitter-empty interrupt
+  inb(COM1 + 2);
+  acquire(&tx.lock);
+  uartstart();
+  release(&tx.lock);
+  consoleintr(uartgetc);
+}
@@ -1,9 +1,15 @@
 #include <cdefs.h>
+#include <cpuid.h>
 #include <defs.h>
 #include <elf.h>
+#include <file.h>
 #include <memlayout.h>
+#include <mman.h>
+#include <pcache.h>
 #include <vspace.h>
 #include <proc.h>
+#include <slab.h>
+#include <trap.h>
 #include <x86_64.h>
 #include <x86_64vm.h>
 #include "../inc/vspace.h"
@@ -22,6 +28,16 @@ va2vpi_idx(struct vregion *r, uint64_t va)
     panic("va2vpi_idx: invalid direction");
 }
 
+// the inverse of va2vpi_idx: the address of the page at index idx of r
+static uint64_t
+vpi_idx2va(struct vregion *r, int idx)
+{
+  if (r->dir == VRDIR_UP)
+    return r->va_base + (uint64_t)idx * PGSIZE;
+  else
+    return r->va_base - (uint64_t)(idx + 1) * PGSIZE;
+}
+
 // given a reference to a vpage_info struct
 // returns its permissions with respect to the 
 // user bit, present bit, and writable bit  
@@ -38,14 +54,288 @@ x86perms(struct vpage_info *vpi)
 
 extern pml4e_t *kpml4;  // kernel page table 
 
+static void vspacesetpte(struct vspace *, uint64_t, struct vregion *);
+
+// With PCIDs, a CR3 load keeps the TLB entries of the other address
+// spaces, so a switch back into one need not refill it. Each generation
+// hands out every PCID once; when they run out a new generation starts,
+// and each cpu flushes its whole TLB before it uses a PCID from it. The
+// kernel's table has PCID 0.
+static int pcidon;
+static struct spinlock pcidlock; // protects pcidnext, pcidgen and vs->pcid*
+static uint pcidnext = 1;
+static uint pcidgen = 1;
+
+// the address spaces of the processes, which threads share, and of the
+// shared-memory segments, which hold their pages in one
+static struct {
+  struct spinlock lock; // protects each vs->ref
+  struct vspace vs[NPROC + NSHM];
+} vspaces;
+
+static struct slabcache vpicache;    // struct vpi_pages
+static struct slabcache vpidircache; // struct vpi_dirs
+
+// held while a vpi_page that a fork shared is copied, taken over or let
+// go of, so that its holders agree on its ref and vs
+static struct sleeplock vpisharelock;
+
+// allocates a zeroed vpi_page for a region of vs, or returns 0
+static struct vpi_page *
+vpialloc(struct vspace *vs)
+{
+  struct vpi_page *page;
+
+  if ((page = slaballoc(&vpicache))) {
+    memset(page, 0, sizeof(struct vpi_page));
+    page->ref = 1;
+    page->vs = vs;
+  }
+  return page;
+}
+
+// allocates a zeroed vpi_dir, or returns 0
+static struct vpi_dir *
+vpidiralloc(void)
+{
+  struct vpi_dir *dir;
+
+  if ((dir = slaballoc(&vpidircache)))
+    memset(dir, 0, sizeof(struct vpi_dir));
+  return dir;
+}
+
+// the number of vpage_infos beneath a node of height h
+static uint64_t
+vpispan(int h)
+{
+  uint64_t n = VPIPPAGE;
+
+  while (h-- > 0)
+    n *= VPIDIRN;
+  return n;
+}
+
+// Returns the slot of vr's vpage_info tree that holds, or is to hold,
+// the vpi_page with index i in it. If alloc, the tree grows and fills in
+// with vpi_dirs to reach it, and 0 is returned only if out of memory;
+// otherwise 0 is returned if it is not there.
+static void **
+vpislot(struct vregion *vr, int i, int alloc)
+{
+  struct vpi_dir *dir;
+  void **slot;
+  uint64_t idx = i, span;
+  int h;
+
+  if (i < 0)
+    return 0;
+  // a taller tree starts with the old one as its first child
+  while (idx >= vpispan(vr->pgheight)) {
+    if (!alloc)
+      return 0;
+    if (vr->pages) {
+      if (!(dir = vpidiralloc()))
+        return 0;
+      dir->slots[0] = vr->pages;
+      vr->pages = dir;
+    }
+    vr->pgheight++;
+  }
+
+  slot = &vr->pages;
+  for (h = vr->pgheight; h > 0; h--) {
+    if (!*slot && (!alloc || !(*slot = vpidiralloc())))
+      return 0;
+    span = vpispan(h - 1);
+    slot = &((struct vpi_dir *)*slot)->slots[idx / span];
+    idx %= span;
+  }
+  return slot;
+}
+
+// Returns the vpi_page of vr holding index i as it is, which may be
+// shared with the regions a fork copied vr to, or 0 if there is none.
+// Nothing is allocated.
+static struct vpi_page *
+vpipage(struct vregion *vr, int i)
+{
+  void **slot = vpislot(vr, i, 0);
+
+  return slot ? *slot : 0;
+}
+
+// the vpage_info at index i of vr as it is, as vpipage finds it, or 0
+static struct vpage_info *
+vpipeek(struct vregion *vr, int i)
+{
+  struct vpi_page *page = vpipage(vr, i);
+
+  return page ? &page->infos[i % VPIPPAGE] : 0;
+}
+
+// Makes the vpi_page at *slot, starting at index idx of vr, vr's own to
+// change and to map. One that a fork left shared is copied, each used
+// page getting a reference and a reverse map entry for the copy; a
+// private region's pages go copy-on-write in both. The holder whose
+// page table maps the pages goes on mapping them through its copy, and
+// its reverse map entries go with it, the others' naming the vpi_page.
+// A vpi_page that vr is left holding alone is taken over instead.
+// Returns 0, or -1 if there is no memory for the copy.
+static int
+vpiown(struct vregion *vr, void **slot, uint64_t idx)
+{
+  struct vpi_page *page = *slot, *copy;
+  uint64_t va = vpi_idx2va(vr, idx);
+  int64_t step = vr->dir == VRDIR_UP ? PGSIZE : -PGSIZE;
+  int i, r = 0;
+
+  if (page->ref == 1 && page->vs == vr->vs)
+    return 0;
+
+  acquiresleep(&vpisharelock);
+  if (page->ref == 1) {
+    // the holders it was shared with have let go, the one mapping its
+    // pages too
+    if (page->vs != vr->vs) {
+      rmapmoven(page->infos, VPIPPAGE, 0, vr->vs, va, step, page);
+      page->vs = vr->vs;
+    }
+  } else if (!(copy = vpialloc(vr->vs))) {
+    r = -1;
+  } else {
+    // the other holders see the copy-on-write marks too
+    if (!vr->shared) {
+      for (i = 0; i < VPIPPAGE; i++) {
+        if (page->infos[i].used && page->infos[i].writable) {
+          page->infos[i].writable = 0;
+          page->infos[i].is_cow = 1;
+        }
+      }
+    }
+    // vr's entries, if they are the ones, go on naming its mappings
+    if (page->vs == vr->vs) {
+      if ((r = pagedupn(copy->infos, page->infos, VPIPPAGE, 0, 0, 0, page)) == 0)
+        page->vs = 0;
+    } else {
+      r = pagedupn(copy->infos, page->infos, VPIPPAGE, vr->vs, va, step, 0);
+    }
+    if (r == 0) {
+      *slot = copy;
+      __sync_fetch_and_sub(&page->ref, 1);
+    } else {
+      slabfree(copy);
+    }
+  }
+  releasesleep(&vpisharelock);
+  return r;
+}
+
+// Returns the vpage_info at index i of vr, in a vpi_page that vpiown
+// has made vr's own. If alloc, the tree grows and fills in to hold it;
+// otherwise 0 is returned if it is not there. 0 is returned too if out
+// of memory.
+static struct vpage_info *
+vpilookup(struct vregion *vr, int i, int alloc)
+{
+  void **slot;
+
+  if (!(slot = vpislot(vr, i, alloc)))
+    return 0;
+  if (!*slot && (!alloc || !(*slot = vpialloc(vr->vs))))
+    return 0;
+  if (vpiown(vr, slot, i - i % VPIPPAGE) < 0)
+    return 0;
+  return &((struct vpi_page *)*slot)->infos[i % VPIPPAGE];
+}
+
+// Returns the first vpi_page of vr at or after index *idx, which must
+// start a vpi_page, and sets *idx to the index of its first vpage_info.
+// Returns 0 if there are no more.
+static struct vpi_page *
+vpinextleaf(struct vregion *vr, uint64_t *idx)
+{
+  void *node;
+  uint64_t span = VPIPPAGE;
+  int h;
+
+  while (vr->pages && *idx < vpispan(vr->pgheight)) {
+    node = vr->pages;
+    for (h = vr->pgheight; h > 0; h--) {
+      span = vpispan(h - 1);
+      if (!(node = ((struct vpi_dir *)node)->slots[*idx / span % VPIDIRN]))
+        break;
+    }
+    if (node)
+      return node;
+    // skip the empty subtree
+    *idx = (*idx / span + 1) * span;
+  }
+  return 0;
+}
+
+// frees the vpi_dirs of the vpage_info tree under node, of height h,
+// whose vpi_pages have been let go of
+static void
+vpifree(void *node, int h)
+{
+  int i;
+
+  if (!node || h == 0)
+    return;
+  for (i = 0; i < VPIDIRN; i++)
+    vpifree(((struct vpi_dir *)node)->slots[i], h - 1);
+  slabfree(node);
+}
+
+// Returns the permissions with which vr's page table may map the page at
+// index i, and sets *ppn to it; 0 if it is not in memory, or not vr's to
+// map, being in a vpi_page another holder maps. A page of a private
+// region is writable only while its vpi_page is vr's alone.
+static int
+vpiperms(struct vregion *vr, int i, uint64_t *ppn)
+{
+  struct vpi_page *page = vpipage(vr, i);
+  struct vpage_info *vpi;
+  int perms;
+
+  if (!page || page->vs != vr->vs)
+    return 0;
+  vpi = &page->infos[i % VPIPPAGE];
+  if (!vpi->used || !vpi->present)
+    return 0;
+  perms = x86perms(vpi);
+  if (page->ref > 1 && !vr->shared)
+    perms &= ~PTE_W;
+  *ppn = vpi->ppn;
+  return perms;
+}
+
 // allocates space for the kernel page table and populates 
 // it with the kernel's virtual address mapping after the 
 // virtual address space has been initialized by the kernel
 void
 vspacebootinit(void)
 {
+  initlock(&vspaces.lock, "vspaces");
+  slabcreate(&vpicache, "vpi_page", sizeof(struct vpi_page), 0);
+  slabcreate(&vpidircache, "vpi_dir", sizeof(struct vpi_dir), 0);
+  initsleeplock(&vpisharelock, "vpishare");
   kpml4 = setupkvm(); // sets up the kernel's page table
-  vspaceinstallkern();  // installs the kernel mapping in the table
+  initlock(&pcidlock, "pcid");
+  pcidon = cpuid_feature(CPUID_FEATURE_PCID);
+  vspaceinitcpu();
+}
+
+// installs the kernel's page table and segments on this cpu, the boot
+// cpu or one starting up
+void
+vspaceinitcpu(void)
+{
+  lcr3(V2P(kpml4));
+  // PCIDE needs PCID 0 in CR3, as the kernel's table has
+  if (pcidon)
+    lcr4(rcr4() | CR4_PCIDE);
   seginit();   // segment table
 }
 
@@ -62,18 +352,100 @@ vspaceinit(struct vspace *vs)
     return -1;
 
   initlock(&vs->lock, "vspacelock");
+  initsleeplock(&vs->faultlock, "vspacefault");
+  vs->pcidgen = 0;
+  vs->tlbactive = 0;
+  vs->tlbstale = 0;
+  vs->rss = vs->swapped = vs->wss = 0;
+  vs->sampled = ticks;
+  vs->memlimit = 0;
 
   for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++) {
     memset(vr, 0, sizeof(struct vregion));
+    vr->vs = vs;
   }
 
   vs->regions[VR_CODE].dir   = VRDIR_UP;
   vs->regions[VR_HEAP].dir   = VRDIR_UP;
   vs->regions[VR_USTACK].dir = VRDIR_DOWN;
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    vr->dir = VRDIR_UP;
 
   return 0;
 }
 
+// returns a new vspace for a process or a shared-memory segment,
+// initialized as by vspaceinit, or 0. Each holds one reference to its
+// vspace, so there are never more in use than there are of them.
+struct vspace*
+vspacealloc(void)
+{
+  struct vspace *vs;
+
+  acquire(&vspaces.lock);
+  for (vs = vspaces.vs; vs < &vspaces.vs[NPROC + NSHM]; vs++)
+    if (vs->ref == 0)
+      break;
+  if (vs == &vspaces.vs[NPROC + NSHM])
+    panic("vspacealloc");
+  vs->ref = 1;
+  release(&vspaces.lock);
+
+  if (vspaceinit(vs) < 0) {
+    acquire(&vspaces.lock);
+    vs->ref = 0;
+    release(&vspaces.lock);
+    return 0;
+  }
+  return vs;
+}
+
+// takes another reference to vs, for a thread sharing it
+void
+vspacehold(struct vspace *vs)
+{
+  acquire(&vspaces.lock);
+  vs->ref++;
+  release(&vspaces.lock);
+}
+
+// drops a reference to vs, freeing it with the last
+void
+vspaceput(struct vspace *vs)
+{
+  acquire(&vspaces.lock);
+  if (vs->ref > 1) {
+    vs->ref--;
+    release(&vspaces.lock);
+    return;
+  }
+  release(&vspaces.lock);
+
+  // still in use until freed, so that no one takes it meanwhile
+  vspacefree(vs);
+  acquire(&vspaces.lock);
+  vs->ref = 0;
+  release(&vspaces.lock);
+}
+
+// serializes the page faults and region changes of vs's threads, if it
+// has any. Returns whether it took faultlock, for vspaceunlockfault.
+int
+vspacelockfault(struct vspace *vs)
+{
+  if (vs->ref <= 1)
+    return 0;
+  acquiresleep(&vs->faultlock);
+  return 1;
+}
+
+void
+vspaceunlockfault(struct vspace *vs, int locked)
+{
+  if (locked)
+    releasesleep(&vs->faultlock);
+}
+
 // Adds a mapping in the vregion from the virtual address from_va of size sz with the appropriate
 // permissions. If size spans more than one page, multiple physical pages are mapped into the 
 // page table
@@ -93,10 +465,13 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
     if (!(vpi = va2vpage_info(vr, a)))
       goto addmap_failure;
     
-    mem = kalloc();
+    mem = kzalloc();
     if (!mem)
       goto addmap_failure;
-    memset(mem, 0, PGSIZE);
+    if (rmapadd(PGNUM(V2P(mem)), vr->vs, a) < 0) {
+      kfree(mem);
+      goto addmap_failure;
+    }
 
     vpi->used = 1;
     vpi->present = present;
@@ -124,6 +499,40 @@ addmap_failure:
   return -1;
 }
 
+// Maps sz bytes of vr from from_va to the shared zero page, read-only
+// and copy-on-write if writable, so that the memory takes a page of its
+// own only once written. Returns sz, or -1 if out of memory.
+int
+vregionaddzero(struct vregion *vr, uint64_t from_va, uint64_t sz, short writable)
+{
+  uint64_t a;
+  struct vpage_info *vpi;
+
+  if (sz + from_va >= KERNBASE)
+    return -1;
+
+  for (a = PGROUNDUP(from_va); a < from_va + sz; a += PGSIZE) {
+    if (!(vpi = va2vpage_info(vr, a))) {
+      // only the vpage_info tree can have run out; give back the zero
+      // page refs
+      for (a -= PGSIZE; a >= PGROUNDUP(from_va); a -= PGSIZE) {
+        vpi = va2vpage_info(vr, a);
+        kfree(P2V(zero_ppn << PT_SHIFT));
+        memset(vpi, 0, sizeof(*vpi));
+      }
+      return -1;
+    }
+    increment_cme_ref(zero_ppn);
+    vpi->used = 1;
+    vpi->present = 1;
+    vpi->writable = 0;
+    vpi->is_cow = writable;
+    vpi->ppn = zero_ppn;
+    vpi->swapped = 0;
+    vpi->swap_index = 0;
+  }
+  return sz;
+}
 
 // Adds a mapping into the vregion at va of size sz with the given permissions and then 
 // copies the data present in data to these addresses
@@ -146,25 +555,245 @@ vradddata(struct vregion *r, uint64_t va, char *data, int sz, short present, sho
   return 0;
 }
 
-// va must be page aligned
+// Fills in the page at va of segment sg of r. If the page lies wholly
+// within the file data, it is mapped straight from the page cache,
+// read-only, and copy-on-write if the segment is writable; otherwise
+// it gets a private zero-filled page with whatever file data it holds.
+// A shared region maps every page that starts within the file from the
+// cache as it is, so that its writes reach the file.
+// Caller must hold r->ip's lock if the page holds file data.
 static int
-vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint sz)
+vrfillpage(struct vregion *r, struct vrseg *sg, uint64_t va)
 {
   uint i, n;
+  uint64_t ppn;
+  char *mem;
+  struct cpage *cp;
   struct vpage_info *vpi;
-  assertm(va % PGSIZE == 0, "va must be page aligned");
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
-    assertm(vpi->used, "page must be allocated");
-    n = min(sz - i, (uint) PGSIZE);
-    if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
+  i = va - sg->va;
+  if (!(vpi = va2vpage_info(r, va)))
+    return -1;
+
+  if ((sg->off + i) % PGSIZE == 0 &&
+      (i + PGSIZE <= sg->filesz || (r->shared && i < sg->filesz))) {
+    if (!(cp = pcget(r->ip, (sg->off + i) / PGSIZE)))
       return -1;
-  }
+    ppn = PGNUM(V2P(cp->data));
+    increment_cme_ref(ppn);
+    if (r->shared) {
+      cp->shared = 1;
+      vpi->writable = sg->writable;
+      vpi->is_cow = 0;
+    } else {
+      vpi->writable = 0;
+      vpi->is_cow = sg->writable;
+    }
+    pcput(cp);
+  } else {
+    if (!(mem = kzalloc()))
+      return -1;
+    if (i < sg->filesz) {
+      n = min(sg->filesz - i, (uint) PGSIZE);
+      if (readi(r->ip, mem, sg->off + i, n) != n) {
+        kfree(mem);
+        return -1;
+      }
+    }
+    ppn = PGNUM(V2P(mem));
 
+    vpi->writable = sg->writable;
+    vpi->is_cow = 0;
+  }
+  if (rmapadd(ppn, r->vs, va) < 0) {
+    kfree(P2V(ppn << PT_SHIFT));
+    return -1;
+  }
+  vpi->used = 1;
+  vpi->present = 1;
+  vpi->ppn = ppn;
+  vpi->swapped = 0;
+  vpi->swap_index = 0;
   return 0;
 }
 
+// Handles a fault on a not-yet-loaded page of a lazily filled segment
+// (program file, mmap'd file or anonymous memory) by filling the page
+// in and mapping it, or on a page in memory that the page table has yet
+// to map, as after a fork, by mapping it, once the vpi_page holding it is
+// vs's own.
+// Returns 1 if va was such a page, 0 if it was not, -1 if the page
+// could not be filled in.
+int
+vspacefault(struct vspace *vs, uint64_t va)
+{
+  struct vregion *r;
+  struct vrseg *sg;
+  struct vpage_info *vpi;
+  int ret, file;
+
+  va = PGROUNDDOWN(va);
+  if (!(r = va2vregion(vs, va)))
+    return 0;
+
+  if ((vpi = vpilookup(r, va2vpi_idx(r, va), 0)) && vpi->used &&
+      vpi->present) {
+    // a new page table page must not need an eviction
+    ensure_n_free_pages(3);
+    acquire(&vs->lock);
+    vspacesetpte(vs, va, r);
+    release(&vs->lock);
+    return 1;
+  }
+  for (sg = r->seg; sg < &r->seg[r->nseg]; sg++)
+    if (va >= sg->va && va < sg->va + sg->memsz)
+      break;
+  if (sg == &r->seg[r->nseg])
+    return 0;
+  if (!(vpi = va2vpage_info(r, va)) || vpi->used)
+    return 0;
+  if (vspacehuge(vs, va))
+    return 1;
+
+  // bss pages need no file data, so need not wait for the inode
+  file = va - sg->va < sg->filesz;
+  if (file)
+    lockishared(r->ip);
+  ret = vrfillpage(r, sg, va);
+  // programs mostly run on into the next page
+  if (file && ret == 0)
+    ireadahead(r->ip, sg->off + (va - sg->va) + PGSIZE, PGSIZE);
+  if (file)
+    unlockishared(r->ip);
+  if (ret < 0)
+    return -1;
+
+  acquire(&vs->lock);
+  mappages(vs->pgtbl, va >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi), 0);
+  release(&vs->lock);
+  return 1;
+}
+
+// Fills in the pages of [va, va + n) in the current process's vspace
+// that are still to be filled in, ahead of a copy the kernel is to make
+// to or from them holding an inode's lock: filling in a page of a file
+// takes the file's inode lock, which the copy's fault would wait on for
+// good if it were the same inode. Addresses outside the process's
+// regions, the kernel's among them, are left alone.
+void
+vspaceprefault(uint64_t va, uint64_t n)
+{
+  struct vspace *vs;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a;
+  int locked;
+
+  if (!myproc() || va >= KERNBASE || n == 0)
+    return;
+  vs = myproc()->vspace;
+  locked = vspacelockfault(vs);
+  for (a = PGROUNDDOWN(va); a < va + n; a += PGSIZE) {
+    if (!(vr = va2vregion(vs, a)))
+      continue;
+    // in memory or in swap, it can be had without the inode
+    if (!(vpi = vpipeek(vr, va2vpi_idx(vr, a))) || !vpi->used)
+      vspacefault(vs, a);
+  }
+  vspaceunlockfault(vs, locked);
+}
+
+// Tries to back the 2MB block of vs holding va with one 2MB page, on
+// the first touch of the block: rather than 512 faults each filling a
+// page, there is one, and the TLB needs one entry for it all. The block
+// must lie in a private region that grows up, and be all heap pages
+// still on the zero page, or all untouched bss or anonymous memory.
+// Returns 1 if it was done, 0 if the fault is left to the 4KB paths.
+int
+vspacehuge(struct vspace *vs, uint64_t va)
+{
+  struct vregion *r;
+  struct vrseg *sg;
+  struct vpage_info *vpi;
+  uint64_t blk = va & ~(PD_SIZE - 1), ppn, i, j;
+  pde_t *pde, old;
+  char *mem;
+  int zero;
+
+  if (free_pages < HUGEMINFREE || !(r = va2vregion(vs, va)) ||
+      r->dir != VRDIR_UP || r->shared ||
+      blk < VRBOT(r) || blk + PD_SIZE > VRTOP(r))
+    return 0;
+
+  // zero is set for a heap block, which goes off the zero page; else
+  // the block must be untouched and past the file data of its segment
+  if (!(vpi = va2vpage_info(r, blk)))
+    return 0;
+  zero = vpi->used;
+  if (!zero) {
+    for (sg = r->seg; sg < &r->seg[r->nseg]; sg++)
+      if (blk >= sg->va && blk < sg->va + sg->memsz)
+        break;
+    if (sg == &r->seg[r->nseg] || !sg->writable ||
+        blk < PGROUNDUP(sg->va + sg->filesz) ||
+        blk + PD_SIZE > sg->va + sg->memsz)
+      return 0;
+  }
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    if (!(vpi = va2vpage_info(r, blk + i * PGSIZE)))
+      return 0;
+    if (zero && !(vpi->used && vpi->present && vpi->ppn == zero_ppn &&
+                  vpi->is_cow))
+      return 0;
+    if (!zero && vpi->used)
+      return 0;
+  }
+
+  if (!(mem = kallochuge()))
+    return 0;
+  ppn = PGNUM(V2P(mem));
+  mark_huge_mem(V2P(mem), 1);
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    if (rmapadd(ppn + i, vs, blk + i * PGSIZE) < 0) {
+      for (j = 0; j < PTRS_PER_PT; j++) {
+        if (j < i)
+          rmapdel(ppn + j, vs, blk + j * PGSIZE);
+        kfree(mem + j * PGSIZE);
+      }
+      return 0;
+    }
+  }
+
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    vpi = va2vpage_info(r, blk + i * PGSIZE);
+    if (zero)
+      kfree(P2V(zero_ppn << PT_SHIFT));
+    vpi->used = 1;
+    vpi->present = 1;
+    vpi->writable = 1;
+    vpi->is_cow = 0;
+    vpi->swapped = 0;
+    vpi->swap_index = 0;
+    vpi->ppn = ppn + i;
+    mark_user_mem((ppn + i) << PT_SHIFT, blk + i * PGSIZE);
+  }
+
+  // a new page directory page must not need an eviction
+  ensure_n_free_pages(3);
+  acquire(&vs->lock);
+  if (!(pde = walkpde(vs->pgtbl, (char *)blk, 1)))
+    panic("vspacehuge: no memory for page table");
+  old = *pde;
+  *pde = PTE(ppn << PT_SHIFT, x86perms(vpi) | PTE_PS);
+  release(&vs->lock);
+
+  // the zero page's entries go, along with the page table holding them
+  vspaceflush(vs);
+  if (old & PTE_P)
+    kfree(P2V(PTE_ADDR(old)));
+  return 1;
+}
+
 // Initializes the code region in the given vspace and copies the 
 // code in init to the region. Also allocates space for the stack 
 // region of 1 page. 
@@ -199,6 +828,10 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
 // vspace for a process. The program must be ELF compliant. The 
 // first instruction for the program is returned in the output 
 // parameter rip
+//
+// Only the headers are read here: the code region records each
+// PT_LOAD segment, and vspacefault fills in its pages as the program
+// touches them.
 int
 vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
 {
@@ -207,13 +840,15 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
   int off, sz;
   uint64_t va;
   struct elfhdr elf;
+  struct vrseg *sg;
   int i;
 
   if((ip = namei(path)) == 0){
     return 0;
   }
   
-  locki(ip);
+  // many may exec the same program at once
+  lockishared(ip);
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -223,9 +858,11 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
 
   // Set start bound
   vs->regions[VR_CODE].va_base = 0;
+  vs->regions[VR_CODE].nseg = 0;
 
   // Load program into memory.
   va = 0;
+  sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto elf_failure;
@@ -236,15 +873,20 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto elf_failure;
 
-    if((sz = vregionaddmap(&vs->regions[VR_CODE], (uint64_t)va, ph.vaddr + ph.memsz, VPI_PRESENT, VPI_WRITABLE)) < 0)
-     goto elf_failure;
     if(ph.vaddr % PGSIZE != 0)
       goto elf_failure;
+    if(vs->regions[VR_CODE].nseg == NVRSEG)
+      goto elf_failure;
 
-    va += sz;
+    sg = &vs->regions[VR_CODE].seg[vs->regions[VR_CODE].nseg++];
+    sg->va = ph.vaddr;
+    sg->off = ph.off;
+    sg->filesz = ph.filesz;
+    sg->memsz = ph.memsz;
+    sg->writable = (ph.flags & ELF_PROG_FLAG_WRITE) != 0;
 
-    if(vrloaddata(&vs->regions[VR_CODE], ph.vaddr, ip, ph.off, ph.filesz) < 0)
-     goto elf_failure;
+    va = max(va, ph.vaddr + ph.memsz);
+    sz = va;
   }
 
   // Set end bound;
@@ -253,13 +895,21 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
   vs->regions[VR_HEAP].va_base = PGROUNDUP(sz);
   vs->regions[VR_HEAP].size = 0;
 
-  unlocki(ip);
-  irelease(ip);
+  // the first page the program runs is the entry page: start reading it
+  for (i = 0; i < vs->regions[VR_CODE].nseg; i++) {
+    sg = &vs->regions[VR_CODE].seg[i];
+    if (elf.entry >= sg->va && elf.entry < sg->va + sg->filesz)
+      ireadahead(ip, sg->off + PGROUNDDOWN(elf.entry - sg->va), PGSIZE);
+  }
+
+  // the code region keeps the reference to ip
+  vs->regions[VR_CODE].ip = ip;
+  unlockishared(ip);
   *rip = elf.entry;
   return sz;
 elf_failure:
   if(ip) {
-    unlocki(ip);
+    unlockishared(ip);
     irelease(ip);
   }
 
@@ -275,11 +925,24 @@ vspaceinvalidate(struct vspace *vs)
   struct vregion *vr;
   struct vpage_info *vpi;
   uint64_t start, end;
+  pte_t *pte;
 
   ensure_n_free_pages(20);
 
   acquire(&vs->lock);
 
+  // Save the accessed bits of the entries about to go for the clock,
+  // and the dirty bits for the swap cache
+  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++) {
+    for (start = VRBOT(vr); start < VRTOP(vr); start += PGSIZE) {
+      pte = walkpml4(vs->pgtbl, (char *)start, 0);
+      if (pte && (*pte & (PTE_P | PTE_A)) == (PTE_P | PTE_A))
+        pa2page(PTE_ADDR(*pte))->accessed = 1;
+      if (pte && (*pte & (PTE_P | PTE_D)) == (PTE_P | PTE_D))
+        pa2page(PTE_ADDR(*pte))->dirty = 1;
+    }
+  }
+
   // First free the user entries (not the pages they point to)
   for (i = 0; i <= PML4_INDEX(SZ_4G); i++) {
     if(vs->pgtbl[i] & PTE_P){
@@ -302,6 +965,127 @@ vspaceinvalidate(struct vspace *vs)
     }
   }
   release(&vs->lock);
+  vspaceflush(vs);
+}
+
+// drops the TLB's entry for va, if it has one
+static inline void
+flushtlbpage(uint64_t va)
+{
+  asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+// the bit for this cpu in a vspace's cpu masks; interrupts must be off
+static uint
+cpubit(void)
+{
+  return 1U << (mycpu() - cpus);
+}
+
+// has every cpu flush vs's PCID when it next installs vs, but this one
+// if vs is installed here
+static void
+vspacestale(struct vspace *vs)
+{
+  pushcli();
+  __sync_fetch_and_or(&vs->tlbstale,
+                      mycpu()->vspace == vs ? ~cpubit() : ~0U);
+  popcli();
+}
+
+// drops vs's TLB entry for va on this cpu, if vs is installed here, and
+// on the others when they next install vs. The caller does a
+// vspaceshootdown for the cpus that have it installed now.
+static void
+vspaceflushpage(struct vspace *vs, uint64_t va)
+{
+  pushcli();
+  if (mycpu()->vspace == vs)
+    flushtlbpage(va);
+  vspacestale(vs);
+  popcli();
+}
+
+// Sets the page table entry for the page at va from its vpage_info in
+// vr, as vpiperms allows, or clears it if vr is 0 or the page is not
+// there to map, keeping the old entry's accessed bit for the clock and
+// its dirty bit for the swap cache. The stale entry leaves the TLB if vs
+// is the one installed.
+// Caller must hold vs->lock.
+static void
+vspacesetpte(struct vspace *vs, uint64_t va, struct vregion *vr)
+{
+  pde_t *pde;
+  pte_t *pte;
+  uint64_t ppn;
+  int perms = vr ? vpiperms(vr, va2vpi_idx(vr, va), &ppn) : 0;
+  int present = perms != 0;
+
+  // a 2MB page over va is split, so that only va's entry changes
+  if ((pde = walkpde(vs->pgtbl, (char *)va, 0)) && (*pde & PTE_PS) &&
+      splitpde(pde) < 0)
+    panic("vspacesetpte: no memory to split a 2MB page");
+
+  if (!(pte = walkpml4(vs->pgtbl, (char *)va, present))) {
+    if (present)
+      panic("vspacesetpte: no memory for page table");
+    return;
+  }
+  if ((*pte & (PTE_P | PTE_A)) == (PTE_P | PTE_A))
+    pa2page(PTE_ADDR(*pte))->accessed = 1;
+  if ((*pte & (PTE_P | PTE_D)) == (PTE_P | PTE_D))
+    pa2page(PTE_ADDR(*pte))->dirty = 1;
+
+  if (present) {
+    *pte = PTE(ppn << PT_SHIFT, perms);
+    mark_user_mem(ppn << PT_SHIFT, va);
+  } else {
+    *pte = 0;
+  }
+  vspaceflushpage(vs, va);
+}
+
+// Brings the page table entries for [va, va + len) up to date with the
+// vpage_infos: maps new pages, drops gone ones and changes permissions,
+// touching only those entries. vspaceinvalidate rebuilds them all.
+void
+vspacemaprange(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  uint64_t a;
+
+  // new page table pages must not need an eviction, which takes vs->lock
+  ensure_n_free_pages(20);
+
+  acquire(&vs->lock);
+  for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    vspacesetpte(vs, a, va2vregion(vs, a));
+  release(&vs->lock);
+  vspaceshootdown(vs);
+}
+
+// Clears the page table entries for [va, va + len), whatever the
+// vpage_infos say.
+void
+vspaceunmaprange(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  uint64_t a;
+  pde_t *pde;
+
+  acquire(&vs->lock);
+  for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+    // a 2MB page going whole need not be split first
+    if (a % PD_SIZE == 0 && a + PD_SIZE <= va + len &&
+        (pde = walkpde(vs->pgtbl, (char *)a, 0)) && (*pde & PTE_PS)) {
+      mark_huge_mem(PTE_ADDR(*pde), 0);
+      *pde = 0;
+      vspaceflushpage(vs, a);
+      a += PD_SIZE - PGSIZE;
+      continue;
+    }
+    vspacesetpte(vs, a, 0);
+  }
+  release(&vs->lock);
+  vspaceshootdown(vs);
 }
 
 // Marks the current user address as not present in the page directory
@@ -310,7 +1094,6 @@ vspaceinvalidate(struct vspace *vs)
 void vspacemarknotpresent(struct vspace *vspace, uint64_t user_va) {
   struct vregion *vr;
   struct vpage_info *vpi;
-  pte_t *pte;
 
   acquire(&vspace->lock);
   // Grab arguments and ensure they are valid and exist.
@@ -318,7 +1101,7 @@ void vspacemarknotpresent(struct vspace *vspace, uint64_t user_va) {
   assert(vspace);
   vr = va2vregion(vspace, user_va);
   assert(vr);
-  vpi = va2vpage_info(vr, user_va);
+  vpi = vpipeek(vr, va2vpi_idx(vr, user_va));
   assert(vpi);
   if (vpi->present) {
     panic("Passed user_va had present vpi.\n");
@@ -326,14 +1109,63 @@ void vspacemarknotpresent(struct vspace *vspace, uint64_t user_va) {
 
   // Zero out the page table entry so the page is signalled as not
   // present.
-  pte = walkpml4(vspace->pgtbl, (char *)user_va, 0);
-  if (pte) {
-    *pte = 0;
-  }
+  vspacesetpte(vspace, user_va, 0);
   release(&vspace->lock);
+  // the page is about to go to the disk; no cpu may write it meanwhile
+  vspaceshootdown(vspace);
 }
 
 
+// installs vs's page table on this cpu, giving vs a PCID if its last one
+// is from an old generation. The TLB keeps vs's entries unless they
+// changed since this cpu last had vs installed. Interrupts must be off.
+static void
+vspaceload(struct vspace *vs)
+{
+  struct cpu *c = mycpu();
+  struct vspace *old = c->vspace;
+  uint bit = cpubit(), gen;
+  uint64_t cr3, cr4;
+  int stale;
+
+  // vs is marked installed before its stale bit is read, so a change
+  // made meanwhile either shoots this cpu down or leaves the bit set
+  __sync_fetch_and_or(&vs->tlbactive, bit);
+  c->vspace = vs;
+  stale = __sync_fetch_and_and(&vs->tlbstale, ~bit) & bit;
+
+  if (!pcidon) {
+    cr3 = V2P(vs->pgtbl);
+  } else {
+    acquire(&pcidlock);
+    if (vs->pcidgen != pcidgen) {
+      if (pcidnext == NPCID) {
+        pcidgen++;
+        pcidnext = 1;
+      }
+      vs->pcid = pcidnext++;
+      vs->pcidgen = pcidgen;
+    }
+    gen = pcidgen;
+    release(&pcidlock);
+
+    // toggling PGE flushes the entries of every PCID
+    if (c->pcidgen != gen) {
+      cr4 = rcr4();
+      lcr4(cr4 ^ CR4_PGE);
+      lcr4(cr4);
+      c->pcidgen = gen;
+    }
+    cr3 = V2P(vs->pgtbl) | vs->pcid;
+    if (!stale)
+      cr3 |= CR3_NOFLUSH;
+  }
+  lcr3(cr3);
+
+  if (old && old != vs)
+    __sync_fetch_and_and(&old->tlbactive, ~bit);
+}
+
 // installs the process' page table/vspace on the given 
 // cpu
 //
@@ -346,45 +1178,144 @@ vspaceinstall(struct proc *p)
     panic("mrinstall: null proc");
   if (!p->kstack)
     panic("mrinstall: null kstack");
-  if (!p->vspace.pgtbl)
+  if (!p->vspace->pgtbl)
     panic("mrinstall: page table not initialized");
 
   pushcli();  // turn off interrupts
   mycpu()->ts.rsp0 = (uint64_t)p->kstack + KSTACKSIZE;
-  lcr3(V2P(p->vspace.pgtbl));
+  vspaceload(p->vspace);
   popcli();  // turns on interrupts
 }
 
-// installs the kernel's page table on the cpu
+// installs the kernel's page table on the cpu
+void
+vspaceinstallkern(void)
+{
+  struct cpu *c;
+
+  pushcli();
+  c = mycpu();
+  if (pcidon)
+    lcr3(V2P(kpml4) | CR3_NOFLUSH);
+  else
+    lcr3(V2P(kpml4));
+  if (c->vspace) {
+    __sync_fetch_and_and(&c->vspace->tlbactive, ~cpubit());
+    c->vspace = 0;
+  }
+  popcli();
+}
+
+// drops vs's entries from the TLB of every cpu: now on those that have
+// vs installed, or else when they next install it. A change to many of
+// vs's page table entries is followed by this rather than a flush of
+// each.
+void
+vspaceflush(struct vspace *vs)
+{
+  pushcli();
+  __sync_fetch_and_or(&vs->tlbstale, ~0U);
+  if (mycpu()->vspace == vs)
+    vspaceload(vs);
+  popcli();
+  vspaceshootdown(vs);
+}
+
+// Has the other cpus that have vs installed drop their TLB entries for
+// it, and waits until they have. The caller must hold no spinlock that
+// such a cpu could be spinning for with interrupts off.
+void
+vspaceshootdown(struct vspace *vs)
+{
+  struct cpu *c;
+  uint targets;
+
+  pushcli();
+  targets = vs->tlbactive & ~cpubit();
+  for (c = cpus; c < cpus + ncpu; c++) {
+    if (targets & (1U << (c - cpus))) {
+      xchg(&c->tlbflush, 1);
+      lapicipi(c->apicid, TRAP_IRQ0 + IRQ_TLBFLUSH);
+    }
+  }
+  // a cpu shooting this one down meanwhile waits for it in turn
+  for (c = cpus; c < cpus + ncpu; c++)
+    while ((targets & (1U << (c - cpus))) && c->tlbflush)
+      vspacetlbflush();
+  popcli();
+}
+
+// Flushes this cpu's TLB entries for the PCID installed, if another cpu
+// has asked it to. Interrupts must be off.
 void
-vspaceinstallkern(void)
+vspacetlbflush(void)
 {
-  lcr3(V2P(kpml4));
+  // CR3 reads back without the no-flush bit
+  if (xchg(&mycpu()->tlbflush, 0))
+    lcr3(rcr3());
 }
 
-// recrusively frees the page descriptor linked list
-// calling kfree on each page
+// Lets go of vr's vpi_page page, starting at index idx. A vpi_page
+// that a fork left shared stays with its other holders, naming itself in
+// the reverse maps if vr's entries were the ones; otherwise vr's entries
+// go, and the vpi_page with the pages and swap slots it holds.
 static void
-free_page_desc_list(struct vpi_page *page)
+vpiput(struct vregion *vr, struct vpi_page *page, uint64_t idx)
 {
+  struct vspace *vs = vr->vs;
+  struct vpage_info *vpi;
+  uint64_t va = vpi_idx2va(vr, idx);
+  int64_t step = vr->dir == VRDIR_UP ? PGSIZE : -PGSIZE;
   int i;
-  struct vpage_info* vpi;
-
-  assert((uint64_t) page % PGSIZE == 0);
 
-  if (!page)
-    return;
+  if (page->ref > 1 || page->vs != vs) {
+    acquiresleep(&vpisharelock);
+    if (page->ref > 1) {
+      if (page->vs == vs) {
+        rmapmoven(page->infos, VPIPPAGE, vs, 0, va, step, page);
+        page->vs = 0;
+      }
+      __sync_fetch_and_sub(&page->ref, 1);
+      releasesleep(&vpisharelock);
+      return;
+    }
+    // the last holder; the entries come to name vs, to go below
+    rmapmoven(page->infos, VPIPPAGE, 0, vs, va, step, page);
+    page->vs = vs;
+    releasesleep(&vpisharelock);
+  }
 
-  // free all swap pages
-  for (i = 0; i < VPIPPAGE; i++) {
+  // a page table need not map the pages, as after a fork
+  for (i = 0; i < VPIPPAGE; i++, va += step) {
     vpi = &page->infos[i];
-    if (vpi->used && vpi->swapped) {
+    if (!vpi->used)
+      continue;
+    if (vpi->swapped) {
+      rmapdelswap(vpi->swap_index, vs, va);
       swapfree(vpi->swap_index);
+    } else if (vpi->present) {
+      rmapdel(vpi->ppn, vs, va);
+      kfree(P2V(vpi->ppn << PT_SHIFT));
     }
   }
+  slabfree(page);
+}
+
+// frees the vpage_info tree of vr, taking vr's mappings of its pages off
+// the pages' reverse maps and freeing the pages and swap slots it holds
+// alone
+static void
+free_page_desc_list(struct vregion *vr)
+{
+  struct vpi_page *page;
+  uint64_t idx;
+
+  for (idx = 0; (page = vpinextleaf(vr, &idx)); idx += VPIPPAGE)
+    vpiput(vr, page, idx);
 
-  free_page_desc_list(page->next);
-  kfree((char *)page);
+  vpifree(vr->pages, vr->pgheight);
+  vr->pages = 0;
+  vr->pgheight = 0;
 }
 
 // frees the given vpsace by freeing each page that 
@@ -396,11 +1327,209 @@ vspacefree(struct vspace *vs)
   struct vregion *vr;
 
   for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_page_desc_list(vr->pages);
+    free_page_desc_list(vr);
+    if (vr->ip)
+      irelease(vr->ip);
     memset(vr, 0, sizeof(struct vregion));
   }
 
   freevm(vs->pgtbl);
+  // entries the reverse maps have yet to drop may still name vs
+  vs->pgtbl = 0;
+  // the TLB may hold entries of the old table under the PCID
+  vs->pcidgen = 0;
+}
+
+// returns a region of vs holding part of [lo, hi), or 0 if there is
+// none. A region's last page counts in full.
+struct vregion*
+vspacemapped(struct vspace *vs, uint64_t lo, uint64_t hi)
+{
+  struct vregion *vr;
+
+  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size && VRBOT(vr) < hi && lo < PGROUNDUP(VRTOP(vr)))
+      return vr;
+  return 0;
+}
+
+// finds a free mmap region of vs and a place for len bytes in it: *va
+// if that range is free, and otherwise the highest free range below
+// VMMAPTOP, which it sets *va to. Returns the region, or 0.
+static struct vregion*
+vrplace(struct vspace *vs, uint64_t *va, uint64_t len)
+{
+  struct vregion *vr, *r;
+  uint64_t hi, heaptop;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size == 0)
+      break;
+  if (vr == &vs->regions[NREGIONS])
+    return 0;
+
+  heaptop = PGROUNDUP(VRTOP(&vs->regions[VR_HEAP]));
+  if (*va < heaptop || *va + len > VMMAPTOP ||
+      vspacemapped(vs, *va, *va + len)) {
+    for (hi = VMMAPTOP; (r = vspacemapped(vs, hi - len, hi)) != 0; hi = VRBOT(r))
+      if (VRBOT(r) < heaptop + len)
+        return 0;
+    if (hi - len < heaptop)
+      return 0;
+    *va = hi - len;
+  }
+  return vr;
+}
+
+// Maps len bytes into vs: the file ip from byte off, or zero-filled
+// memory if ip is 0. The mapping goes at va if that range is free, and
+// otherwise at the highest free range below VMMAPTOP. Pages are filled
+// in on first touch, except that shared anonymous memory is allocated
+// at once so that a fork shares every page of it.
+// Returns the address of the mapping, or -1.
+uint64_t
+vspacemmap(struct vspace *vs, uint64_t va, uint64_t len, int prot, int flags,
+           struct inode *ip, uint off)
+{
+  struct vregion *vr;
+  struct vrseg *sg;
+
+  len = PGROUNDUP(len);
+  if (len == 0 || len >= VMMAPTOP || va % PGSIZE || off % PGSIZE)
+    return -1;
+  if ((vr = vrplace(vs, &va, len)) == 0)
+    return -1;
+
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = len;
+  vr->shared = (flags & MAP_SHARED) != 0;
+  vr->nseg = 1;
+  sg = &vr->seg[0];
+  sg->va = va;
+  sg->off = off;
+  sg->filesz = 0;
+  sg->memsz = len;
+  sg->writable = (prot & PROT_WRITE) != 0;
+
+  if (ip) {
+    lockishared(ip);
+    if (off < ip->size)
+      sg->filesz = min(ip->size - off, (uint)len);
+    unlockishared(ip);
+    vr->ip = idup(ip);
+  } else if (vr->shared) {
+    vr->nseg = 0;
+    if (vregionaddmap(vr, va, len, VPI_PRESENT, sg->writable) < 0) {
+      free_page_desc_list(vr);
+      memset(vr, 0, sizeof(struct vregion));
+      vr->vs = vs;
+      return -1;
+    }
+  }
+
+  vspacemaprange(vs, va, len);
+  return va;
+}
+
+// Maps the pages of src, a shared anonymous region of another vspace,
+// into vs as a region sharing them, as a fork shares such a region: each
+// page, in memory or in swap, is referenced once more. Returns the
+// address of the mapping, or -1.
+uint64_t
+vspacemapshared(struct vspace *vs, struct vregion *src)
+{
+  struct vregion *vr;
+  struct vpi_page *page;
+  struct vpage_info *vpi;
+  uint64_t va = 0, idx;
+
+  if ((vr = vrplace(vs, &va, src->size)) == 0)
+    return -1;
+
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = src->size;
+  vr->shared = 1;
+  vr->nseg = 0;
+  for (idx = 0; (page = vpinextleaf(src, &idx)); idx += VPIPPAGE) {
+    if (!(vpi = vpilookup(vr, idx, 1)) ||
+        pagedupn(vpi, page->infos, VPIPPAGE, vs, vpi_idx2va(vr, idx),
+                 PGSIZE, 0) < 0) {
+      free_page_desc_list(vr);
+      memset(vr, 0, sizeof(struct vregion));
+      vr->vs = vs;
+      return -1;
+    }
+  }
+
+  vspacemaprange(vs, va, vr->size);
+  return va;
+}
+
+// writes the pages of a shared, writable file mapping back to the file
+static void
+vrsync(struct vregion *vr)
+{
+  struct vrseg *sg = &vr->seg[0];
+  struct vpage_info *vpi;
+  uint i, n;
+
+  if (!vr->shared || !vr->ip || !sg->writable)
+    return;
+
+  locki(vr->ip);
+  for (i = 0; i < sg->filesz; i += PGSIZE) {
+    vpi = va2vpage_info(vr, sg->va + i);
+    if (!vpi || !vpi->used || !vpi->present || sg->off + i > vr->ip->size)
+      continue;
+    n = min(sg->filesz - i, (uint)PGSIZE);
+    writei(vr->ip, P2V(vpi->ppn << PT_SHIFT), sg->off + i, n);
+  }
+  unlocki(vr->ip);
+}
+
+// writes every shared file mapping of vs back to its file
+void
+vspacesync(struct vspace *vs)
+{
+  struct vregion *vr;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size)
+      vrsync(vr);
+}
+
+// Removes the mmap'd regions in [va, va + len), which must hold whole
+// regions only, writing shared file mappings back first.
+// Returns 0 on success, -1 if a region lies partly in the range.
+int
+vspacemunmap(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr;
+
+  len = PGROUNDUP(len);
+  if (len == 0 || va % PGSIZE || va + len < va)
+    return -1;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size && VRBOT(vr) < va + len && va < VRTOP(vr) &&
+        (VRBOT(vr) < va || VRTOP(vr) > va + len))
+      return -1;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++) {
+    if (!vr->size || VRBOT(vr) < va || VRTOP(vr) > va + len)
+      continue;
+    vrsync(vr);
+    vspaceunmaprange(vs, VRBOT(vr), vr->size);
+    free_page_desc_list(vr);
+    if (vr->ip)
+      irelease(vr->ip);
+    memset(vr, 0, sizeof(struct vregion));
+    vr->vs = vs;
+  }
+
+  return 0;
 }
 
 // returns the region that a given virtual address exists 
@@ -428,30 +1557,7 @@ va2vregion(struct vspace *vs, uint64_t va)
 struct vpage_info*
 va2vpage_info(struct vregion *vr, uint64_t va)
 {
-  int idx;
-  struct vpi_page *info;
-
-  if (!vr->pages) {
-    vr->pages = (struct vpi_page *)kalloc();
-    memset(vr->pages, 0, PGSIZE);
-  }
-
-  idx = va2vpi_idx(vr, va);
-  info = vr->pages;
-  while (idx >= VPIPPAGE) {
-    assertm(info, "idx was out of bounds");
-    if (!info->next) {
-      info->next = (struct vpi_page *)kalloc();
-      if (!info->next)
-        return 0;
-      memset(info->next, 0, PGSIZE);
-    }
-
-    info = info->next;
-    idx -= VPIPPAGE;
-  }
-
-  return &info->infos[idx];
+  return vpilookup(vr, va2vpi_idx(vr, va), 1);
 }
 
 // Tests if a vregion has [va, va + size) mapped in it's virtual address space.
@@ -477,41 +1583,41 @@ vspacecontains(struct vspace *vs, uint64_t va, int size)
 }
 
 
-// recursively copies the vpi_page struct from src to dst
+// copies the vpage_infos of region src to dst, which has the same
+// place in its vspace, and the pages they map
 //
 // return 0 on success, -1 if failed 
 static int
-copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+copy_vpi_page(struct vregion *dst, struct vregion *src)
 {
   int i;
   char *data;
+  uint64_t idx;
+  struct vpi_page *page;
   struct vpage_info *srcvpi, *dstvpi;
 
-  if (!src) {
-    *dst = 0;
-    return 0;
-  }
-
-  if (!(*dst = (struct vpi_page *)kalloc()))
-    return -1;
-
-  memset(*dst, 0, sizeof(struct vpi_page));
-
-  for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
-    if (srcvpi->used) {
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-      dstvpi->writable = srcvpi->writable;
-      if (!(data = kalloc()))
-        return -1;
-      memmove(data, P2V(srcvpi->ppn << PT_SHIFT), PGSIZE);
-      dstvpi->ppn = PGNUM(V2P(data));
+  for (idx = 0; (page = vpinextleaf(src, &idx)); idx += VPIPPAGE) {
+    if (!(dstvpi = vpilookup(dst, idx, 1)))
+      return -1;
+    for (i = 0; i < VPIPPAGE; i++, dstvpi++) {
+      srcvpi = &page->infos[i];
+      if (srcvpi->used) {
+        dstvpi->used = srcvpi->used;
+        dstvpi->present = srcvpi->present;
+        dstvpi->writable = srcvpi->writable;
+        if (!(data = kalloc()))
+          return -1;
+        if (rmapadd(PGNUM(V2P(data)), dst->vs, vpi_idx2va(dst, idx + i)) < 0) {
+          kfree(data);
+          return -1;
+        }
+        memmove(data, P2V(srcvpi->ppn << PT_SHIFT), PGSIZE);
+        dstvpi->ppn = PGNUM(V2P(data));
+      }
     }
   }
 
-  return copy_vpi_page(&(*dst)->next, src->next);
+  return 0;
 }
 
 // copies the regions and pagesof the src vspace to dst
@@ -521,9 +1627,17 @@ vspacecopy(struct vspace *dst, struct vspace *src)
   struct vregion *vr;
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  // dst has no vpage_infos of its own until they are copied
+  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++) {
+    vr->vs = dst;
+    vr->pages = 0;
+    vr->pgheight = 0;
+    if (vr->ip)
+      idup(vr->ip);
+  }
 
   for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
-    if (copy_vpi_page(&vr->pages, vr->pages) < 0)
+    if (copy_vpi_page(vr, &src->regions[vr - dst->regions]) < 0)
       return -1;
 
   vspaceinvalidate(dst);
@@ -532,82 +1646,153 @@ vspacecopy(struct vspace *dst, struct vspace *src)
 }
 
 
-// Completes a shallow copy of the vpi_page struct from src to dst
+// Completes a shallow copy of the vpage_infos of region src to dst,
+// which has the same place in its vspace: dst gets vpi_dirs of its own
+// over src's vpi_pages, each held once more. Nothing is done per page;
+// vpiown copies a vpi_page, or takes it over, when a holder first
+// touches it. dst's page table is left empty, to be filled in by
+// vspacefault as the pages are touched.
 // Returns 0 on success, -1 on failure
 static int
-copy_vpi_page_cow(struct vpi_page **dst, struct vpi_page *src) {
-  int i;
-  struct vpage_info *srcvpi, *dstvpi;
-  
-  // Return if no pages remain
-  if (!src) {
-    *dst = 0;
-    return 0;
-  }
+copy_vpi_page_cow(struct vregion *dst, struct vregion *src) {
+  struct vpi_page *page;
+  uint64_t idx;
+  void **slot;
 
-  // Allocate space for dst page fields
-  if (!(*dst = (struct vpi_page *) kalloc())) {
-    return -1;
+  for (idx = 0; (page = vpinextleaf(src, &idx)); idx += VPIPPAGE) {
+    if (!(slot = vpislot(dst, idx, 1)))
+      return -1;
+    *slot = page;
+    __sync_fetch_and_add(&page->ref, 1);
   }
-  memset(*dst, 0, sizeof(struct vpi_page));
-
-  // Shallow copy pages
-  for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
-    if (srcvpi->used) {
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-      dstvpi->ppn = srcvpi->ppn;
-      dstvpi->swapped = srcvpi->swapped;
-      dstvpi->swap_index = srcvpi->swap_index;
-
-      // Increment the reference count of the page
-      if (srcvpi->swapped)
-        increment_sme_ref(srcvpi->swap_index);
-      else
-        increment_cme_ref(srcvpi->ppn);
-
-      // If the source page is writable, set the cow flag for src and dst
-      if (srcvpi->writable) {
-        srcvpi->is_cow = 1;
-        dstvpi->is_cow = 1;
-      } else {
-        dstvpi->is_cow = srcvpi->is_cow;
-      }
+  return 0;
+}
 
-      // Set the permission of src and dst page to be read only
-      srcvpi->writable = 0;
-      dstvpi->writable = 0;
-    }
+// Takes write access away from all of vs's page table at once, in the
+// page directory entries, for the pages a fork has just shared;
+// vspacewritefault gives it back a 2MB block at a time.
+// Caller must hold vs->lock.
+static void
+vspacewrprotect(struct vspace *vs)
+{
+  pdpte_t *pdpt;
+  pde_t *pgdir;
+  uint i, j, k;
 
+  for (i = 0; i <= PML4_INDEX(SZ_4G); i++) {
+    if (!(vs->pgtbl[i] & PTE_P))
+      continue;
+    pdpt = P2V(PDPT_ADDR(vs->pgtbl[i]));
+    for (j = 0; j < PTRS_PER_PDPT; j++) {
+      if (!(pdpt[j] & PTE_P))
+        continue;
+      pgdir = P2V(PDE_ADDR(pdpt[j]));
+      for (k = 0; k < PTRS_PER_PD; k++)
+        pgdir[k] &= ~PTE_W;
+    }
   }
-  return copy_vpi_page_cow(&(*dst)->next, src->next);
 }
 
+// Handles a write fault at va in a 2MB block of vs that vspacewrprotect
+// took write access from. A 2MB page gets it back whole if all of its
+// pages may be written; otherwise the block's page table entries lose it
+// instead, for vspacesetpte to give back a page at a time on the next
+// write faults, as vpiperms allows. The TLB holds the block's entries
+// read-only, so none need flushing.
+// Returns 1 if the block was such a one, 0 if not.
+int
+vspacewritefault(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  uint64_t blk = va & ~(PD_SIZE - 1), ppn;
+  pde_t *pde;
+  pte_t *pgtab;
+  int i, r = 0;
+
+  acquire(&vs->lock);
+  if ((pde = walkpde(vs->pgtbl, (char *)va, 0)) &&
+      (*pde & (PTE_P | PTE_W)) == PTE_P) {
+    if (*pde & PTE_PS) {
+      vr = va2vregion(vs, blk);
+      for (i = 0; vr && i < PTRS_PER_PT; i++)
+        if (!(vpiperms(vr, va2vpi_idx(vr, blk + i * PGSIZE), &ppn) & PTE_W))
+          break;
+      r = vr && i == PTRS_PER_PT;
+    } else {
+      pgtab = P2V(PTE_ADDR(*pde));
+      for (i = 0; i < PTRS_PER_PT; i++)
+        pgtab[i] &= ~PTE_W;
+      r = 1;
+    }
+    if (r)
+      *pde |= PTE_W;
+  }
+  release(&vs->lock);
+  return r;
+}
 
 int
 vspacecopy_cow(struct vspace *dst, struct vspace *src) {
   struct vregion *vr;
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  // dst has no vpage_infos of its own until they are copied
+  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++) {
+    vr->vs = dst;
+    vr->pages = 0;
+    vr->pgheight = 0;
+    if (vr->ip)
+      idup(vr->ip);
+  }
 
   for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++) {
-    if (copy_vpi_page_cow(&vr->pages, vr->pages) < 0) {
+    if (copy_vpi_page_cow(vr, &src->regions[vr - dst->regions]) < 0) {
       return -1;
     }
   }
 
-  // Invalidate both parent and child
-  vspaceinvalidate(src);
-  vspaceinvalidate(dst);
-
-  vspaceinstall(myproc());
+  // src may no longer write the pages it now shares
+  acquire(&src->lock);
+  vspacewrprotect(src);
+  release(&src->lock);
+  vspaceflush(src);
 
   return 0;
 }
 
 
+// Moves the regions, pages and page table of src to dst, which must be
+// freed, leaving src empty. Nothing is copied: the pages only have
+// their reverse maps and vpi_pages point at dst.
+void
+vspacemove(struct vspace *dst, struct vspace *src)
+{
+  struct vregion *vr;
+  struct vpi_page *page;
+  uint64_t idx;
+
+  memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  dst->pgtbl = src->pgtbl;
+  dst->pcidgen = 0;
+  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++) {
+    vr->vs = dst;
+    for (idx = 0; (page = vpinextleaf(vr, &idx)); idx += VPIPPAGE) {
+      if (page->vs != src)
+        continue;
+      rmapmoven(page->infos, VPIPPAGE, src, dst, vpi_idx2va(vr, idx),
+                vr->dir == VRDIR_UP ? PGSIZE : -PGSIZE, 0);
+      page->vs = dst;
+    }
+  }
+
+  for (vr = src->regions; vr < &src->regions[NREGIONS]; vr++) {
+    memset(vr, 0, sizeof(struct vregion));
+    vr->vs = src;
+  }
+  src->pgtbl = 0;
+}
+
+
 // initializes the stack region in the user's address space for the 
 // given vspace beginning at start and growing down from that address. 
 // The stack starts with 1 page.
@@ -644,7 +1829,8 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 
   end = va + sz;
   while (va < end) {
-    wsz = min((int)(PGROUNDUP(va) - va), sz);
+    // to the end of va's page, a whole one if va is page aligned
+    wsz = min((int)(PGSIZE - va % PGSIZE), sz);
 
     if (!(vr = va2vregion(vs, va)))
       return -1;
@@ -656,6 +1842,8 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
       return -1;
 
     memmove(P2V(vpi->ppn << PT_SHIFT) + (va % PGSIZE), data, wsz);
+    // no page table entry saw the write
+    pa2page(vpi->ppn << PT_SHIFT)->dirty = 1;
 
     va += wsz;
     data += wsz;
@@ -714,15 +1902,30 @@ vspacedumpcode(struct vspace*vs) {
   }
 }
 
-int vspacemarkswapped(uint64_t ppn, uint swap_index, uint64_t va, struct vspace* vs) {
+// the vpage_info a reverse map entry names: at va in vs, or in slot va
+// of page if vs is 0. Sets *vr to vs's region, if vs is not 0.
+static struct vpage_info *
+rmapvpi(struct vspace *vs, uint64_t va, struct vpi_page *page,
+        struct vregion **vr)
+{
+  if (!vs)
+    return &page->infos[va];
+  if (!(*vr = va2vregion(vs, va)))
+    return 0;
+  return vpipeek(*vr, va2vpi_idx(*vr, va));
+}
+
+// Points the mapping of page ppn at va in vs, or in slot va of page, a
+// vpi_page a fork shared, if vs is 0, at swap slot swap_index. Every
+// holder of a shared vpi_page sees the change; there is a page table
+// entry to drop only if vs is given. Returns 1, or 0 if the mapping is
+// gone.
+int vspacemarkswapped(uint64_t ppn, uint swap_index, uint64_t va, struct vspace* vs,
+                      struct vpi_page *page) {
   struct vregion *vr;
   struct vpage_info* vpi;
-  
-  vr = va2vregion(vs, va);
-  if (vr == NULL)
-    return 0;
-  vpi = va2vpage_info(vr, va);
-  if (vpi == NULL)
+
+  if (!(vpi = rmapvpi(vs, va, page, &vr)))
     return 0;
 
   if (vpi->used && vpi->ppn == ppn && vpi->present) {
@@ -730,22 +1933,180 @@ int vspacemarkswapped(uint64_t ppn, uint swap_index, uint64_t va, struct vspace*
     vpi->present = 0;
     vpi->ppn = 0;
     vpi->swap_index = swap_index;
-    vspacemarknotpresent(vs, va);
+    if (vs) {
+      vspacemarknotpresent(vs, va);
+      vs->rss--;
+      vs->swapped++;
+    }
     return 1;
   }
 
   return 0;
 }
 
-int vspaceupdatecow(uint64_t ppn, uint swap_idx, uint64_t va, struct vspace* vs) {
+// Returns 1 and sets *ppn if va is a present page of vs, else returns 0.
+// Nothing is locked or allocated, so the allocator may ask; the answer
+// is a hint for it to check.
+int vspacepresent(struct vspace *vs, uint64_t va, uint64_t *ppn) {
   struct vregion *vr;
-  struct vpage_info* vpi;
-  
-  vr = va2vregion(vs, va);
-  if (vr == NULL)
+  struct vpage_info *vpi;
+
+  if (!(vr = va2vregion(vs, va)))
+    return 0;
+  if (!(vpi = vpipeek(vr, va2vpi_idx(vr, va))))
+    return 0;
+  if (!vpi->used || !vpi->present)
+    return 0;
+  *ppn = vpi->ppn;
+  return 1;
+}
+
+// Swaps the page at va in vs, page aligned, for the kernel page *kpage,
+// and hands back the old page, now the kernel's, in *kpage: what was in
+// *kpage is at va without a copy. The page at va must be present,
+// private and writable. Returns 0, or -1 if it is not such a page, and
+// nothing changes.
+int vspaceflippage(struct vspace *vs, uint64_t va, char **kpage) {
+  struct vregion *vr;
+  struct vpi_page *page;
+  struct vpage_info *vpi;
+  uint64_t ppn = PGNUM(V2P(*kpage)), old;
+
+  if (va % PGSIZE != 0 || va >= KERNBASE)
+    return -1;
+  // the reverse map entry may need memory, so before vs->lock
+  if (rmapadd(ppn, vs, va) < 0)
+    return -1;
+
+  acquire(&vs->lock);
+  // nor may the vpi_page be one a fork shared, which the child would see
+  // the new page through
+  if (!(vr = va2vregion(vs, va)) || vr->shared ||
+      !(page = vpipage(vr, va2vpi_idx(vr, va))) || page->ref != 1 ||
+      page->vs != vs || !(vpi = vpipeek(vr, va2vpi_idx(vr, va))) ||
+      !vpi->used || !vpi->present || !vpi->writable || vpi->is_cow ||
+      takeuserpage(vpi->ppn, vs, va) < 0) {
+    release(&vs->lock);
+    rmapdel(ppn, vs, va);
+    return -1;
+  }
+  old = vpi->ppn;
+  vpi->ppn = ppn;
+  vspacesetpte(vs, va, vr);
+  release(&vs->lock);
+  vspaceshootdown(vs);
+
+  *kpage = P2V(old << PT_SHIFT);
+  return 0;
+}
+
+// Makes the mapping of page ppn at va in vs copy-on-write if it is
+// writable, as a fork does, so that a write takes a copy of the page.
+// Returns 0, or -1 if va no longer maps ppn in a private region.
+int vspacemarkcow(struct vspace *vs, uint64_t va, uint64_t ppn) {
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  pde_t *pde;
+  int changed = 0;
+
+  acquire(&vs->lock);
+  if (!vs->pgtbl || !(vr = va2vregion(vs, va)) || vr->shared ||
+      !(vpi = vpipeek(vr, va2vpi_idx(vr, va))) || !vpi->used ||
+      !vpi->present || vpi->ppn != ppn ||
+      ((pde = walkpde(vs->pgtbl, (char *)va, 0)) && (*pde & PTE_PS))) {
+    release(&vs->lock);
+    return -1;
+  }
+  if (vpi->writable) {
+    vpi->writable = 0;
+    vpi->is_cow = 1;
+    vspacesetpte(vs, va, vr);
+    changed = 1;
+  }
+  release(&vs->lock);
+  if (changed)
+    vspaceshootdown(vs);
+  return 0;
+}
+
+// Points the mapping of page old at va in vs at page new, which holds
+// the same bytes, for same-page merging. The mapping must not have been
+// written since vspacemarkcow; a reference on new for it is the
+// caller's to give. Returns 0, or -1 if va no longer maps old read-only.
+int vspaceremap(struct vspace *vs, uint64_t va, uint64_t old, uint64_t new) {
+  struct vregion *vr;
+  struct vpage_info *vpi;
+
+  // the reverse map entry may need memory, so before vs->lock
+  if (rmapadd(new, vs, va) < 0)
+    return -1;
+
+  acquire(&vs->lock);
+  if (!vs->pgtbl || !(vr = va2vregion(vs, va)) || vr->shared ||
+      !(vpi = vpipeek(vr, va2vpi_idx(vr, va))) || !vpi->used ||
+      !vpi->present || vpi->ppn != old || vpi->writable) {
+    release(&vs->lock);
+    rmapdel(new, vs, va);
+    return -1;
+  }
+  vpi->ppn = new;
+  vspacesetpte(vs, va, vr);
+  release(&vs->lock);
+  vspaceshootdown(vs);
+
+  rmapdel(old, vs, va);
+  return 0;
+}
+
+// Tests and clears the accessed bit of the PTE mapping page ppn at va
+// in vs. Returns 1 if it was set.
+int vspacetestaccessed(uint64_t ppn, uint64_t va, struct vspace* vs) {
+  pde_t *pde;
+  pte_t *pte;
+
+  if (!vs->pgtbl)
+    return 0;
+
+  // a 2MB page has one accessed bit for all of its pages
+  if ((pde = walkpde(vs->pgtbl, (char *)va, 0)) && (*pde & PTE_PS)) {
+    pte = pde;
+    ppn &= ~(PTRS_PER_PT - 1);
+  } else {
+    pte = walkpml4(vs->pgtbl, (char *)va, 0);
+  }
+  if (pte && (*pte & PTE_P) && PGNUM(PTE_ADDR(*pte)) == ppn && (*pte & PTE_A)) {
+    *pte &= ~PTE_A;
+    // a cached entry would not set the bit again
+    vspacestale(vs);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Tests the dirty bit of the PTE mapping page ppn at va in vs.
+// Returns 1 if it is set.
+int vspacetestdirty(uint64_t ppn, uint64_t va, struct vspace* vs) {
+  pte_t *pte;
+
+  if (!vs->pgtbl)
     return 0;
-  vpi = va2vpage_info(vr, va);
-  if (vpi == NULL)
+  pte = walkpml4(vs->pgtbl, (char *)va, 0);
+  return pte && (*pte & PTE_P) && PGNUM(PTE_ADDR(*pte)) == ppn &&
+         (*pte & PTE_D);
+}
+
+// Points the mapping of swap slot swap_idx at va in vs, or in slot va of
+// page if vs is 0, at page ppn, which the slot has been read into, as
+// vspacemarkswapped points it the other way. Returns 1, or 0 if the
+// mapping is gone.
+int vspaceupdatecow(uint64_t ppn, uint swap_idx, uint64_t va, struct vspace* vs,
+                    struct vpi_page *page) {
+  struct vregion *vr;
+  struct vpage_info* vpi;
+  int perms;
+
+  if (!(vpi = rmapvpi(vs, va, page, &vr)))
     return 0;
 
   if (vpi->swap_index == swap_idx && !vpi->present) {
@@ -753,10 +2114,116 @@ int vspaceupdatecow(uint64_t ppn, uint swap_idx, uint64_t va, struct vspace* vs)
     vpi->present = 1;
     vpi->ppn = ppn;
     vpi->swap_index = 0;
-
-    vspaceinvalidate(vs);
+    if (!vs)
+      return 1;
+    vs->rss++;
+    vs->swapped--;
+
+    // just this page came back; the rest of the page table stands
+    acquire(&vs->lock);
+    if ((perms = vpiperms(vr, va2vpi_idx(vr, va), &ppn)))
+      mappages(vs->pgtbl, va >> PT_SHIFT, 1, ppn, perms, 0);
+    release(&vs->lock);
     return 1;
   }
 
   return 0;
 }
+
+// Counts the pages of vs in memory and in swap, and those used since the
+// last count, once every WSTICKS. The accessed bits it clears are kept
+// for the clock in the core map. Runs on a timer interrupt from user
+// space, so this cpu holds no lock.
+void
+vspacesample(struct vspace *vs)
+{
+  struct vregion *vr;
+  struct vpi_page *page;
+  struct vpage_info *vpi;
+  uint64_t idx, va, hugeva = 1;
+  int i, used = 0, rss = 0, swapped = 0, wss = 0;
+  pde_t *pde;
+
+  if (ticks - vs->sampled < WSTICKS)
+    return;
+  vs->sampled = ticks;
+
+  acquire(&vs->lock);
+  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
+    for (idx = 0; (page = vpinextleaf(vr, &idx)); idx += VPIPPAGE) {
+      for (i = 0; i < VPIPPAGE; i++) {
+        vpi = &page->infos[i];
+        if (vpi->used && vpi->swapped)
+          swapped++;
+        if (!vpi->used || !vpi->present || vpi->ppn == zero_ppn)
+          continue;
+        rss++;
+        va = vpi_idx2va(vr, idx + i);
+        // a 2MB page has one accessed bit for all of its pages
+        if ((pde = walkpde(vs->pgtbl, (char *)va, 0)) && (*pde & PTE_PS)) {
+          if ((va & ~(PD_SIZE - 1)) != hugeva) {
+            hugeva = va & ~(PD_SIZE - 1);
+            used = vspacetestaccessed(vpi->ppn, va, vs);
+          }
+        } else {
+          used = vspacetestaccessed(vpi->ppn, va, vs);
+        }
+        if (used) {
+          wss++;
+          pa2page(vpi->ppn << PT_SHIFT)->accessed = 1;
+        }
+      }
+    }
+  }
+  vs->rss = rss;
+  vs->swapped = swapped;
+  vs->wss = wss;
+  release(&vs->lock);
+
+  // cached entries would not set the bits again: this cpu drops them
+  // now, and the others when they next install vs
+  pushcli();
+  __sync_fetch_and_or(&vs->tlbstale, ~0U);
+  if (mycpu()->vspace == vs)
+    vspaceload(vs);
+  popcli();
+}
+
+// Returns whether some vspace has more pages in memory than its limit.
+// Nothing is locked; the answer is a hint for reclaim.
+int
+vspaceoverlimit(void)
+{
+  struct vspace *vs;
+
+  for (vs = vspaces.vs; vs < &vspaces.vs[NPROC + NSHM]; vs++)
+    if (vs->ref > 0 && vs->memlimit && vs->rss > vs->memlimit)
+      return 1;
+  return 0;
+}
+
+// Returns memory figure k of sysstat.h for vs, or summed over every
+// vspace in use if vs is 0.
+int
+vspacememstat(struct vspace *vs, int k)
+{
+  int n = 0;
+
+  if (vs == 0) {
+    for (vs = vspaces.vs; vs < &vspaces.vs[NPROC + NSHM]; vs++)
+      if (vs->ref > 0 && k != MEM_LIMIT)
+        n += vspacememstat(vs, k);
+    return n;
+  }
+  switch (k) {
+  case MEM_RSS:
+    return vs->rss;
+  case MEM_SWAP:
+    return vs->swapped;
+  case MEM_WS:
+    return vs->wss;
+  case MEM_LIMIT:
+    return vs->memlimit;
+  }
+  return 0;
+}
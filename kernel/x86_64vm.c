@@ -42,9 +42,10 @@ seginit(void)
   lgdt((void*) gdt, 8 * sizeof(uint64_t));
   ltr(SEG_TSS << 3);
 
+  // the kernel's %gs base; trapasm.S swaps it with user space's, 0
   loadgs(SEG_KCPU << 3);
   wrmsr(MSR_IA32_GS_BASE, (uint64_t)&c->cpu);
-  wrmsr(MSR_IA32_KERNEL_GS_BASE, (uint64_t)&c->cpu);
+  wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
 
   // Initialize cpu-local storage.
   c->cpu = c;
@@ -52,25 +53,23 @@ seginit(void)
 };
 
 
-// Return the address of the PTE in page table pgdir
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-pte_t *
-walkpml4(pml4e_t *pml4, const void *va, int alloc)
+// Return the address of the PDE in page table pml4 that
+// corresponds to virtual address va.  If alloc!=0, create
+// any required page directory pages.
+pde_t *
+walkpde(pml4e_t *pml4, const void *va, int alloc)
 {
   pml4e_t *pml4e;
   pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pte_t *pgtab;
+  pde_t *pgdir;
 
   pml4e = &pml4[PML4_INDEX(va)];
 
   if (*pml4e & PTE_P) {
     pdpt = (pdpte_t*)P2V(PDPT_ADDR(*pml4e));
   } else {
-    if(!alloc || (pdpt = (pdpte_t*)kalloc()) == 0)
+    if(!alloc || (pdpt = (pdpte_t*)kzalloc()) == 0)
       return 0;
-    memset(pdpt, 0, PGSIZE);
     *pml4e = V2P(pdpt) | PTE_P | PTE_W | PTE_U;
   }
 
@@ -79,20 +78,56 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
   if (*pdpte & PTE_P) {
     pgdir = (pde_t*)P2V(PDE_ADDR(*pdpte));
   } else {
-    if(!alloc || (pgdir = (pde_t*)kalloc()) == 0)
+    if(!alloc || (pgdir = (pde_t*)kzalloc()) == 0)
       return 0;
-    memset(pgdir, 0, PGSIZE);
     *pdpte = V2P(pgdir) | PTE_P | PTE_W | PTE_U;
   }
 
-  pde = &pgdir[PD_INDEX(va)];
+  return &pgdir[PD_INDEX(va)];
+}
+
+// Replaces the 2MB page mapped by pde with a page table of 4KB pages
+// mapping the same memory the same way. The pages of a user huge page
+// may then be swapped out one by one.
+// Returns 0, or -1 if there is no memory for the page table.
+int
+splitpde(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint64_t pa = PTE_ADDR(*pde);
+  uint i;
+
+  if ((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  for (i = 0; i < PTRS_PER_PT; i++)
+    pgtab[i] = PTE(pa + i * PGSIZE, *pde & ~(PTE_PS | BITMASK64(51, 12)));
+  if (*pde & PTE_U)
+    mark_huge_mem(pa, 0);
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
+// Return the address of the PTE in page table pgdir
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages, splitting a 2MB
+// page in the way; otherwise there is no PTE for a 2MB page.
+pte_t *
+walkpml4(pml4e_t *pml4, const void *va, int alloc)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+
+  if (!(pde = walkpde(pml4, va, alloc)))
+    return 0;
+
+  if ((*pde & PTE_PS) && (!alloc || splitpde(pde) < 0))
+    return 0;
 
   if (*pde & PTE_P) {
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
       return 0;
-    memset(pgtab, 0, PGSIZE);
     *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
   }
 
@@ -129,16 +164,53 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
 }
 
 
-// Set up kernel part of a page table.
+// Map physical memory [pa, end) at va for the kernel, using 2MB pages
+// wherever va and pa line up with them, to keep the page tables small and
+// the TLB reach large; the ends go in 4KB pages.
+static int
+mapkern(pml4e_t *pml4, uint64_t va, uint64_t pa, uint64_t end, int perm)
+{
+  pde_t *pde;
+  uint64_t n;
+
+  while (pa < end) {
+    if (va % PD_SIZE == 0 && pa % PD_SIZE == 0 && end - pa >= PD_SIZE) {
+      if ((pde = walkpde(pml4, (char*)va, 1)) == 0)
+        return -1;
+      if (*pde & PTE_P)
+        panic("remap");
+      *pde = PTE(pa, perm | PTE_PS);
+      n = PD_SIZE;
+    } else {
+      // up to the next 2MB boundary, or the end
+      n = min(end - pa, PD_SIZE - va % PD_SIZE);
+      if (mappages(pml4, va >> PT_SHIFT, n >> PT_SHIFT, pa >> PT_SHIFT, perm, 1) < 0)
+        return -1;
+    }
+    va += n;
+    pa += n;
+  }
+  return 0;
+}
+
+// Set up kernel part of a page table. The kernel's mappings never
+// change once kpml4 is made, so later tables share its kernel half.
 pml4e_t*
 setupkvm(void)
 {
   pml4e_t *pml4;
   struct kmap *k;
+  struct memrange *m;
+  uint64_t start;
 
-  if((pml4 = (pml4e_t*)kalloc()) == 0)
+  if((pml4 = (pml4e_t*)kzalloc()) == 0)
     return 0;
-  memset(pml4, 0, PGSIZE);
+
+  if (kpml4) {
+    memmove(pml4 + PTRS_PER_PML4 / 2, kpml4 + PTRS_PER_PML4 / 2,
+            PTRS_PER_PML4 / 2 * sizeof(pml4e_t));
+    return pml4;
+  }
 
   struct kmap {
     void *virt;
@@ -148,12 +220,19 @@ setupkvm(void)
   } kmap[] = {
     { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
     { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
-    { (void*)data,     V2P(data),     (uint64_t) npages * PGSIZE,   PTE_W}, // kern data+memory
+    { (void*)data,     V2P(data),     V2P(_end), PTE_W}, // kern data
+    { P2V(0),          0,             EXTMEM,    PTE_W}, // I/O space, direct
     { (void*)DEVSPACE, 0xFE000000,    0x100000000,         PTE_W}, // more devices
   };
 
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++) {
-    if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P, 1) < 0)
+    if(mapkern(pml4, (uint64_t)k->virt, k->phys_start, k->phys_end, k->perm | PTE_P) < 0)
+      return 0;
+  }
+  // then usable memory, and only that, in the direct map
+  for (m = memranges; m < &memranges[nmemranges]; m++) {
+    start = max(m->start, (uint64_t)EXTMEM);
+    if(mapkern(pml4, (uint64_t)P2V(start), start, m->end, PTE_W | PTE_P) < 0)
       return 0;
   }
   return pml4;
@@ -226,7 +305,10 @@ freevm_pgdir(pde_t *pgdir)
 {
   uint i;
   for (i = 0; i < PTRS_PER_PD; i++) {
-    if (pgdir[i] & PTE_P) {
+    // a 2MB page's memory is not the page table's to free
+    if ((pgdir[i] & (PTE_P | PTE_PS | PTE_U)) == (PTE_P | PTE_PS | PTE_U)) {
+      mark_huge_mem(PTE_ADDR(pgdir[i]), 0);
+    } else if ((pgdir[i] & (PTE_P | PTE_PS)) == PTE_P) {
       char *v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -248,15 +330,15 @@ freevm_pdpt(pdpte_t *pdpt)
 }
 
 
-// Free a page table and all the physical memory pages
-// in the user part.
+// Free a page table. The pages of the user part belong to the
+// vpage_infos of its vspace, which free them; the kernel half is
+// kpml4's.
 void
 freevm(pml4e_t *pml4)
 {
   uint i;
   assertm(pml4, "freevm: no pml4");
-  deallocuvm(pml4, 0, SZ_4G, 0);
-  for(i = 0; i < PTRS_PER_PML4; i++){
+  for(i = 0; i < PTRS_PER_PML4 / 2; i++){
     if(pml4[i] & PTE_P){
       pdpte_t *pdpt = P2V(PDPT_ADDR(pml4[i]));
       freevm_pdpt(pdpt);
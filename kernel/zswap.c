@@ -0,0 +1,113 @@
+// Compressed swap pool.
+//
+// A page being swapped out is compressed first. If it shrinks enough
+// and the pool has room, the compressed copy stays in memory and the
+// disk is not touched: bringing the page back costs a decompression
+// rather than a disk read. The page keeps its swap slot, which names it
+// in the vpage_infos and holds its reverse map, and the slot's swap map
+// entry points at the copy. Copies live in slab caches of a few sizes;
+// a page that compresses to more than the largest goes to the disk.
+//
+// The pool grows to at most ZSWAP_PCT percent of memory, and is off if
+// ZSWAP_PCT is 0.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <mmu.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <slab.h>
+#include <spinlock.h>
+
+// sized to pack 16, 8, 4, 3 and 2 copies to a slab page
+#define NZCLASS 5
+static uint zsizes[NZCLASS] = {240, 496, 1000, 1344, 2016};
+
+static struct {
+  struct sleeplock lock; // protects buf and htab
+  char buf[2016];        // compressor output, largest class
+  ushort htab[1 << LZHASHBITS];
+  struct slabcache caches[NZCLASS];
+
+  struct spinlock countlock; // protects bytes
+  uint64_t bytes;            // slab space the copies take
+} zswap;
+
+int zswap_pages; // pages held in the pool
+
+void zswapinit(void) {
+  int c;
+
+  initsleeplock(&zswap.lock, "zswap");
+  initlock(&zswap.countlock, "zswapcount");
+  for (c = 0; c < NZCLASS; c++)
+    slabcreate(&zswap.caches[c], "zswap", zsizes[c], 0);
+}
+
+// the size class for len compressed bytes
+static int zclass(uint len) {
+  int c;
+
+  for (c = 0; zsizes[c] < len; c++)
+    ;
+  return c;
+}
+
+// Compresses the page at page into the pool. Returns the copy and sets
+// *len to its length, or returns 0 if the page is to go to the disk.
+char *zswapstore(char *page, ushort *len) {
+  char *z;
+  int n, c;
+  uint64_t max = (uint64_t)npages * PGSIZE / 100 * ZSWAP_PCT;
+
+  // a kalloc for the pool itself may be swapping a page out; and rather
+  // than wait on another's, the page can go to the disk
+  if (ZSWAP_PCT == 0 || zswap.bytes + zsizes[0] > max || zswap.lock.locked)
+    return 0;
+
+  acquiresleep(&zswap.lock);
+  n = lzcompress(page, PGSIZE, zswap.buf, sizeof(zswap.buf), zswap.htab);
+  if (n < 0) {
+    releasesleep(&zswap.lock);
+    return 0;
+  }
+  c = zclass(n);
+
+  acquire(&zswap.countlock);
+  if (zswap.bytes + zsizes[c] > max) {
+    release(&zswap.countlock);
+    releasesleep(&zswap.lock);
+    return 0;
+  }
+  zswap.bytes += zsizes[c];
+  release(&zswap.countlock);
+
+  if ((z = slaballoc(&zswap.caches[c])) != 0) {
+    memmove(z, zswap.buf, n);
+    *len = n;
+  }
+  releasesleep(&zswap.lock);
+
+  acquire(&zswap.countlock);
+  if (z)
+    zswap_pages++;
+  else
+    zswap.bytes -= zsizes[c];
+  release(&zswap.countlock);
+  return z;
+}
+
+// Decompresses the copy z of len bytes into the page at page.
+void zswapload(char *z, ushort len, char *page) {
+  if (lzdecompress(z, len, page, PGSIZE) != PGSIZE)
+    panic("zswapload");
+}
+
+// Gives back the copy z of len bytes.
+void zswapfree(char *z, ushort len) {
+  slabfree(z);
+  acquire(&zswap.countlock);
+  zswap.bytes -= zsizes[zclass(len)];
+  zswap_pages--;
+  release(&zswap.countlock);
+}
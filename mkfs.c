@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 
 typedef unsigned long  ulong;
 typedef unsigned int   uint;
@@ -25,15 +26,19 @@ typedef unsigned char  uchar;
 // Disk layout:
 // [ boot block | sb block | free bit map | inode file start | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int nswapblocks = SWAPPAGES * 8;  // Number of swap blocks
-int nlogblocks = 20;  // Number of log blocks
+int fssize = FSSIZE;  // Blocks in the image
+int nbitmap;  // Number of bitmap blocks
+int nextent = 1;  // Files get a multiple of this many blocks
+int nswappages = SWAPPAGES;  // Number of swap pages, 8 blocks each
+int nswapblocks;  // Number of swap blocks
+int nlogblocks = NLOGBLOCKS;  // Number of log blocks
+int ndirbuckets = 0;  // Hash buckets of the root directory, 0 for linear
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+char *img;  // the image, mapped
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode;
 uint freeblock;
 
@@ -46,6 +51,7 @@ void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iallocblocks(uint inum, int start, int numblks);
 void iappend(uint inum, void *p, int n);
+void diradd(uint inum, struct dirent *de);
 
 // convert to intel byte order
 ushort
@@ -85,10 +91,40 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-l") == 0 && argc > 3){
+      nlogblocks = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-h") == 0 && argc > 3){
+      ndirbuckets = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-s") == 0 && argc > 3){
+      nswappages = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-n") == 0 && argc > 3){
+      fssize = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-e") == 0 && argc > 3){
+      nextent = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else {
+      argc = 0;
+    }
+  }
+  if(argc < 2 || nlogblocks < 2 || nlogblocks > LOGMAXBLOCKS + 1 ||
+     ndirbuckets < 0 || nswappages < 0 || nswappages > MAXSWAPPAGES ||
+     fssize <= 0 || nextent < 1){
+    fprintf(stderr, "Usage: mkfs [-n blocks] [-l logblocks] [-h dirbuckets] "
+            "[-s swappages] [-e extentblocks] fs.img files...\n");
     exit(1);
   }
+  nswapblocks = nswappages * 8;
+  nbitmap = fssize/(BSIZE*8) + 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
@@ -99,24 +135,40 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  // The image is built in place through a shared mapping of the file,
+  // which starts as a hole: blocks never written read as zeroes, and
+  // the host writes the rest back in large runs.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
+  img = mmap(0, (size_t)fssize * BSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nbitmap + nswapblocks + nlogblocks;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
+  if(nblocks < 1024){
+    fprintf(stderr, "mkfs: %d swap pages leave too few data blocks\n", nswappages);
+    exit(1);
+  }
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.swapstart = xint(2);
+  sb.nswap = xint(nswappages);
   sb.logstart = xint(2+nswapblocks);
+  sb.nlog = xint(nlogblocks);
   sb.bmapstart = xint(2+nswapblocks+nlogblocks);
   sb.inodestart = xint(2+nbitmap+nswapblocks+nlogblocks);
 
-  printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d total %d\n",
-       nmeta, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, bitmap blocks %u, swap blocks %u, log blocks %u) blocks %d total %d\n",
+       nmeta, nbitmap, nswapblocks, nlogblocks, nblocks, fssize);
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -129,7 +181,7 @@ main(int argc, char *argv[])
 
   // setup inode file data area
   rinode(inodefileino, &din);
-  for (int i = 0; i < 6; i++) {
+  for (int i = 0; i < NEXTENT; i++) {
     din.data[i].startblkno = 0;
     din.data[i].nblocks = 0;
   }
@@ -137,6 +189,7 @@ main(int argc, char *argv[])
   inodefileblkn = inum_count/IPB;
   if (inodefileblkn == 0 || (inum_count * sizeof(struct dinode) % BSIZE))
     inodefileblkn++;
+  inodefileblkn = (inodefileblkn + nextent - 1) / nextent * nextent;
   din.data[0].nblocks = xint(inodefileblkn);
   din.size = xint(inum_count * sizeof(struct dinode));
   winode(inodefileino, &din);
@@ -153,18 +206,35 @@ main(int argc, char *argv[])
   rootdir_blocks = rootdir_size / BSIZE;
 	if (rootdir_size % BSIZE)
 		rootdir_blocks += 1;
+  if (ndirbuckets > 0) {
+    // header block plus the buckets, which must hold every entry
+    assert(rootdir_size <= ndirbuckets * BSIZE);
+    rootdir_blocks = 1 + ndirbuckets;
+    rootdir_size = rootdir_blocks * BSIZE;
+  }
   iallocblocks(rootino, freeblock, rootdir_blocks);
   freeblock += rootdir_blocks;
 
+  if (ndirbuckets > 0) {
+    struct dirhdr hdr;
+
+    bzero(buf, sizeof(buf));
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = xint(DIRHDR_MAGIC);
+    hdr.nbuckets = xint(ndirbuckets);
+    memmove(buf, &hdr, sizeof(hdr));
+    wsect(freeblock - rootdir_blocks, buf);
+  }
+
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  diradd(rootino, &de);
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  diradd(rootino, &de);
 
   inum = ialloc(T_DEV);
   rinode(inum, &din);
@@ -174,7 +244,7 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(inum);
   strncpy(de.name, "console", DIRSIZ);
-  iappend(rootino, &de, sizeof(de));
+  diradd(rootino, &de);
 
   for(i = 2; i < argc; i++){
     char *name = argv[i];
@@ -201,10 +271,10 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, name, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    diradd(rootino, &de);
 
     rinode(inum, &din);
-    for (int i = 0; i < 6; i++) {
+    for (int i = 0; i < NEXTENT; i++) {
       din.data[i].startblkno = 0;
       din.data[i].nblocks = 0;
     }
@@ -214,8 +284,11 @@ main(int argc, char *argv[])
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
 
+    // each file in one extent, with room to grow in place to a
+    // multiple of nextent blocks
     rinode(inum, &din);
     din.data[0].nblocks = xint(xint(din.size) / BSIZE + (xint(din.size) % BSIZE == 0 ? 0 : 1));
+    din.data[0].nblocks = xint((xint(din.data[0].nblocks) + nextent - 1) / nextent * nextent);
     freeblock += xint(din.data[0].nblocks);
     winode(inum, &din);
 
@@ -233,22 +306,25 @@ main(int argc, char *argv[])
   printf("inum: %d size %d start: %d nblocks: %d\n",
       inum,xint(din.size), xint(din.data[0].startblkno), xint(din.data[0].nblocks));
 
+  if(freeblock > fssize){
+    fprintf(stderr, "mkfs: files need %u blocks, more than the %d there are\n",
+            freeblock, fssize);
+    exit(1);
+  }
   balloc(freeblock);
 
+  if(munmap(img, (size_t)fssize * BSIZE) < 0 || close(fsfd) < 0){
+    perror(argv[1]);
+    exit(1);
+  }
   exit(0);
 }
 
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
-    exit(1);
-  }
+  assert(sec < fssize);
+  memmove(img + (size_t)sec * BSIZE, buf, BSIZE);
 }
 
 void
@@ -281,14 +357,8 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
-    exit(1);
-  }
+  assert(sec < fssize);
+  memmove(buf, img + (size_t)sec * BSIZE, BSIZE);
 }
 
 uint
@@ -361,3 +431,35 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Add a directory entry: appended to a linear directory, or placed in
+// its hash bucket, or the next one with room, in a hashed one.
+void
+diradd(uint inum, struct dirent *de)
+{
+  struct dinode din;
+  struct dirent ents[BSIZE / sizeof(struct dirent)];
+  uint b, k, blk;
+  int i;
+
+  if (ndirbuckets == 0) {
+    iappend(inum, de, sizeof(*de));
+    return;
+  }
+
+  rinode(inum, &din);
+  b = dirhash(de->name) % ndirbuckets;
+  for (k = 0; k < ndirbuckets; k++) {
+    blk = xint(din.data[0].startblkno) + 1 + (b + k) % ndirbuckets;
+    rsect(blk, ents);
+    for (i = 0; i < BSIZE / sizeof(struct dirent); i++) {
+      if (ents[i].inum == 0) {
+        ents[i] = *de;
+        wsect(blk, ents);
+        return;
+      }
+    }
+  }
+  fprintf(stderr, "mkfs: hashed directory full\n");
+  exit(1);
+}
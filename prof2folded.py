@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Turns the samples the prof program prints on the serial console into
+# folded stacks, the input of flamegraph.pl and speedscope:
+#
+#   python3 prof2folded.py console.log > prof.folded
+#   flamegraph.pl prof.folded > prof.svg
+#
+# Kernel pcs are looked up in out/xk.elf and user pcs in the program's
+# out/user/_<name>; frames of the kernel are marked [k].
+
+import argparse
+import bisect
+import collections
+import os
+import subprocess
+import sys
+
+
+class Symbols:
+    def __init__(self, elf, nm):
+        self.addrs, self.names = [], []
+        if not os.path.exists(elf):
+            return
+        out = subprocess.run([nm, "-n", elf], capture_output=True,
+                             text=True).stdout
+        for line in out.splitlines():
+            f = line.split()
+            if len(f) == 3 and f[1] in "tTwW":
+                self.addrs.append(int(f[0], 16))
+                self.names.append(f[2])
+
+    def lookup(self, pc):
+        i = bisect.bisect_right(self.addrs, pc) - 1
+        return self.names[i] if i >= 0 else "0x%x" % pc
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("log", nargs="?", type=argparse.FileType("r"),
+                    default=sys.stdin)
+    ap.add_argument("--out", default="out", help="the build directory")
+    ap.add_argument("--nm", default="nm")
+    args = ap.parse_args()
+
+    kernel = Symbols(os.path.join(args.out, "xk.elf"), args.nm)
+    users = {}
+    stacks = collections.Counter()
+    for line in args.log:
+        f = line.split()
+        if len(f) < 5 or f[0] != "P":
+            continue
+        try:
+            user = int(f[2])
+            pcs = [int(x, 16) for x in f[4:]]
+        except ValueError:
+            continue
+        name = f[3]
+        if user:
+            if name not in users:
+                elf = os.path.join(args.out, "user", "_" + name)
+                users[name] = Symbols(elf, args.nm)
+            frames = [users[name].lookup(pc) for pc in pcs]
+        else:
+            frames = [kernel.lookup(pc) + "_[k]" for pc in pcs]
+        # the root first
+        stacks[";".join([name] + frames[::-1])] += 1
+
+    for stack, n in sorted(stacks.items()):
+        print(stack, n)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Turns the events the trace program prints on the serial console into
+# Chrome trace JSON, for chrome://tracing or ui.perfetto.dev:
+#
+#   python3 trace2json.py console.log > trace.json
+#
+# Lines other than trace's are skipped, so a whole captured console log
+# will do. Scheduler and disk events go on a track per cpu; the events
+# of a process, which may move between cpus, on a track per pid.
+
+import argparse
+import json
+import sys
+
+# keep in step with inc/trace.h
+NAMES = {
+    1: "run",
+    2: "sleep",
+    3: "wakeup",
+    4: "iderw",
+    5: "ideintr",
+    6: "tx",
+    7: "commit",
+    8: "fault",
+    9: "evict",
+    10: "lost",
+}
+CPU_EVENTS = {"run", "iderw", "ideintr", "lost"}
+CPUS, PROCS = 0, 1  # Chrome "processes" the two kinds of track go in
+TICK_US = 10000     # a tick, as the lapic timer is set up
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("log", nargs="?", type=argparse.FileType("r"),
+                    default=sys.stdin)
+    ap.add_argument("--tick-us", type=float, default=TICK_US,
+                    help="microseconds in a kernel tick")
+    args = ap.parse_args()
+
+    tsc_per_us = None
+    events = []
+    for line in args.log:
+        f = line.split()
+        if len(f) == 3 and f[:2] == ["#", "tsc_per_tick"]:
+            tsc_per_us = int(f[2]) / args.tick_us
+        elif len(f) == 7 and f[0] == "T":
+            try:
+                cpu, tsc, pid, typ = (int(x) for x in f[1:5])
+                arg = int(f[6], 16)
+            except ValueError:
+                continue
+            events.append((tsc, cpu, pid, typ, f[5], arg))
+    if not events:
+        sys.exit("trace2json: no trace events found")
+    if not tsc_per_us:
+        sys.exit("trace2json: no tsc_per_tick line found")
+
+    events.sort()
+    t0 = events[0][0]
+    out = [
+        {"ph": "M", "pid": CPUS, "name": "process_name",
+         "args": {"name": "cpus"}},
+        {"ph": "M", "pid": PROCS, "name": "process_name",
+         "args": {"name": "processes"}},
+    ]
+    for tsc, cpu, pid, typ, phase, arg in events:
+        name = NAMES.get(typ, "type%d" % typ)
+        e = {"name": name, "ph": phase, "ts": (tsc - t0) / tsc_per_us}
+        if name in CPU_EVENTS:
+            e["pid"], e["tid"] = CPUS, cpu
+        else:
+            e["pid"], e["tid"] = PROCS, pid
+        if name == "run":
+            # slices on a cpu track are named by what ran
+            e["name"] = "pid %d" % arg
+        if phase == "i":
+            e["s"] = "t"
+        e["args"] = {"arg": hex(arg), "cpu": cpu, "pid": pid}
+        out.append(e)
+    json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
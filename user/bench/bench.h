@@ -0,0 +1,48 @@
+#pragma once
+
+// Timing for the benchmarks. Each result is one line,
+//
+//   BENCH <name> ops=<n> bytes=<n> cycles=<n> ticks=<n>
+//
+// of what a run did and the TSC cycles and timer ticks it took, for
+// bench.py on the host to read. tsc_per_tick gives the cycles in a
+// tick once per program, to turn cycles into time.
+
+#include <msr.h>
+
+struct bench {
+  char *name;
+  uint64_t c0;
+  int t0;
+};
+
+static inline void benchtsc(void) {
+  uint64_t c0;
+  int t0;
+
+  sleep(1);
+  t0 = uptime();
+  c0 = readtsc();
+  sleep(10);
+  printf(1, "BENCH tsc_per_tick %ld\n", (readtsc() - c0) / (uptime() - t0));
+}
+
+static inline void benchstart(struct bench *b, char *name) {
+  b->name = name;
+  b->t0 = uptime();
+  b->c0 = readtsc();
+}
+
+static inline void benchend(struct bench *b, int ops, int64_t bytes) {
+  uint64_t c = readtsc() - b->c0;
+  int t = uptime() - b->t0;
+
+  printf(1, "BENCH %s ops=%d bytes=%ld cycles=%ld ticks=%d\n", b->name, ops,
+         bytes, c, t);
+}
+
+// A pseudo-random number, for the random access patterns.
+static inline uint benchrand(uint *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
@@ -0,0 +1,40 @@
+// Process creation latency: forkbench.
+
+#include <cdefs.h>
+#include <user.h>
+
+#include "bench.h"
+
+#define NFORK 200 // forks of each test
+
+int main(int argc, char *argv[]) {
+  struct bench b;
+  char *args[] = {"forkbench", "-x", 0};
+  int i;
+
+  // the program fork+exec runs
+  if (argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit();
+
+  benchtsc();
+
+  benchstart(&b, "fork_exit");
+  for (i = 0; i < NFORK; i++) {
+    if (fork() == 0)
+      exit();
+    wait();
+  }
+  benchend(&b, NFORK, 0);
+
+  benchstart(&b, "fork_exec");
+  for (i = 0; i < NFORK; i++) {
+    if (fork() == 0) {
+      exec(args[0], args);
+      printf(2, "forkbench: exec failed\n");
+      exit();
+    }
+    wait();
+  }
+  benchend(&b, NFORK, 0);
+  exit();
+}
@@ -0,0 +1,114 @@
+// File system throughput and metadata rates: fsbench.
+
+#include <cdefs.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <stat.h>
+#include <user.h>
+
+#include "bench.h"
+
+#define FILESIZE (256 * 1024) // bytes of the sequential and random tests
+#define CHUNK 4096            // bytes a sequential read or write moves
+#define NRAND 256             // random reads and writes
+#define NFILES 64             // files the create and lookup tests make
+
+static char buf[CHUNK];
+
+static void seqwrite(char *path) {
+  struct bench b;
+  int fd, n;
+
+  if ((fd = open(path, O_CREATE | O_RDWR)) < 0) {
+    printf(2, "fsbench: cannot create %s\n", path);
+    exit();
+  }
+  benchstart(&b, "fs_seq_write");
+  for (n = 0; n < FILESIZE; n += CHUNK)
+    if (write(fd, buf, CHUNK) != CHUNK) {
+      printf(2, "fsbench: write failed\n");
+      exit();
+    }
+  benchend(&b, FILESIZE / CHUNK, FILESIZE);
+  close(fd);
+}
+
+static void seqread(char *path) {
+  struct bench b;
+  int fd, n, r;
+
+  fd = open(path, O_RDONLY);
+  benchstart(&b, "fs_seq_read");
+  for (n = 0; (r = read(fd, buf, CHUNK)) > 0; n += r)
+    ;
+  benchend(&b, n / CHUNK, n);
+  close(fd);
+}
+
+// BSIZE-sized reads or writes at random block offsets in the file.
+static void randio(char *path, int writing) {
+  struct bench b;
+  uint seed = 1;
+  int fd, i, off;
+
+  fd = open(path, O_RDWR);
+  benchstart(&b, writing ? "fs_rand_write" : "fs_rand_read");
+  for (i = 0; i < NRAND; i++) {
+    off = benchrand(&seed) % (FILESIZE / BSIZE) * BSIZE;
+    if (writing)
+      pwrite(fd, buf, BSIZE, off);
+    else
+      pread(fd, buf, BSIZE, off);
+  }
+  benchend(&b, NRAND, NRAND * BSIZE);
+  close(fd);
+}
+
+static void filename(char *name, int pid, int i) {
+  name[0] = 'b';
+  name[1] = 'a' + pid % 26;
+  name[2] = 'a' + pid / 26 % 26;
+  name[3] = '0' + i / 10;
+  name[4] = '0' + i % 10;
+  name[5] = 0;
+}
+
+// There is no unlink to clean up with, so the names have the pid in
+// them for a later run to make new files.
+static void createlookup(void) {
+  struct bench b;
+  struct stat st;
+  char name[8];
+  int i, fd, pid = getpid();
+
+  benchstart(&b, "fs_create");
+  for (i = 0; i < NFILES; i++) {
+    filename(name, pid, i);
+    if ((fd = open(name, O_CREATE | O_RDWR)) < 0) {
+      printf(2, "fsbench: cannot create %s\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  benchend(&b, NFILES, 0);
+
+  benchstart(&b, "fs_lookup");
+  for (i = 0; i < NFILES; i++) {
+    filename(name, pid, i);
+    stat(name, &st);
+  }
+  benchend(&b, NFILES, 0);
+}
+
+int main(int argc, char *argv[]) {
+  char path[] = "fsbench.dat";
+
+  memset(buf, 'x', sizeof(buf));
+  benchtsc();
+  seqwrite(path);
+  seqread(path);
+  randio(path, 1);
+  randio(path, 0);
+  createlookup();
+  exit();
+}
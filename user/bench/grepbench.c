@@ -0,0 +1,67 @@
+// grep throughput over a log file: grepbench.
+
+#include <cdefs.h>
+#include <fcntl.h>
+#include <user.h>
+
+#include "bench.h"
+
+#define FILESIZE (1024 * 1024) // bytes of the log grep searches
+#define LOG "grepbench.log"
+#define OUT "grepbench.out"
+
+static char line[128];
+
+// Writes FILESIZE bytes of log lines, one in 64 of them an error.
+static void makelog(void) {
+  uint seed = 1;
+  int fd, n, i, len;
+
+  if ((fd = open(LOG, O_CREATE | O_RDWR)) < 0) {
+    printf(2, "grepbench: cannot create %s\n", LOG);
+    exit();
+  }
+  for (n = i = 0; n < FILESIZE; n += len, i++) {
+    strcpy(line, i % 64 == 0 ? "kernel: ERROR disk timeout, retrying request "
+                             : "kernel: info request done in few ticks, ok ");
+    len = strlen(line);
+    // a varying tail, so the lines differ
+    for (; len < 80 + benchrand(&seed) % 40; len++)
+      line[len] = 'a' + benchrand(&seed) % 26;
+    line[len++] = '\n';
+    if (n + len > FILESIZE)
+      len = FILESIZE - n;
+    write(fd, line, len);
+  }
+  close(fd);
+}
+
+// Times a grep for pattern through the log, its output to a file.
+static void run(char *name, char *pattern) {
+  char *args[] = {"grep", pattern, LOG, 0};
+  struct bench b;
+
+  unlink(OUT);
+  benchstart(&b, name);
+  if (fork() == 0) {
+    close(1);
+    if (open(OUT, O_CREATE | O_RDWR) != 1)
+      exit();
+    exec(args[0], args);
+    printf(2, "grepbench: exec failed\n");
+    exit();
+  }
+  wait();
+  benchend(&b, 1, FILESIZE);
+}
+
+int main(int argc, char *argv[]) {
+  benchtsc();
+  makelog();
+  run("grep_literal", "ERROR disk");
+  run("grep_prefix", "ERROR.*retry");
+  run("grep_regex", ".*timeout");
+  unlink(OUT);
+  unlink(LOG);
+  exit();
+}
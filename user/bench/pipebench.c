@@ -0,0 +1,45 @@
+// Pipe bandwidth at several message sizes: pipebench.
+
+#include <cdefs.h>
+#include <user.h>
+
+#include "bench.h"
+
+#define TOTAL (1024 * 1024) // bytes sent at each size
+#define MAXMSG 32768
+
+static char buf[MAXMSG];
+
+static void run(char *name, int size) {
+  struct bench b;
+  int fds[2], n, r;
+
+  if (pipe(fds) < 0) {
+    printf(2, "pipebench: pipe failed\n");
+    exit();
+  }
+  // the child the writer, and the parent the reader, which times it
+  if (fork() == 0) {
+    close(fds[0]);
+    for (n = 0; n < TOTAL; n += size)
+      write(fds[1], buf, size);
+    exit();
+  }
+  close(fds[1]);
+
+  benchstart(&b, name);
+  for (n = 0; (r = read(fds[0], buf, size)) > 0; n += r)
+    ;
+  benchend(&b, TOTAL / size, n);
+  close(fds[0]);
+  wait();
+}
+
+int main(int argc, char *argv[]) {
+  benchtsc();
+  run("pipe_64", 64);
+  run("pipe_512", 512);
+  run("pipe_4096", 4096);
+  run("pipe_32768", MAXMSG);
+  exit();
+}
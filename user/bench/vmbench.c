@@ -0,0 +1,75 @@
+// Virtual memory rates: vmbench. Times first touches of fresh heap
+// pages, copy-on-write breaks after a fork, and a loop over more memory
+// than there is, which swaps.
+
+#include <cdefs.h>
+#include <mmu.h>
+#include <sysinfo.h>
+#include <user.h>
+
+#include "bench.h"
+
+#define NPAGES 256 // pages of the fault and copy-on-write tests
+
+static void touch(char *p, int npages) {
+  int i;
+
+  for (i = 0; i < npages; i++)
+    p[i * PGSIZE] = i;
+}
+
+static void faults(void) {
+  struct bench b;
+  char *p = sbrk(NPAGES * PGSIZE);
+
+  benchstart(&b, "vm_fault");
+  touch(p, NPAGES);
+  benchend(&b, NPAGES, NPAGES * PGSIZE);
+}
+
+// The child writes to every page it shares with the parent.
+static void cow(void) {
+  struct bench b;
+  char *p = sbrk(NPAGES * PGSIZE);
+
+  touch(p, NPAGES);
+  if (fork() == 0) {
+    benchstart(&b, "vm_cow");
+    touch(p, NPAGES);
+    benchend(&b, NPAGES, NPAGES * PGSIZE);
+    exit();
+  }
+  wait();
+}
+
+// Two passes over a quarter again as much memory as is free, little
+// enough to fit in the default swap region.
+static void thrash(void) {
+  struct bench b;
+  struct sys_info info;
+  char *p;
+  int npages, swapins;
+
+  sysinfo(&info);
+  npages = info.free_pages + info.free_pages / 4;
+  if ((p = sbrk(npages * PGSIZE)) == (char *)-1) {
+    printf(2, "vmbench: sbrk of %d pages failed\n", npages);
+    return;
+  }
+  swapins = info.num_swap_ins;
+  benchstart(&b, "vm_thrash");
+  touch(p, npages);
+  touch(p, npages);
+  sysinfo(&info);
+  benchend(&b, 2 * npages, (int64_t)2 * npages * PGSIZE);
+  printf(1, "BENCH vm_thrash_swapins ops=%d bytes=0 cycles=0 ticks=0\n",
+         info.num_swap_ins - swapins);
+}
+
+int main(int argc, char *argv[]) {
+  benchtsc();
+  faults();
+  cow();
+  thrash();
+  exit();
+}
@@ -1,50 +1,124 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The input is read BUFSIZE bytes at a time and searched whole lines at
+// a time in the buffer. When every match starts with a literal string,
+// the buffer is searched for that with Boyer-Moore-Horspool, and only
+// the lines it turns up in go to the matcher; a literal pattern needs
+// no matcher at all. Matching lines go out through fout's buffer.
 
 #include <cdefs.h>
 #include <stat.h>
 #include <user.h>
 
-char buf[1024];
+#define BUFSIZE 65536
+
+// one more for the nul put after a line
+static char buf[BUFSIZE + 1];
+
+static char *re;      // the pattern
+static int plen;      // bytes of the literal prefix of every match, or 0
+static int literal;   // the pattern is its prefix; a line holding it matches
+static int skip[256]; // Horspool shifts for the prefix
+
 int match(char *, char *);
 
-void grep(char *pattern, int fd) {
-  int n, m;
-  char *p, *q;
-
-  m = 0;
-  while ((n = read(fd, buf + m, sizeof(buf) - m - 1)) > 0) {
-    m += n;
-    buf[m] = '\0';
-    p = buf;
-    while ((q = strchr(p, '\n')) != 0) {
-      *q = 0;
-      if (match(pattern, p)) {
-        *q = '\n';
-        write(1, p, q + 1 - p);
-      }
-      p = q + 1;
+// Finds the literal prefix of re, if every match must start with one:
+// re is not anchored and starts with plain characters, the last of which
+// is not under a *.
+static void compile(char *pattern) {
+  int i;
+
+  re = pattern;
+  if (re[0] == '^')
+    return; // each line is tried only at its start, which is quick
+  for (plen = 0; re[plen] && !strchr(".*^$", re[plen]); plen++)
+    ;
+  literal = re[plen] == '\0';
+  if (re[plen] == '*')
+    plen--;
+  for (i = 0; i < 256; i++)
+    skip[i] = plen;
+  for (i = 0; i < plen - 1; i++)
+    skip[(uchar)re[i]] = plen - 1 - i;
+}
+
+// The first place in s[0..n) the prefix is, or 0.
+static char *search(char *s, int n) {
+  int i, j;
+
+  if (plen == 1)
+    return memchr(s, re[0], n);
+  for (i = 0; i + plen <= n; i += skip[(uchar)s[i + plen - 1]]) {
+    for (j = plen - 1; j >= 0 && s[i + j] == re[j]; j--)
+      ;
+    if (j < 0)
+      return s + i;
+  }
+  return 0;
+}
+
+// Prints the matching lines of s[0..n), which are whole lines, but for
+// the last, at the end of the input or of a piece of a long line. The
+// byte at s[n] may be overwritten.
+static void scan(char *s, int n) {
+  char *end = s + n, *line = s, *from, *eol, c;
+
+  while (line < end) {
+    from = line;
+    if (plen > 0) {
+      if ((from = search(line, end - line)) == 0)
+        return;
+      // back to the start of the line it is in
+      for (line = from; line > s && line[-1] != '\n'; line--)
+        ;
+    }
+    if ((eol = memchr(from, '\n', end - from)) == 0)
+      eol = end;
+    c = *eol;
+    *eol = '\0';
+    if (literal || match(re, line)) {
+      *eol = c;
+      fwrite(line, eol - line + (eol < end), fout);
     }
-    if (p == buf)
-      m = 0;
-    if (m > 0) {
-      m -= p - buf;
-      memmove(buf, p, m);
+    *eol = c;
+    line = eol + 1;
+  }
+}
+
+// Lines longer than buf are matched a piece at a time.
+void grep(int fd) {
+  int n = 0, r;
+  char *tail;
+
+  while ((r = read(fd, buf + n, BUFSIZE - n)) > 0) {
+    n += r;
+    // the lines that are whole; the rest waits for more input
+    for (tail = buf + n; tail > buf && tail[-1] != '\n'; tail--)
+      ;
+    if (tail == buf) {
+      if (n < BUFSIZE)
+        continue;
+      tail = buf + n;
     }
+    scan(buf, tail - buf);
+    n -= tail - buf;
+    memmove(buf, tail, n);
   }
+  if (n > 0)
+    scan(buf, n);
 }
 
 int main(int argc, char *argv[]) {
   int fd, i;
-  char *pattern;
 
   if (argc <= 1) {
     printf(2, "usage: grep pattern [file ...]\n");
     exit();
   }
-  pattern = argv[1];
+  compile(argv[1]);
 
   if (argc <= 2) {
-    grep(pattern, 0);
+    grep(0);
     exit();
   }
 
@@ -53,7 +127,7 @@ int main(int argc, char *argv[]) {
       printf(1, "grep: cannot open %s\n", argv[i]);
       exit();
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit();
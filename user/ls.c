@@ -22,8 +22,8 @@ char *fmtname(char *path) {
 
 void ls(char *path) {
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, n, i;
+  struct dirent de[BSIZE / sizeof(struct dirent)];
   struct stat st;
 
   if ((fd = open(path, 0)) < 0) {
@@ -50,16 +50,16 @@ void ls(char *path) {
     strcpy(buf, path);
     p = buf + strlen(buf);
     *p++ = '/';
-    while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-      if (de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if (stat(buf, &st) < 0) {
-        printf(1, "ls: cannot stat %s\n", buf);
-        continue;
+    while ((n = getdents(fd, de, sizeof(de))) > 0) {
+      for (i = 0; i < n / sizeof(de[0]); i++) {
+        memmove(p, de[i].name, DIRSIZ);
+        p[DIRSIZ] = 0;
+        if (stat(buf, &st) < 0) {
+          printf(1, "ls: cannot stat %s\n", buf);
+          continue;
+        }
+        printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
       }
-      printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
     break;
   }
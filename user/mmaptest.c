@@ -0,0 +1,152 @@
+#include <cdefs.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <param.h>
+#include <stat.h>
+#include <user.h>
+
+char buf[8192];
+int stdout = 1;
+
+#define error(msg, ...)                                                        \
+  do {                                                                         \
+    printf(stdout, "ERROR (line %d): ", __LINE__);                             \
+    printf(stdout, msg, ##__VA_ARGS__);                                        \
+    printf(stdout, "\n");                                                      \
+    exit();                                                                    \
+  } while (0)
+
+int same(char *a, char *b, int n) {
+  while (n-- > 0)
+    if (*a++ != *b++)
+      return 0;
+  return 1;
+}
+
+void anonymous(void) {
+  char *p;
+  int i;
+
+  printf(stdout, "anonymous...\n");
+  p = mmap(0, 3 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+    error("mmap of anonymous memory failed");
+  for (i = 0; i < 3 * 4096; i++)
+    if (p[i] != 0)
+      error("byte %d of fresh memory is %d", i, p[i]);
+  for (i = 0; i < 3 * 4096; i++)
+    p[i] = i;
+  for (i = 0; i < 3 * 4096; i++)
+    if (p[i] != (char)i)
+      error("byte %d did not keep its value", i);
+
+  if (munmap(p + 4096, 4096) != -1)
+    error("munmap of part of a mapping succeeded");
+  if (munmap(p, 3 * 4096) < 0)
+    error("munmap failed");
+  printf(stdout, "anonymous ok\n");
+}
+
+void forked(void) {
+  char *shared, *private;
+
+  printf(stdout, "fork...\n");
+  shared = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                -1, 0);
+  private = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+  if (shared == MAP_FAILED || private == MAP_FAILED)
+    error("mmap failed");
+  shared[0] = 1;
+  private[0] = 1;
+
+  if (fork() == 0) {
+    shared[0] = 2;
+    private[0] = 2;
+    exit();
+  }
+  wait();
+
+  if (shared[0] != 2)
+    error("child's write to shared memory was lost: %d", shared[0]);
+  if (private[0] != 1)
+    error("child's write to private memory showed up: %d", private[0]);
+  munmap(shared, 4096);
+  munmap(private, 4096);
+  printf(stdout, "fork ok\n");
+}
+
+void fileprivate(void) {
+  int fd, n;
+  char *p;
+
+  printf(stdout, "private file...\n");
+  if ((fd = open("small.txt", O_RDONLY)) < 0)
+    error("could not open small.txt");
+  n = read(fd, buf, sizeof(buf));
+  p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    error("mmap of small.txt failed");
+  if (!same(p, buf, n))
+    error("mapping does not match the file");
+  if (p[n] != 0)
+    error("bytes past the end of the file are not zero");
+
+  // private writes stay out of the file
+  p[0] = 'X';
+  close(fd);
+  munmap(p, n);
+  fd = open("small.txt", O_RDONLY);
+  read(fd, buf, 1);
+  close(fd);
+  if (buf[0] == 'X')
+    error("private write reached the file");
+
+  if (mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+           open("small.txt", O_RDONLY), 0) != MAP_FAILED)
+    error("writable shared mapping of a read-only file succeeded");
+  printf(stdout, "private file ok\n");
+}
+
+void fileshared(void) {
+  int fd, i, n;
+  char *p;
+
+  printf(stdout, "shared file...\n");
+  n = 4096 + 100;
+  for (i = 0; i < n; i++)
+    buf[i] = 'a' + i % 26;
+  if ((fd = open("mmapfile", O_CREATE | O_RDWR)) < 0)
+    error("could not create mmapfile");
+  if (write(fd, buf, n) != n)
+    error("could not write mmapfile");
+
+  p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    error("mmap of mmapfile failed");
+  if (!same(p, buf, n))
+    error("mapping does not match the file");
+  p[1] = 'Z';
+  p[4096 + 1] = 'Y';
+  if (munmap(p, n) < 0)
+    error("munmap failed");
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if (read(fd, buf, n) != n)
+    error("could not read mmapfile back");
+  close(fd);
+  if (buf[1] != 'Z' || buf[4096 + 1] != 'Y')
+    error("shared writes did not reach the file");
+  printf(stdout, "shared file ok\n");
+}
+
+int main(int argc, char *argv[]) {
+  anonymous();
+  forked();
+  fileprivate();
+  fileshared();
+  printf(stdout, "mmaptest passed\n");
+  exit();
+}
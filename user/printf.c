@@ -3,9 +3,7 @@
 #include <stdarg.h>
 #include <user.h>
 
-static void putc(int fd, char c) { write(fd, &c, 1); }
-
-static void printint64(int fd, int xx, int base, int sgn) {
+static void printint64(struct stream *f, int64_t xx, int base, int sgn) {
   static char digits[] = "0123456789abcdef";
   char buf[32];
   int i;
@@ -25,10 +23,10 @@ static void printint64(int fd, int xx, int base, int sgn) {
     buf[i++] = '-';
 
   while (--i >= 0)
-    putc(fd, buf[i]);
+    fputc(buf[i], f);
 }
 
-static void printint(int fd, int xx, int base, int sgn) {
+static void printint(struct stream *f, int xx, int base, int sgn) {
   static char digits[] = "0123456789ABCDEF";
   char buf[16];
   int i, neg;
@@ -50,17 +48,16 @@ static void printint(int fd, int xx, int base, int sgn) {
     buf[i++] = '-';
 
   while (--i >= 0)
-    putc(fd, buf[i]);
+    fputc(buf[i], f);
 }
 
-// Print to the given fd. Only understands %d, %x, %p, %s.
-void printf(int fd, char *fmt, ...) {
+// Print to the stream f. Only understands %d, %x, %p, %s.
+static void vprintf(struct stream *f, char *fmt, va_list valist) {
   char *s;
   int c, i, state;
   int lflag;
-  va_list valist;
-  va_start(valist, fmt);
 
+  f->hold++;
   state = 0;
   for (i = 0; fmt[i]; i++) {
     c = fmt[i] & 0xff;
@@ -69,7 +66,7 @@ void printf(int fd, char *fmt, ...) {
         state = '%';
         lflag = 0;
       } else {
-        putc(fd, c);
+        fputc(c, f);
       }
     } else if (state == '%') {
       if (c == 'l') {
@@ -77,29 +74,59 @@ void printf(int fd, char *fmt, ...) {
         continue;
       } else if (c == 'd') {
         if (lflag == 1)
-          printint64(fd, va_arg(valist, int64_t), 10, 1);
+          printint64(f, va_arg(valist, int64_t), 10, 1);
         else
-          printint(fd, va_arg(valist, int), 10, 1);
+          printint(f, va_arg(valist, int), 10, 1);
       } else if (c == 'x' || c == 'p') {
         if (lflag == 1)
-          printint64(fd, va_arg(valist, int64_t), 16, 0);
+          printint64(f, va_arg(valist, int64_t), 16, 0);
         else
-          printint(fd, va_arg(valist, int), 16, 0);
+          printint(f, va_arg(valist, int), 16, 0);
       } else if (c == 's') {
         if ((s = (char *)va_arg(valist, char *)) == 0)
           s = "(null)";
         for (; *s; s++)
-          putc(fd, *s);
+          fputc(*s, f);
       } else if (c == '%') {
-        putc(fd, c);
+        fputc(c, f);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        fputc('%', f);
+        fputc(c, f);
       }
       state = 0;
     }
   }
+  // the console sees every printf whole as it is made
+  if (--f->hold == 0 && f->mode != IOFBF)
+    fflush(f);
+}
 
+void fprintf(struct stream *f, char *fmt, ...) {
+  va_list valist;
+
+  va_start(valist, fmt);
+  vprintf(f, fmt, valist);
+  va_end(valist);
+}
+
+// Print to the given fd: through fout or ferr for 1 and 2, and in one
+// write for any other.
+void printf(int fd, char *fmt, ...) {
+  struct stream tmp;
+  char buf[128];
+  va_list valist;
+
+  va_start(valist, fmt);
+  if (fd == 1 || fd == 2) {
+    vprintf(fd == 1 ? fout : ferr, fmt, valist);
+  } else {
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.fd = fd;
+    tmp.mode = IONBF;
+    tmp.size = sizeof(buf);
+    tmp.buf = buf;
+    vprintf(&tmp, fmt, valist);
+  }
   va_end(valist);
 }
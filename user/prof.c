@@ -0,0 +1,45 @@
+// Profiles a command: prof command [args...]. Samples every cpu's pc at
+// each tick while the command runs, then prints them, one per line, for
+// prof2folded.py on the host.
+
+#include <cdefs.h>
+#include <prof.h>
+#include <user.h>
+
+#define NSAMPLE 64
+
+static struct profsample s[NSAMPLE];
+
+int main(int argc, char *argv[]) {
+  int pid, n, i, j, dropped;
+
+  if (argc < 2) {
+    printf(2, "usage: prof command [args...]\n");
+    exit();
+  }
+
+  profile(1);
+  if ((pid = fork()) < 0) {
+    printf(2, "prof: fork failed\n");
+    exit();
+  }
+  if (pid == 0) {
+    exec(argv[1], argv + 1);
+    printf(2, "prof: exec %s failed\n", argv[1]);
+    exit();
+  }
+  wait();
+  dropped = profile(0);
+
+  while ((n = profdump(s, NSAMPLE)) > 0) {
+    for (i = 0; i < n; i++) {
+      printf(1, "P %d %d %s", s[i].pid, s[i].user,
+             s[i].name[0] ? s[i].name : "-");
+      for (j = 0; j < PROFDEPTH && s[i].pcs[j]; j++)
+        printf(1, " %lx", s[i].pcs[j]);
+      printf(1, "\n");
+    }
+  }
+  printf(1, "# dropped %d\n", dropped);
+  exit();
+}
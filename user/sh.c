@@ -52,6 +52,10 @@ struct backcmd {
 int fork1(void); // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
+int spawnable(char *);
+int spawncmd(struct cmd *, int, int);
+void freecmd(struct cmd *);
+extern char whitespace[];
 
 // Execute cmd.  Never returns.
 void runcmd(struct cmd *cmd) {
@@ -158,6 +162,15 @@ int main(void) {
         printf(2, "cannot cd %s\n", buf + 3);
       continue;
     }
+    if (spawnable(buf)) {
+      // programs and pipes only: start them from here, without copying
+      // the shell
+      struct cmd *cmd = parsecmd(buf);
+      for (int n = spawncmd(cmd, 0, 1); n > 0; n--)
+        wait();
+      freecmd(cmd);
+      continue;
+    }
     if (fork1() == 0)
       runcmd(parsecmd(buf));
     wait();
@@ -165,6 +178,80 @@ int main(void) {
   exit();
 }
 
+// Whether buf is only programs joined by pipes, which spawncmd can run.
+// Anything it cannot run, or that would not parse, goes to runcmd in a
+// forked shell, so that parse errors do not end this one.
+int spawnable(char *buf) {
+  char *s;
+  int words = 0, inword = 0;
+
+  for (s = buf; *s; s++) {
+    if (strchr("<>&;()", *s))
+      return 0;
+    if (*s == '|') {
+      words = inword = 0;
+    } else if (strchr(whitespace, *s)) {
+      inword = 0;
+    } else if (!inword) {
+      inword = 1;
+      if (++words >= MAXARGS)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Spawns the programs of cmd, a program or a pipeline, with standard
+// input in and standard output out. Returns how many were started.
+int spawncmd(struct cmd *cmd, int in, int out) {
+  int p[2], fds[3], n;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+
+  switch (cmd->type) {
+  default:
+    panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd *)cmd;
+    if (ecmd->argv[0] == 0)
+      return 0;
+    fds[0] = in;
+    fds[1] = out;
+    fds[2] = 2;
+    if (spawn(ecmd->argv[0], ecmd->argv, fds, 3) < 0) {
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    if (pipe(p) < 0)
+      panic("pipe");
+    // each end closes here once its side has it, so that the reader
+    // sees the end of the data when the writer exits
+    n = spawncmd(pcmd->left, in, p[1]);
+    close(p[1]);
+    n += spawncmd(pcmd->right, p[0], out);
+    close(p[0]);
+    return n;
+  }
+}
+
+void freecmd(struct cmd *cmd) {
+  struct pipecmd *pcmd;
+
+  if (cmd == 0)
+    return;
+  if (cmd->type == PIPE) {
+    pcmd = (struct pipecmd *)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+  }
+  free(cmd);
+}
+
 void panic(char *s) {
   printf(2, "%s\n", s);
   exit();
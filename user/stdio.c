@@ -0,0 +1,219 @@
+// Buffered streams, to make one system call of many small reads or
+// writes.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+static char inbuf[BUFSIZ], outbuf[BUFSIZ], errbuf[128];
+
+static struct stream sin = {.fd = 0, .reading = 1, .size = BUFSIZ,
+                            .buf = inbuf};
+static struct stream serr = {.fd = 2, .mode = IONBF, .size = sizeof(errbuf),
+                             .buf = errbuf};
+static struct stream sout = {.fd = 1, .size = BUFSIZ, .buf = outbuf,
+                             .next = &serr};
+
+struct stream *fin = &sin, *fout = &sout, *ferr = &serr;
+
+// the output streams, for exit to flush
+static struct stream *streams = &sout;
+
+// Line buffers the console, and fully buffers files and pipes.
+static void pickmode(struct stream *f) {
+  struct stat st;
+
+  if (fstat(f->fd, &st) == 0 && st.type == T_DEV)
+    f->mode = IOLBF;
+  else
+    f->mode = IOFBF;
+}
+
+// Opens a stream on fd, for reading if mode starts with r, or else for
+// writing. Returns 0 if there is no memory.
+struct stream *fdopen(int fd, char *mode) {
+  struct stream *f;
+
+  if ((f = malloc(sizeof(*f) + BUFSIZ)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->fd = fd;
+  f->reading = mode[0] == 'r';
+  f->size = BUFSIZ;
+  f->buf = (char *)(f + 1);
+  if (!f->reading) {
+    f->next = streams;
+    streams = f;
+  }
+  return f;
+}
+
+// Flushes f and closes its fd. The streams on fds 0, 1 and 2 are
+// flushed only, and stay open.
+int fclose(struct stream *f) {
+  struct stream **pp;
+  int r = fflush(f);
+
+  if (f == fin || f == fout || f == ferr)
+    return r;
+  for (pp = &streams; *pp; pp = &(*pp)->next)
+    if (*pp == f) {
+      *pp = f->next;
+      break;
+    }
+  if (close(f->fd) < 0)
+    r = -1;
+  free(f);
+  return r;
+}
+
+// Writes out what is buffered for output, or drops what is buffered
+// for input. Returns -1 if a write fails.
+int fflush(struct stream *f) {
+  int i, n;
+
+  if (f->reading) {
+    f->n = f->r = 0;
+    return 0;
+  }
+  for (i = 0; i < f->n; i += n)
+    if ((n = write(f->fd, f->buf + i, f->n - i)) <= 0) {
+      f->n = 0;
+      f->error = 1;
+      return -1;
+    }
+  f->n = 0;
+  return 0;
+}
+
+static void flushall(void) {
+  struct stream *f;
+
+  for (f = streams; f; f = f->next)
+    fflush(f);
+}
+
+int fputc(int c, struct stream *f) {
+  if (!f->mode)
+    pickmode(f);
+  f->buf[f->n++] = c;
+  if (f->n == f->size || (c == '\n' && f->mode == IOLBF) ||
+      (f->mode == IONBF && !f->hold))
+    fflush(f);
+  return c & 0xff;
+}
+
+int fputs(char *s, struct stream *f) {
+  return fwrite(s, strlen(s), f);
+}
+
+// Writes n bytes from p. Returns n, or -1.
+int fwrite(void *p, int n, struct stream *f) {
+  char *s = p;
+  int i, m;
+
+  if (!f->mode)
+    pickmode(f);
+  // one too big to buffer goes straight out
+  if (n >= f->size) {
+    if (fflush(f) < 0 || write(f->fd, s, n) != n)
+      return -1;
+    return n;
+  }
+  for (i = 0; i < n; i += m) {
+    m = min(n - i, f->size - f->n);
+    memmove(f->buf + f->n, s + i, m);
+    f->n += m;
+    if (f->n == f->size && fflush(f) < 0)
+      return -1;
+  }
+  if (f->mode == IOLBF)
+    for (i = 0; i < n && s[i] != '\n'; i++)
+      ;
+  if ((f->mode == IOLBF && i < n) || (f->mode == IONBF && !f->hold))
+    return fflush(f) < 0 ? -1 : n;
+  return n;
+}
+
+// Refills f's buffer. Returns 0 at the end of input or on error.
+static int fill(struct stream *f) {
+  int n;
+
+  f->r = 0;
+  f->n = 0;
+  if ((n = read(f->fd, f->buf, f->size)) <= 0) {
+    f->error |= n < 0;
+    return 0;
+  }
+  f->n = n;
+  return n;
+}
+
+// Returns the next byte, or -1 at the end of input.
+int fgetc(struct stream *f) {
+  if (f->r == f->n && !fill(f))
+    return -1;
+  return f->buf[f->r++] & 0xff;
+}
+
+// Reads a line into s, with its newline if it fits in size - 1 bytes.
+// Returns s, or 0 at the end of input.
+char *fgets(char *s, int size, struct stream *f) {
+  int i, c = 0;
+
+  for (i = 0; i < size - 1 && c != '\n'; i++) {
+    if ((c = fgetc(f)) < 0)
+      break;
+    s[i] = c;
+  }
+  s[i] = 0;
+  return i > 0 ? s : 0;
+}
+
+// Reads at most n bytes into p. Returns how many, 0 at the end of
+// input.
+int fread(void *p, int n, struct stream *f) {
+  char *s = p;
+  int i, m;
+
+  for (i = 0; i < n; i += m) {
+    if (f->r == f->n) {
+      // one too big to buffer comes straight in
+      if (n - i >= f->size) {
+        if ((m = read(f->fd, s + i, n - i)) <= 0) {
+          f->error |= m < 0;
+          break;
+        }
+        continue;
+      }
+      if (!fill(f))
+        break;
+    }
+    m = min(n - i, f->n - f->r);
+    memmove(s + i, f->buf + f->r, m);
+    f->r += m;
+  }
+  return i;
+}
+
+// Whether a read or write of f has failed.
+int ferror(struct stream *f) {
+  return f->error;
+}
+
+// Neither a child nor a new program should get, or lose, output still
+// in a buffer.
+noreturn void exit(void) {
+  flushall();
+  _exit();
+}
+
+int fork(void) {
+  flushall();
+  return _fork();
+}
+
+int exec(char *path, char **argv) {
+  flushall();
+  return _exec(path, argv);
+}
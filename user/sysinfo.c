@@ -1,18 +1,113 @@
+// Prints the system statistics: sysinfo.
+// With an interval, prints how much each counter moved in every interval
+// of that many ticks, vmstat-style: sysinfo ticks [count].
+
 #include <cdefs.h>
 #include <fs.h>
 #include <stat.h>
 #include <sysinfo.h>
 #include <user.h>
 
+static void printall(struct sys_info *info) {
+  int i;
+
+  printf(1, "pages_in_use = %d\n", info->pages_in_use);
+  printf(1, "pages_in_swap = %d\n", info->pages_in_swap);
+  printf(1, "free_pages = %d\n", info->free_pages);
+  printf(1, "num_page_faults = %d\n", info->num_page_faults);
+  printf(1, "num_swap_ins = %d\n", info->num_swap_ins);
+  printf(1, "zswap_pages = %d\n", info->zswap_pages);
+  printf(1, "num_disk_reads = %d\n", info->num_disk_reads);
+  printf(1, "disk_queue_depth = %d\n", info->disk_queue_depth);
+  printf(1, "disk_queue_peak = %d\n", info->disk_queue_peak);
+  printf(1, "disk_requests = %d\n", info->disk_requests);
+  printf(1, "disk_merges = %d\n", info->disk_merges);
+  printf(1, "icache_hits = %d\n", info->icache_hits);
+  printf(1, "icache_misses = %d\n", info->icache_misses);
+  printf(1, "slab_pages = %d\n", info->slab_pages);
+  printf(1, "slab_objects = %d\n", info->slab_objects);
+  if (info->version < 2)
+    return;
+  printf(1, "bcache_hits = %d\n", info->bcache_hits);
+  printf(1, "bcache_misses = %d\n", info->bcache_misses);
+  printf(1, "disk_blocks_read = %d\n", info->disk_blocks_read);
+  printf(1, "disk_blocks_written = %d\n", info->disk_blocks_written);
+  printf(1, "log_commits = %d\n", info->log_commits);
+  printf(1, "log_blocks = %d\n", info->log_blocks);
+  printf(1, "num_cow_faults = %d\n", info->num_cow_faults);
+  printf(1, "num_swap_outs = %d\n", info->num_swap_outs);
+  printf(1, "context_switches = %d\n", info->context_switches);
+  printf(1, "wakeups = %d\n", info->wakeups);
+  for (i = 0; i < info->ncpu && i < SYSINFO_NCPU; i++)
+    printf(1, "idle_ticks[%d] = %d\n", i, info->idle_ticks[i]);
+  if (info->version < 3)
+    return;
+  printf(1, "swap_cached = %d\n", info->swap_cached);
+  printf(1, "swap_reused = %d\n", info->swap_reused);
+  if (info->version < 4)
+    return;
+  printf(1, "ksm_merged = %d\n", info->ksm_merged);
+}
+
+static int idlesum(struct sys_info *info) {
+  int i, sum = 0;
+
+  for (i = 0; i < info->ncpu && i < SYSINFO_NCPU; i++)
+    sum += info->idle_ticks[i];
+  return sum;
+}
+
+static void header(void) {
+  printf(1, "free\tswap\tflt\tcow\tsi\tso\tbhit\tbmiss\tdr\tdw\tcommit\t"
+            "blk\tcs\twake\tidle%%\n");
+}
+
+// One line of what moved between a and b, over dt ticks.
+static void delta(struct sys_info *a, struct sys_info *b, int dt) {
+  int busy = dt * b->ncpu;
+
+  printf(1, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+         b->free_pages, b->pages_in_swap,
+         b->num_page_faults - a->num_page_faults,
+         b->num_cow_faults - a->num_cow_faults,
+         b->num_swap_ins - a->num_swap_ins,
+         b->num_swap_outs - a->num_swap_outs,
+         b->bcache_hits - a->bcache_hits,
+         b->bcache_misses - a->bcache_misses,
+         b->disk_blocks_read - a->disk_blocks_read,
+         b->disk_blocks_written - a->disk_blocks_written,
+         b->log_commits - a->log_commits, b->log_blocks - a->log_blocks,
+         b->context_switches - a->context_switches,
+         b->wakeups - a->wakeups,
+         busy ? (idlesum(b) - idlesum(a)) * 100 / busy : 0);
+}
+
 int main(int argc, char *argv[]) {
-  struct sys_info info;
-  sysinfo(&info);
+  struct sys_info info[2];
+  int interval, count, i, t0, t1;
+
+  sysinfo(&info[0]);
+  if (argc < 2) {
+    printall(&info[0]);
+    exit();
+  }
 
-  printf(1, "pages_in_use = %d\n", info.pages_in_use);
-  printf(1, "pages_in_swap = %d\n", info.pages_in_swap);
-  printf(1, "free_pages = %d\n", info.free_pages);
-  printf(1, "num_page_faults = %d\n", info.num_page_faults);
-  printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  interval = atoi(argv[1]);
+  count = argc > 2 ? atoi(argv[2]) : -1;
+  if (interval <= 0 || info[0].version < 2) {
+    printf(2, "usage: sysinfo [ticks [count]]\n");
+    exit();
+  }
 
+  t0 = uptime();
+  for (i = 0; count < 0 || i < count; i++) {
+    if (i % 20 == 0)
+      header();
+    sleep(interval);
+    t1 = uptime();
+    sysinfo(&info[(i + 1) % 2]);
+    delta(&info[i % 2], &info[(i + 1) % 2], t1 - t0);
+    t0 = t1;
+  }
   exit();
 }
@@ -0,0 +1,112 @@
+// Prints the system calls that took the most time, the page faults by
+// kind and the pages in use, system-wide or of one process:
+// sysstat [pid].
+
+#include <cdefs.h>
+#include <syscall.h>
+#include <sysstat.h>
+#include <user.h>
+
+#define NTOP 10
+
+static char *names[NSYSCALL] = {
+    [SYS_fork] = "fork",           [SYS_exit] = "exit",
+    [SYS_wait] = "wait",           [SYS_pipe] = "pipe",
+    [SYS_read] = "read",           [SYS_kill] = "kill",
+    [SYS_exec] = "exec",           [SYS_fstat] = "fstat",
+    [SYS_dup] = "dup",             [SYS_getpid] = "getpid",
+    [SYS_sbrk] = "sbrk",           [SYS_sleep] = "sleep",
+    [SYS_uptime] = "uptime",       [SYS_open] = "open",
+    [SYS_write] = "write",         [SYS_close] = "close",
+    [SYS_sysinfo] = "sysinfo",     [SYS_crashn] = "crashn",
+    [SYS_getdents] = "getdents",   [SYS_mmap] = "mmap",
+    [SYS_munmap] = "munmap",       [SYS_spawn] = "spawn",
+    [SYS_setpriority] = "setpriority", [SYS_splice] = "splice",
+    [SYS_pread] = "pread",         [SYS_pwrite] = "pwrite",
+    [SYS_readv] = "readv",         [SYS_writev] = "writev",
+    [SYS_ioringsetup] = "ioringsetup", [SYS_ioringenter] = "ioringenter",
+    [SYS_clone] = "clone",         [SYS_futex_wait] = "futex_wait",
+    [SYS_futex_wake] = "futex_wake", [SYS_shm_open] = "shm_open",
+    [SYS_shm_map] = "shm_map",     [SYS_shm_unlink] = "shm_unlink",
+    [SYS_stats] = "stats",         [SYS_tracedump] = "tracedump",
+    [SYS_profile] = "profile",     [SYS_profdump] = "profdump",
+    [SYS_fsync] = "fsync",         [SYS_unlink] = "unlink",
+    [SYS_ftruncate] = "ftruncate", [SYS_memlimit] = "memlimit",
+};
+
+static char *faults[NFAULT] = {
+    [FAULT_FATAL] = "fatal", [FAULT_LAZY] = "lazy", [FAULT_SWAPIN] = "swapin",
+    [FAULT_STACK] = "stack", [FAULT_COW] = "cow",   [FAULT_RACE] = "race",
+};
+
+static char *mems[NMEM] = {
+    [MEM_RSS] = "rss", [MEM_SWAP] = "swap", [MEM_WS] = "ws",
+    [MEM_LIMIT] = "limit",
+};
+
+static struct sysstat st[NSTAT];
+
+// the bucket the median call falls in
+static int median(struct sysstat *s) {
+  uint64_t seen = 0;
+  int b;
+
+  for (b = 0; b < NSTATBUCKET - 1; b++)
+    if ((seen += s->hist[b]) * 2 >= s->count)
+      break;
+  return b;
+}
+
+int main(int argc, char *argv[]) {
+  int pid = argc > 1 ? atoi(argv[1]) : 0;
+  int n, i, j, best, top[NTOP], ntop = 0;
+  char taken[NSYSCALL];
+  struct sysstat *f;
+
+  if ((n = stats(pid, st, NSTAT)) < 0) {
+    printf(2, "sysstat: no process %d\n", pid);
+    exit();
+  }
+
+  // the NTOP largest totals, largest first
+  memset(taken, 0, sizeof(taken));
+  for (ntop = 0; ntop < NTOP; ntop++) {
+    best = -1;
+    for (i = 0; i < NSYSCALL && i < n; i++)
+      if (!taken[i] && st[i].count &&
+          (best < 0 || st[i].cycles > st[best].cycles))
+        best = i;
+    if (best < 0)
+      break;
+    taken[best] = 1;
+    top[ntop] = best;
+  }
+
+  printf(1, "%s\tcalls\tcycles\tavg\t%s\n", "syscall",
+         pid ? "" : "median");
+  for (i = 0; i < ntop; i++) {
+    j = top[i];
+    printf(1, "%s\t%ld\t%ld\t%ld", names[j] ? names[j] : "?", st[j].count,
+           st[j].cycles, st[j].cycles / st[j].count);
+    if (pid == 0)
+      printf(1, "\t<2^%d", median(&st[j]) + 1);
+    printf(1, "\n");
+  }
+
+  printf(1, "\n%s\tfaults\tcycles\tavg\t%s\n", "fault", pid ? "" : "median");
+  for (i = 0; i < NFAULT && NSYSCALL + i < n; i++) {
+    f = &st[NSYSCALL + i];
+    if (f->count == 0)
+      continue;
+    printf(1, "%s\t%ld\t%ld\t%ld", faults[i], f->count, f->cycles,
+           f->cycles / f->count);
+    if (pid == 0)
+      printf(1, "\t<2^%d", median(f) + 1);
+    printf(1, "\n");
+  }
+
+  printf(1, "\n%s\tpages\n", "memory");
+  for (i = 0; i < NMEM && NSYSCALL + NFAULT + i < n; i++)
+    printf(1, "%s\t%ld\n", mems[i], st[NSYSCALL + NFAULT + i].count);
+  exit();
+}
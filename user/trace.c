@@ -0,0 +1,51 @@
+// Runs a command with the kernel's trace rings emptied first, then
+// prints the events it left, one per line, for trace2json.py on the
+// host: trace [command args...]. With no command, prints what has
+// gathered in the rings.
+
+#include <cdefs.h>
+#include <msr.h>
+#include <trace.h>
+#include <user.h>
+
+#define NEV 128
+
+static struct traceev ev[NEV];
+
+int main(int argc, char *argv[]) {
+  uint64_t c0, c1;
+  int t0, t1, n, i, pid;
+  char phase[2] = {0, 0};
+
+  // TSC cycles in a tick, for the decoder to turn cycles into time
+  sleep(1);
+  t0 = uptime();
+  c0 = readtsc();
+  sleep(10);
+  c1 = readtsc();
+  t1 = uptime();
+
+  if (argc > 1) {
+    while (tracedump(ev, NEV) > 0)
+      ;
+    if ((pid = fork()) < 0) {
+      printf(2, "trace: fork failed\n");
+      exit();
+    }
+    if (pid == 0) {
+      exec(argv[1], argv + 1);
+      printf(2, "trace: exec %s failed\n", argv[1]);
+      exit();
+    }
+    wait();
+  }
+
+  printf(1, "# tsc_per_tick %ld\n", (c1 - c0) / (t1 - t0));
+  while ((n = tracedump(ev, NEV)) > 0)
+    for (i = 0; i < n; i++) {
+      phase[0] = ev[i].phase;
+      printf(1, "T %d %ld %d %d %s %lx\n", ev[i].cpu, ev[i].tsc, ev[i].pid,
+             ev[i].type, phase, ev[i].arg);
+    }
+  exit();
+}
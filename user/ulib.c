@@ -39,6 +39,15 @@ char *strchr(const char *s, char c) {
   return 0;
 }
 
+void *memchr(const void *s, int c, int n) {
+  const uchar *p = s;
+
+  for (; n > 0; n--, p++)
+    if (*p == (uchar)c)
+      return (void *)p;
+  return 0;
+}
+
 char *gets(char *buf, int max) {
   int i, cc;
   char c;
@@ -84,4 +93,48 @@ void *memmove(void *vdst, void *vsrc, int n) {
   while (n-- > 0)
     *dst++ = *src++;
   return vdst;
-}
\ No newline at end of file
+}
+void mutex_init(struct mutex *m) { m->state = 0; }
+
+void mutex_lock(struct mutex *m) {
+  int c;
+
+  if ((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // mark it contended, so that the unlock wakes us
+  if (c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while (c != 0) {
+    futex_wait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void mutex_unlock(struct mutex *m) {
+  if (__sync_fetch_and_sub(&m->state, 1) != 1) {
+    m->state = 0;
+    futex_wake(&m->state, 1);
+  }
+}
+
+void cond_init(struct cond *c) { c->seq = 0; }
+
+// a signal after the mutex is let go, and before the wait, changes seq,
+// so the wait does not sleep through it
+void cond_wait(struct cond *c, struct mutex *m) {
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void cond_signal(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
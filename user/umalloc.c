@@ -1,84 +1,158 @@
 #include <cdefs.h>
+#include <mman.h>
+#include <mmu.h>
 #include <param.h>
 #include <stat.h>
 #include <user.h>
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// A size-class allocator. Small blocks come in powers of two from 32
+// to 2048 bytes, each size with a free list of its own, carved from
+// heap pages; a malloc or free of one takes constant time. Larger
+// blocks are whole pages: from an mmap of their own if they are big
+// enough to be worth one, which free hands back with munmap, or else
+// from a list of free page runs in the heap.
 
-typedef long Align;
+#define MINCLASS 5   // log2 of the smallest block
+#define NCLASS 7     // small block sizes, 2^MINCLASS up to 2048
+#define MMAPMIN (16 * PGSIZE) // blocks from this size up get an mmap
 
+#define KSMALL 1 // a small block from a free list
+#define KHEAP 2  // pages from the heap
+#define KMMAP 3  // pages mmap'd for the block alone
+
+// before every block; 16 bytes, so that blocks are 16-byte aligned
 union header {
   struct {
-    union header *ptr;
-    uint size;
+    uint kind; // K*
+    uint size; // the class for KSMALL, or else pages
   } s;
-  Align x;
+  struct {
+    union header *next; // on a free list
+  } f;
+  char pad[16];
 };
 
-typedef union header Header;
+// a run of free heap pages, address ordered
+struct run {
+  struct run *next;
+  uint npages;
+};
 
-static Header base;
-static Header *freep;
+static union header *freelist[NCLASS];
+static struct run *runs;
 
-void free(void *ap) {
-  Header *bp, *p;
-
-  bp = (Header *)ap - 1;
-  for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if (bp + bp->s.size == p->s.ptr) {
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if (p + p->s.size == bp) {
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
-}
-
-static Header *morecore(uint nu) {
+// Takes npages of heap pages, from a free run if one is big enough.
+static void *heappages(uint npages) {
+  struct run **pp, *r;
   char *p;
-  Header *hp;
 
-  if (nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if (p == (char *)-1)
+  for (pp = &runs; (r = *pp) != 0; pp = &r->next) {
+    if (r->npages < npages)
+      continue;
+    if (r->npages == npages) {
+      *pp = r->next;
+      return r;
+    }
+    // the tail of the run
+    r->npages -= npages;
+    return (char *)r + r->npages * PGSIZE;
+  }
+  // pages, page aligned, should the break not be
+  p = sbrk(0);
+  if (sbrk(PGROUNDUP((uint64_t)p) - (uint64_t)p + npages * PGSIZE) ==
+      (char *)-1)
     return 0;
-  hp = (Header *)p;
-  hp->s.size = nu;
-  free((void *)(hp + 1));
-  return freep;
+  return (char *)PGROUNDUP((uint64_t)p);
+}
+
+// Gives back npages at p to the free runs, merging neighbours.
+static void heapfree(void *p, uint npages) {
+  struct run **pp, *r = p, *prev = 0;
+
+  for (pp = &runs; *pp && *pp < r; pp = &(*pp)->next)
+    prev = *pp;
+  r->npages = npages;
+  r->next = *pp;
+  if (r->next && (char *)r + npages * PGSIZE == (char *)r->next) {
+    r->npages += r->next->npages;
+    r->next = r->next->next;
+  }
+  if (prev && (char *)prev + prev->npages * PGSIZE == (char *)r) {
+    prev->npages += r->npages;
+    prev->next = r->next;
+  } else {
+    *pp = r;
+  }
+}
+
+// Fills the empty free list of class c from a fresh page.
+static int refill(int c) {
+  uint size = 1 << (MINCLASS + c);
+  char *p, *page;
+
+  if ((page = heappages(1)) == 0)
+    return -1;
+  for (p = page; p + size <= page + PGSIZE; p += size) {
+    ((union header *)p)->f.next = freelist[c];
+    freelist[c] = (union header *)p;
+  }
+  return 0;
 }
 
 void *malloc(uint nbytes) {
-  Header *p, *prevp;
-  uint nunits;
+  union header *h;
+  uint need = nbytes + sizeof(union header), npages;
+  int c;
 
-  nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
-  if ((prevp = freep) == 0) {
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if (need < nbytes)
+    return 0;
+  for (c = 0; c < NCLASS; c++) {
+    if (need > 1 << (MINCLASS + c))
+      continue;
+    if (freelist[c] == 0 && refill(c) < 0)
+      return 0;
+    h = freelist[c];
+    freelist[c] = h->f.next;
+    h->s.kind = KSMALL;
+    h->s.size = c;
+    return h + 1;
   }
-  for (p = prevp->s.ptr;; prevp = p, p = p->s.ptr) {
-    if (p->s.size >= nunits) {
-      if (p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void *)(p + 1);
-    }
-    if (p == freep)
-      if ((p = morecore(nunits)) == 0)
-        return 0;
+
+  npages = (need + PGSIZE - 1) / PGSIZE;
+  h = MAP_FAILED;
+  // only a few mmap regions go round, so they are for big blocks
+  if (npages * PGSIZE >= MMAPMIN)
+    h = mmap(0, npages * PGSIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (h != MAP_FAILED) {
+    h->s.kind = KMMAP;
+  } else {
+    if ((h = heappages(npages)) == 0)
+      return 0;
+    h->s.kind = KHEAP;
   }
-}
\ No newline at end of file
+  h->s.size = npages;
+  return h + 1;
+}
+
+void free(void *ap) {
+  union header *h;
+  int c;
+
+  if (ap == 0)
+    return;
+  h = (union header *)ap - 1;
+  switch (h->s.kind) {
+  case KSMALL:
+    c = h->s.size;
+    h->f.next = freelist[c];
+    freelist[c] = h;
+    break;
+  case KMMAP:
+    munmap(h, h->s.size * PGSIZE);
+    break;
+  case KHEAP:
+    heapfree(h, h->s.size);
+    break;
+  }
+}